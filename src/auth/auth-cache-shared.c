@@ -0,0 +1,626 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "str.h"
+#include "hash.h"
+#include "file-lock.h"
+#include "safe-mkstemp.h"
+#include "auth-cache.h"
+#include "auth-cache-shared.h"
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define AUTH_CACHE_SHARED_MAGIC 0x41554331 /* "AUC1" */
+#define AUTH_CACHE_SHARED_HEADER_SIZE 64
+/* Each entry uses a fixed size record. Entries that don't fit into it
+   aren't cached. */
+#define AUTH_CACHE_SHARED_RECORD_SIZE 1024
+/* How many records are looked at for each key. If all of them are in use,
+   the least recently used one is replaced. */
+#define AUTH_CACHE_SHARED_PROBE_COUNT 8
+/* How many times to try opening the file, if other processes keep
+   replacing it while it's being opened. */
+#define AUTH_CACHE_SHARED_OPEN_TRY_COUNT 3
+
+struct auth_cache_shared_header {
+	uint32_t magic;
+	/* sizeof(struct auth_cache_shared_record), which changes if
+	   struct auth_cache_node's layout changes */
+	uint32_t record_header_size;
+	uint32_t record_size;
+	uint32_t record_count;
+	uint32_t used_count;
+	uint32_t unused_padding;
+	/* Incremented for every access. Used for finding the least recently
+	   used record. Lookups update this while holding only a read lock,
+	   so it's accessed atomically. */
+	uint64_t access_counter;
+};
+
+struct auth_cache_shared_record {
+	/* 0 = unused record */
+	uint32_t key_hash;
+	uint32_t unused_padding;
+	/* Updated atomically, similarly to access_counter */
+	uint64_t last_access;
+	/* prev and next are always NULL */
+	struct auth_cache_node node;
+};
+
+struct auth_cache_shared {
+	char *path;
+	struct event *event;
+	int fd;
+	dev_t st_dev;
+	ino_t st_ino;
+
+	void *mmap_base;
+	size_t mmap_size;
+	struct auth_cache_shared_header *hdr;
+	unsigned char *records;
+	unsigned int record_count;
+
+	unsigned int ttl_secs, neg_ttl_secs;
+	struct file_lock *lock;
+	buffer_t *lookup_buf;
+};
+
+static_assert(sizeof(struct auth_cache_shared_header) <=
+	      AUTH_CACHE_SHARED_HEADER_SIZE, "header is too large");
+
+#define AUTH_CACHE_SHARED_DATA_MAX_SIZE \
+	(AUTH_CACHE_SHARED_RECORD_SIZE - sizeof(struct auth_cache_shared_record))
+
+static void auth_cache_shared_hdr_init(struct auth_cache_shared_header *hdr,
+				       unsigned int record_count)
+{
+	i_zero(hdr);
+	hdr->magic = AUTH_CACHE_SHARED_MAGIC;
+	hdr->record_header_size = sizeof(struct auth_cache_shared_record);
+	hdr->record_size = AUTH_CACHE_SHARED_RECORD_SIZE;
+	hdr->record_count = record_count;
+}
+
+static bool
+auth_cache_shared_hdr_is_valid(const struct auth_cache_shared_header *hdr,
+			       unsigned int record_count)
+{
+	return hdr->magic == AUTH_CACHE_SHARED_MAGIC &&
+		hdr->record_header_size == sizeof(struct auth_cache_shared_record) &&
+		hdr->record_size == AUTH_CACHE_SHARED_RECORD_SIZE &&
+		hdr->record_count == record_count &&
+		hdr->used_count <= record_count;
+}
+
+static const struct file_lock_settings auth_cache_shared_lock_set = {
+	.lock_method = FILE_LOCK_METHOD_FCNTL,
+};
+
+/* Returns 1 if the opened file is usable, 0 if it needs to be recreated,
+   -1 on error. */
+static int
+auth_cache_shared_file_check(struct auth_cache_shared *shared, int fd,
+			     struct stat *st_r, const char **error_r)
+{
+	struct auth_cache_shared_header hdr;
+	ssize_t ret;
+
+	if (fstat(fd, st_r) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m",
+					   shared->path);
+		return -1;
+	}
+	if ((uoff_t)st_r->st_size != shared->mmap_size)
+		return 0;
+
+	/* The header is written only while creating the file, so it can be
+	   read without locking. */
+	ret = pread(fd, &hdr, sizeof(hdr), 0);
+	if (ret < 0) {
+		*error_r = t_strdup_printf("pread(%s) failed: %m",
+					   shared->path);
+		return -1;
+	}
+	return ret == sizeof(hdr) &&
+		auth_cache_shared_hdr_is_valid(&hdr, shared->record_count) ?
+		1 : 0;
+}
+
+static int
+auth_cache_shared_file_create(struct auth_cache_shared *shared,
+			      const char **error_r)
+{
+	struct auth_cache_shared_header hdr;
+	string_t *temp_path = t_str_new(128);
+	int fd, ret = 0;
+
+	/* Other processes may have the old file mmapped, so it can't be
+	   modified in place. Create the new file with a temporary name and
+	   rename() it over the old one. The other processes notice this the
+	   next time they lock the file. */
+	str_printfa(temp_path, "%s.", shared->path);
+	fd = safe_mkstemp_hostpid(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("safe_mkstemp(%s) failed: %m",
+					   str_c(temp_path));
+		return -1;
+	}
+	auth_cache_shared_hdr_init(&hdr, shared->record_count);
+	if (ftruncate(fd, shared->mmap_size) < 0) {
+		*error_r = t_strdup_printf("ftruncate(%s, %zu) failed: %m",
+					   str_c(temp_path), shared->mmap_size);
+		ret = -1;
+	} else if (pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+		*error_r = t_strdup_printf("pwrite(%s) failed: %m",
+					   str_c(temp_path));
+		ret = -1;
+	} else if (rename(str_c(temp_path), shared->path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   str_c(temp_path), shared->path);
+		ret = -1;
+	}
+	if (ret < 0)
+		i_unlink_if_exists(str_c(temp_path));
+	i_close_fd_path(&fd, str_c(temp_path));
+	return ret;
+}
+
+static void auth_cache_shared_file_close(struct auth_cache_shared *shared)
+{
+	i_assert(shared->lock == NULL);
+
+	if (shared->mmap_base != MAP_FAILED) {
+		if (munmap(shared->mmap_base, shared->mmap_size) < 0)
+			e_error(shared->event, "munmap(%s) failed: %m",
+				shared->path);
+		shared->mmap_base = MAP_FAILED;
+		shared->hdr = NULL;
+		shared->records = NULL;
+	}
+	if (shared->fd != -1)
+		i_close_fd_path(&shared->fd, shared->path);
+}
+
+static int
+auth_cache_shared_file_open(struct auth_cache_shared *shared,
+			    const char **error_r)
+{
+	struct stat st;
+	unsigned int i;
+	int fd, ret;
+
+	for (i = 0;; i++) {
+		fd = open(shared->path, O_RDWR | O_CREAT, 0600);
+		if (fd == -1) {
+			*error_r = t_strdup_printf("open(%s) failed: %m",
+						   shared->path);
+			return -1;
+		}
+		ret = auth_cache_shared_file_check(shared, fd, &st, error_r);
+		if (ret > 0)
+			break;
+		i_close_fd_path(&fd, shared->path);
+		if (ret < 0)
+			return -1;
+		if (i == AUTH_CACHE_SHARED_OPEN_TRY_COUNT) {
+			*error_r = t_strdup_printf(
+				"%s keeps getting replaced by other processes",
+				shared->path);
+			return -1;
+		}
+		if (auth_cache_shared_file_create(shared, error_r) < 0)
+			return -1;
+	}
+
+	shared->mmap_base = mmap(NULL, shared->mmap_size,
+				 PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (shared->mmap_base == MAP_FAILED) {
+		*error_r = t_strdup_printf("mmap(%s, size=%zu) failed: %m",
+					   shared->path, shared->mmap_size);
+		i_close_fd_path(&fd, shared->path);
+		return -1;
+	}
+	shared->fd = fd;
+	shared->st_dev = st.st_dev;
+	shared->st_ino = st.st_ino;
+	shared->hdr = shared->mmap_base;
+	shared->records = PTR_OFFSET(shared->mmap_base,
+				     AUTH_CACHE_SHARED_HEADER_SIZE);
+	return 0;
+}
+
+/* Returns TRUE if the locked file is still the one in the path and its
+   header is valid. */
+static bool auth_cache_shared_is_current(struct auth_cache_shared *shared)
+{
+	struct stat st;
+
+	if (!auth_cache_shared_hdr_is_valid(shared->hdr, shared->record_count))
+		return FALSE;
+	if (stat(shared->path, &st) < 0) {
+		if (errno != ENOENT) {
+			e_error(shared->event, "stat(%s) failed: %m",
+				shared->path);
+		}
+		return FALSE;
+	}
+	return st.st_ino == shared->st_ino &&
+		CMP_DEV_T(st.st_dev, shared->st_dev);
+}
+
+static int
+auth_cache_shared_try_lock(struct auth_cache_shared *shared, int lock_type)
+{
+	const char *error;
+	int ret;
+
+	ret = file_try_lock(shared->fd, shared->path, lock_type,
+			    &auth_cache_shared_lock_set,
+			    &shared->lock, &error);
+	if (ret < 0)
+		e_error(shared->event, "%s", error);
+	return ret;
+}
+
+/* Lock the file with F_RDLCK or F_WRLCK. The cache is accessed from the
+   ioloop, so the lock is never waited on. If another process has it locked,
+   the cache access is skipped, i.e. a lookup is handled as a cache miss.
+   Returns 0 if locked, -1 if not. */
+static int
+auth_cache_shared_lock(struct auth_cache_shared *shared, int lock_type)
+{
+	const char *error;
+
+	i_assert(shared->lock == NULL);
+
+	if (shared->fd != -1) {
+		if (auth_cache_shared_try_lock(shared, lock_type) <= 0)
+			return -1;
+		if (auth_cache_shared_is_current(shared))
+			return 0;
+		file_unlock(&shared->lock);
+	}
+
+	/* The file was replaced or it's corrupted - reopen it */
+	auth_cache_shared_file_close(shared);
+	if (auth_cache_shared_file_open(shared, &error) < 0) {
+		e_error(shared->event, "%s", error);
+		return -1;
+	}
+	if (auth_cache_shared_try_lock(shared, lock_type) <= 0)
+		return -1;
+	if (!auth_cache_shared_is_current(shared)) {
+		/* replaced again - try again on the next access */
+		file_unlock(&shared->lock);
+		return -1;
+	}
+	return 0;
+}
+
+static void auth_cache_shared_unlock(struct auth_cache_shared *shared)
+{
+	file_unlock(&shared->lock);
+}
+
+int auth_cache_shared_open(const char *path, struct event *event,
+			   size_t max_size, unsigned int ttl_secs,
+			   unsigned int neg_ttl_secs,
+			   struct auth_cache_shared **shared_r,
+			   const char **error_r)
+{
+	struct auth_cache_shared *shared;
+
+	shared = i_new(struct auth_cache_shared, 1);
+	shared->path = i_strdup(path);
+	shared->event = event;
+	shared->fd = -1;
+	shared->ttl_secs = ttl_secs;
+	shared->neg_ttl_secs = neg_ttl_secs;
+	shared->record_count = I_MAX(max_size / AUTH_CACHE_SHARED_RECORD_SIZE,
+				     AUTH_CACHE_SHARED_PROBE_COUNT);
+	shared->mmap_size = AUTH_CACHE_SHARED_HEADER_SIZE +
+		(size_t)shared->record_count * AUTH_CACHE_SHARED_RECORD_SIZE;
+	shared->lookup_buf = buffer_create_dynamic(default_pool,
+						   AUTH_CACHE_SHARED_RECORD_SIZE);
+	shared->mmap_base = MAP_FAILED;
+
+	if (auth_cache_shared_file_open(shared, error_r) < 0) {
+		auth_cache_shared_close(&shared);
+		return -1;
+	}
+	*shared_r = shared;
+	return 0;
+}
+
+void auth_cache_shared_close(struct auth_cache_shared **_shared)
+{
+	struct auth_cache_shared *shared = *_shared;
+
+	*_shared = NULL;
+	auth_cache_shared_file_close(shared);
+	buffer_free(&shared->lookup_buf);
+	i_free(shared->path);
+	i_free(shared);
+}
+
+
+static struct auth_cache_shared_record *
+auth_cache_shared_record(struct auth_cache_shared *shared, unsigned int idx)
+{
+	return (void *)(shared->records +
+			(size_t)idx * AUTH_CACHE_SHARED_RECORD_SIZE);
+}
+
+static unsigned int auth_cache_shared_key_hash(const char *key)
+{
+	unsigned int hash = str_hash(key);
+
+	/* 0 is used for unused records */
+	return hash == 0 ? 1 : hash;
+}
+
+static size_t
+auth_cache_shared_record_data_size(const struct auth_cache_shared_record *rec)
+{
+	return rec->node.alloc_size - sizeof(struct auth_cache_node);
+}
+
+static bool
+auth_cache_shared_record_is_valid(const struct auth_cache_shared_record *rec)
+{
+	size_t data_size;
+
+	/* The file may have been modified by a process that crashed, so don't
+	   trust the data to be NUL-terminated. */
+	if (rec->node.alloc_size < sizeof(struct auth_cache_node) + 2 ||
+	    rec->node.alloc_size > sizeof(struct auth_cache_node) +
+				   AUTH_CACHE_SHARED_DATA_MAX_SIZE)
+		return FALSE;
+	data_size = auth_cache_shared_record_data_size(rec);
+	return rec->node.data[data_size - 1] == '\0' &&
+		memchr(rec->node.data, '\0', data_size - 1) != NULL;
+}
+
+static bool
+auth_cache_shared_record_is_expired(struct auth_cache_shared *shared,
+				    const struct auth_cache_shared_record *rec,
+				    time_t now)
+{
+	const char *value = rec->node.data + strlen(rec->node.data) + 1;
+	unsigned int ttl_secs = *value == '\0' ?
+		shared->neg_ttl_secs : shared->ttl_secs;
+
+	return rec->node.created < now - (time_t)ttl_secs;
+}
+
+static void
+auth_cache_shared_record_clear(struct auth_cache_shared *shared,
+			       struct auth_cache_shared_record *rec)
+{
+	rec->key_hash = 0;
+	/* don't assert-crash on a corrupted header */
+	if (shared->hdr->used_count > 0)
+		shared->hdr->used_count--;
+}
+
+static uint64_t auth_cache_shared_next_access(struct auth_cache_shared *shared)
+{
+	return __atomic_add_fetch(&shared->hdr->access_counter, 1,
+				  __ATOMIC_RELAXED);
+}
+
+/* Find the record for the key. If write_locked is FALSE, the file is only
+   read locked and corrupted records are skipped instead of cleared. */
+static struct auth_cache_shared_record *
+auth_cache_shared_find(struct auth_cache_shared *shared, const char *key,
+		       unsigned int key_hash, bool write_locked)
+{
+	struct auth_cache_shared_record *rec;
+	unsigned int i, idx = key_hash % shared->record_count;
+
+	/* There are no tombstones, so the whole probe range must always be
+	   looked at. */
+	for (i = 0; i < AUTH_CACHE_SHARED_PROBE_COUNT; i++) {
+		rec = auth_cache_shared_record(shared,
+			(idx + i) % shared->record_count);
+		if (rec->key_hash != key_hash)
+			continue;
+		if (!auth_cache_shared_record_is_valid(rec)) {
+			if (write_locked) {
+				e_error(shared->event, "%s: Corrupted record - "
+					"dropping it", shared->path);
+				auth_cache_shared_record_clear(shared, rec);
+			}
+			continue;
+		}
+		if (strcmp(rec->node.data, key) == 0)
+			return rec;
+	}
+	return NULL;
+}
+
+struct auth_cache_node *
+auth_cache_shared_lookup(struct auth_cache_shared *shared, const char *key)
+{
+	struct auth_cache_shared_record *rec;
+	struct auth_cache_node *node = NULL;
+
+	if (auth_cache_shared_lock(shared, F_RDLCK) < 0)
+		return NULL;
+	rec = auth_cache_shared_find(shared, key,
+				     auth_cache_shared_key_hash(key), FALSE);
+	if (rec != NULL) {
+		/* return a copy, since other processes may change the
+		   record as soon as it's unlocked */
+		buffer_set_used_size(shared->lookup_buf, 0);
+		node = buffer_append_space_unsafe(shared->lookup_buf,
+						  rec->node.alloc_size);
+		memcpy(node, &rec->node, rec->node.alloc_size);
+		node->prev = node->next = NULL;
+
+		if (!auth_cache_shared_record_is_expired(shared, rec,
+							 time(NULL)))
+			__atomic_store_n(&rec->last_access,
+				auth_cache_shared_next_access(shared),
+				__ATOMIC_RELAXED);
+	}
+	auth_cache_shared_unlock(shared);
+	return node;
+}
+
+void auth_cache_shared_set_last_success(struct auth_cache_shared *shared,
+					const char *key, bool last_success)
+{
+	struct auth_cache_shared_record *rec;
+
+	if (auth_cache_shared_lock(shared, F_WRLCK) < 0)
+		return;
+	rec = auth_cache_shared_find(shared, key,
+				     auth_cache_shared_key_hash(key), TRUE);
+	if (rec != NULL)
+		rec->node.last_success = last_success;
+	auth_cache_shared_unlock(shared);
+}
+
+static struct auth_cache_shared_record *
+auth_cache_shared_find_free(struct auth_cache_shared *shared,
+			    unsigned int key_hash, bool *replaced_r)
+{
+	struct auth_cache_shared_record *rec, *expired = NULL, *lru = NULL;
+	unsigned int i, idx = key_hash % shared->record_count;
+	time_t now = time(NULL);
+
+	*replaced_r = FALSE;
+	for (i = 0; i < AUTH_CACHE_SHARED_PROBE_COUNT; i++) {
+		rec = auth_cache_shared_record(shared,
+			(idx + i) % shared->record_count);
+		if (rec->key_hash == 0)
+			return rec;
+		if (!auth_cache_shared_record_is_valid(rec)) {
+			auth_cache_shared_record_clear(shared, rec);
+			return rec;
+		}
+		if (expired == NULL &&
+		    auth_cache_shared_record_is_expired(shared, rec, now))
+			expired = rec;
+		if (lru == NULL || rec->last_access < lru->last_access)
+			lru = rec;
+	}
+	rec = expired != NULL ? expired : lru;
+	auth_cache_shared_record_clear(shared, rec);
+	*replaced_r = TRUE;
+	return rec;
+}
+
+int auth_cache_shared_insert(struct auth_cache_shared *shared,
+			     const char *key, const char *value,
+			     bool last_success)
+{
+	struct auth_cache_shared_record *rec;
+	size_t key_len = strlen(key), value_len = strlen(value);
+	size_t data_size = key_len + 1 + value_len + 1;
+	unsigned int key_hash;
+	bool replaced;
+
+	if (data_size > AUTH_CACHE_SHARED_DATA_MAX_SIZE)
+		return -1;
+
+	if (auth_cache_shared_lock(shared, F_WRLCK) < 0)
+		return -1;
+	key_hash = auth_cache_shared_key_hash(key);
+	rec = auth_cache_shared_find(shared, key, key_hash, TRUE);
+	if (rec != NULL) {
+		/* key is already in cache (probably expired), replace it */
+		auth_cache_shared_record_clear(shared, rec);
+		replaced = FALSE;
+	} else {
+		rec = auth_cache_shared_find_free(shared, key_hash, &replaced);
+	}
+
+	/* @UNSAFE */
+	rec->last_access = auth_cache_shared_next_access(shared);
+	rec->node.prev = rec->node.next = NULL;
+	rec->node.created = time(NULL);
+	rec->node.alloc_size = sizeof(struct auth_cache_node) + data_size;
+	rec->node.last_success = last_success;
+	memcpy(rec->node.data, key, key_len + 1);
+	memcpy(rec->node.data + key_len + 1, value, value_len + 1);
+	rec->key_hash = key_hash;
+	shared->hdr->used_count++;
+
+	auth_cache_shared_unlock(shared);
+	return replaced ? 1 : 0;
+}
+
+void auth_cache_shared_remove(struct auth_cache_shared *shared,
+			      const char *key)
+{
+	struct auth_cache_shared_record *rec;
+
+	if (auth_cache_shared_lock(shared, F_WRLCK) < 0)
+		return;
+	rec = auth_cache_shared_find(shared, key,
+				     auth_cache_shared_key_hash(key), TRUE);
+	if (rec != NULL)
+		auth_cache_shared_record_clear(shared, rec);
+	auth_cache_shared_unlock(shared);
+}
+
+unsigned int auth_cache_shared_clear(struct auth_cache_shared *shared)
+{
+	unsigned int count;
+
+	if (auth_cache_shared_lock(shared, F_WRLCK) < 0)
+		return 0;
+	count = shared->hdr->used_count;
+	/* the rest of the header is read without locking, so keep it
+	   unchanged */
+	shared->hdr->used_count = 0;
+	shared->hdr->access_counter = 0;
+	memset(shared->records, 0,
+	       (size_t)shared->record_count * AUTH_CACHE_SHARED_RECORD_SIZE);
+	auth_cache_shared_unlock(shared);
+	return count;
+}
+
+#undef auth_cache_shared_clear_matching
+unsigned int
+auth_cache_shared_clear_matching(struct auth_cache_shared *shared,
+				 bool (*callback)(struct auth_cache_node *node,
+						  void *context),
+				 void *context)
+{
+	struct auth_cache_shared_record *rec;
+	unsigned int i, count = 0;
+
+	if (auth_cache_shared_lock(shared, F_WRLCK) < 0)
+		return 0;
+	for (i = 0; i < shared->record_count; i++) {
+		rec = auth_cache_shared_record(shared, i);
+		if (rec->key_hash == 0)
+			continue;
+		if (!auth_cache_shared_record_is_valid(rec) ||
+		    callback(&rec->node, context)) {
+			auth_cache_shared_record_clear(shared, rec);
+			count++;
+		}
+	}
+	auth_cache_shared_unlock(shared);
+	return count;
+}
+
+void auth_cache_shared_get_usage(struct auth_cache_shared *shared,
+				 size_t *used_r, size_t *total_r)
+{
+	/* hdr is NULL if reopening the file failed */
+	*used_r = shared->hdr == NULL ? 0 :
+		(size_t)shared->hdr->used_count * AUTH_CACHE_SHARED_RECORD_SIZE;
+	*total_r = (size_t)shared->record_count *
+		AUTH_CACHE_SHARED_RECORD_SIZE;
+}
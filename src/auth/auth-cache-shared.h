@@ -0,0 +1,65 @@
+#ifndef AUTH_CACHE_SHARED_H
+#define AUTH_CACHE_SHARED_H
+
+struct auth_cache_node;
+
+/* Auth cache backend that stores the cache entries into a memory mapped
+   file. The file consists of a fixed size open addressing hash table, so it
+   can be shared by all auth processes, and it's preserved across auth
+   process restarts. All the functions lock the file while accessing it:
+   lookups with a read lock and modifications with a write lock. The lock is
+   never waited on. If another process has the file locked, the access is
+   skipped, i.e. a lookup is handled as a cache miss. */
+struct auth_cache_shared;
+
+/* Open or create the cache file. If the existing file doesn't match the
+   wanted size (or it's otherwise unusable), it's recreated by renaming a new
+   file over it. Processes that still use the old file reopen it the next
+   time they lock it. Errors while accessing the cache later on are logged
+   using the given event. */
+int auth_cache_shared_open(const char *path, struct event *event,
+			   size_t max_size, unsigned int ttl_secs,
+			   unsigned int neg_ttl_secs,
+			   struct auth_cache_shared **shared_r,
+			   const char **error_r);
+/* Close the cache file. The cache contents are preserved. */
+void auth_cache_shared_close(struct auth_cache_shared **shared);
+
+/* Lookup key from cache. Returns a copy of the cache node, which is valid
+   until the next auth_cache_shared_*() call, or NULL if not found. */
+struct auth_cache_node *
+auth_cache_shared_lookup(struct auth_cache_shared *shared, const char *key);
+/* Update last_success for the given key. */
+void auth_cache_shared_set_last_success(struct auth_cache_shared *shared,
+					const char *key, bool last_success);
+/* Insert key => value into cache. Returns the number of other entries that
+   were removed to make space for it, or -1 if the entry couldn't be added
+   (e.g. it's too large). */
+int auth_cache_shared_insert(struct auth_cache_shared *shared,
+			     const char *key, const char *value,
+			     bool last_success);
+/* Remove key from cache. */
+void auth_cache_shared_remove(struct auth_cache_shared *shared,
+			      const char *key);
+
+/* Remove all entries from cache. Returns the number of removed entries. */
+unsigned int auth_cache_shared_clear(struct auth_cache_shared *shared);
+/* Remove all entries for which the callback returns TRUE. Returns the number
+   of removed entries. */
+unsigned int
+auth_cache_shared_clear_matching(struct auth_cache_shared *shared,
+				 bool (*callback)(struct auth_cache_node *node,
+						  void *context),
+				 void *context);
+#define auth_cache_shared_clear_matching(shared, callback, context) \
+	auth_cache_shared_clear_matching(shared, \
+		1 ? (bool (*)(struct auth_cache_node *, void *))callback : \
+		CALLBACK_TYPECHECK(callback, bool (*)( \
+			struct auth_cache_node *, typeof(context))), \
+		(void *)(context))
+
+/* Returns the number of used and total bytes in the cache. */
+void auth_cache_shared_get_usage(struct auth_cache_shared *shared,
+				 size_t *used_r, size_t *total_r);
+
+#endif
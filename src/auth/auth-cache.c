@@ -9,18 +9,24 @@
 #include "var-expand.h"
 #include "auth-request.h"
 #include "auth-cache.h"
+#include "auth-cache-shared.h"
 
 #include <time.h>
 
 struct auth_cache {
 	HASH_TABLE(char *, struct auth_cache_node *) hash;
 	struct auth_cache_node *head, *tail;
+	/* Expanded keys of the entries that are currently being refreshed */
+	HASH_TABLE(char *, char *) refreshing;
+	/* If non-NULL, the cache nodes are stored in a shared memory mapped
+	   file instead of the hash table. */
+	struct auth_cache_shared *shared;
 	struct event *event;
 
 	size_t max_size, size_left;
-	unsigned int ttl_secs, neg_ttl_secs;
+	unsigned int ttl_secs, neg_ttl_secs, stale_ttl_secs;
 
-	unsigned int hit_count, miss_count;
+	unsigned int hit_count, miss_count, stale_hit_count;
 	unsigned int pos_entries, neg_entries;
 	unsigned long long pos_size, neg_size;
 };
@@ -201,12 +207,17 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 {
 	struct auth_cache *cache = context;
 	unsigned int total_count;
-	size_t cache_used;
+	size_t cache_used, cache_total;
 
 	total_count = cache->hit_count + cache->miss_count;
 	e_info(cache->event, "Authentication cache hits %u/%u (%u%%)",
 	       cache->hit_count, total_count,
 	       total_count == 0 ? 100 : (cache->hit_count * 100 / total_count));
+	if (cache->stale_ttl_secs > 0) {
+		e_info(cache->event, "Authentication cache stale hits: %u, "
+		       "refreshes in progress: %u", cache->stale_hit_count,
+		       hash_table_count(cache->refreshing));
+	}
 
 	e_info(cache->event, "Authentication cache inserts: "
 	       "positive: %u entries %llu bytes, "
@@ -214,30 +225,39 @@ static void sig_auth_cache_stats(const siginfo_t *si ATTR_UNUSED, void *context)
 	       cache->pos_entries, cache->pos_size,
 	       cache->neg_entries, cache->neg_size);
 
-	cache_used = cache->max_size - cache->size_left;
+	if (cache->shared != NULL) {
+		auth_cache_shared_get_usage(cache->shared,
+					    &cache_used, &cache_total);
+	} else {
+		cache_used = cache->max_size - cache->size_left;
+		cache_total = cache->max_size;
+	}
 	e_info(cache->event, "Authentication cache current size: "
 	       "%zu bytes used of %zu bytes (%u%%)",
-	       cache_used, cache->max_size,
-	       (unsigned int)(cache_used * 100ULL / cache->max_size));
+	       cache_used, cache_total,
+	       (unsigned int)(cache_used * 100ULL / cache_total));
 
 	/* reset counters */
-	cache->hit_count = cache->miss_count = 0;
+	cache->hit_count = cache->miss_count = cache->stale_hit_count = 0;
 	cache->pos_entries = cache->neg_entries = 0;
 	cache->pos_size = cache->neg_size = 0;
 }
 
 struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
-				  unsigned int neg_ttl_secs
-)
+				  unsigned int neg_ttl_secs,
+				  unsigned int stale_ttl_secs)
 {
 	struct auth_cache *cache;
 
 	cache = i_new(struct auth_cache, 1);
 	hash_table_create(&cache->hash, default_pool, 0, str_hash, strcmp);
+	hash_table_create(&cache->refreshing, default_pool, 0,
+			  str_hash, strcmp);
 	cache->max_size = max_size;
 	cache->size_left = max_size;
 	cache->ttl_secs = ttl_secs;
 	cache->neg_ttl_secs = neg_ttl_secs;
+	cache->stale_ttl_secs = stale_ttl_secs;
 	cache->event = event_create(auth_event);
 
 	lib_signals_set_handler(SIGHUP, LIBSIG_FLAGS_SAFE,
@@ -247,6 +267,27 @@ struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
 	return cache;
 }
 
+struct auth_cache *
+auth_cache_new_shared(const char *path, size_t max_size,
+		      unsigned int ttl_secs, unsigned int neg_ttl_secs,
+		      unsigned int stale_ttl_secs, const char **error_r)
+{
+	struct auth_cache *cache;
+
+	cache = auth_cache_new(max_size, ttl_secs, neg_ttl_secs,
+			       stale_ttl_secs);
+	/* stale entries are still usable, so don't let them be evicted
+	   before the other expired entries */
+	if (auth_cache_shared_open(path, cache->event, max_size,
+				   ttl_secs + stale_ttl_secs,
+				   neg_ttl_secs + stale_ttl_secs,
+				   &cache->shared, error_r) < 0) {
+		auth_cache_free(&cache);
+		return NULL;
+	}
+	return cache;
+}
+
 void auth_cache_free(struct auth_cache **_cache)
 {
 	struct auth_cache *cache = *_cache;
@@ -255,15 +296,33 @@ void auth_cache_free(struct auth_cache **_cache)
 	lib_signals_unset_handler(SIGHUP, sig_auth_cache_clear, cache);
 	lib_signals_unset_handler(SIGUSR2, sig_auth_cache_stats, cache);
 
+	if (cache->shared != NULL) {
+		/* keep the shared cache for other processes and for the
+		   next auth process */
+		auth_cache_shared_close(&cache->shared);
+	}
 	auth_cache_clear(cache);
 	hash_table_destroy(&cache->hash);
+
+	struct hash_iterate_context *iter =
+		hash_table_iterate_init(cache->refreshing);
+	char *key, *value;
+	while (hash_table_iterate(iter, cache->refreshing, &key, &value))
+		i_free(key);
+	hash_table_iterate_deinit(&iter);
+	hash_table_destroy(&cache->refreshing);
 	event_unref(&cache->event);
 	i_free(cache);
 }
 
 unsigned int auth_cache_clear(struct auth_cache *cache)
 {
-	unsigned int ret = hash_table_count(cache->hash);
+	unsigned int ret;
+
+	if (cache->shared != NULL)
+		return auth_cache_shared_clear(cache->shared);
+
+	ret = hash_table_count(cache->hash);
 
 	while (cache->tail != NULL)
 		auth_cache_node_destroy(cache, cache->tail);
@@ -319,6 +378,11 @@ unsigned int auth_cache_clear_users(struct auth_cache *cache,
 	struct auth_cache_node *node, *next;
 	unsigned int ret = 0;
 
+	if (cache->shared != NULL) {
+		return auth_cache_shared_clear_matching(cache->shared,
+			auth_cache_node_is_one_of_users, usernames);
+	}
+
 	for (node = cache->tail; node != NULL; node = next) {
 		next = node->next;
 		if (auth_cache_node_is_one_of_users(node, usernames)) {
@@ -376,7 +440,8 @@ auth_request_expand_cache_key(const struct auth_request *request,
 const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
-		  bool *expired_r, bool *neg_expired_r)
+		  bool *expired_r, bool *neg_expired_r,
+		  const char **refresh_key_r)
 {
 	struct auth_cache_node *node;
 	const char *value;
@@ -385,9 +450,14 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 
 	*expired_r = FALSE;
 	*neg_expired_r = FALSE;
+	if (refresh_key_r != NULL)
+		*refresh_key_r = NULL;
 
 	key = auth_request_expand_cache_key(request, key, request->fields.translated_username);
-	node = hash_table_lookup(cache->hash, key);
+	if (cache->shared != NULL)
+		node = auth_cache_shared_lookup(cache->shared, key);
+	else
+		node = hash_table_lookup(cache->hash, key);
 	if (node == NULL) {
 		cache->miss_count++;
 		return NULL;
@@ -397,13 +467,27 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	ttl_secs = *value == '\0' ? cache->neg_ttl_secs : cache->ttl_secs;
 
 	now = time(NULL);
-	if (node->created < now - (time_t)ttl_secs) {
+	if (node->created < now - (time_t)ttl_secs &&
+	    (refresh_key_r == NULL ||
+	     node->created < now - (time_t)(ttl_secs + cache->stale_ttl_secs))) {
 		/* TTL expired */
 		cache->miss_count++;
 		*expired_r = TRUE;
+	} else if (node->created < now - (time_t)ttl_secs) {
+		/* TTL expired, but it's still within the stale grace period.
+		   Use the entry, but have the caller refresh it unless
+		   someone is already doing it. */
+		cache->hit_count++;
+		cache->stale_hit_count++;
+		if (hash_table_lookup(cache->refreshing, key) == NULL) {
+			char *refresh_key = i_strdup(key);
+			hash_table_insert(cache->refreshing, refresh_key,
+					  refresh_key);
+			*refresh_key_r = key;
+		}
 	} else {
 		/* move to head */
-		if (node != cache->head) {
+		if (cache->shared == NULL && node != cache->head) {
 			auth_cache_node_unlink(cache, node);
 			auth_cache_node_link_head(cache, node);
 		}
@@ -418,12 +502,28 @@ auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 	return value;
 }
 
+void auth_cache_refresh_finished(struct auth_cache *cache,
+				 const char *refresh_key)
+{
+	char *orig_key, *value;
+
+	if (!hash_table_lookup_full(cache->refreshing, refresh_key,
+				    &orig_key, &value)) {
+		/* the refresh has already been finished */
+		return;
+	}
+	hash_table_remove(cache->refreshing, refresh_key);
+	i_free(orig_key);
+}
+
 void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		       const char *key, const char *value, bool last_success)
 {
-        struct auth_cache_node *node;
+	struct auth_cache_node *node;
 	size_t data_size, alloc_size, key_len, value_len = strlen(value);
+	unsigned int evicted_count = 0;
 	char *hash_key;
+	int ret;
 
 	if (*value == '\0' && cache->neg_ttl_secs == 0) {
 		/* we're not caching negative entries */
@@ -436,29 +536,44 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 	data_size = key_len + 1 + value_len + 1;
 	alloc_size = sizeof(struct auth_cache_node) + data_size;
 
-	/* make sure we have enough space */
-	while (cache->size_left < alloc_size && cache->tail != NULL)
-		auth_cache_node_destroy(cache, cache->tail);
+	if (cache->shared != NULL) {
+		ret = auth_cache_shared_insert(cache->shared, key, value,
+					       last_success);
+		if (ret < 0) {
+			e_debug(cache->event,
+				"Entry with %zu bytes couldn't be cached",
+				data_size);
+			return;
+		}
+		evicted_count = ret;
+	} else {
+		node = hash_table_lookup(cache->hash, key);
+		if (node != NULL) {
+			/* key is already in cache (probably expired),
+			   remove it */
+			auth_cache_node_destroy(cache, node);
+		}
 
-	node = hash_table_lookup(cache->hash, key);
-	if (node != NULL) {
-		/* key is already in cache (probably expired), remove it */
-		auth_cache_node_destroy(cache, node);
-	}
+		/* make sure we have enough space */
+		while (cache->size_left < alloc_size && cache->tail != NULL) {
+			auth_cache_node_destroy(cache, cache->tail);
+			evicted_count++;
+		}
 
-	/* @UNSAFE */
-	node = i_malloc(alloc_size);
-	node->created = time(NULL);
-	node->alloc_size = alloc_size;
-	node->last_success = last_success;
-	memcpy(node->data, key, key_len);
-	memcpy(node->data + key_len + 1, value, value_len);
+		/* @UNSAFE */
+		node = i_malloc(alloc_size);
+		node->created = time(NULL);
+		node->alloc_size = alloc_size;
+		node->last_success = last_success;
+		memcpy(node->data, key, key_len);
+		memcpy(node->data + key_len + 1, value, value_len);
 
-	auth_cache_node_link_head(cache, node);
+		auth_cache_node_link_head(cache, node);
 
-	cache->size_left -= alloc_size;
-	hash_key = node->data;
-	hash_table_insert(cache->hash, hash_key, node);
+		cache->size_left -= alloc_size;
+		hash_key = node->data;
+		hash_table_insert(cache->hash, hash_key, node);
+	}
 
 	if (*value != '\0') {
 		cache->pos_entries++;
@@ -467,6 +582,15 @@ void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		cache->neg_entries++;
 		cache->neg_size += alloc_size;
 	}
+
+	struct event_passthrough *e =
+		event_create_passthrough(cache->event)->
+		set_name("auth_cache_insert_finished")->
+		add_str("type", *value != '\0' ? "positive" : "negative")->
+		add_int("size", alloc_size)->
+		add_int("evicted_entries", evicted_count);
+	e_debug(e->event(), "Inserted %zu bytes, evicted %u entries",
+		alloc_size, evicted_count);
 }
 
 void auth_cache_remove(struct auth_cache *cache,
@@ -475,9 +599,26 @@ void auth_cache_remove(struct auth_cache *cache,
 	struct auth_cache_node *node;
 
 	key = auth_request_expand_cache_key(request, key, request->fields.user);
+	if (cache->shared != NULL) {
+		auth_cache_shared_remove(cache->shared, key);
+		return;
+	}
 	node = hash_table_lookup(cache->hash, key);
 	if (node == NULL)
 		return;
 
 	auth_cache_node_destroy(cache, node);
 }
+
+void auth_cache_node_set_last_success(struct auth_cache *cache,
+				      struct auth_cache_node *node,
+				      bool last_success)
+{
+	if (node->last_success == last_success)
+		return;
+	node->last_success = last_success;
+	if (cache->shared != NULL) {
+		auth_cache_shared_set_last_success(cache->shared, node->data,
+						   last_success);
+	}
+}
@@ -28,9 +28,20 @@ char *auth_cache_parse_key_and_fields(pool_t pool, const char *query,
 /* Create a new cache. max_size specifies the maximum amount of memory in
    bytes to use for cache (it's not fully exact). ttl_secs specifies time to
    live for cache record, requests older than that are not used.
-   neg_ttl_secs specifies the TTL for negative entries. */
+   neg_ttl_secs specifies the TTL for negative entries. If stale_ttl_secs is
+   non-zero, entries that expired less than that many seconds ago are still
+   returned by auth_cache_lookup() while they are being refreshed. */
 struct auth_cache *auth_cache_new(size_t max_size, unsigned int ttl_secs,
-				  unsigned int neg_ttl_secs);
+				  unsigned int neg_ttl_secs,
+				  unsigned int stale_ttl_secs);
+/* Same as auth_cache_new(), but store the cache into a memory mapped file in
+   the given path. The cache is shared with other auth processes using the
+   same path, and it's preserved across auth process restarts. Returns NULL
+   and error_r on failure. */
+struct auth_cache *
+auth_cache_new_shared(const char *path, size_t max_size,
+		      unsigned int ttl_secs, unsigned int neg_ttl_secs,
+		      unsigned int stale_ttl_secs, const char **error_r);
 void auth_cache_free(struct auth_cache **cache);
 
 /* Clear the cache. Returns how many entries were removed. */
@@ -41,11 +52,26 @@ unsigned int auth_cache_clear_users(struct auth_cache *cache,
 
 /* Look key from cache. key should be the same string as returned by
    auth_cache_parse_key(). Returned node can't be used after any other
-   auth_cache_*() calls. */
+   auth_cache_*() calls.
+
+   If refresh_key_r is non-NULL, an entry that is within the stale grace
+   period is returned as if it hadn't expired. If nobody is refreshing it
+   yet, *refresh_key_r is set to the expanded cache key and the caller must
+   start a new lookup to refresh the entry. auth_cache_refresh_finished()
+   must be called once the lookup is done. */
 const char *
 auth_cache_lookup(struct auth_cache *cache, const struct auth_request *request,
 		  const char *key, struct auth_cache_node **node_r,
-		  bool *expired_r, bool *neg_expired_r);
+		  bool *expired_r, bool *neg_expired_r,
+		  const char **refresh_key_r);
+/* Finish refreshing the entry, which was requested by auth_cache_lookup(). */
+void auth_cache_refresh_finished(struct auth_cache *cache,
+				 const char *refresh_key);
+/* Update the node returned by auth_cache_lookup() to remember whether the
+   user gave the correct password. */
+void auth_cache_node_set_last_success(struct auth_cache *cache,
+				      struct auth_cache_node *node,
+				      bool last_success);
 /* Insert key => value into cache. "" value means negative cache entry. */
 void auth_cache_insert(struct auth_cache *cache, struct auth_request *request,
 		       const char *key, const char *value, bool last_success);
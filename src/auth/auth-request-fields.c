@@ -303,6 +303,9 @@ bool auth_request_import(struct auth_request *request,
 	} else if (strcmp(key, "original-username") == 0) {
 		fields->original_username = p_strdup(request->pool, value);
 		event_add_str(request->event, "original_user", value);
+	} else if (strcmp(key, "translated-username") == 0) {
+		fields->translated_username = p_strdup(request->pool, value);
+		event_add_str(request->event, "translated_user", value);
 	} else if (strcmp(key, "requested-login-user") == 0)
 		auth_request_set_login_username_forced(request, value);
 	else if (strcmp(key, "successful") == 0)
@@ -60,6 +60,9 @@ unsigned int auth_request_state_count[AUTH_REQUEST_STATE_MAX];
 
 static void
 auth_request_userdb_import(struct auth_request *request, const char *args);
+static void
+auth_request_userdb_cache_refresh(struct auth_request *request,
+				  const char *refresh_key);
 
 static void auth_request_lookup_credentials_policy_continue(
 	struct auth_request *request, lookup_credentials_callback_t *callback);
@@ -175,7 +178,7 @@ struct auth_request *auth_request_new_dummy(struct event *parent_event)
 	struct auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"auth_request", 1024);
+	pool = pool_slab_create("auth_request");
 	request = p_new(pool, struct auth_request, 1);
 	request->pool = pool;
 
@@ -256,6 +259,15 @@ auth_request_finished_event(struct auth_request *request, struct event *event)
 	} else if (request->fields.successful) {
 		e->add_str("success", "yes");
 	}
+
+	struct pool_slab_stats slab_stats;
+	if (pool_slab_get_pool_stats(request->pool, &slab_stats)) {
+		e->add_int("mem_slab_allocs", slab_stats.alloc_count);
+		e->add_int("mem_slab_system_allocs",
+			   slab_stats.system_alloc_count);
+		e->add_int("mem_slab_system_alloc_bytes",
+			   slab_stats.system_alloc_bytes);
+	}
 	if (request->userdb_lookup) {
 		return e;
 	}
@@ -366,6 +378,20 @@ void auth_request_ref(struct auth_request *request)
 	request->refcount++;
 }
 
+static void auth_request_cache_refresh_release(struct auth_request *request)
+{
+	if (request->cache_refresh_key == NULL ||
+	    request->cache_refresh_released)
+		return;
+
+	/* allow the entry to be refreshed again */
+	request->cache_refresh_released = TRUE;
+	if (passdb_cache != NULL) {
+		auth_cache_refresh_finished(passdb_cache,
+					    request->cache_refresh_key);
+	}
+}
+
 void auth_request_unref(struct auth_request **_request)
 {
 	struct auth_request *request = *_request;
@@ -394,6 +420,9 @@ void auth_request_unref(struct auth_request **_request)
 		dns_lookup_abort(&request->dns_lookup_ctx->dns_lookup);
 	timeout_remove(&request->to_abort);
 	timeout_remove(&request->to_penalty);
+	timeout_remove(&request->to_cache_refresh);
+	/* The refresh lookup may have been aborted without finishing */
+	auth_request_cache_refresh_release(request);
 
 	if (request->mech != NULL)
 		request->mech->auth_free(request);
@@ -551,6 +580,25 @@ auth_request_save_cache(struct auth_request *request,
 			  result == PASSDB_RESULT_OK);
 }
 
+static void auth_request_cache_refresh_finish(struct auth_request *request)
+{
+	e_debug(request->event, "Stale cache entry refresh finished");
+	auth_request_cache_refresh_release(request);
+	auth_request_unref(&request);
+}
+
+static void
+auth_request_passdb_cache_refresh_finish(struct auth_request *request,
+					 enum passdb_result result)
+{
+	/* Only update the cache. On internal failure the stale entry is
+	   kept, and the next lookup tries to refresh it again. */
+	if (result != PASSDB_RESULT_INTERNAL_FAILURE)
+		auth_request_save_cache(request, result);
+	auth_request_passdb_lookup_end(request, result);
+	auth_request_cache_refresh_finish(request);
+}
+
 static bool
 auth_request_mechanism_accepted(const char *const *mechs,
 				const struct mech_module *mech)
@@ -1142,6 +1190,11 @@ void auth_request_verify_plain_callback(enum passdb_result result,
 	    auth_fields_exists(request->fields.extra_fields, "noauthenticate"))
 		result = PASSDB_RESULT_NEXT;
 
+	if (request->cache_refresh_key != NULL) {
+		auth_request_passdb_cache_refresh_finish(request, result);
+		return;
+	}
+
 	if (result != PASSDB_RESULT_INTERNAL_FAILURE)
 		auth_request_save_cache(request, result);
 	else {
@@ -1399,6 +1452,11 @@ void auth_request_lookup_credentials_callback(enum passdb_result result,
 	    auth_fields_exists(request->fields.extra_fields, "noauthenticate"))
 		result = PASSDB_RESULT_NEXT;
 
+	if (request->cache_refresh_key != NULL) {
+		auth_request_passdb_cache_refresh_finish(request, result);
+		return;
+	}
+
 	if (result != PASSDB_RESULT_INTERNAL_FAILURE)
 		auth_request_save_cache(request, result);
 	else {
@@ -1585,12 +1643,17 @@ static bool
 auth_request_lookup_user_cache(struct auth_request *request, const char *key,
 			       enum userdb_result *result_r, bool use_expired)
 {
-	const char *value;
+	const char *value, *refresh_key;
 	struct auth_cache_node *node;
 	bool expired, neg_expired;
 
 	value = auth_cache_lookup(passdb_cache, request, key, &node,
-				  &expired, &neg_expired);
+				  &expired, &neg_expired,
+				  use_expired ? NULL : &refresh_key);
+	if (value != NULL && !use_expired && refresh_key != NULL) {
+		/* stale entry - refresh it in the background */
+		auth_request_userdb_cache_refresh(request, refresh_key);
+	}
 	if (value == NULL || (expired && !use_expired)) {
 		request->userdb_cache_result = AUTH_REQUEST_CACHE_MISS;
 		e_debug(request->event,
@@ -1635,6 +1698,16 @@ void auth_request_userdb_callback(enum userdb_result result,
 	enum auth_db_rule result_rule;
 	bool userdb_continue = FALSE;
 
+	if (request->cache_refresh_key != NULL) {
+		/* Only update the cache, like with passdb refreshes */
+		if (!request->userdb_lookup_tempfailed &&
+		    result != USERDB_RESULT_INTERNAL_FAILURE)
+			auth_request_userdb_save_cache(request, result);
+		auth_request_userdb_lookup_end(request, result);
+		auth_request_cache_refresh_finish(request);
+		return;
+	}
+
 	if (!request->userdb_lookup_tempfailed &&
 	    result != USERDB_RESULT_INTERNAL_FAILURE &&
 	    request->userdb_cache_result != AUTH_REQUEST_CACHE_HIT) {
@@ -1801,6 +1874,155 @@ void auth_request_lookup_user(struct auth_request *request,
 	}
 }
 
+static void auth_request_cache_refresh_timeout(struct auth_request *request)
+{
+	timeout_remove(&request->to_cache_refresh);
+	/* The stale entry can't be used anymore after this, so there's no
+	   point in waiting for this lookup. Allow another refresh to be
+	   started. This request is still freed when the lookup finishes. */
+	e_warning(request->event,
+		  "Stale cache entry refresh timed out after %u secs",
+		  request->set->cache_stale_ttl);
+	auth_request_cache_refresh_release(request);
+}
+
+static void auth_request_cache_refresh_start(struct auth_request *request)
+{
+	struct auth_passdb *passdb = request->passdb;
+	struct auth_userdb *userdb = request->userdb;
+	unsigned int timeout_msecs;
+
+	timeout_remove(&request->to_cache_refresh);
+	/* The lookup may finish and free the request immediately, so
+	   add the timeout before starting it. */
+	if (request->set->cache_stale_ttl > INT_MAX / 1000)
+		timeout_msecs = INT_MAX;
+	else
+		timeout_msecs = request->set->cache_stale_ttl * 1000;
+	request->to_cache_refresh =
+		timeout_add(timeout_msecs,
+			    auth_request_cache_refresh_timeout, request);
+
+	if (request->userdb_lookup) {
+		auth_request_userdb_lookup_begin(request);
+		if (userdb->userdb->iface->lookup == NULL) {
+			auth_request_userdb_callback(
+				USERDB_RESULT_INTERNAL_FAILURE, request);
+		} else if (userdb->userdb->blocking) {
+			userdb_blocking_lookup(request);
+		} else {
+			userdb->userdb->iface->lookup(
+				request, auth_request_userdb_callback);
+		}
+		return;
+	}
+
+	auth_request_passdb_lookup_begin(request);
+	auth_request_set_state(request, AUTH_REQUEST_STATE_PASSDB);
+	if (request->wanted_credentials_scheme != NULL) {
+		if (passdb->passdb->iface.lookup_credentials == NULL) {
+			auth_request_lookup_credentials_callback(
+				PASSDB_RESULT_INTERNAL_FAILURE,
+				uchar_empty_ptr, 0, request);
+		} else if (passdb->passdb->blocking) {
+			passdb_blocking_lookup_credentials(request);
+		} else {
+			passdb->passdb->iface.lookup_credentials(request,
+				auth_request_lookup_credentials_callback);
+		}
+	} else {
+		if (passdb->passdb->iface.verify_plain == NULL) {
+			auth_request_verify_plain_callback(
+				PASSDB_RESULT_INTERNAL_FAILURE, request);
+		} else if (passdb->passdb->blocking) {
+			passdb_blocking_verify_plain(request);
+		} else {
+			passdb->passdb->iface.verify_plain(request,
+				request->mech_password,
+				auth_request_verify_plain_callback);
+		}
+	}
+}
+
+static struct auth_request *
+auth_request_cache_refresh_new(struct auth_request *request,
+			       const char *refresh_key)
+{
+	struct auth_request *refresh;
+	const char *const *args, *value;
+	string_t *str;
+
+	/* Copy the request the same way as it's copied to auth workers.
+	   The copy is independent of the original request, which can
+	   finish using the stale cache entry immediately. */
+	str = t_str_new(256);
+	auth_request_export(request, str);
+
+	refresh = auth_request_new_dummy(auth_event);
+	for (args = t_strsplit_tabescaped(str_c(str)); *args != NULL; args++) {
+		value = strchr(*args, '=');
+		if (value == NULL)
+			(void)auth_request_import(refresh, *args, "");
+		else {
+			(void)auth_request_import(refresh,
+				t_strdup_until(*args, value), value + 1);
+		}
+	}
+	/* the cache key is expanded using the translated username */
+	if (request->fields.translated_username != NULL) {
+		(void)auth_request_import(refresh, "translated-username",
+					  request->fields.translated_username);
+	}
+	/* cache only the fields that are set by the refresh lookup */
+	auth_fields_snapshot(refresh->fields.extra_fields);
+	if (refresh->fields.userdb_reply != NULL)
+		auth_fields_snapshot(refresh->fields.userdb_reply);
+
+	auth_request_init(refresh);
+	refresh->passdb = request->passdb;
+	refresh->userdb = request->userdb;
+	refresh->cache_refresh_key = p_strdup(refresh->pool, refresh_key);
+
+	/* Start the lookup only after the original request has finished
+	   using the cache node. */
+	refresh->to_cache_refresh =
+		timeout_add_short(0, auth_request_cache_refresh_start, refresh);
+	return refresh;
+}
+
+void auth_request_passdb_cache_refresh(struct auth_request *request,
+				       const char *refresh_key,
+				       bool verify_plain)
+{
+	struct auth_request *refresh;
+
+	refresh = auth_request_cache_refresh_new(request, refresh_key);
+	if (verify_plain) {
+		refresh->mech_password =
+			p_strdup(refresh->pool, request->mech_password);
+	} else {
+		refresh->wanted_credentials_scheme =
+			p_strdup(refresh->pool,
+				 request->wanted_credentials_scheme);
+	}
+	e_debug(authdb_event(request),
+		"cache entry is stale, refreshing it in background");
+}
+
+static void
+auth_request_userdb_cache_refresh(struct auth_request *request,
+				  const char *refresh_key)
+{
+	struct auth_request *refresh;
+
+	refresh = auth_request_cache_refresh_new(request, refresh_key);
+	refresh->userdb_lookup = TRUE;
+	if (refresh->fields.userdb_reply == NULL)
+		auth_request_init_userdb_reply(refresh);
+	e_debug(authdb_event(request),
+		"userdb cache entry is stale, refreshing it in background");
+}
+
 static void
 auth_request_validate_networks(struct auth_request *request,
 			       const char *name, const char *networks,
@@ -188,6 +188,11 @@ struct auth_request {
 
 	enum auth_request_cache_result passdb_cache_result;
 	enum auth_request_cache_result userdb_cache_result;
+	/* If non-NULL, this request is refreshing a stale auth cache entry
+	   with this key in the background. */
+	const char *cache_refresh_key;
+	/* Starts the refresh lookup, and after that times it out */
+	struct timeout *to_cache_refresh;
 
 	/* this is a lookup on auth socket (not login socket).
 	   skip any proxying stuff if enabled. */
@@ -243,6 +248,9 @@ struct auth_request {
 	bool final_resp_sent:1;
 
 	bool event_finished_sent:1;
+	/* The cache_refresh_key has already been released, so another
+	   refresh for it may have been started. */
+	bool cache_refresh_released:1;
 
 	/* ... mechanism specific data ... */
 };
@@ -435,6 +443,12 @@ void auth_request_passdb_lookup_end(struct auth_request *request,
 void auth_request_userdb_lookup_begin(struct auth_request *request);
 void auth_request_userdb_lookup_end(struct auth_request *request,
 				    enum userdb_result result);
+/* Refresh a stale passdb cache entry in the background by repeating the
+   passdb lookup with a copy of the request. The lookup is either
+   verify_plain or lookup_credentials. */
+void auth_request_passdb_cache_refresh(struct auth_request *request,
+				       const char *refresh_key,
+				       bool verify_plain);
 
 /* Fetches the current authdb event, this is done because
    some lookups can recurse into new lookups, requiring new event,
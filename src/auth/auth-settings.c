@@ -291,8 +291,10 @@ static const struct setting_define auth_setting_defines[] = {
 	DEF(BOOLLIST, realms),
 	DEF(STR, default_domain),
 	DEF(SIZE, cache_size),
+	DEF(STR_NOVARS, cache_path),
 	DEF(TIME, cache_ttl),
 	DEF(TIME, cache_negative_ttl),
+	DEF(TIME, cache_stale_ttl),
 	DEF(BOOL, cache_verify_password_with_worker),
 	DEF(STR, username_chars),
 	DEF(STR_HIDDEN, username_translation),
@@ -358,8 +360,10 @@ static const struct auth_settings auth_default_settings = {
 	.realms = ARRAY_INIT,
 	.default_domain = "",
 	.cache_size = 0,
+	.cache_path = "",
 	.cache_ttl = 60*60,
 	.cache_negative_ttl = 60*60,
+	.cache_stale_ttl = 0,
 	.cache_verify_password_with_worker = FALSE,
 	.username_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890.-_@",
 	.username_translation = "",
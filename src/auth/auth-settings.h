@@ -55,8 +55,10 @@ struct auth_settings {
 	ARRAY_TYPE(const_string) realms;
 	const char *default_domain;
 	uoff_t cache_size;
+	const char *cache_path;
 	unsigned int cache_ttl;
 	unsigned int cache_negative_ttl;
+	unsigned int cache_stale_ttl;
 	bool cache_verify_password_with_worker;
 	const char *username_chars;
 	const char *username_translation;
@@ -22,6 +22,8 @@ static const struct setting_define ldap_setting_defines[] = {
 	{ .type = SET_FILTER_NAME, .key = "userdb_ldap", },
 	DEF(STR, uris),
 	DEF(STR, connection_group),
+	DEF(UINT, connection_count),
+	DEF(UINT, max_pending_requests),
 	DEF(STR, auth_dn),
 	DEF(STR, auth_dn_password),
 	DEF(BOOLLIST, auth_sasl_mechanisms),
@@ -38,6 +40,8 @@ static const struct setting_define ldap_setting_defines[] = {
 static const struct ldap_settings ldap_default_settings = {
 	.uris = "",
 	.connection_group = "",
+	.connection_count = 1,
+	.max_pending_requests = 9,
 	.auth_dn = "",
 	.auth_dn_password = "",
 	.auth_sasl_mechanisms = ARRAY_INIT,
@@ -169,6 +173,15 @@ static bool ldap_setting_check(void *_set, pool_t pool ATTR_UNUSED,
 		return FALSE;
 	}
 
+	if (set->connection_count == 0) {
+		*error_r = "ldap_connection_count must be at least 1";
+		return FALSE;
+	}
+	if (set->max_pending_requests == 0) {
+		*error_r = "ldap_max_pending_requests must be at least 1";
+		return FALSE;
+	}
+
 #ifndef HAVE_LDAP_SASL
 	if (!array_is_empty(&set->auth_sasl_mechanisms)) {
 		*error_r = "ldap_auth_sasl_mechanism set, but no SASL support compiled in";
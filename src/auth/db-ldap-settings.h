@@ -22,6 +22,13 @@ struct ldap_settings {
 	   affects how ldap_conn_find() compares the settings against an
 	   existing connection */
 	const char *connection_group;
+	/* Number of LDAP connections to use in parallel for these settings.
+	   Requests are sent to the connection with the shortest queue. */
+	unsigned int connection_count;
+	/* Maximum number of requests sent to a connection before waiting
+	   for replies. The default 9 is the same as the old hardcoded
+	   limit. */
+	unsigned int max_pending_requests;
 
 	const char *auth_dn;
 	const char *auth_dn_password;
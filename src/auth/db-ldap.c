@@ -105,6 +105,98 @@ static bool db_ldap_abort_requests(struct ldap_connection *conn,
 				   bool error, const char *reason);
 static void db_ldap_request_free(struct ldap_request *request);
 
+static struct ldap_connection *
+db_ldap_conn_primary(struct ldap_connection *conn)
+{
+	return conn->primary != NULL ? conn->primary : conn;
+}
+
+static unsigned int
+db_ldap_search_hash(const struct ldap_request_search *srequest)
+{
+	return str_hash(srequest->filter) ^ str_hash(srequest->base);
+}
+
+static int db_ldap_search_cmp(const struct ldap_request_search *srequest1,
+			      const struct ldap_request_search *srequest2)
+{
+	int ret;
+
+	/* the attribute lists come from the passdb/userdb module, so they
+	   are the same only if the pointers are the same */
+	if (srequest1->attributes != srequest2->attributes ||
+	    srequest1->sensitive_attr_names != srequest2->sensitive_attr_names)
+		return 1;
+	ret = strcmp(srequest1->filter, srequest2->filter);
+	if (ret != 0)
+		return ret;
+	return strcmp(srequest1->base, srequest2->base);
+}
+
+static bool
+db_ldap_request_coalesce(struct ldap_connection *conn,
+			 struct ldap_request *request)
+{
+	struct ldap_connection *primary = db_ldap_conn_primary(conn);
+	struct ldap_request_search *srequest, *first;
+
+	if (request->type != LDAP_REQUEST_TYPE_SEARCH)
+		return FALSE;
+	srequest = container_of(request, struct ldap_request_search, request);
+	if (srequest->multi_entry)
+		return FALSE;
+
+	first = hash_table_lookup(primary->search_hash, srequest);
+	if (first == NULL) {
+		hash_table_insert(primary->search_hash, srequest, srequest);
+		return FALSE;
+	}
+	request->coalesced_next = first->request.coalesced_requests;
+	first->request.coalesced_requests = request;
+	return TRUE;
+}
+
+static void
+db_ldap_request_coalesce_remove(struct ldap_connection *conn,
+				struct ldap_request *request)
+{
+	struct ldap_connection *primary = db_ldap_conn_primary(conn);
+	struct ldap_request_search *srequest;
+
+	if (request->type != LDAP_REQUEST_TYPE_SEARCH)
+		return;
+	srequest = container_of(request, struct ldap_request_search, request);
+	if (srequest->multi_entry)
+		return;
+	if (hash_table_lookup(primary->search_hash, srequest) == srequest)
+		hash_table_remove(primary->search_hash, srequest);
+}
+
+static void
+db_ldap_request_callback(struct ldap_connection *conn,
+			 struct ldap_request *request,
+			 LDAPMessage *entry_res, LDAPMessage *res)
+{
+	struct ldap_request *coalesced, *next;
+
+	/* the callback may free the request, so detach the coalesced
+	   requests first */
+	db_ldap_request_coalesce_remove(conn, request);
+	coalesced = request->coalesced_requests;
+	request->coalesced_requests = NULL;
+
+	if (entry_res != NULL)
+		request->callback(conn, request, entry_res);
+	request->callback(conn, request, res);
+
+	for (; coalesced != NULL; coalesced = next) {
+		next = coalesced->coalesced_next;
+		if (entry_res != NULL)
+			coalesced->callback(conn, coalesced, entry_res);
+		coalesced->callback(conn, coalesced, res);
+	}
+}
+
 static int ldap_get_errno(struct ldap_connection *conn)
 {
 	int ret, err;
@@ -256,7 +348,7 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 		/* no non-pending requests */
 		return FALSE;
 	}
-	if (conn->pending_count > DB_LDAP_MAX_PENDING_REQUESTS) {
+	if (conn->pending_count >= conn->set->max_pending_requests) {
 		/* wait until server has replied to some requests */
 		return FALSE;
 	}
@@ -319,7 +411,7 @@ static bool db_ldap_request_queue_next(struct ldap_connection *conn)
 	} else {
 		/* broken request, remove from queue */
 		aqueue_delete(conn->request_queue, conn->pending_count);
-		request->callback(conn, request, NULL);
+		db_ldap_request_callback(conn, request, NULL, NULL);
 		return TRUE;
 	}
 }
@@ -345,6 +437,31 @@ db_ldap_check_hanging(struct ldap_connection *conn)
 	}
 }
 
+static struct ldap_connection *
+db_ldap_conn_pick(struct ldap_connection *conn, struct ldap_request *request)
+{
+	struct ldap_connection *primary = db_ldap_conn_primary(conn);
+	struct ldap_connection *fanout_conn, *best = primary;
+
+	if (!array_is_created(&primary->fanout_conns))
+		return conn;
+	if (request->type == LDAP_REQUEST_TYPE_SEARCH &&
+	    (container_of(request, struct ldap_request_search,
+			  request))->multi_entry) {
+		/* iteration controls the input of the connection with
+		   db_ldap_enable_input(), so keep it in the caller's
+		   connection */
+		return conn;
+	}
+
+	array_foreach_elem(&primary->fanout_conns, fanout_conn) {
+		if (aqueue_count(fanout_conn->request_queue) <
+		    aqueue_count(best->request_queue))
+			best = fanout_conn;
+	}
+	return best;
+}
+
 void db_ldap_request(struct ldap_connection *conn,
 		     struct ldap_request *request)
 {
@@ -352,10 +469,33 @@ void db_ldap_request(struct ldap_connection *conn,
 
 	request->msgid = -1;
 	request->create_time = ioloop_time;
+	request->coalesced_requests = NULL;
+	request->coalesced_next = NULL;
+
+	if (db_ldap_request_coalesce(conn, request)) {
+		e_debug(event_create_passthrough(
+				authdb_event(request->auth_request))->
+			set_name("ldap_request_queued")->
+			add_str("coalesced", "yes")->event(),
+			"Coalesced into an identical pending LDAP search");
+		return;
+	}
 
+	conn = db_ldap_conn_pick(conn, request);
 	db_ldap_check_hanging(conn);
 
 	aqueue_append(conn->request_queue, &request);
+
+	unsigned int in_flight = conn->pending_count;
+	unsigned int queue_depth =
+		aqueue_count(conn->request_queue) - in_flight;
+	e_debug(event_create_passthrough(authdb_event(request->auth_request))->
+		set_name("ldap_request_queued")->
+		add_int("queue_depth", queue_depth)->
+		add_int("in_flight", in_flight)->event(),
+		"Queued LDAP request (%u queued, %u in flight)",
+		queue_depth, in_flight);
+
 	(void)db_ldap_request_queue_next(conn);
 }
 
@@ -434,7 +574,7 @@ static bool db_ldap_abort_requests(struct ldap_connection *conn,
 			e_info(authdb_event(request->auth_request),
 			       "%s", reason);
 		}
-		request->callback(conn, request, NULL);
+		db_ldap_request_callback(conn, request, NULL, NULL);
 		max_count--;
 		aborts = TRUE;
 	}
@@ -571,10 +711,12 @@ db_ldap_handle_request_result(struct ldap_connection *conn,
 	}
 
 	T_BEGIN {
-		if (res != NULL && srequest != NULL && srequest->result != NULL)
-			request->callback(conn, request, srequest->result->msg);
+		LDAPMessage *entry_res = NULL;
 
-		request->callback(conn, request, res == NULL ? NULL : res->msg);
+		if (res != NULL && srequest != NULL && srequest->result != NULL)
+			entry_res = srequest->result->msg;
+		db_ldap_request_callback(conn, request, entry_res,
+					 res == NULL ? NULL : res->msg);
 	} T_END;
 
 	if (idx > 0) {
@@ -1475,6 +1617,35 @@ db_ldap_conn_find(const struct ldap_settings *set, const struct ssl_settings *ss
 	return NULL;
 }
 
+static struct ldap_connection *
+db_ldap_conn_create(const struct ldap_settings *set,
+		    const struct ssl_settings *ssl_set)
+{
+	struct ldap_connection *conn;
+
+	pool_t pool = pool_alloconly_create("ldap_connection", 1024);
+	conn = p_new(pool, struct ldap_connection, 1);
+	conn->pool = pool;
+	conn->refcount = 1;
+
+        conn->set = set;
+	conn->ssl_set = ssl_set;
+
+	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
+	conn->default_bind_msgid = -1;
+	conn->fd = -1;
+
+	conn->event = event_create(auth_event);
+	conn->log_prefix = i_strdup_printf("ldap(%s): ", set->uris);
+	event_set_log_prefix_callback(conn->event, FALSE, db_ldap_log_callback, conn);
+
+	i_array_init(&conn->request_array, 512);
+	conn->request_queue = aqueue_init(&conn->request_array.arr);
+
+	db_ldap_init_ld(conn);
+	return conn;
+}
+
 struct ldap_connection *db_ldap_init(struct event *event)
 {
 	const struct ldap_settings *set;
@@ -1496,39 +1667,52 @@ struct ldap_connection *db_ldap_init(struct event *event)
 		return conn;
 	}
 
-	pool_t pool = pool_alloconly_create("ldap_connection", 1024);
-	conn = p_new(pool, struct ldap_connection, 1);
-	conn->pool = pool;
-	conn->refcount = 1;
-
-        conn->set = set;
-	conn->ssl_set = ssl_set;
+	conn = db_ldap_conn_create(set, ssl_set);
+	hash_table_create(&conn->search_hash, default_pool, 0,
+			  db_ldap_search_hash, db_ldap_search_cmp);
+	if (set->connection_count > 1) {
+		i_array_init(&conn->fanout_conns, set->connection_count - 1);
+		for (unsigned int i = 1; i < set->connection_count; i++) {
+			struct ldap_connection *fanout_conn =
+				db_ldap_conn_create(set, ssl_set);
+			fanout_conn->primary = conn;
+			array_push_back(&conn->fanout_conns, &fanout_conn);
+		}
+	}
 
-	conn->conn_state = LDAP_CONN_STATE_DISCONNECTED;
-	conn->default_bind_msgid = -1;
-	conn->fd = -1;
+	conn->next = ldap_connections;
+        ldap_connections = conn;
+	return conn;
+}
 
-	conn->event = event_create(auth_event);
-	conn->log_prefix = i_strdup_printf("ldap(%s): ", set->uris);
-	event_set_log_prefix_callback(conn->event, FALSE, db_ldap_log_callback, conn);
+static void db_ldap_conn_free(struct ldap_connection *conn)
+{
+	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
+	i_assert(conn->pending_count == 0);
+	db_ldap_conn_close(conn);
+	i_assert(conn->to == NULL);
 
-	i_array_init(&conn->request_array, 512);
-	conn->request_queue = aqueue_init(&conn->request_array.arr);
+	array_free(&conn->request_array);
+	aqueue_deinit(&conn->request_queue);
 
-	conn->next = ldap_connections;
-        ldap_connections = conn;
+	event_unref(&conn->event);
+	i_free(conn->log_prefix);
 
-	db_ldap_init_ld(conn);
-	return conn;
+	if (hash_table_is_created(conn->search_hash))
+		hash_table_destroy(&conn->search_hash);
+	pool_unref(&conn->pool);
 }
 
 void db_ldap_unref(struct ldap_connection **_conn)
 {
         struct ldap_connection *conn = *_conn;
-	struct ldap_connection **p;
+	struct ldap_connection **p, *fanout_conn;
+	const struct ldap_settings *set = conn->set;
+	const struct ssl_settings *ssl_set = conn->ssl_set;
 
 	*_conn = NULL;
 	i_assert(conn->refcount >= 0);
+	i_assert(conn->primary == NULL);
 	if (--conn->refcount > 0)
 		return;
 
@@ -1539,21 +1723,17 @@ void db_ldap_unref(struct ldap_connection **_conn)
 		}
 	}
 
-	db_ldap_abort_requests(conn, UINT_MAX, 0, FALSE, "Shutting down");
-	i_assert(conn->pending_count == 0);
-	db_ldap_conn_close(conn);
-	i_assert(conn->to == NULL);
-
-	array_free(&conn->request_array);
-	aqueue_deinit(&conn->request_queue);
-
-	settings_free(conn->ssl_set);
-	settings_free(conn->set);
-
-	event_unref(&conn->event);
-	i_free(conn->log_prefix);
+	/* the fanout connections still use the primary connection's
+	   search_hash while aborting their requests */
+	if (array_is_created(&conn->fanout_conns)) {
+		array_foreach_elem(&conn->fanout_conns, fanout_conn)
+			db_ldap_conn_free(fanout_conn);
+		array_free(&conn->fanout_conns);
+	}
+	db_ldap_conn_free(conn);
 
-	pool_unref(&conn->pool);
+	settings_free(ssl_set);
+	settings_free(set);
 }
 
 #ifndef BUILTIN_LDAP
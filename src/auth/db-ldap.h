@@ -6,8 +6,6 @@
    It is now set in m4/want_ldap.m4 if ldap is enabled. */
 /* #define LDAP_DEPRECATED 1 */
 
-/* Maximum number of pending requests before delaying new requests. */
-#define DB_LDAP_MAX_PENDING_REQUESTS 8
 /* connect() timeout to LDAP */
 #define DB_LDAP_CONNECT_TIMEOUT_SECS 5
 /* If LDAP connection is down, fail requests after waiting for this long. */
@@ -20,6 +18,7 @@
 #define DB_LDAP_IDLE_RECONNECT_SECS 60
 
 #include <ldap.h>
+#include "hash.h"
 #include "var-expand.h"
 #include "db-ldap-settings.h"
 
@@ -72,6 +71,12 @@ struct ldap_request {
 
 	db_search_callback_t *callback;
 	struct auth_request *auth_request;
+
+	/* Identical search requests that were received while this request
+	   was in the queue. They get the same reply as this request. */
+	struct ldap_request *coalesced_requests;
+	/* Next request in the coalesced_requests list */
+	struct ldap_request *coalesced_next;
 };
 
 struct ldap_request_named_result {
@@ -141,6 +146,17 @@ struct ldap_connection {
 	/* Timestamp when we last received a reply */
 	time_t last_reply_stamp;
 
+	/* With ldap_connection_count > 1 the connection returned by
+	   db_ldap_init() is the primary connection and the rest are in
+	   fanout_conns. The other connections point to the primary. */
+	struct ldap_connection *primary;
+	ARRAY(struct ldap_connection *) fanout_conns;
+	/* Search requests in the request queues of all the connections, which
+	   other identical searches can be coalesced into. Only in the primary
+	   connection. */
+	HASH_TABLE(struct ldap_request_search *,
+		   struct ldap_request_search *) search_hash;
+
 	bool delayed_connect;
 };
 
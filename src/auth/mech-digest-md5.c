@@ -576,8 +576,7 @@ static struct auth_request *mech_digest_md5_auth_new(void)
 	struct digest_auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(
-		MEMPOOL_GROWING"digest_md5_auth_request", 2048);
+	pool = pool_slab_create("digest_md5_auth_request");
 	request = p_new(pool, struct digest_auth_request, 1);
 	request->pool = pool;
 	request->qop = QOP_AUTH;
@@ -45,7 +45,7 @@ static struct auth_request *mech_external_auth_new(void)
         struct auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"external_auth_request", 2048);
+	pool = pool_slab_create("external_auth_request");
 	request = p_new(pool, struct auth_request, 1);
 	request->pool = pool;
 	return request;
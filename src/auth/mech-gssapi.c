@@ -116,7 +116,7 @@ static struct auth_request *mech_gssapi_auth_new(void)
 	struct gssapi_auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"gssapi_auth_request", 2048);
+	pool = pool_slab_create("gssapi_auth_request");
 	request = p_new(pool, struct gssapi_auth_request, 1);
 	request->pool = pool;
 
@@ -217,7 +217,7 @@ static struct auth_request *mech_otp_auth_new(void)
 
 	otp_lock_init();
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"otp_auth_request", 2048);
+	pool = pool_slab_create("otp_auth_request");
 	request = p_new(pool, struct otp_auth_request, 1);
 	request->pool = pool;
 	request->lock = FALSE;
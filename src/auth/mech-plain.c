@@ -69,7 +69,7 @@ static struct auth_request *mech_plain_auth_new(void)
         struct auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"plain_auth_request", 2048);
+	pool = pool_slab_create("plain_auth_request");
 	request = p_new(pool, struct auth_request, 1);
 	request->pool = pool;
 	return request;
@@ -177,7 +177,7 @@ mech_scram_auth_new(const struct hash_method *hash_method,
 	struct scram_auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"scram_auth_request", 2048);
+	pool = pool_slab_create("scram_auth_request");
 	request = p_new(pool, struct scram_auth_request, 1);
 	request->pool = pool;
 	request->password_scheme = password_scheme;
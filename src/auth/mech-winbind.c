@@ -318,7 +318,7 @@ static struct auth_request *do_auth_new(struct winbind_helper *winbind)
 	struct winbind_auth_request *request;
 	pool_t pool;
 
-	pool = pool_alloconly_create(MEMPOOL_GROWING"winbind_auth_request", 2048);
+	pool = pool_slab_create("winbind_auth_request");
 	request = p_new(pool, struct winbind_auth_request, 1);
 	request->auth_request.pool = pool;
 
@@ -10,6 +10,11 @@
 #include "passdb-cache.h"
 #include "passdb-blocking.h"
 
+struct passdb_cache_verify_context {
+	struct auth_request *request;
+	const char *refresh_key;
+};
+
 struct auth_cache *passdb_cache = NULL;
 
 static void
@@ -26,10 +31,26 @@ passdb_cache_log_hit(struct auth_request *request, const char *value)
 	e_debug(authdb_event(request), "cache hit: %s", value);
 }
 
+static void
+passdb_cache_verify_plain_refresh(struct auth_request *request,
+				  const char *refresh_key,
+				  enum passdb_result result)
+{
+	if (refresh_key == NULL)
+		return;
+	/* Refresh the stale entry only if the password matched it. Otherwise
+	   a wrong password could replace a good entry. */
+	if (result == PASSDB_RESULT_OK)
+		auth_request_passdb_cache_refresh(request, refresh_key, TRUE);
+	else
+		auth_cache_refresh_finished(passdb_cache, refresh_key);
+}
+
 static bool
 passdb_cache_lookup(struct auth_request *request, const char *key,
 		    bool use_expired, struct auth_cache_node **node_r,
-		    const char **value_r, bool *neg_expired_r)
+		    const char **value_r, bool *neg_expired_r,
+		    const char **refresh_key_r)
 {
 	const char *value;
 	bool expired;
@@ -38,7 +59,10 @@ passdb_cache_lookup(struct auth_request *request, const char *key,
 
 	/* value = password \t ... */
 	value = auth_cache_lookup(passdb_cache, request, key, node_r,
-				  &expired, neg_expired_r);
+				  &expired, neg_expired_r,
+				  use_expired ? NULL : refresh_key_r);
+	if (use_expired)
+		*refresh_key_r = NULL;
 	if (value == NULL || (expired && !use_expired)) {
 		e_debug(authdb_event(request),
 			value == NULL ? "cache miss" :
@@ -57,12 +81,14 @@ passdb_cache_verify_plain_callback(struct auth_worker_connection *conn ATTR_UNUS
 				   const char *const *args,
 				   void *context)
 {
-	struct auth_request *request = context;
+	struct passdb_cache_verify_context *ctx = context;
+	struct auth_request *request = ctx->request;
 	enum passdb_result result;
 
 	result = passdb_blocking_auth_worker_reply_parse(request, args);
 	if (result != PASSDB_RESULT_OK)
 		auth_fields_rollback(request->fields.extra_fields);
+	passdb_cache_verify_plain_refresh(request, ctx->refresh_key, result);
 	auth_request_verify_plain_callback_finish(result, request);
 	auth_request_unref(&request);
 	return TRUE;
@@ -72,7 +98,7 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 			       const char *password,
 			       enum passdb_result *result_r, bool use_expired)
 {
-	const char *value, *cached_pw, *scheme, *const *list;
+	const char *value, *cached_pw, *scheme, *const *list, *refresh_key;
 	struct auth_cache_node *node;
 	enum passdb_result ret;
 	bool neg_expired;
@@ -81,11 +107,13 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 		return FALSE;
 
 	if (!passdb_cache_lookup(request, key, use_expired,
-				 &node, &value, &neg_expired))
+				 &node, &value, &neg_expired, &refresh_key))
 		return FALSE;
 
 	if (*value == '\0') {
 		/* negative cache entry */
+		passdb_cache_verify_plain_refresh(request, refresh_key,
+						  PASSDB_RESULT_USER_UNKNOWN);
 		auth_request_db_log_unknown_user(request);
 		*result_r = PASSDB_RESULT_USER_UNKNOWN;
 		auth_request_verify_plain_callback_finish(*result_r, request);
@@ -101,6 +129,7 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 		       "Cached NULL password access");
 		ret = PASSDB_RESULT_OK;
 	} else if (request->set->cache_verify_password_with_worker) {
+		struct passdb_cache_verify_context *ctx;
 		string_t *str;
 
 		str = t_str_new(128);
@@ -118,8 +147,11 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 		   If verification fails, roll back fields. */
 		auth_request_set_fields(request, list + 1, NULL);
 		auth_fields_snapshot(request->fields.extra_fields);
+		ctx = p_new(request->pool, struct passdb_cache_verify_context, 1);
+		ctx->request = request;
+		ctx->refresh_key = p_strdup(request->pool, refresh_key);
 		auth_worker_call(request->pool, request->fields.user, str_c(str),
-				 passdb_cache_verify_plain_callback, request);
+				 passdb_cache_verify_plain_callback, ctx);
 		return TRUE;
 	} else {
 		scheme = password_get_scheme(&cached_pw);
@@ -135,11 +167,16 @@ bool passdb_cache_verify_plain(struct auth_request *request, const char *key,
 			   that the password was changed and cache is expired.
 			   b) negative TTL reached, use it for password
 			   mismatches too. */
-			node->last_success = FALSE;
+			auth_cache_node_set_last_success(passdb_cache, node,
+							 FALSE);
+			passdb_cache_verify_plain_refresh(request, refresh_key,
+							  ret);
 			return FALSE;
 		}
 	}
-	node->last_success = ret == PASSDB_RESULT_OK;
+	auth_cache_node_set_last_success(passdb_cache, node,
+					 ret == PASSDB_RESULT_OK);
+	passdb_cache_verify_plain_refresh(request, refresh_key, ret);
 
 	/* save the extra_fields only after we know we're using the
 	   cached data */
@@ -157,7 +194,7 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 				     enum passdb_result *result_r,
 				     bool use_expired)
 {
-	const char *value, *const *list;
+	const char *value, *const *list, *refresh_key;
 	struct auth_cache_node *node;
 	bool neg_expired;
 
@@ -165,8 +202,13 @@ bool passdb_cache_lookup_credentials(struct auth_request *request,
 		return FALSE;
 
 	if (!passdb_cache_lookup(request, key, use_expired,
-				 &node, &value, &neg_expired))
+				 &node, &value, &neg_expired, &refresh_key))
 		return FALSE;
+	if (refresh_key != NULL) {
+		/* stale entry - refresh it in the background. The
+		   credentials don't depend on the client's password. */
+		auth_request_passdb_cache_refresh(request, refresh_key, FALSE);
+	}
 
 	if (*value == '\0') {
 		/* negative cache entry */
@@ -200,8 +242,20 @@ void passdb_cache_init(const struct auth_settings *set)
 			  set->cache_size/1024/1024,
 			  (uoff_t)(limit/1024/1024));
 	}
-	passdb_cache = auth_cache_new(set->cache_size, set->cache_ttl,
-				      set->cache_negative_ttl);
+	if (set->cache_path[0] == '\0') {
+		passdb_cache = auth_cache_new(set->cache_size, set->cache_ttl,
+					      set->cache_negative_ttl,
+					      set->cache_stale_ttl);
+		return;
+	}
+
+	const char *error;
+	passdb_cache = auth_cache_new_shared(set->cache_path, set->cache_size,
+					     set->cache_ttl,
+					     set->cache_negative_ttl,
+					     set->cache_stale_ttl, &error);
+	if (passdb_cache == NULL)
+		i_fatal("auth_cache_path: %s", error);
 }
 
 void passdb_cache_deinit(void)
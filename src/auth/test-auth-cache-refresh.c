@@ -0,0 +1,215 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "test-auth.h"
+#include "ioloop.h"
+#include "master-service.h"
+#include "auth-common.h"
+#include "auth-request.h"
+#include "auth-settings.h"
+#include "auth-cache.h"
+#include "passdb.h"
+#include "passdb-cache.h"
+
+#define TEST_CACHE_KEY "%{user}"
+
+static struct auth_request *test_lookup_request;
+static lookup_credentials_callback_t *test_lookup_callback;
+
+static void
+test_passdb_lookup_credentials(struct auth_request *request,
+			       lookup_credentials_callback_t *callback)
+{
+	/* leave the lookup hanging until the test finishes it */
+	i_assert(test_lookup_request == NULL);
+	test_lookup_request = request;
+	test_lookup_callback = callback;
+	io_loop_stop(current_ioloop);
+}
+
+static struct passdb_module test_passdb_module = {
+	.iface = {
+		.name = "test",
+		.lookup_credentials = test_passdb_lookup_credentials,
+	},
+};
+
+static const struct auth_passdb_settings test_passdb_set;
+
+static struct auth_passdb test_passdb = {
+	.name = "test",
+	.set = &test_passdb_set,
+	.passdb = &test_passdb_module,
+};
+
+static void test_lookup_finish(enum passdb_result result)
+{
+	struct auth_request *request = test_lookup_request;
+
+	test_lookup_request = NULL;
+	test_lookup_callback(result, uchar_empty_ptr, 0, request);
+}
+
+static const char *test_cache_lookup(struct auth_request *request)
+{
+	struct auth_cache_node *node;
+	const char *value, *refresh_key;
+	bool expired, neg_expired;
+
+	value = auth_cache_lookup(passdb_cache, request, TEST_CACHE_KEY, &node,
+				  &expired, &neg_expired, &refresh_key);
+	test_assert_strcmp(value, "{PLAIN}pass");
+	test_assert(!expired);
+	return refresh_key;
+}
+
+static struct auth_request *test_request_init(void)
+{
+	struct auth_request *request;
+	struct auth_cache_node *node;
+	const char *value;
+	bool expired, neg_expired;
+
+	request = auth_request_new_dummy(auth_event);
+	(void)auth_request_import(request, "user", "testuser");
+	(void)auth_request_import(request, "translated-username", "testuser");
+	auth_request_init(request);
+	request->passdb = &test_passdb;
+	request->wanted_credentials_scheme = "PLAIN";
+
+	/* add an entry that is within the stale grace period */
+	auth_cache_insert(passdb_cache, request, TEST_CACHE_KEY,
+			  "{PLAIN}pass", TRUE);
+	value = auth_cache_lookup(passdb_cache, request, TEST_CACHE_KEY, &node,
+				  &expired, &neg_expired, NULL);
+	i_assert(value != NULL);
+	node->created = ioloop_time - 70;
+	return request;
+}
+
+static void test_auth_cache_refresh_finished(void)
+{
+	struct auth_request *request;
+	const char *refresh_key;
+
+	test_begin("auth cache refresh finished");
+	request = test_request_init();
+
+	refresh_key = test_cache_lookup(request);
+	test_assert(refresh_key != NULL);
+	auth_request_passdb_cache_refresh(request, refresh_key, FALSE);
+	io_loop_run(current_ioloop);
+	test_assert(test_lookup_request != NULL);
+	/* the refresh is still in progress */
+	test_assert(test_cache_lookup(request) == NULL);
+
+	/* the stale entry is kept on internal failure, but it can be
+	   refreshed again */
+	test_lookup_finish(PASSDB_RESULT_INTERNAL_FAILURE);
+	refresh_key = test_cache_lookup(request);
+	test_assert(refresh_key != NULL);
+	auth_cache_refresh_finished(passdb_cache, refresh_key);
+
+	auth_request_unref(&request);
+	test_end();
+}
+
+static void test_auth_cache_refresh_timeout(void)
+{
+	struct auth_request *request;
+	struct timeout *to;
+	const char *refresh_key;
+
+	test_begin("auth cache refresh timeout");
+	request = test_request_init();
+
+	refresh_key = test_cache_lookup(request);
+	test_assert(refresh_key != NULL);
+	auth_request_passdb_cache_refresh(request, refresh_key, FALSE);
+	io_loop_run(current_ioloop);
+	test_assert(test_lookup_request != NULL);
+
+	/* the refresh times out after auth_cache_stale_ttl */
+	test_expect_error_string("Stale cache entry refresh timed out");
+	to = timeout_add(global_auth_settings->cache_stale_ttl * 1000 + 100,
+			 io_loop_stop, current_ioloop);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_expect_no_more_errors();
+
+	/* another refresh can be started while the lookup is still hanging */
+	refresh_key = test_cache_lookup(request);
+	test_assert(refresh_key != NULL);
+	/* the late reply doesn't finish the new refresh */
+	test_lookup_finish(PASSDB_RESULT_INTERNAL_FAILURE);
+	test_assert(test_cache_lookup(request) == NULL);
+	auth_cache_refresh_finished(passdb_cache, refresh_key);
+
+	auth_request_unref(&request);
+	test_end();
+}
+
+static void test_auth_cache_refresh_password_mismatch(void)
+{
+	struct auth_request *request;
+	enum passdb_result result;
+	const char *refresh_key;
+
+	test_begin("auth cache refresh password mismatch");
+	request = test_request_init();
+
+	/* a wrong password doesn't start refreshing the stale entry */
+	auth_request_passdb_lookup_begin(request);
+	test_assert(!passdb_cache_verify_plain(request, TEST_CACHE_KEY,
+					       "wrong", &result, FALSE));
+	auth_request_passdb_lookup_end(request,
+				       PASSDB_RESULT_PASSWORD_MISMATCH);
+
+	/* the entry is kept, and nothing is refreshing it */
+	refresh_key = test_cache_lookup(request);
+	test_assert(refresh_key != NULL);
+	auth_cache_refresh_finished(passdb_cache, refresh_key);
+
+	auth_request_unref(&request);
+	test_end();
+}
+
+static void test_auth_cache_refresh(void)
+{
+	test_auth_init();
+	i_assert(global_auth_settings->cache_stale_ttl > 0);
+	test_passdb.auth_set = global_auth_settings;
+	passdb_cache = auth_cache_new(1024*1024, 60, 60, 60);
+
+	test_auth_cache_refresh_finished();
+	test_auth_cache_refresh_timeout();
+	test_auth_cache_refresh_password_mismatch();
+
+	auth_cache_free(&passdb_cache);
+	test_auth_deinit();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*const test_functions[])(void) = {
+		test_auth_cache_refresh,
+		NULL
+	};
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_CONFIG_BUILTIN |
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_STD_CLIENT |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS;
+	int ret;
+
+	master_service = master_service_init("test-auth-cache-refresh",
+					     service_flags, &argc, &argv, "");
+	master_service_init_finish(master_service);
+
+	struct ioloop *ioloop = io_loop_create();
+	io_loop_set_current(ioloop);
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+
+	master_service_deinit(&master_service);
+	return ret;
+}
@@ -4,8 +4,16 @@
 #include "str.h"
 #include "auth-request.h"
 #include "auth-cache.h"
+#include "auth-cache-shared.h"
 #include "test-common.h"
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#define TEST_CACHE_PATH ".test-auth-cache"
+
 const struct var_expand_table
 auth_request_var_expand_static_tab[AUTH_REQUEST_VAR_TAB_COUNT + 1] = {
 	{ .key = "user", .value = NULL },
@@ -20,10 +28,16 @@ struct event *auth_event;
 
 struct var_expand_table *
 auth_request_get_var_expand_table_full(const struct auth_request *auth_request ATTR_UNUSED,
-				       const char *username ATTR_UNUSED,
+				       const char *username,
 				       unsigned int *count ATTR_UNUSED)
 {
-	i_unreached();
+	struct var_expand_table *tab = t_new(struct var_expand_table, 3);
+
+	tab[0].key = "user";
+	tab[0].value = username;
+	tab[1].key = "id";
+	tab[1].value = "1";
+	return tab;
 }
 
 static int mock_get_passdb(const char *key, const char **value_r,
@@ -50,12 +64,12 @@ static int mock_get_userdb(const char *key, const char **value_r,
 
 int auth_request_var_expand_with_table(string_t *dest, const char *str,
 				       const struct auth_request *auth_request,
-				       const struct var_expand_table *table ATTR_UNUSED,
+				       const struct var_expand_table *table,
 				       auth_request_escape_func_t *escape_func ATTR_UNUSED,
 				       const char **error_r ATTR_UNUSED)
 {
 	const struct var_expand_params params = {
-		.table = auth_request_var_expand_static_tab,
+		.table = table,
 		.providers = (const struct var_expand_provider[]) {
 			{ .key = "passdb", .func = mock_get_passdb },
 			{ .key = "userdb", .func = mock_get_userdb },
@@ -100,12 +114,300 @@ static void test_auth_cache_parse_key(void)
 	test_end();
 }
 
+static const char *test_shared_value(struct auth_cache_node *node)
+{
+	return node->data + strlen(node->data) + 1;
+}
+
+static bool test_shared_match_prefix(struct auth_cache_node *node,
+				     const char *prefix)
+{
+	return str_begins_with(node->data, prefix);
+}
+
+static void test_auth_cache_shared(void)
+{
+	struct auth_cache_shared *shared, *shared2;
+	struct auth_cache_node *node;
+	const char *prefix = "P2\t", *error;
+	string_t *large_value;
+	int fd;
+
+	test_begin("auth cache shared");
+	i_unlink_if_exists(TEST_CACHE_PATH);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   100*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") == NULL);
+
+	/* insert and lookup */
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass1", TRUE) == 0);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser2",
+					     "", FALSE) == 0);
+	node = auth_cache_shared_lookup(shared, "P1\tuser1");
+	test_assert(node != NULL && node->last_success &&
+		    strcmp(node->data, "P1\tuser1") == 0 &&
+		    strcmp(test_shared_value(node), "pass1") == 0);
+	node = auth_cache_shared_lookup(shared, "P1\tuser2");
+	test_assert(node != NULL && !node->last_success &&
+		    strcmp(test_shared_value(node), "") == 0);
+
+	/* update */
+	auth_cache_shared_set_last_success(shared, "P1\tuser1", FALSE);
+	node = auth_cache_shared_lookup(shared, "P1\tuser1");
+	test_assert(node != NULL && !node->last_success);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass2", TRUE) == 0);
+	node = auth_cache_shared_lookup(shared, "P1\tuser1");
+	test_assert(node != NULL && node->last_success &&
+		    strcmp(test_shared_value(node), "pass2") == 0);
+
+	/* the cache is visible to other users of the same file */
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   100*1024, 60, 60,
+					   &shared2, &error) == 0);
+	node = auth_cache_shared_lookup(shared2, "P1\tuser2");
+	test_assert(node != NULL);
+	auth_cache_shared_remove(shared2, "P1\tuser2");
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser2") == NULL);
+	auth_cache_shared_close(&shared2);
+
+	/* replacing the file is noticed by the other users */
+	i_unlink(TEST_CACHE_PATH);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   100*1024, 60, 60,
+					   &shared2, &error) == 0);
+	test_assert(auth_cache_shared_insert(shared2, "P1\tuser3",
+					     "pass3", TRUE) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") == NULL);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser3") != NULL);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass2", TRUE) == 0);
+	test_assert(auth_cache_shared_lookup(shared2, "P1\tuser1") != NULL);
+	auth_cache_shared_remove(shared2, "P1\tuser3");
+	auth_cache_shared_close(&shared2);
+
+	/* the cache is preserved after closing */
+	auth_cache_shared_close(&shared);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   100*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") != NULL);
+
+	/* clearing */
+	test_assert(auth_cache_shared_insert(shared, "P2\tuser1",
+					     "pass", TRUE) == 0);
+	test_assert(auth_cache_shared_clear_matching(shared,
+			test_shared_match_prefix, prefix) == 1);
+	test_assert(auth_cache_shared_lookup(shared, "P2\tuser1") == NULL);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") != NULL);
+	test_assert(auth_cache_shared_clear(shared) == 1);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") == NULL);
+
+	/* too large entries aren't cached */
+	large_value = t_str_new(2048);
+	while (str_len(large_value) < 2048)
+		str_append(large_value, "0123456789");
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     str_c(large_value), TRUE) == -1);
+	auth_cache_shared_close(&shared);
+
+	/* a different size recreates the file */
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   100*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass1", TRUE) == 0);
+	auth_cache_shared_close(&shared);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   200*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") == NULL);
+	auth_cache_shared_close(&shared);
+
+	/* a corrupted header recreates the file */
+	fd = open(TEST_CACHE_PATH, O_WRONLY);
+	test_assert(fd != -1 && pwrite(fd, "junk", 4, 0) == 4);
+	i_close_fd(&fd);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   200*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass1", TRUE) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") != NULL);
+	auth_cache_shared_close(&shared);
+
+	i_unlink(TEST_CACHE_PATH);
+	test_end();
+}
+
+static void test_auth_cache_shared_eviction(void)
+{
+	struct auth_cache_shared *shared;
+	const char *error, *key;
+	unsigned int i, found = 0;
+	int ret, evicted = 0;
+
+	test_begin("auth cache shared eviction");
+	i_unlink_if_exists(TEST_CACHE_PATH);
+	/* the minimum size has space for only a few entries */
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   1024, 60, 60,
+					   &shared, &error) == 0);
+	for (i = 0; i < 100; i++) {
+		key = t_strdup_printf("P1\tuser%u", i);
+		ret = auth_cache_shared_insert(shared, key, "pass", TRUE);
+		test_assert_idx(ret >= 0, i);
+		evicted += ret;
+		/* the newest entry is never evicted */
+		test_assert_idx(auth_cache_shared_lookup(shared, key) != NULL, i);
+	}
+	for (i = 0; i < 100; i++) {
+		key = t_strdup_printf("P1\tuser%u", i);
+		if (auth_cache_shared_lookup(shared, key) != NULL)
+			found++;
+	}
+	test_assert(evicted > 0);
+	test_assert(found + evicted == 100);
+	auth_cache_shared_close(&shared);
+	i_unlink(TEST_CACHE_PATH);
+	test_end();
+}
+
+static void test_auth_cache_shared_locked_by(int lock_type)
+{
+	struct auth_cache_shared *shared;
+	const char *error;
+	struct flock fl;
+	time_t start;
+	int ready_fds[2], wait_fds[2], fd, status;
+	char c;
+	pid_t pid;
+
+	i_unlink_if_exists(TEST_CACHE_PATH);
+	test_assert(auth_cache_shared_open(TEST_CACHE_PATH, auth_event,
+					   200*1024, 60, 60,
+					   &shared, &error) == 0);
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser1",
+					     "pass1", TRUE) == 0);
+
+	/* another process keeps the file locked until the wait pipe is
+	   closed */
+	if (pipe(ready_fds) < 0 || pipe(wait_fds) < 0)
+		i_fatal("pipe() failed: %m");
+	if ((pid = fork()) == (pid_t)-1)
+		i_fatal("fork() failed: %m");
+	if (pid == 0) {
+		i_close_fd(&ready_fds[0]);
+		i_close_fd(&wait_fds[1]);
+		fd = open(TEST_CACHE_PATH, O_RDWR);
+		i_zero(&fl);
+		fl.l_type = lock_type;
+		fl.l_whence = SEEK_SET;
+		if (fd == -1 || fcntl(fd, F_SETLK, &fl) < 0 ||
+		    write(ready_fds[1], "", 1) != 1)
+			_exit(1);
+		if (read(wait_fds[0], &c, 1) != 0)
+			_exit(1);
+		_exit(0);
+	}
+	i_close_fd(&ready_fds[1]);
+	i_close_fd(&wait_fds[0]);
+	test_assert(read(ready_fds[0], &c, 1) == 1);
+	i_close_fd(&ready_fds[0]);
+
+	/* the cache access is skipped without blocking, except lookups can
+	   be done while another process is also only reading */
+	start = time(NULL);
+	test_assert((auth_cache_shared_lookup(shared, "P1\tuser1") != NULL) ==
+		    (lock_type == F_RDLCK));
+	test_assert(auth_cache_shared_insert(shared, "P1\tuser2",
+					     "pass2", TRUE) < 0);
+	test_assert(time(NULL) - start <= 1);
+
+	i_close_fd(&wait_fds[1]);
+	test_assert(waitpid(pid, &status, 0) == pid &&
+		    WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	test_assert(auth_cache_shared_lookup(shared, "P1\tuser1") != NULL);
+	auth_cache_shared_close(&shared);
+	i_unlink(TEST_CACHE_PATH);
+}
+
+static void test_auth_cache_shared_locked(void)
+{
+	test_begin("auth cache shared locked");
+	test_auth_cache_shared_locked_by(F_WRLCK);
+	test_auth_cache_shared_locked_by(F_RDLCK);
+	test_end();
+}
+
+static void test_auth_cache_stale(void)
+{
+	struct auth_request request = {
+		.event = auth_event,
+		.fields = { .translated_username = "user1" },
+	};
+	struct auth_cache *cache;
+	struct auth_cache_node *node;
+	const char *value, *refresh_key, *refresh_key2;
+	bool expired, neg_expired;
+
+	test_begin("auth cache stale");
+	cache = auth_cache_new(1024*1024, 60, 60, 30);
+	auth_cache_insert(cache, &request, "%{user}", "pass", TRUE);
+
+	/* fresh entry */
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, &refresh_key);
+	test_assert_strcmp(value, "pass");
+	test_assert(!expired && refresh_key == NULL);
+
+	/* expired, but within the stale grace period */
+	node->created = time(NULL) - 70;
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, &refresh_key);
+	test_assert_strcmp(value, "pass");
+	test_assert(!expired);
+	test_assert_strcmp(refresh_key, "P1\tuser1");
+	/* refresh is already in progress */
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, &refresh_key2);
+	test_assert_strcmp(value, "pass");
+	test_assert(!expired && refresh_key2 == NULL);
+	/* callers not wanting stale entries see it expired */
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, NULL);
+	test_assert(value != NULL && expired);
+
+	auth_cache_refresh_finished(cache, refresh_key);
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, &refresh_key);
+	test_assert(!expired && refresh_key != NULL);
+	auth_cache_refresh_finished(cache, refresh_key);
+	/* finishing an already finished refresh is ignored */
+	auth_cache_refresh_finished(cache, refresh_key);
+
+	/* past the stale grace period */
+	node->created = time(NULL) - 100;
+	value = auth_cache_lookup(cache, &request, "%{user}", &node,
+				  &expired, &neg_expired, &refresh_key);
+	test_assert(value != NULL && expired && refresh_key == NULL);
+
+	auth_cache_free(&cache);
+	test_end();
+}
+
 int main(void)
 {
 	lib_init();
 	auth_event = event_create(NULL);
 	static void (*const test_functions[])(void) = {
 		test_auth_cache_parse_key,
+		test_auth_cache_shared,
+		test_auth_cache_shared_eviction,
+		test_auth_cache_shared_locked,
+		test_auth_cache_stale,
 		NULL
 	};
 	int ret = test_run(test_functions);
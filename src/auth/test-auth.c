@@ -30,6 +30,8 @@ static const char *const settings[] = {
 	"oauth2_client_id", "foo",
 	"oauth2_client_secret", "foo",
 	"oauth2_use_worker", "no",
+	/* For tests of stale cache entry refreshing. */
+	"auth_cache_stale_ttl", "1s",
 
 	"passdb", "mock1 mock2",
 	"passdb/mock1/name", "mock1",
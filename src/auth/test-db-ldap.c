@@ -0,0 +1,439 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "test-auth.h"
+#include "array.h"
+#include "ioloop.h"
+#include "master-service.h"
+#include "settings.h"
+#include "auth-common.h"
+#include "auth-request.h"
+#include "db-ldap.h"
+
+#include <unistd.h>
+
+/* Replaces the LDAP library functions used by db-ldap with a fake server.
+   Each LDAP handle has a pipe, which becomes readable when the fake server
+   has replies that ldap_result() can return. */
+
+struct test_ldap_msg {
+	int msgid;
+	int type;
+	int result;
+};
+
+struct test_ldap {
+	int fd[2];
+	ARRAY(struct test_ldap_msg *) replies;
+	int next_msgid;
+	unsigned int search_count;
+};
+
+struct test_ldap_request {
+	struct ldap_request_search search;
+
+	unsigned int entry_count;
+	unsigned int result_count;
+	unsigned int failure_count;
+};
+
+static const char *const test_attributes[] = { "uid", NULL };
+static const char *const test_sensitive_attr_names[] = { NULL };
+
+static ARRAY(struct test_ldap *) test_ldaps;
+static int test_search_result;
+static bool test_search_entry;
+static unsigned int test_callbacks_left;
+
+static void test_ldap_reply(struct test_ldap *ld, int msgid, int type,
+			    int result)
+{
+	struct test_ldap_msg *msg = i_new(struct test_ldap_msg, 1);
+
+	msg->msgid = msgid;
+	msg->type = type;
+	msg->result = result;
+	array_push_back(&ld->replies, &msg);
+	if (write(ld->fd[1], "", 1) != 1)
+		i_fatal("write(test ldap pipe) failed: %m");
+}
+
+int ldap_initialize(LDAP **ldp, const char *url ATTR_UNUSED)
+{
+	struct test_ldap *ld = i_new(struct test_ldap, 1);
+
+	if (pipe(ld->fd) < 0)
+		i_fatal("pipe() failed: %m");
+	i_array_init(&ld->replies, 8);
+	ld->next_msgid = 1;
+	array_push_back(&test_ldaps, &ld);
+	*ldp = (LDAP *)ld;
+	return LDAP_SUCCESS;
+}
+
+int ldap_unbind_ext(LDAP *_ld, LDAPControl **sctrls ATTR_UNUSED,
+		    LDAPControl **cctrls ATTR_UNUSED)
+{
+	struct test_ldap *ld = (struct test_ldap *)_ld;
+	struct test_ldap *const *ldp;
+	struct test_ldap_msg *msg;
+
+	array_foreach(&test_ldaps, ldp) {
+		if (*ldp == ld) {
+			array_delete(&test_ldaps,
+				     array_foreach_idx(&test_ldaps, ldp), 1);
+			break;
+		}
+	}
+	array_foreach_elem(&ld->replies, msg)
+		i_free(msg);
+	array_free(&ld->replies);
+	i_close_fd(&ld->fd[0]);
+	i_close_fd(&ld->fd[1]);
+	i_free(ld);
+	return LDAP_SUCCESS;
+}
+
+int ldap_set_option(LDAP *ld ATTR_UNUSED, int option ATTR_UNUSED,
+		    const void *invalue ATTR_UNUSED)
+{
+	return LDAP_OPT_SUCCESS;
+}
+
+int ldap_get_option(LDAP *_ld, int option, void *outvalue)
+{
+	struct test_ldap *ld = (struct test_ldap *)_ld;
+
+	switch (option) {
+	case LDAP_OPT_DESC:
+		*(int *)outvalue = ld->fd[0];
+		break;
+	case LDAP_OPT_ERROR_NUMBER:
+		*(int *)outvalue = LDAP_OPERATIONS_ERROR;
+		break;
+	case LDAP_OPT_ERROR_STRING:
+		*(char **)outvalue = NULL;
+		break;
+	default:
+		return LDAP_OPERATIONS_ERROR;
+	}
+	return LDAP_OPT_SUCCESS;
+}
+
+int ldap_sasl_bind(LDAP *_ld, const char *dn ATTR_UNUSED,
+		   const char *mechanism ATTR_UNUSED,
+		   struct berval *cred ATTR_UNUSED,
+		   LDAPControl **sctrls ATTR_UNUSED,
+		   LDAPControl **cctrls ATTR_UNUSED, int *msgidp)
+{
+	struct test_ldap *ld = (struct test_ldap *)_ld;
+
+	*msgidp = ld->next_msgid++;
+	test_ldap_reply(ld, *msgidp, LDAP_RES_BIND, LDAP_SUCCESS);
+	return LDAP_SUCCESS;
+}
+
+int ldap_search_ext(LDAP *_ld, const char *base ATTR_UNUSED,
+		    int scope ATTR_UNUSED, const char *filter ATTR_UNUSED,
+		    char **attrs ATTR_UNUSED, int attrsonly ATTR_UNUSED,
+		    LDAPControl **serverctrls ATTR_UNUSED,
+		    LDAPControl **clientctrls ATTR_UNUSED,
+		    struct timeval *timeout ATTR_UNUSED,
+		    int sizelimit ATTR_UNUSED, int *msgidp)
+{
+	struct test_ldap *ld = (struct test_ldap *)_ld;
+
+	*msgidp = ld->next_msgid++;
+	ld->search_count++;
+	if (test_search_entry) {
+		test_ldap_reply(ld, *msgidp, LDAP_RES_SEARCH_ENTRY,
+				LDAP_SUCCESS);
+	}
+	test_ldap_reply(ld, *msgidp, LDAP_RES_SEARCH_RESULT,
+			test_search_result);
+	return LDAP_SUCCESS;
+}
+
+int ldap_result(LDAP *_ld, int msgid ATTR_UNUSED, int all ATTR_UNUSED,
+		struct timeval *timeout ATTR_UNUSED, LDAPMessage **result)
+{
+	struct test_ldap *ld = (struct test_ldap *)_ld;
+	struct test_ldap_msg *msg;
+	char buf[32];
+
+	if (array_is_empty(&ld->replies)) {
+		/* all replies read - wait for more */
+		while (read(ld->fd[0], buf, sizeof(buf)) > 0) ;
+		return 0;
+	}
+	msg = array_idx_elem(&ld->replies, 0);
+	array_pop_front(&ld->replies);
+	*result = (LDAPMessage *)msg;
+	return msg->type;
+}
+
+int ldap_msgtype(LDAPMessage *lm)
+{
+	return ((struct test_ldap_msg *)lm)->type;
+}
+
+int ldap_msgid(LDAPMessage *lm)
+{
+	return ((struct test_ldap_msg *)lm)->msgid;
+}
+
+int ldap_msgfree(LDAPMessage *lm)
+{
+	int type = ldap_msgtype(lm);
+
+	i_free(lm);
+	return type;
+}
+
+int ldap_parse_result(LDAP *ld ATTR_UNUSED, LDAPMessage *res, int *errcodep,
+		      char **matcheddnp ATTR_UNUSED,
+		      char **diagmsgp ATTR_UNUSED,
+		      char ***referralsp ATTR_UNUSED,
+		      LDAPControl ***serverctrls ATTR_UNUSED,
+		      int freeit ATTR_UNUSED)
+{
+	*errcodep = ((struct test_ldap_msg *)res)->result;
+	return LDAP_SUCCESS;
+}
+
+static void
+test_search_callback(struct ldap_connection *conn ATTR_UNUSED,
+		     struct ldap_request *request, LDAPMessage *res)
+{
+	struct test_ldap_request *trequest =
+		container_of(request, struct test_ldap_request,
+			     search.request);
+
+	if (res == NULL)
+		trequest->failure_count++;
+	else if (ldap_msgtype(res) == LDAP_RES_SEARCH_ENTRY) {
+		trequest->entry_count++;
+		return;
+	} else {
+		trequest->result_count++;
+	}
+	i_assert(test_callbacks_left > 0);
+	if (--test_callbacks_left == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static struct test_ldap_request *
+test_search(struct ldap_connection *conn, struct auth_request *auth_request,
+	    const char *filter)
+{
+	struct test_ldap_request *trequest;
+
+	trequest = p_new(auth_request->pool, struct test_ldap_request, 1);
+	trequest->search.request.type = LDAP_REQUEST_TYPE_SEARCH;
+	trequest->search.request.callback = test_search_callback;
+	trequest->search.request.auth_request = auth_request;
+	trequest->search.base = "dc=example,dc=com";
+	trequest->search.filter = filter;
+	trequest->search.attributes = test_attributes;
+	trequest->search.sensitive_attr_names = test_sensitive_attr_names;
+	test_callbacks_left++;
+	db_ldap_request(conn, &trequest->search.request);
+	return trequest;
+}
+
+static void test_search_timeout(void *context ATTR_UNUSED)
+{
+	test_assert(FALSE);
+	io_loop_stop(current_ioloop);
+}
+
+static void test_search_wait(void)
+{
+	struct timeout *to;
+
+	to = timeout_add(5000, test_search_timeout, NULL);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert(test_callbacks_left == 0);
+}
+
+static unsigned int test_search_count(void)
+{
+	struct test_ldap *ld;
+	unsigned int count = 0;
+
+	array_foreach_elem(&test_ldaps, ld)
+		count += ld->search_count;
+	return count;
+}
+
+static bool
+test_request_succeeded(const struct test_ldap_request *trequest)
+{
+	return trequest->entry_count == 1 && trequest->result_count == 1 &&
+		trequest->failure_count == 0;
+}
+
+static bool
+test_request_failed(const struct test_ldap_request *trequest)
+{
+	return trequest->entry_count == 0 && trequest->result_count == 0 &&
+		trequest->failure_count == 1;
+}
+
+static struct ldap_connection *
+test_ldap_init(struct settings_simple *set, const char *connection_count)
+{
+	const char *const settings[] = {
+		"ldap_uris", "ldap://localhost",
+		"ldap_connection_count", connection_count,
+		NULL
+	};
+
+	settings_simple_init(set, settings);
+	test_search_result = LDAP_SUCCESS;
+	test_search_entry = TRUE;
+	return db_ldap_init(set->event);
+}
+
+static void test_ldap_search_coalesce(void)
+{
+	struct settings_simple set;
+	struct ldap_connection *conn;
+	struct auth_request *auth_request;
+	struct test_ldap_request *req1, *req2, *req3, *req4;
+
+	test_begin("ldap search coalesce");
+	conn = test_ldap_init(&set, "1");
+	auth_request = auth_request_new_dummy(auth_event);
+
+	req1 = test_search(conn, auth_request, "(uid=user1)");
+	req2 = test_search(conn, auth_request, "(uid=user1)");
+	req3 = test_search(conn, auth_request, "(uid=user2)");
+	test_search_wait();
+
+	/* the identical searches were sent only once */
+	test_assert(test_search_count() == 2);
+	test_assert(test_request_succeeded(req1));
+	test_assert(test_request_succeeded(req2));
+	test_assert(test_request_succeeded(req3));
+
+	/* a finished search isn't coalesced into anymore */
+	req4 = test_search(conn, auth_request, "(uid=user1)");
+	test_search_wait();
+	test_assert(test_search_count() == 3);
+	test_assert(test_request_succeeded(req4));
+
+	db_ldap_unref(&conn);
+	auth_request_unref(&auth_request);
+	settings_simple_deinit(&set);
+	test_end();
+}
+
+static void test_ldap_search_coalesce_failure(void)
+{
+	struct settings_simple set;
+	struct ldap_connection *conn;
+	struct auth_request *auth_request;
+	struct test_ldap_request *req1, *req2, *req3, *req4;
+
+	test_begin("ldap search coalesce failure");
+	conn = test_ldap_init(&set, "1");
+	auth_request = auth_request_new_dummy(auth_event);
+
+	/* the server fails the search */
+	test_search_result = LDAP_OPERATIONS_ERROR;
+	test_search_entry = FALSE;
+	test_expect_error_string("ldap_search_ext(base=dc=example,dc=com "
+				 "filter=(uid=user1)) failed");
+	req1 = test_search(conn, auth_request, "(uid=user1)");
+	req2 = test_search(conn, auth_request, "(uid=user1)");
+	test_search_wait();
+	test_expect_no_more_errors();
+	test_assert(test_search_count() == 1);
+	test_assert(test_request_failed(req1));
+	test_assert(test_request_failed(req2));
+
+	/* the searches are aborted before the replies arrive */
+	req3 = test_search(conn, auth_request, "(uid=user2)");
+	req4 = test_search(conn, auth_request, "(uid=user2)");
+	db_ldap_unref(&conn);
+	test_assert(test_callbacks_left == 0);
+	test_assert(test_request_failed(req3));
+	test_assert(test_request_failed(req4));
+
+	auth_request_unref(&auth_request);
+	settings_simple_deinit(&set);
+	test_end();
+}
+
+static void test_ldap_connection_fanout(void)
+{
+	struct settings_simple set;
+	struct ldap_connection *conn;
+	struct auth_request *auth_request;
+	struct test_ldap_request *req1, *req2, *req3;
+	struct test_ldap *ld;
+
+	test_begin("ldap connection fanout");
+	conn = test_ldap_init(&set, "2");
+	auth_request = auth_request_new_dummy(auth_event);
+	test_assert(array_count(&test_ldaps) == 2);
+
+	req1 = test_search(conn, auth_request, "(uid=user1)");
+	req2 = test_search(conn, auth_request, "(uid=user2)");
+	/* coalesced, although it was sent using another connection */
+	req3 = test_search(conn, auth_request, "(uid=user1)");
+	test_search_wait();
+
+	/* each connection sent one search */
+	array_foreach_elem(&test_ldaps, ld)
+		test_assert(ld->search_count == 1);
+	test_assert(test_request_succeeded(req1));
+	test_assert(test_request_succeeded(req2));
+	test_assert(test_request_succeeded(req3));
+
+	db_ldap_unref(&conn);
+	test_assert(array_count(&test_ldaps) == 0);
+	auth_request_unref(&auth_request);
+	settings_simple_deinit(&set);
+	test_end();
+}
+
+static void test_db_ldap(void)
+{
+	test_auth_init();
+	i_array_init(&test_ldaps, 4);
+
+	test_ldap_search_coalesce();
+	test_ldap_search_coalesce_failure();
+	test_ldap_connection_fanout();
+
+	array_free(&test_ldaps);
+	test_auth_deinit();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*const test_functions[])(void) = {
+		test_db_ldap,
+		NULL
+	};
+	const enum master_service_flags service_flags =
+		MASTER_SERVICE_FLAG_CONFIG_BUILTIN |
+		MASTER_SERVICE_FLAG_STANDALONE |
+		MASTER_SERVICE_FLAG_STD_CLIENT |
+		MASTER_SERVICE_FLAG_DONT_SEND_STATS;
+	int ret;
+
+	master_service = master_service_init("test-db-ldap",
+					     service_flags, &argc, &argv, "");
+	master_service_init_finish(master_service);
+
+	struct ioloop *ioloop = io_loop_create();
+	io_loop_set_current(ioloop);
+	ret = test_run(test_functions);
+	io_loop_destroy(&ioloop);
+
+	master_service_deinit(&master_service);
+	return ret;
+}
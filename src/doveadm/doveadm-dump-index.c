@@ -479,6 +479,11 @@ static void dump_cache_hdr(struct mail_cache *cache)
 	printf("field_header_offset .. = %u (0x%08x nontranslated)\n",
 	       mail_index_offset_to_uint32(hdr->field_header_offset),
 	       hdr->field_header_offset);
+	if (hdr->major_version == MAIL_CACHE_MAJOR_VERSION_COMPRESSED &&
+	    mail_cache_compress_open(cache) == 0) {
+		printf("compress_dict_size ... = %zu\n",
+		       mail_cache_compress_dict_size(cache->compress));
+	}
 
 	printf("-- Cache fields --\n");
 	fields = mail_cache_register_get_list(cache, &pool, &count);
@@ -579,6 +584,10 @@ static void dump_cache(struct mail_cache_view *cache_view, unsigned int seq)
 		}
 
 		field = &cache_view->cache->fields[iter_field.field_idx].field;
+		if (mail_cache_lookup_iter_decompress(&iter, &iter_field) < 0) {
+			ret = -1;
+			break;
+		}
 		data = iter_field.data;
 		size = iter_field.size;
 
@@ -138,8 +138,7 @@ struct client *client_create(int fd_in, int fd_out,
 	client->to_idle = timeout_add(CLIENT_IDLE_TIMEOUT_MSECS,
 				      client_idle_timeout, client);
 
-	client->command_pool =
-		pool_alloconly_create(MEMPOOL_GROWING"client command", 1024*2);
+	client->command_pool = pool_slab_create("client command");
 	client->user = user;
 	client->notify_count_changes = TRUE;
 	client->notify_flag_changes = TRUE;
@@ -948,6 +947,8 @@ struct client_command_context *client_command_alloc(struct client *client)
 	cmd->stats.last_run_timeval = ioloop_timeval;
 	cmd->stats.start_ioloop_wait_usecs =
 		io_loop_get_wait_usecs(current_ioloop);
+	(void)pool_slab_get_pool_stats(cmd->pool,
+				       &cmd->stats.start_slab_stats);
 	p_array_init(&cmd->module_contexts, cmd->pool, 5);
 
 	DLLIST_PREPEND(&client->command_queue, cmd);
@@ -1039,6 +1040,21 @@ void client_command_free(struct client_command_context **_cmd)
 	event_add_int(cmd->event, "lock_wait_usecs", cmd->stats.lock_wait_usecs);
 	event_add_int(cmd->event, "net_in_bytes", cmd->stats.bytes_in);
 	event_add_int(cmd->event, "net_out_bytes", cmd->stats.bytes_out);
+	event_add_int(cmd->event, "net_out_sendfile_bytes",
+		      cmd->stats.bytes_out_sendfile);
+
+	/* Pipelined commands share the pool, so this may include some of
+	   their allocations as well. */
+	struct pool_slab_stats slab_stats;
+	(void)pool_slab_get_pool_stats(cmd->pool, &slab_stats);
+	event_add_int(cmd->event, "mem_slab_allocs", slab_stats.alloc_count -
+		      cmd->stats.start_slab_stats.alloc_count);
+	event_add_int(cmd->event, "mem_slab_system_allocs",
+		      slab_stats.system_alloc_count -
+		      cmd->stats.start_slab_stats.system_alloc_count);
+	event_add_int(cmd->event, "mem_slab_system_alloc_bytes",
+		      slab_stats.system_alloc_bytes -
+		      cmd->stats.start_slab_stats.system_alloc_bytes);
 
 	if (cmd->name != NULL) {
 		string_t *str = t_str_new(128);
@@ -73,12 +73,18 @@ struct client_command_stats {
 	uint64_t lock_wait_usecs;
 	/* how many bytes of client input/output command has used */
 	uint64_t bytes_in, bytes_out;
+	/* how many of the output bytes were sent directly from mail files
+	   with sendfile() */
+	uint64_t bytes_out_sendfile;
+	/* pool_slab_get_pool_stats()'s value for the command pool when the
+	   command was started */
+	struct pool_slab_stats start_slab_stats;
 };
 
 struct client_command_stats_start {
 	struct timeval timeval;
 	uint64_t lock_wait_usecs;
-	uint64_t bytes_in, bytes_out;
+	uint64_t bytes_in, bytes_out, bytes_out_sendfile;
 };
 
 struct client_command_context {
@@ -173,10 +173,14 @@ void command_stats_start(struct client_command_context *cmd)
 	cmd->stats_start.lock_wait_usecs = file_lock_wait_get_total_usecs();
 	cmd->stats_start.bytes_in = i_stream_get_absolute_offset(cmd->client->input);
 	cmd->stats_start.bytes_out = cmd->client->output->offset;
+	cmd->stats_start.bytes_out_sendfile =
+		o_stream_get_sendfile_bytes(cmd->client->output);
 }
 
 void command_stats_flush(struct client_command_context *cmd)
 {
+	uoff_t bytes_out_sendfile;
+
 	io_loop_time_refresh();
 	cmd->stats.running_usecs +=
 		timeval_diff_usecs(&ioloop_timeval, &cmd->stats_start.timeval);
@@ -187,6 +191,13 @@ void command_stats_flush(struct client_command_context *cmd)
 		cmd->stats_start.bytes_in;
 	cmd->stats.bytes_out += cmd->client->prev_output_size +
 		cmd->client->output->offset - cmd->stats_start.bytes_out;
+	bytes_out_sendfile = o_stream_get_sendfile_bytes(cmd->client->output);
+	/* COMPRESS may have replaced the output stream, which resets the
+	   counter. Nothing is sent with sendfile() after that anyway. */
+	if (bytes_out_sendfile >= cmd->stats_start.bytes_out_sendfile) {
+		cmd->stats.bytes_out_sendfile += bytes_out_sendfile -
+			cmd->stats_start.bytes_out_sendfile;
+	}
 	/* allow flushing multiple times */
 	command_stats_start(cmd);
 }
@@ -17,6 +17,7 @@
 #include "master-service-settings.h"
 #include "master-admin-client.h"
 #include "login-server.h"
+#include "mail-index.h"
 #include "mail-user.h"
 #include "mail-storage-service.h"
 #include "smtp-submit-settings.h"
@@ -69,6 +70,19 @@ void imap_refresh_proctitle_delayed(void)
 			imap_refresh_proctitle_callback, NULL);
 }
 
+static void imap_proctitle_append_index_memory(string_t *title)
+{
+	struct mail_index_memory_usage usage;
+
+	/* Show how much of the indexes is copied to this process's memory,
+	   i.e. not shared with the user's other imap processes. */
+	mail_index_get_memory_usage(&usage);
+	if (usage.private_size == 0 && usage.shared_size == 0)
+		return;
+	str_printfa(title, " - index %zu kB private, %zu kB shared",
+		    usage.private_size / 1024, usage.shared_size / 1024);
+}
+
 void imap_refresh_proctitle(void)
 {
 #define IMAP_PROCTITLE_PREFERRED_LEN 80
@@ -122,6 +136,8 @@ void imap_refresh_proctitle(void)
 		str_printfa(title, "%u connections", imap_client_count);
 		break;
 	}
+	if (imap_client_count > 0)
+		imap_proctitle_append_index_memory(title);
 	str_append_c(title, ']');
 	process_title_set(str_c(title));
 }
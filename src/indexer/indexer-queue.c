@@ -2,29 +2,83 @@
 
 #include "lib.h"
 #include "array.h"
+#include "ioloop.h"
 #include "llist.h"
 #include "hash.h"
+#include "time-util.h"
 #include "wildcard-match.h"
 #include "indexer-queue.h"
 
+/* When requests with both priorities are waiting, index this many
+   interactive requests for each background request. */
+#define INDEXER_QUEUE_INTERACTIVE_WEIGHT 4
+/* Background requests that have been waiting for this long are promoted to
+   interactive priority. */
+#define INDEXER_QUEUE_AGING_MSECS (60*1000)
+
+struct indexer_queue_user_class {
+	/* Linked list of users with queued requests in the same priority */
+	struct indexer_queue_user_class *prev, *next;
+	struct indexer_queue_user *user;
+
+	/* The user's queued requests with this priority */
+	struct indexer_request *head, *tail;
+};
+
+struct indexer_queue_user {
+	char *username;
+	/* All the user's requests */
+	struct indexer_request *requests;
+	/* Number of the user's requests currently being worked on */
+	unsigned int working_count;
+
+	struct indexer_queue_user_class classes[INDEXER_REQUEST_PRIORITY_COUNT];
+};
+
+struct indexer_queue_class {
+	/* Queued requests in the order they were added */
+	struct indexer_request *head, *tail;
+	/* Users with queued requests. The first user is served next. */
+	struct indexer_queue_user_class *users_head, *users_tail;
+	unsigned int count;
+};
+
 struct indexer_queue {
 	indexer_queue_callback_t *callback;
 	void (*listen_callback)(struct indexer_queue *);
+	bool (*user_busy_callback)(const char *username);
+	struct event *event;
 
 	/* username+mailbox -> indexer_request */
 	HASH_TABLE(struct indexer_request *, struct indexer_request *) requests;
-	/* username -> indexer_request */
-	HASH_TABLE(char *, struct indexer_request *) users;
-	struct indexer_request *head, *tail;
+	/* username -> indexer_queue_user */
+	HASH_TABLE(char *, struct indexer_queue_user *) users;
+
+	struct indexer_queue_class classes[INDEXER_REQUEST_PRIORITY_COUNT];
+	/* Number of interactive requests removed from the queue in a row
+	   while there were background requests waiting. */
+	unsigned int interactive_served;
 };
 
 struct indexer_queue_iter {
 	struct indexer_queue *queue;
 	struct hash_iterate_context *hash_iter;
 	struct indexer_request *next;
+	unsigned int class_idx;
 	bool only_working;
 };
 
+static struct event_category event_category_indexer = {
+	.name = "indexer",
+};
+
+static const char *const indexer_request_priority_names[] = {
+	"interactive",
+	"background",
+};
+static_assert_array_size(indexer_request_priority_names,
+			 INDEXER_REQUEST_PRIORITY_COUNT);
+
 static unsigned int
 indexer_request_hash(const struct indexer_request *request)
 {
@@ -45,6 +99,8 @@ indexer_queue_init(indexer_queue_callback_t *callback)
 
 	queue = i_new(struct indexer_queue, 1);
 	queue->callback = callback;
+	queue->event = event_create(NULL);
+	event_add_category(queue->event, &event_category_indexer);
 	hash_table_create(&queue->requests, default_pool, 0,
 			  indexer_request_hash, indexer_request_cmp);
 	hash_table_create(&queue->users, default_pool, 0, str_hash, strcmp);
@@ -63,6 +119,7 @@ void indexer_queue_deinit(struct indexer_queue **_queue)
 
 	hash_table_destroy(&queue->users);
 	hash_table_destroy(&queue->requests);
+	event_unref(&queue->event);
 	i_free(queue);
 }
 
@@ -72,6 +129,12 @@ void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 	queue->listen_callback = callback;
 }
 
+void indexer_queue_set_user_busy_callback(struct indexer_queue *queue,
+					  bool (*callback)(const char *username))
+{
+	queue->user_busy_callback = callback;
+}
+
 static struct indexer_request *
 indexer_queue_lookup(struct indexer_queue *queue,
 		     const char *username, const char *mailbox)
@@ -93,14 +156,87 @@ static void request_add_context(struct indexer_request *request, void *context)
 	array_push_back(&request->contexts, &context);
 }
 
+static void
+indexer_queue_request_enqueue(struct indexer_queue *queue,
+			      struct indexer_request *request,
+			      enum indexer_request_priority priority,
+			      bool head)
+{
+	struct indexer_queue_class *qclass = &queue->classes[priority];
+	struct indexer_queue_user_class *uclass =
+		&request->user->classes[priority];
+
+	i_assert(!request->queued);
+	i_assert(!request->working);
+
+	if (uclass->head == NULL) {
+		/* the user's first request with this priority - it's indexed
+		   after the other users' requests that are already waiting. */
+		DLLIST2_APPEND(&qclass->users_head, &qclass->users_tail,
+			       uclass);
+	}
+	if (head) {
+		DLLIST2_PREPEND(&qclass->head, &qclass->tail, request);
+		DLLIST2_PREPEND_FULL(&uclass->head, &uclass->tail, request,
+				     user_queue_prev, user_queue_next);
+	} else {
+		DLLIST2_APPEND(&qclass->head, &qclass->tail, request);
+		DLLIST2_APPEND_FULL(&uclass->head, &uclass->tail, request,
+				    user_queue_prev, user_queue_next);
+	}
+	qclass->count++;
+	request->priority = priority;
+	request->queued = TRUE;
+}
+
+static void
+indexer_queue_request_dequeue(struct indexer_queue *queue,
+			      struct indexer_request *request)
+{
+	struct indexer_queue_class *qclass =
+		&queue->classes[request->priority];
+	struct indexer_queue_user_class *uclass =
+		&request->user->classes[request->priority];
+
+	i_assert(request->queued);
+	i_assert(qclass->count > 0);
+
+	DLLIST2_REMOVE(&qclass->head, &qclass->tail, request);
+	DLLIST2_REMOVE_FULL(&uclass->head, &uclass->tail, request,
+			    user_queue_prev, user_queue_next);
+	if (uclass->head == NULL) {
+		DLLIST2_REMOVE(&qclass->users_head, &qclass->users_tail,
+			       uclass);
+	}
+	qclass->count--;
+	request->queued = FALSE;
+}
+
+static struct indexer_queue_user *
+indexer_queue_user_get(struct indexer_queue *queue, const char *username)
+{
+	struct indexer_queue_user *user;
+
+	user = hash_table_lookup(queue->users, username);
+	if (user != NULL)
+		return user;
+
+	user = i_new(struct indexer_queue_user, 1);
+	user->username = i_strdup(username);
+	for (unsigned int i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+		user->classes[i].user = user;
+	hash_table_insert(queue->users, user->username, user);
+	return user;
+}
+
 static struct indexer_request *
 indexer_queue_append_request(struct indexer_queue *queue, bool append,
 			     const char *username, const char *mailbox,
 			     const char *session_id,
 			     unsigned int max_recent_msgs, void *context)
 {
-	struct indexer_request *request, *first_request;
-	char *first_username;
+	struct indexer_request *request;
+	struct indexer_queue_user *user;
 
 	request = indexer_queue_lookup(queue, username, mailbox);
 	if (request != NULL) {
@@ -117,36 +253,39 @@ indexer_queue_append_request(struct indexer_queue *queue, bool append,
 			if (append) {
 				/* keep the request in its old position */
 			} else {
-				/* move request to beginning of the queue */
-				DLLIST2_REMOVE(&queue->head, &queue->tail, request);
-				DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+				/* move request to the beginning of the user's
+				   interactive requests. It keeps its original
+				   queueing time. */
+				indexer_queue_request_dequeue(queue, request);
+				indexer_queue_request_enqueue(queue, request,
+					INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+					TRUE);
 			}
 		}
 		return request;
 	}
 
+	user = indexer_queue_user_get(queue, username);
 	request = i_new(struct indexer_request, 1);
+	request->user = user;
 	request->username = i_strdup(username);
 	request->mailbox = i_strdup(mailbox);
 	request->session_id = i_strdup(session_id);
 	request->max_recent_msgs = max_recent_msgs;
 	request_add_context(request, context);
 	hash_table_insert(queue->requests, request, request);
-
-	if (!hash_table_lookup_full(queue->users, username,
-				    &first_username, &first_request)) {
-		first_username = i_strdup(username);
-		hash_table_insert(queue->users, first_username, request);
-	} else {
-		DLLIST_PREPEND_FULL(&first_request, request,
-				    user_prev, user_next);
-		hash_table_update(queue->users, first_username, request);
-	}
-
-	if (append)
-		DLLIST2_APPEND(&queue->head, &queue->tail, request);
-	else
-		DLLIST2_PREPEND(&queue->head, &queue->tail, request);
+	DLLIST_PREPEND_FULL(&user->requests, request, user_prev, user_next);
+
+	request->event = event_create(queue->event);
+	event_add_str(request->event, "user", username);
+	event_add_str(request->event, "mailbox", mailbox);
+	event_add_str(request->event, "session", session_id);
+
+	request->queued_time = ioloop_timeval;
+	indexer_queue_request_enqueue(queue, request, append ?
+				      INDEXER_REQUEST_PRIORITY_BACKGROUND :
+				      INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+				      !append);
 	return request;
 }
 
@@ -183,18 +322,116 @@ void indexer_queue_append_optimize(struct indexer_queue *queue,
 	indexer_queue_append_finish(queue);
 }
 
+static void indexer_queue_promote_aged(struct indexer_queue *queue)
+{
+	struct indexer_queue_class *qclass =
+		&queue->classes[INDEXER_REQUEST_PRIORITY_BACKGROUND];
+	struct indexer_request *request;
+
+	/* background requests are always appended, so the oldest requests
+	   are at the head */
+	while ((request = qclass->head) != NULL &&
+	       timeval_diff_msecs(&ioloop_timeval, &request->queued_time) >=
+	       INDEXER_QUEUE_AGING_MSECS) {
+		indexer_queue_request_dequeue(queue, request);
+		indexer_queue_request_enqueue(queue, request,
+			INDEXER_REQUEST_PRIORITY_INTERACTIVE, FALSE);
+		request->aged = TRUE;
+	}
+}
+
+static bool
+indexer_queue_user_is_busy(struct indexer_queue *queue,
+			   const struct indexer_queue_user *user)
+{
+	/* index only one mailbox at a time for each user */
+	if (user->working_count > 0)
+		return TRUE;
+	return queue->user_busy_callback != NULL &&
+		queue->user_busy_callback(user->username);
+}
+
+static struct indexer_request *
+indexer_queue_class_peek(struct indexer_queue *queue,
+			 struct indexer_queue_class *qclass)
+{
+	struct indexer_queue_user_class *uclass;
+
+	for (uclass = qclass->users_head; uclass != NULL; uclass = uclass->next) {
+		if (!indexer_queue_user_is_busy(queue, uclass->user))
+			return uclass->head;
+	}
+	return NULL;
+}
+
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue)
 {
-	return queue->head;
+	struct indexer_request *request, *bg_request;
+
+	indexer_queue_promote_aged(queue);
+	request = indexer_queue_class_peek(queue,
+		&queue->classes[INDEXER_REQUEST_PRIORITY_INTERACTIVE]);
+	bg_request = indexer_queue_class_peek(queue,
+		&queue->classes[INDEXER_REQUEST_PRIORITY_BACKGROUND]);
+	if (request == NULL ||
+	    (bg_request != NULL &&
+	     queue->interactive_served >= INDEXER_QUEUE_INTERACTIVE_WEIGHT))
+		return bg_request;
+	return request;
+}
+
+static unsigned int indexer_queue_queued_count(struct indexer_queue *queue)
+{
+	unsigned int i, count = 0;
+
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++)
+		count += queue->classes[i].count;
+	return count;
 }
 
 void indexer_queue_request_remove(struct indexer_queue *queue)
 {
-	struct indexer_request *request = queue->head;
+	struct indexer_request *request = indexer_queue_request_peek(queue);
+	unsigned int queue_length = indexer_queue_queued_count(queue);
 
 	i_assert(request != NULL);
 
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	struct indexer_queue_class *qclass =
+		&queue->classes[request->priority];
+	struct indexer_queue_user_class *uclass =
+		&request->user->classes[request->priority];
+
+	indexer_queue_request_dequeue(queue, request);
+	if (uclass->head != NULL) {
+		/* the user's next request waits until the other users with
+		   the same priority have been served */
+		DLLIST2_REMOVE(&qclass->users_head, &qclass->users_tail,
+			       uclass);
+		DLLIST2_APPEND(&qclass->users_head, &qclass->users_tail,
+			       uclass);
+	}
+
+	if (request->priority == INDEXER_REQUEST_PRIORITY_BACKGROUND)
+		queue->interactive_served = 0;
+	else if (queue->classes[INDEXER_REQUEST_PRIORITY_BACKGROUND].count > 0)
+		queue->interactive_served++;
+	else
+		queue->interactive_served = 0;
+
+	long long wait_usecs =
+		timeval_diff_usecs(&ioloop_timeval, &request->queued_time);
+	struct event_passthrough *e =
+		event_create_passthrough(request->event)->
+		set_name("indexer_request_dequeued")->
+		add_str("priority",
+			indexer_request_priority_names[request->priority])->
+		add_int("queue_wait_usecs", wait_usecs)->
+		add_int("queue_length", queue_length);
+	if (request->aged)
+		e->add_str("aged", "yes");
+	e_debug(e->event(), "Request waited %lld.%03lld secs in %s queue",
+		wait_usecs / 1000000, (wait_usecs / 1000) % 1000,
+		indexer_request_priority_names[request->priority]);
 }
 
 static void indexer_queue_request_status_int(struct indexer_queue *queue,
@@ -218,17 +455,12 @@ void indexer_queue_request_status(struct indexer_queue *queue,
 	indexer_queue_request_status_int(queue, request, status);
 }
 
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue)
-{
-	struct indexer_request *request = queue->head;
-
-	indexer_queue_request_remove(queue);
-	DLLIST2_APPEND(&queue->head, &queue->tail, request);
-}
-
 void indexer_queue_request_work(struct indexer_request *request)
 {
+	i_assert(!request->queued);
+
 	request->working = TRUE;
+	request->user->working_count++;
 	request->working_context_idx =
 		!array_is_created(&request->contexts) ? 0 :
 		array_count(&request->contexts);
@@ -238,8 +470,8 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  struct indexer_request **_request,
 				  enum indexer_state state)
 {
-	struct indexer_request *first_request, *request = *_request;
-	char *first_username;
+	struct indexer_request *request = *_request;
+	struct indexer_queue_user *user = request->user;
 
 	*_request = NULL;
 
@@ -247,6 +479,11 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 	struct indexer_status status = { .state = state };
 	indexer_queue_request_status_int(queue, request, &status);
 
+	if (request->working) {
+		i_assert(user->working_count > 0);
+		user->working_count--;
+	}
+
 	if (request->reindex_head || request->reindex_tail) {
 		i_assert(request->working);
 		request->working = FALSE;
@@ -254,28 +491,30 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 			array_delete(&request->contexts, 0,
 				     request->working_context_idx);
 		}
-		if (request->reindex_head)
-			DLLIST2_PREPEND(&queue->head, &queue->tail, request);
-		else
-			DLLIST2_APPEND(&queue->head, &queue->tail, request);
+		request->queued_time = ioloop_timeval;
+		request->aged = FALSE;
+		indexer_queue_request_enqueue(queue, request,
+			request->reindex_head ?
+			INDEXER_REQUEST_PRIORITY_INTERACTIVE :
+			INDEXER_REQUEST_PRIORITY_BACKGROUND,
+			request->reindex_head);
 		request->reindex_head = FALSE;
 		request->reindex_tail = FALSE;
 		return;
 	}
 
-	if (!hash_table_lookup_full(queue->users, request->username,
-				    &first_username, &first_request))
-		i_unreached();
-	DLLIST_REMOVE_FULL(&first_request, request, user_prev, user_next);
-	if (first_request != NULL)
-		hash_table_update(queue->users, first_username, first_request);
-	else {
-		hash_table_remove(queue->users, first_username);
-		i_free(first_username);
+	i_assert(!request->queued);
+	DLLIST_REMOVE_FULL(&user->requests, request, user_prev, user_next);
+	if (user->requests == NULL) {
+		i_assert(user->working_count == 0);
+		hash_table_remove(queue->users, user->username);
+		i_free(user->username);
+		i_free(user);
 	}
 	hash_table_remove(queue->requests, request);
 	if (array_is_created(&request->contexts))
 		array_free(&request->contexts);
+	event_unref(&request->event);
 	i_free(request->username);
 	i_free(request->mailbox);
 	i_free(request->session_id);
@@ -292,21 +531,24 @@ indexer_queue_request_cancel(struct indexer_queue *queue,
 
 	*_request = NULL;
 	request->reindex_head = request->reindex_tail = FALSE;
-	DLLIST2_REMOVE(&queue->head, &queue->tail, request);
+	indexer_queue_request_dequeue(queue, request);
 	indexer_queue_request_finish(queue, &request, INDEXER_STATE_FAILED);
 }
 
 void indexer_queue_cancel(struct indexer_queue *queue, const char *username,
 			  const char *mailbox_mask)
 {
+	struct indexer_queue_user *user;
 	struct indexer_request *request, *next;
 	bool single_mailbox =
 		mailbox_mask != NULL && wildcard_is_literal(mailbox_mask);
 
 	if (single_mailbox)
 		request = indexer_queue_lookup(queue, username, mailbox_mask);
-	else
-		request = hash_table_lookup(queue->users, username);
+	else {
+		user = hash_table_lookup(queue->users, username);
+		request = user == NULL ? NULL : user->requests;
+	}
 
 	while (request != NULL) {
 		next = request->user_next;
@@ -331,6 +573,7 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 {
 	struct indexer_request *request;
 	struct hash_iterate_context *iter;
+	unsigned int i;
 
 	/* remove all reindex-markers so when the current requests finish
 	   (or are cancelled) we don't try to retry them (especially during
@@ -340,13 +583,15 @@ void indexer_queue_cancel_all(struct indexer_queue *queue)
 		request->reindex_head = request->reindex_tail = FALSE;
 	hash_table_iterate_deinit(&iter);
 
-	while ((request = indexer_queue_request_peek(queue)) != NULL)
-		indexer_queue_request_cancel(queue, &request);
+	for (i = 0; i < INDEXER_REQUEST_PRIORITY_COUNT; i++) {
+		while ((request = queue->classes[i].head) != NULL)
+			indexer_queue_request_cancel(queue, &request);
+	}
 }
 
 bool indexer_queue_is_empty(struct indexer_queue *queue)
 {
-	return queue->head == NULL;
+	return indexer_queue_queued_count(queue) == 0;
 }
 
 unsigned int indexer_queue_count(struct indexer_queue *queue)
@@ -383,9 +628,15 @@ struct indexer_request *indexer_queue_iter_next(struct indexer_queue_iter *iter)
 		hash_table_iterate_deinit(&iter->hash_iter);
 		if (iter->only_working)
 			return NULL;
-		iter->next = indexer_queue_request_peek(iter->queue);
+		iter->class_idx = 0;
+		iter->next = iter->queue->classes[0].head;
 	}
 	request = iter->next;
+	while (request == NULL && !iter->only_working &&
+	       iter->class_idx + 1 < INDEXER_REQUEST_PRIORITY_COUNT) {
+		iter->class_idx++;
+		request = iter->queue->classes[iter->class_idx].head;
+	}
 	if (request != NULL)
 		iter->next = request->next;
 	return request;
@@ -13,11 +13,25 @@ enum indexer_request_type {
 	INDEXER_REQUEST_TYPE_OPTIMIZE,
 };
 
+enum indexer_request_priority {
+	/* a client is waiting for the indexing to finish (PREPEND) */
+	INDEXER_REQUEST_PRIORITY_INTERACTIVE,
+	/* background indexing, e.g. after mail delivery (APPEND) */
+	INDEXER_REQUEST_PRIORITY_BACKGROUND,
+};
+#define INDEXER_REQUEST_PRIORITY_COUNT 2
+
 struct indexer_request {
-	/* Linked list of all requests - highest priority first */
+	/* Linked list of the queued requests with the same priority - in the
+	   order they were added to the queue */
 	struct indexer_request *prev, *next;
+	/* Linked list of the same username's queued requests with the same
+	   priority - the first one is indexed next */
+	struct indexer_request *user_queue_prev, *user_queue_next;
 	/* Linked list of the same username's requests */
 	struct indexer_request *user_prev, *user_next;
+	struct indexer_queue_user *user;
+	struct event *event;
 
 	char *username;
 	char *mailbox;
@@ -25,7 +39,15 @@ struct indexer_request {
 	unsigned int max_recent_msgs;
 
 	enum indexer_request_type type;
-
+	enum indexer_request_priority priority;
+	/* when the request was added to the queue */
+	struct timeval queued_time;
+
+	/* request is in the queue waiting to be indexed */
+	bool queued:1;
+	/* request was promoted from background to interactive priority,
+	   because it was waiting for too long */
+	bool aged:1;
 	/* currently indexing this mailbox */
 	bool working:1;
 	/* after indexing is finished, add this request back to the queue and
@@ -47,7 +69,17 @@ void indexer_queue_deinit(struct indexer_queue **queue);
 /* The callback is called whenever a new request is added to the queue. */
 void indexer_queue_set_listen_callback(struct indexer_queue *queue,
 				       void (*callback)(struct indexer_queue *));
-
+/* The callback is called to check whether the user is still busy with
+   something outside the queue, such as a worker connection that hasn't
+   disconnected yet. The requests of busy users are skipped. */
+void indexer_queue_set_user_busy_callback(struct indexer_queue *queue,
+					  bool (*callback)(const char *username));
+
+/* Add a request to the queue. append=TRUE adds a background request, while
+   append=FALSE adds an interactive request that is indexed before the user's
+   other requests. Interactive requests are preferred over background
+   requests, but the background requests aren't starved. The users are served
+   in round-robin order within each priority. */
 void indexer_queue_append(struct indexer_queue *queue, bool append,
 			  const char *username, const char *mailbox,
 			  const char *session_id, unsigned int max_recent_msgs,
@@ -65,17 +97,19 @@ void indexer_queue_cancel_all(struct indexer_queue *queue);
 bool indexer_queue_is_empty(struct indexer_queue *queue);
 unsigned int indexer_queue_count(struct indexer_queue *queue);
 
-/* Return the next request from the queue, without removing it. */
+/* Return the next request from the queue, without removing it. Requests for
+   users who already have a request being worked on, or who are busy
+   according to the user_busy_callback, are skipped. Returns NULL if there
+   are no such requests. */
 struct indexer_request *indexer_queue_request_peek(struct indexer_queue *queue);
-/* Remove the next request from the queue. You must call
-   indexer_queue_request_finish() to free its memory. */
+/* Remove the next request (as returned by indexer_queue_request_peek()) from
+   the queue. You must call indexer_queue_request_finish() to free its
+   memory. */
 void indexer_queue_request_remove(struct indexer_queue *queue);
 /* Give a status update about how far the indexing is going on. */
 void indexer_queue_request_status(struct indexer_queue *queue,
 				  struct indexer_request *request,
 				  const struct indexer_status *status);
-/* Move the next request to the end of the queue. */
-void indexer_queue_move_head_to_tail(struct indexer_queue *queue);
 /* Start working on a request */
 void indexer_queue_request_work(struct indexer_request *request);
 /* Finish the request and free its memory. */
@@ -84,7 +118,8 @@ void indexer_queue_request_finish(struct indexer_queue *queue,
 				  enum indexer_state state);
 
 /* Iterate through all requests. First it returns the requests currently being
-   worked on, followed by the queued requests in the priority order. If
+   worked on, followed by the queued interactive requests and then the queued
+   background requests, in the order they were added to the queue. If
    only_working=TRUE, return only the requests currently being worked on. */
 struct indexer_queue_iter *
 indexer_queue_iter_init(struct indexer_queue *queue, bool only_working);
@@ -50,29 +50,20 @@ static bool worker_send_request(struct indexer_request *request)
 	return TRUE;
 }
 
+static bool queue_user_busy_callback(const char *username)
+{
+	/* The previous worker for this user hasn't disconnected yet. The
+	   user's requests continue when it's gone. */
+	return worker_connections_find_user(username) != NULL;
+}
+
 static void queue_try_send_more(struct indexer_queue *queue)
 {
-	struct worker_connection *worker;
-	struct indexer_request *request, *first_moved_request = NULL;
+	struct indexer_request *request;
 
+	/* The queue skips users whose requests are already being worked on,
+	   so a user is never indexed by multiple workers at the same time. */
 	while ((request = indexer_queue_request_peek(queue)) != NULL) {
-		worker = worker_connections_find_user(request->username);
-		if (worker != NULL) {
-			/* There is already a connection handling a request
-			 * for this user. Move the request to the back of the
-			 * queue and handle requests from other users.
-			 * Terminate if we went through all requests. */
-			if (request == first_moved_request) {
-				/* all requests are waiting for existing users
-				   to finish. */
-				break;
-			}
-			if (first_moved_request == NULL)
-				first_moved_request = request;
-			indexer_queue_move_head_to_tail(queue);
-			continue;
-		}
-
 		/* create a new connection to a worker */
 		if (!worker_send_request(request))
 			break;
@@ -120,6 +111,7 @@ int main(int argc, char *argv[])
 
 	queue = indexer_queue_init(indexer_client_status_callback);
 	indexer_queue_set_listen_callback(queue, queue_listen_callback);
+	indexer_queue_set_user_busy_callback(queue, queue_user_busy_callback);
 	worker_connections_init();
 	master_service_init_finish(master_service);
 
@@ -1,6 +1,7 @@
 /* Copyright (c) 2022 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "ioloop.h"
 #include "test-common.h"
 #include "indexer-queue.h"
 
@@ -25,20 +26,15 @@ static void test_indexer_queue(void)
 	indexer_queue_append(queue, FALSE, "user2", "mailbox2", "session2", 0, NULL);
 	indexer_queue_append(queue, FALSE, "user1", "mailbox1", "session1", 0, NULL);
 
-	request = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request->username, "user1");
-	test_assert_strcmp(request->mailbox, "mailbox1");
-
-	indexer_queue_move_head_to_tail(queue);
-
+	/* interactive requests first, then background requests */
 	struct {
 		const char *username;
 		const char *mailbox;
 	} expected[] = {
 		{ "user2", "mailbox2" },
+		{ "user1", "mailbox1" },
 		{ "user2", "mailbox3" },
 		{ "user1", "mailbox4" },
-		{ "user1", "mailbox1" },
 	};
 	for (unsigned int i = 0; i < N_ELEMENTS(expected); i++) {
 		request = indexer_queue_request_peek(queue);
@@ -153,14 +149,14 @@ static void test_indexer_queue_cancel(void)
 
 	test_assert(indexer_queue_count(queue) == 4);
 	request = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert_strcmp(request->mailbox, "mailbox2");
 
 	/* cancel user1's all requests */
 	indexer_queue_cancel(queue, "user1", NULL);
+	test_assert(indexer_queue_count(queue) == 2);
 	request = indexer_queue_request_peek(queue);
 	test_assert_strcmp(request->mailbox, "mailbox2");
-	test_assert_strcmp(request->next->mailbox, "mailbox3");
-	test_assert(request->next->next == NULL);
+	test_assert(request->next == NULL);
 
 	/* cancel user2's requests one by one */
 	indexer_queue_cancel(queue, "user2", "mailbox2");
@@ -213,17 +209,21 @@ static void test_indexer_queue_iter(void)
 
 	/* start working on the first two requests */
 	request1 = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request1->username, "user1");
-	test_assert_strcmp(request1->mailbox, "mailbox1");
+	test_assert_strcmp(request1->username, "user2");
+	test_assert_strcmp(request1->mailbox, "mailbox2");
 	indexer_queue_request_remove(queue);
 	indexer_queue_request_work(request1);
 
 	request2 = indexer_queue_request_peek(queue);
-	test_assert_strcmp(request2->username, "user2");
-	test_assert_strcmp(request2->mailbox, "mailbox2");
+	test_assert_strcmp(request2->username, "user1");
+	test_assert_strcmp(request2->mailbox, "mailbox1");
 	indexer_queue_request_remove(queue);
 	indexer_queue_request_work(request2);
 
+	/* both users are busy now */
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+	test_assert(!indexer_queue_is_empty(queue));
+
 	/* Iteration shows the requests being worked on first. Their order
 	   depends on hash table iteration, so any order is acceptable. */
 	struct indexer_queue_iter *iter = indexer_queue_iter_init(queue, FALSE);
@@ -232,9 +232,10 @@ static void test_indexer_queue_iter(void)
 	test_assert((iter_request1 == request1 && iter_request2 == request2) ||
 		    (iter_request1 == request2 && iter_request2 == request1));
 
-	request = indexer_queue_request_peek(queue);
-	test_assert(indexer_queue_iter_next(iter) == request);
-	test_assert(indexer_queue_iter_next(iter) == request->next);
+	request = indexer_queue_iter_next(iter);
+	test_assert_strcmp(request->mailbox, "mailbox3");
+	request = indexer_queue_iter_next(iter);
+	test_assert_strcmp(request->mailbox, "mailbox4");
 	test_assert(indexer_queue_iter_next(iter) == NULL);
 	indexer_queue_iter_deinit(&iter);
 
@@ -258,6 +259,201 @@ static void test_indexer_queue_iter(void)
 	test_end();
 }
 
+static void
+test_indexer_queue_expect(struct indexer_queue *queue,
+			  const char *const expected[][2], unsigned int count)
+{
+	struct indexer_request *request;
+
+	for (unsigned int i = 0; i < count; i++) {
+		request = indexer_queue_request_peek(queue);
+		if (request == NULL) {
+			test_assert_idx(request != NULL, i);
+			return;
+		}
+		test_assert_strcmp_idx(request->username, expected[i][0], i);
+		test_assert_strcmp_idx(request->mailbox, expected[i][1], i);
+		indexer_queue_request_remove(queue);
+		indexer_queue_request_work(request);
+		indexer_queue_request_finish(queue, &request,
+					     INDEXER_STATE_COMPLETED);
+	}
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+}
+
+static void test_indexer_queue_fairness(void)
+{
+	struct indexer_queue *queue;
+
+	test_begin("indexer queue fairness");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	/* user1 has a large backlog, which doesn't delay user2 */
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox3", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "mailbox1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user3", "mailbox2", NULL, 0, NULL);
+
+	const char *const expected[][2] = {
+		{ "user1", "mailbox1" },
+		{ "user2", "mailbox1" },
+		{ "user3", "mailbox1" },
+		{ "user1", "mailbox2" },
+		{ "user3", "mailbox2" },
+		{ "user1", "mailbox3" },
+	};
+	test_indexer_queue_expect(queue, expected, N_ELEMENTS(expected));
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_priority_weight(void)
+{
+	struct indexer_queue *queue;
+
+	test_begin("indexer queue priority weight");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	indexer_queue_append(queue, TRUE, "bg1", "mailbox", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "bg2", "mailbox", NULL, 0, NULL);
+	for (unsigned int i = 1; i <= 6; i++) {
+		indexer_queue_append(queue, FALSE, t_strdup_printf("int%u", i),
+				     "mailbox", NULL, 0, NULL);
+	}
+
+	/* background requests aren't starved by the interactive ones */
+	const char *const expected[][2] = {
+		{ "int1", "mailbox" },
+		{ "int2", "mailbox" },
+		{ "int3", "mailbox" },
+		{ "int4", "mailbox" },
+		{ "bg1", "mailbox" },
+		{ "int5", "mailbox" },
+		{ "int6", "mailbox" },
+		{ "bg2", "mailbox" },
+	};
+	test_indexer_queue_expect(queue, expected, N_ELEMENTS(expected));
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static void test_indexer_queue_aging(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+	struct timeval old_ioloop_timeval = ioloop_timeval;
+
+	test_begin("indexer queue aging");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	ioloop_timeval.tv_sec = 1000;
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0, NULL);
+	ioloop_timeval.tv_sec = 1030;
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", NULL, 0, NULL);
+
+	ioloop_timeval.tv_sec = 1059;
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert(request->priority == INDEXER_REQUEST_PRIORITY_BACKGROUND);
+	test_assert(!request->aged);
+
+	/* the oldest request is promoted to interactive priority */
+	ioloop_timeval.tv_sec = 1060;
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->mailbox, "mailbox1");
+	test_assert(request->priority == INDEXER_REQUEST_PRIORITY_INTERACTIVE);
+	test_assert(request->aged);
+
+	/* a new interactive request is still indexed before the user's aged
+	   requests */
+	indexer_queue_append(queue, FALSE, "user1", "mailbox3", NULL, 0, NULL);
+	ioloop_timeval.tv_sec = 1090;
+	const char *const expected[][2] = {
+		{ "user1", "mailbox3" },
+		{ "user1", "mailbox1" },
+		{ "user1", "mailbox2" },
+	};
+	test_indexer_queue_expect(queue, expected, N_ELEMENTS(expected));
+
+	indexer_queue_deinit(&queue);
+	ioloop_timeval = old_ioloop_timeval;
+	test_end();
+}
+
+static void test_indexer_queue_busy_user(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request1, *request2;
+
+	test_begin("indexer queue busy user");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user1", "mailbox2", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0, NULL);
+
+	request1 = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request1->username, "user1");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request1);
+
+	/* user1's next request waits until the first one is finished */
+	request2 = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request2->username, "user2");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_work(request2);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+
+	indexer_queue_request_finish(queue, &request1, INDEXER_STATE_COMPLETED);
+	request1 = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request1->username, "user1");
+	test_assert_strcmp(request1->mailbox, "mailbox2");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_finish(queue, &request1, INDEXER_STATE_COMPLETED);
+	indexer_queue_request_finish(queue, &request2, INDEXER_STATE_COMPLETED);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
+static bool test_user1_busy_callback(const char *username)
+{
+	return strcmp(username, "user1") == 0;
+}
+
+static void test_indexer_queue_busy_user_callback(void)
+{
+	struct indexer_queue *queue;
+	struct indexer_request *request;
+
+	test_begin("indexer queue busy user callback");
+	queue = indexer_queue_init(indexer_queue_status_callback);
+	indexer_queue_set_user_busy_callback(queue, test_user1_busy_callback);
+
+	indexer_queue_append(queue, TRUE, "user1", "mailbox1", NULL, 0, NULL);
+	indexer_queue_append(queue, TRUE, "user2", "mailbox1", NULL, 0, NULL);
+
+	/* user1 is skipped, but it doesn't block the other users */
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->username, "user2");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_finish(queue, &request, INDEXER_STATE_COMPLETED);
+	test_assert(indexer_queue_request_peek(queue) == NULL);
+
+	indexer_queue_set_user_busy_callback(queue, NULL);
+	request = indexer_queue_request_peek(queue);
+	test_assert_strcmp(request->username, "user1");
+	indexer_queue_request_remove(queue);
+	indexer_queue_request_finish(queue, &request, INDEXER_STATE_COMPLETED);
+
+	indexer_queue_deinit(&queue);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -266,6 +462,11 @@ int main(void)
 		test_indexer_queue_reindex,
 		test_indexer_queue_cancel,
 		test_indexer_queue_iter,
+		test_indexer_queue_fairness,
+		test_indexer_queue_priority_weight,
+		test_indexer_queue_aging,
+		test_indexer_queue_busy_user,
+		test_indexer_queue_busy_user_callback,
 		NULL
 	};
 	return test_run(test_functions);
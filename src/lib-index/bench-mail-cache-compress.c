@@ -0,0 +1,199 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "randgen.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unlink-directory.h"
+#include "mail-cache-private.h"
+
+#include <stdio.h>
+#include <sys/stat.h>
+
+/**
+ * Creates an index with a large number of messages that have header-like
+ * cache fields and purges the cache with and without compression. Shows the
+ * resulting cache file sizes and measures how quickly all the fields can be
+ * looked up afterwards, i.e. what FETCH of cached headers would be doing.
+ */
+
+#define BENCH_DIR ".dovecot.bench"
+#define BENCH_INDEX_PREFIX "bench.dovecot.index"
+
+static struct mail_cache_field bench_fields[] = {
+	{ .name = "bench.received", .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX, .decision = MAIL_CACHE_DECISION_YES },
+	{ .name = "imap.envelope", .type = MAIL_CACHE_FIELD_STRING,
+	  .field_size = UINT_MAX, .decision = MAIL_CACHE_DECISION_YES },
+};
+
+static const char *bench_received(uint32_t seq)
+{
+	return t_strdup_printf(
+		"Received: from mx%u.example.com (mx%u.example.com [192.0.2.%u])\r\n"
+		"\tby imap.example.org (Postfix) with ESMTPS id %08x\r\n"
+		"\tfor <user%u@example.org>; Thu, 01 Jan 2015 %02u:%02u:%02u +0000\r\n"
+		"Received: from localhost (localhost [127.0.0.1])\r\n"
+		"\tby mx%u.example.com (Postfix) with ESMTP id %08x\r\n"
+		"\tfor <user%u@example.org>; Thu, 01 Jan 2015 %02u:%02u:%02u +0000\r\n",
+		seq % 7, seq % 7, i_rand_limit(250), i_rand(),
+		i_rand_limit(100), i_rand_limit(24), i_rand_limit(60),
+		i_rand_limit(60), seq % 7, i_rand(), i_rand_limit(100),
+		i_rand_limit(24), i_rand_limit(60), i_rand_limit(60));
+}
+
+static const char *bench_envelope(uint32_t seq)
+{
+	unsigned int sender = i_rand_limit(500);
+
+	return t_strdup_printf(
+		"\"Thu, 01 Jan 2015 00:00:00 +0000\" \"Weekly report %u\" "
+		"((\"Sender %u\" NIL \"sender%u\" \"example.com\")) "
+		"((\"Sender %u\" NIL \"sender%u\" \"example.com\")) "
+		"((\"Sender %u\" NIL \"sender%u\" \"example.com\")) "
+		"((NIL NIL \"user%u\" \"example.org\")) NIL NIL NIL "
+		"\"<%u.%08x@mx.example.com>\"",
+		seq, sender, sender, sender, sender, sender, sender,
+		i_rand_limit(100), seq, i_rand());
+}
+
+static struct mail_index *bench_index_create(unsigned int messages_count)
+{
+	struct mail_index *index;
+	struct mail_index_view *view, *updated_view;
+	struct mail_index_transaction *trans;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	const char *error, *value;
+	uint32_t seq, uid_validity = 1;
+
+	(void)unlink_directory(BENCH_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	if (mkdir(BENCH_DIR, 0700) < 0)
+		i_fatal("mkdir(%s) failed: %m", BENCH_DIR);
+
+	index = mail_index_alloc(NULL, BENCH_DIR, BENCH_INDEX_PREFIX);
+	mail_index_set_fsync_mode(index, FSYNC_MODE_NEVER, 0);
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+	mail_cache_register_fields(index->cache, bench_fields,
+				   N_ELEMENTS(bench_fields), default_pool);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	updated_view = mail_index_transaction_open_updated_view(trans);
+	cache_view = mail_cache_view_open(index->cache, updated_view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uint32_t uid = 1; uid <= messages_count; uid++) T_BEGIN {
+		mail_index_append(trans, uid, &seq);
+		value = bench_received(seq);
+		mail_cache_add(cache_trans, seq, bench_fields[0].idx,
+			       value, strlen(value));
+		value = bench_envelope(seq);
+		mail_cache_add(cache_trans, seq, bench_fields[1].idx,
+			       value, strlen(value));
+	} T_END;
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&updated_view);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+	return index;
+}
+
+static void bench_lookups(struct mail_index *index, bool compress)
+{
+	struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.compress = compress,
+		},
+	};
+	struct mail_index_view *view;
+	struct mail_cache_view *cache_view;
+	struct stat st;
+	string_t *str;
+	uint32_t seq, messages_count;
+	uint64_t ts_0, ts_1, ts_2, ts_3;
+	size_t total_size = 0;
+
+	mail_index_set_optimization_settings(index, &optimization_set);
+	ts_0 = i_nanoseconds();
+	if (mail_cache_purge(index->cache, (uint32_t)-1, "bench") < 0)
+		i_fatal("mail_cache_purge() failed");
+	ts_1 = i_nanoseconds();
+	if (stat(index->cache->filepath, &st) < 0)
+		i_fatal("stat(%s) failed: %m", index->cache->filepath);
+
+	view = mail_index_view_open(index);
+	cache_view = mail_cache_view_open(index->cache, view);
+	messages_count = mail_index_view_get_messages_count(view);
+	str = str_new(default_pool, 1024);
+
+	ts_2 = i_nanoseconds();
+	for (seq = 1; seq <= messages_count; seq++) {
+		for (unsigned int i = 0; i < N_ELEMENTS(bench_fields); i++) {
+			str_truncate(str, 0);
+			if (mail_cache_lookup_field(cache_view, str, seq,
+						    bench_fields[i].idx) <= 0)
+				i_fatal("Cache lookup for seq=%u failed", seq);
+			total_size += str_len(str);
+		}
+	}
+	ts_3 = i_nanoseconds();
+
+	printf("%s (cache file version %u):\n",
+	       compress ? "Compressed" : "Uncompressed",
+	       index->cache->hdr->major_version);
+	printf("\tCache file size: %"PRIuUOFF_T" bytes "
+	       "(%zu bytes of fields)\n", st.st_size, total_size);
+	printf("\tPurge: %0.02lf ms\n", (double)(ts_1 - ts_0) / 1000000.0);
+	printf("\tLookups: %0.02lf Kmsgs/s\n",
+	       (double)messages_count * 1000000.0 / (double)(ts_3 - ts_2 + 1));
+	str_free(&str);
+	mail_cache_view_close(&cache_view);
+	mail_index_view_close(&view);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<messages>]\n", prog);
+	fprintf(stderr, "Runs with 100000 messages if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct mail_index *index;
+	unsigned int messages_count = 100000;
+	const char *error;
+
+	lib_init();
+	/* used for the indexid */
+	ioloop_time = time(NULL);
+
+	if (argc > 2)
+		print_usage(argv[0]);
+	if (argc > 1 && (str_to_uint(argv[1], &messages_count) < 0 ||
+			 messages_count == 0)) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	index = bench_index_create(messages_count);
+	printf("%u messages\n", messages_count);
+	bench_lookups(index, FALSE);
+	if (!mail_cache_compress_supported())
+		printf("Compressed: not available\n");
+	else
+		bench_lookups(index, TRUE);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	(void)unlink_directory(BENCH_DIR, UNLINK_DIRECTORY_FLAG_RMDIR, &error);
+	lib_deinit();
+	return 0;
+}
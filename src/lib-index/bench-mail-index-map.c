@@ -0,0 +1,189 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "ioloop.h"
+#include "randgen.h"
+#include "seq-range-array.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "mail-index-private.h"
+
+#include <stdio.h>
+
+/**
+ * Creates an in-memory index with a large number of messages that have
+ * random flags and measures how quickly the flags can be scanned via
+ * mail_index_lookup() compared to the flags column, and how quickly UIDs
+ * can be converted to sequences with and without the uid column. Also
+ * measures looking up all the matching sequences at once with
+ * mail_index_lookup_seqs_matching().
+ */
+
+#define BENCH_UID_LOOKUP_COUNT 1000000
+
+static struct mail_index *bench_index_create(unsigned int messages_count)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, uid_validity = 1;
+
+	index = mail_index_alloc(NULL, NULL, "(in-memory)");
+	if (mail_index_open_or_create(index, MAIL_INDEX_OPEN_FLAG_CREATE) < 0)
+		i_fatal("mail_index_open_or_create() failed");
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uint32_t uid = 1; uid <= messages_count; uid++) {
+		/* leave some gaps to the UIDs */
+		mail_index_append(trans, uid * 2 + i_rand_limit(2), &seq);
+		mail_index_update_flags(trans, seq, MODIFY_REPLACE,
+					i_rand_limit(MAIL_DRAFT * 2));
+	}
+	if (mail_index_transaction_commit(&trans) < 0)
+		i_fatal("mail_index_transaction_commit() failed");
+	mail_index_view_close(&view);
+	return index;
+}
+
+static void bench_flags_scan(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	const uint8_t *flags_column;
+	unsigned int count1 = 0, count2 = 0;
+	uint64_t ts_0, ts_1, ts_2, ts_3;
+	uint32_t seq, messages_count;
+
+	view = mail_index_view_open(index);
+	messages_count = mail_index_view_get_messages_count(view);
+	flags_column = mail_index_lookup_flags_column(view);
+
+	ts_0 = i_nanoseconds();
+	for (seq = 1; seq <= messages_count; seq++) {
+		rec = mail_index_lookup(view, seq);
+		if ((rec->flags & (MAIL_SEEN | MAIL_DELETED)) == MAIL_DELETED)
+			count1++;
+	}
+	ts_1 = i_nanoseconds();
+	if (flags_column != NULL) {
+		for (seq = 1; seq <= messages_count; seq++) {
+			if ((flags_column[seq-1] & (MAIL_SEEN | MAIL_DELETED)) ==
+			    MAIL_DELETED)
+				count2++;
+		}
+	}
+	ts_2 = i_nanoseconds();
+	i_assert(flags_column == NULL || count1 == count2);
+
+	struct mail_index_record_filter filter = {
+		.flags = MAIL_DELETED,
+		.flags_mask = MAIL_SEEN | MAIL_DELETED,
+	};
+	ARRAY_TYPE(seq_range) seqs;
+	bool have_seqs;
+
+	i_array_init(&seqs, 1024);
+	have_seqs = mail_index_lookup_seqs_matching(view, 1, messages_count,
+						    &filter, &seqs);
+	ts_3 = i_nanoseconds();
+	i_assert(!have_seqs || seq_range_count(&seqs) == count1);
+	array_free(&seqs);
+
+	printf("\tFlags scan with records: %0.02lf Mmsgs/s\n",
+	       (double)messages_count * 1000.0 / (double)(ts_1 - ts_0 + 1));
+	if (flags_column == NULL)
+		printf("\tFlags scan with column: not available\n");
+	else {
+		printf("\tFlags scan with column: %0.02lf Mmsgs/s\n",
+		       (double)messages_count * 1000.0 /
+		       (double)(ts_2 - ts_1 + 1));
+	}
+	if (!have_seqs)
+		printf("\tFlags scan into seq ranges: not available\n");
+	else {
+		printf("\tFlags scan into seq ranges: %0.02lf Mmsgs/s\n",
+		       (double)messages_count * 1000.0 /
+		       (double)(ts_3 - ts_2 + 1));
+	}
+	mail_index_view_close(&view);
+}
+
+static uint64_t
+bench_uid_lookups(struct mail_index_map *map, const uint32_t *uids)
+{
+	uint32_t seq1, seq2;
+	uint64_t ts_0;
+
+	ts_0 = i_nanoseconds();
+	for (unsigned int i = 0; i < BENCH_UID_LOOKUP_COUNT; i++) {
+		mail_index_map_lookup_seq_range(map, uids[i], uids[i] + 100,
+						&seq1, &seq2);
+	}
+	return i_nanoseconds() - ts_0;
+}
+
+static void bench_uid_lookup(struct mail_index *index)
+{
+	struct mail_index_map *map = index->map;
+	uint32_t *uids;
+	uint64_t ts_columns, ts_records;
+
+	uids = i_new(uint32_t, BENCH_UID_LOOKUP_COUNT);
+	for (unsigned int i = 0; i < BENCH_UID_LOOKUP_COUNT; i++)
+		uids[i] = i_rand_minmax(1, map->hdr.next_uid - 1);
+
+	ts_columns = bench_uid_lookups(map, uids);
+	/* Make the map look like mmap()ed so the uid column isn't used */
+	mail_index_record_map_columns_free(map->rec_map);
+	map->rec_map->mmap_base = map->rec_map->records;
+	ts_records = bench_uid_lookups(map, uids);
+	map->rec_map->mmap_base = NULL;
+
+	printf("\tUID lookups with records: %0.02lf Mlookups/s\n",
+	       (double)BENCH_UID_LOOKUP_COUNT * 1000.0 /
+	       (double)(ts_records + 1));
+	printf("\tUID lookups with column: %0.02lf Mlookups/s\n",
+	       (double)BENCH_UID_LOOKUP_COUNT * 1000.0 /
+	       (double)(ts_columns + 1));
+	i_free(uids);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<messages>]\n", prog);
+	fprintf(stderr, "Runs with 500000 messages if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct mail_index *index;
+	unsigned int messages_count = 500000;
+
+	lib_init();
+	/* used for the indexid */
+	ioloop_time = time(NULL);
+
+	if (argc > 2)
+		print_usage(argv[0]);
+	if (argc > 1 && (str_to_uint(argv[1], &messages_count) < 0 ||
+			 messages_count == 0)) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	index = bench_index_create(messages_count);
+	printf("%u messages\n", messages_count);
+	bench_flags_scan(index);
+	bench_uid_lookup(index);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	lib_deinit();
+	return 0;
+}
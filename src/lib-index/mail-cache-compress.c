@@ -0,0 +1,253 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "mail-cache-private.h"
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#include <zdict.h>
+
+/* zstd's default level. Fields are compressed only while purging. */
+#define MAIL_CACHE_COMPRESS_LEVEL 3
+
+struct mail_cache_compress {
+	buffer_t *dict;
+
+	ZSTD_CCtx *cctx;
+	ZSTD_CDict *cdict;
+	ZSTD_DCtx *dctx;
+	ZSTD_DDict *ddict;
+};
+
+bool mail_cache_compress_supported(void)
+{
+	return TRUE;
+}
+
+bool mail_cache_compress_train(const void *samples, const size_t *sample_sizes,
+			       unsigned int samples_count, buffer_t *dict,
+			       const char **error_r)
+{
+	void *data = buffer_get_space_unsafe(dict, 0,
+					     MAIL_CACHE_COMPRESS_DICT_MAX_SIZE);
+	size_t ret = ZDICT_trainFromBuffer(data, MAIL_CACHE_COMPRESS_DICT_MAX_SIZE,
+					   samples, sample_sizes,
+					   samples_count);
+	if (ZDICT_isError(ret) != 0) {
+		buffer_set_used_size(dict, 0);
+		*error_r = ZDICT_getErrorName(ret);
+		return FALSE;
+	}
+	buffer_set_used_size(dict, ret);
+	return TRUE;
+}
+
+struct mail_cache_compress *
+mail_cache_compress_init(const void *dict, size_t dict_size)
+{
+	struct mail_cache_compress *compress;
+
+	compress = i_new(struct mail_cache_compress, 1);
+	compress->dict = buffer_create_dynamic(default_pool, dict_size);
+	buffer_append(compress->dict, dict, dict_size);
+	return compress;
+}
+
+void mail_cache_compress_deinit(struct mail_cache_compress **_compress)
+{
+	struct mail_cache_compress *compress = *_compress;
+
+	if (compress == NULL)
+		return;
+	*_compress = NULL;
+
+	if (compress->cdict != NULL)
+		ZSTD_freeCDict(compress->cdict);
+	if (compress->cctx != NULL)
+		ZSTD_freeCCtx(compress->cctx);
+	if (compress->ddict != NULL)
+		ZSTD_freeDDict(compress->ddict);
+	if (compress->dctx != NULL)
+		ZSTD_freeDCtx(compress->dctx);
+	buffer_free(&compress->dict);
+	i_free(compress);
+}
+
+size_t mail_cache_compress_dict_size(const struct mail_cache_compress *compress)
+{
+	return compress->dict->used;
+}
+
+static void mail_cache_compress_init_cctx(struct mail_cache_compress *compress)
+{
+	compress->cctx = ZSTD_createCCtx();
+	compress->cdict = ZSTD_createCDict(compress->dict->data,
+					   compress->dict->used,
+					   MAIL_CACHE_COMPRESS_LEVEL);
+	if (compress->cctx == NULL || compress->cdict == NULL)
+		i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	/* The fields are tiny, so don't waste space on the dictionary ID.
+	   The dictionary is always the one in the same cache file. */
+	(void)ZSTD_CCtx_setParameter(compress->cctx, ZSTD_c_dictIDFlag, 0);
+	(void)ZSTD_CCtx_refCDict(compress->cctx, compress->cdict);
+}
+
+bool mail_cache_compress(struct mail_cache_compress *compress,
+			 const void *data, size_t size, buffer_t *dest)
+{
+	if (compress->cctx == NULL)
+		mail_cache_compress_init_cctx(compress);
+
+	size_t bound = ZSTD_compressBound(size);
+	void *output = buffer_get_space_unsafe(dest, 0, bound);
+	size_t ret = ZSTD_compress2(compress->cctx, output, bound, data, size);
+	if (ZSTD_isError(ret) || ret >= size) {
+		/* failed or not worth it - store uncompressed */
+		buffer_set_used_size(dest, 0);
+		return FALSE;
+	}
+	buffer_set_used_size(dest, ret);
+	return TRUE;
+}
+
+int mail_cache_decompress(struct mail_cache_compress *compress,
+			  const void *data, size_t size, buffer_t *dest,
+			  const char **error_r)
+{
+	unsigned long long content_size;
+
+	if (compress->dctx == NULL) {
+		compress->dctx = ZSTD_createDCtx();
+		compress->ddict = ZSTD_createDDict(compress->dict->data,
+						   compress->dict->used);
+		if (compress->dctx == NULL || compress->ddict == NULL)
+			i_fatal_status(FATAL_OUTOFMEM, "zstd: Out of memory");
+	}
+
+	content_size = ZSTD_getFrameContentSize(data, size);
+	if (content_size == ZSTD_CONTENTSIZE_ERROR ||
+	    content_size == ZSTD_CONTENTSIZE_UNKNOWN) {
+		*error_r = "Invalid zstd frame header";
+		return -1;
+	}
+	if (content_size > MAIL_CACHE_COMPRESS_FIELD_MAX_SIZE) {
+		*error_r = t_strdup_printf("Decompressed size too large (%llu)",
+					   content_size);
+		return -1;
+	}
+
+	void *output = buffer_get_space_unsafe(dest, 0, content_size);
+	size_t ret = ZSTD_decompress_usingDDict(compress->dctx,
+						output, content_size,
+						data, size, compress->ddict);
+	if (ZSTD_isError(ret)) {
+		buffer_set_used_size(dest, 0);
+		*error_r = ZSTD_getErrorName(ret);
+		return -1;
+	}
+	buffer_set_used_size(dest, ret);
+	return 0;
+}
+
+#else
+
+bool mail_cache_compress_supported(void)
+{
+	return FALSE;
+}
+
+bool mail_cache_compress_train(const void *samples ATTR_UNUSED,
+			       const size_t *sample_sizes ATTR_UNUSED,
+			       unsigned int samples_count ATTR_UNUSED,
+			       buffer_t *dict ATTR_UNUSED, const char **error_r)
+{
+	*error_r = "Not built with zstd support";
+	return FALSE;
+}
+
+struct mail_cache_compress *
+mail_cache_compress_init(const void *dict ATTR_UNUSED,
+			 size_t dict_size ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+void mail_cache_compress_deinit(struct mail_cache_compress **_compress)
+{
+	i_assert(*_compress == NULL);
+}
+
+size_t
+mail_cache_compress_dict_size(const struct mail_cache_compress *compress ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+bool mail_cache_compress(struct mail_cache_compress *compress ATTR_UNUSED,
+			 const void *data ATTR_UNUSED, size_t size ATTR_UNUSED,
+			 buffer_t *dest ATTR_UNUSED)
+{
+	i_unreached();
+}
+
+int mail_cache_decompress(struct mail_cache_compress *compress ATTR_UNUSED,
+			  const void *data ATTR_UNUSED, size_t size ATTR_UNUSED,
+			  buffer_t *dest ATTR_UNUSED, const char **error_r)
+{
+	*error_r = "Not built with zstd support";
+	return -1;
+}
+
+#endif
+
+int mail_cache_compress_open(struct mail_cache *cache)
+{
+	const struct mail_cache_compress_header *chdr;
+	const void *data;
+	uint32_t dict_size;
+	int ret;
+
+	i_assert(!MAIL_CACHE_IS_UNUSABLE(cache));
+
+	if (cache->compress != NULL) {
+		if (cache->compress_file_seq == cache->hdr->file_seq)
+			return 0;
+		mail_cache_compress_deinit(&cache->compress);
+	}
+	if (cache->hdr->major_version != MAIL_CACHE_MAJOR_VERSION_COMPRESSED) {
+		mail_cache_set_corrupted(cache,
+			"Compressed field in uncompressed cache file");
+		return -1;
+	}
+
+	ret = mail_cache_map(cache, sizeof(struct mail_cache_header),
+			     sizeof(*chdr), &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"Compression header points outside file");
+		}
+		return -1;
+	}
+	chdr = data;
+	dict_size = chdr->dict_size;
+	if (dict_size > MAIL_CACHE_COMPRESS_DICT_MAX_SIZE) {
+		mail_cache_set_corrupted(cache,
+			"Compression dictionary too large (%u)", dict_size);
+		return -1;
+	}
+
+	ret = mail_cache_map(cache, sizeof(struct mail_cache_header) +
+			     sizeof(*chdr), dict_size, &data);
+	if (ret <= 0) {
+		if (ret == 0) {
+			mail_cache_set_corrupted(cache,
+				"Compression dictionary points outside file");
+		}
+		return -1;
+	}
+	cache->compress = mail_cache_compress_init(data, dict_size);
+	cache->compress_file_seq = cache->hdr->file_seq;
+	return 0;
+}
@@ -4,10 +4,15 @@
 #include "array.h"
 #include "buffer.h"
 #include "str.h"
+#include "sort.h"
+#include "mmap-util.h"
 #include "mail-cache-private.h"
 
 
 #define CACHE_PREFETCH IO_BLOCK_SIZE
+/* Records closer than this to each other are prefetched with a single
+   request. Reading a small gap is cheaper than an extra seek. */
+#define CACHE_PREFETCH_MERGE_GAP (64*1024)
 
 int mail_cache_get_record(struct mail_cache *cache, uint32_t offset,
 			  const struct mail_cache_record **rec_r)
@@ -111,6 +116,75 @@ mail_cache_lookup_offset(struct mail_cache *cache, struct mail_index_view *view,
 	return 1;
 }
 
+static void
+mail_cache_prefetch_range(struct mail_cache *cache, uoff_t start, uoff_t end)
+{
+	if (cache->mmap_base != NULL && end <= cache->mmap_length) {
+		size_t page_size = mmap_get_page_size();
+
+		start -= start % page_size;
+		(void)posix_madvise(PTR_OFFSET(cache->mmap_base, start),
+				    end - start, POSIX_MADV_WILLNEED);
+		return;
+	}
+/* HAVE_POSIX_FADVISE alone isn't enough for CentOS 4.9 */
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+	if (cache->fd != -1) {
+		(void)posix_fadvise(cache->fd, start, end - start,
+				    POSIX_FADV_WILLNEED);
+	}
+#endif
+}
+
+unsigned int mail_cache_prefetch(struct mail_cache_view *view,
+				 uint32_t seq1, uint32_t seq2)
+{
+	struct mail_cache *cache = view->cache;
+	ARRAY(uint32_t) offsets;
+	const uint32_t *offsetp;
+	uint32_t seq, offset, reset_id;
+	uoff_t start = 0, end = 0;
+	unsigned int count = 0;
+
+	if (!cache->opened)
+		(void)mail_cache_open_and_verify(cache);
+	if (MAIL_CACHE_IS_UNUSABLE(cache) || cache->fd == -1)
+		return 0;
+
+	/* Resolve the record offsets for the whole range first. Continued
+	   records aren't followed, because that would mean reading the
+	   records themselves. After purging there are none. */
+	i_array_init(&offsets, I_MIN(seq2 - seq1 + 1, 1024));
+	for (seq = seq1; seq <= seq2; seq++) {
+		offset = mail_cache_lookup_cur_offset(view->view, seq,
+						      &reset_id);
+		if (offset != 0 && reset_id == cache->hdr->file_seq)
+			array_push_back(&offsets, &offset);
+	}
+	/* Usually the offsets are already mostly in order, since records
+	   are appended and purging writes them in sequence order. */
+	array_sort(&offsets, uint32_cmp);
+
+	array_foreach(&offsets, offsetp) {
+		if (end != 0 && *offsetp <= end + CACHE_PREFETCH_MERGE_GAP) {
+			end = I_MAX(end, *offsetp + CACHE_PREFETCH);
+			continue;
+		}
+		if (end != 0) {
+			mail_cache_prefetch_range(cache, start, end);
+			count++;
+		}
+		start = *offsetp;
+		end = start + CACHE_PREFETCH;
+	}
+	if (end != 0) {
+		mail_cache_prefetch_range(cache, start, end);
+		count++;
+	}
+	array_free(&offsets);
+	return count;
+}
+
 bool mail_cache_track_loops(struct mail_cache_loop_track *loop_track,
 			    uoff_t offset, uoff_t size)
 {
@@ -273,12 +347,52 @@ mail_cache_lookup_rec_get_field(struct mail_cache_lookup_iterate_ctx *ctx,
 	return 0;
 }
 
+int mail_cache_lookup_iter_decompress(struct mail_cache_lookup_iterate_ctx *ctx,
+				      struct mail_cache_iterate_field *field)
+{
+	struct mail_cache_view *view = ctx->view;
+	struct mail_cache *cache = view->cache;
+	const char *error;
+
+	if (!field->compressed)
+		return 0;
+	i_assert(ctx->remap_counter == cache->remap_counter);
+
+	if (cache->compress == NULL ||
+	    cache->compress_file_seq != cache->hdr->file_seq) {
+		if (mail_cache_compress_open(cache) < 0)
+			return -1;
+		/* reading the dictionary might have re-mmaped the file and
+		   caused rec pointer to break. need to get it again. */
+		if (mail_cache_get_record(cache, ctx->offset, &ctx->rec) < 0)
+			return -1;
+		ctx->remap_counter = cache->remap_counter;
+		field->data = CONST_PTR_OFFSET(ctx->rec,
+					       field->offset - ctx->offset);
+	}
+
+	if (view->decompress_buf == NULL)
+		view->decompress_buf = buffer_create_dynamic(default_pool, 1024);
+	buffer_set_used_size(view->decompress_buf, 0);
+	if (mail_cache_decompress(cache->compress, field->data, field->size,
+				  view->decompress_buf, &error) < 0) {
+		mail_cache_set_corrupted(cache,
+			"Failed to decompress field: %s", error);
+		return -1;
+	}
+	field->data = view->decompress_buf->data;
+	field->size = view->decompress_buf->used;
+	field->compressed = FALSE;
+	return 0;
+}
+
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r)
 {
 	struct mail_cache *cache = ctx->view->cache;
 	unsigned int field_idx;
 	unsigned int data_size;
+	bool compressed = FALSE;
 	int ret;
 
 	i_assert(ctx->remap_counter == cache->remap_counter);
@@ -306,6 +420,11 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 		data_size = *((const uint32_t *)
 			      CONST_PTR_OFFSET(ctx->rec, ctx->pos));
 		ctx->pos += sizeof(uint32_t);
+		if ((data_size & MAIL_CACHE_FIELD_SIZE_COMPRESSED) != 0 &&
+		    !ctx->inmemory_field_idx) {
+			data_size &= ~MAIL_CACHE_FIELD_SIZE_COMPRESSED;
+			compressed = TRUE;
+		}
 	}
 
 	if (ctx->rec->size - ctx->pos < data_size) {
@@ -318,6 +437,7 @@ int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 	field_r->data = CONST_PTR_OFFSET(ctx->rec, ctx->pos);
 	field_r->size = data_size;
 	field_r->offset = ctx->offset + ctx->pos;
+	field_r->compressed = compressed;
 
 	/* each record begins from 32bit aligned position */
 	ctx->pos += (data_size + sizeof(uint32_t)-1) & ~(sizeof(uint32_t)-1);
@@ -435,6 +555,11 @@ int mail_cache_lookup_field(struct mail_cache_view *view, buffer_t *dest_buf,
 		   they're all identical. */
 		while ((ret = mail_cache_lookup_iter_next(&iter, &field)) > 0) {
 			if (field.field_idx == field_idx) {
+				if (mail_cache_lookup_iter_decompress(&iter,
+								      &field) < 0) {
+					ret = -1;
+					break;
+				}
 				buffer_append(dest_buf, field.data, field.size);
 				break;
 			}
@@ -556,6 +681,8 @@ mail_cache_lookup_headers_real(struct mail_cache_view *view, string_t *dest,
 		    field_state[field.field_idx] != HDR_FIELD_STATE_WANT) {
 			/* a) don't want it, b) duplicate */
 		} else {
+			if (mail_cache_lookup_iter_decompress(&iter, &field) < 0)
+				return -1;
 			field_state[field.field_idx] = HDR_FIELD_STATE_SEEN;
 			header_lines_save(&ctx, &field);
 		}
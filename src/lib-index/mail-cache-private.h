@@ -7,6 +7,19 @@
 
 #define MAIL_CACHE_MAJOR_VERSION 1
 #define MAIL_CACHE_MINOR_VERSION 1
+/* Cache files containing compressed fields use a different major version,
+   so that older versions don't try to read them. The mail_cache_header is
+   followed by mail_cache_compress_header and the dictionary. */
+#define MAIL_CACHE_MAJOR_VERSION_COMPRESSED 2
+
+/* Variable sized fields have this bit set in their size if the data is
+   compressed. The size is the compressed size. */
+#define MAIL_CACHE_FIELD_SIZE_COMPRESSED 0x80000000U
+/* Maximum size of the compression dictionary */
+#define MAIL_CACHE_COMPRESS_DICT_MAX_SIZE (32*1024)
+/* Only fields within these sizes are compressed */
+#define MAIL_CACHE_COMPRESS_FIELD_MIN_SIZE 32
+#define MAIL_CACHE_COMPRESS_FIELD_MAX_SIZE (1024*1024)
 
 #define MAIL_CACHE_LOCK_TIMEOUT 10
 #define MAIL_CACHE_LOCK_CHANGE_TIMEOUT 300
@@ -58,6 +71,12 @@ struct mail_cache_header {
 	uint32_t field_header_offset;
 };
 
+struct mail_cache_compress_header {
+	/* Size of the zstd dictionary following this header. The first
+	   record begins after it at a 32bit aligned offset. */
+	uint32_t dict_size;
+};
+
 struct mail_cache_header_fields {
 	/* Offset to the updated version of this header. Use
 	   mail_index_offset_to_uint32() to decode it. */
@@ -169,6 +188,11 @@ struct mail_cache {
 	   pointers. */
 	uint32_t last_field_header_offset;
 
+	/* Decompression dictionary for the file with compress_file_seq.
+	   Loaded when the first compressed field is looked up. */
+	struct mail_cache_compress *compress;
+	uint32_t compress_file_seq;
+
 	/* Memory pool used for permanent field allocations. Currently this
 	   means mail_cache_field.name and field_name_hash. */
 	pool_t field_pool;
@@ -266,6 +290,10 @@ struct mail_cache_view {
 	uint8_t cached_exists_value;
 	uint32_t cached_exists_seq;
 
+	/* Decompressed data of the field last given to
+	   mail_cache_lookup_iter_decompress() */
+	buffer_t *decompress_buf;
+
 	/* mail_cache_view_update_cache_decisions() has been used to disable
 	   updating cache decisions. */
 	bool no_decision_updates:1;
@@ -277,10 +305,15 @@ struct mail_cache_iterate_field {
 	unsigned int field_idx;
 	/* Size of data */
 	unsigned int size;
-	/* Cache field content in the field type-specific format */
+	/* Cache field content in the field type-specific format. If
+	   compressed is TRUE, this is the compressed data and
+	   mail_cache_lookup_iter_decompress() must be called before
+	   accessing it. */
 	const void *data;
 	/* Offset to data in cache file */
 	uoff_t offset;
+	/* data is compressed */
+	bool compressed;
 };
 
 struct mail_cache_lookup_iterate_ctx {
@@ -368,6 +401,13 @@ void mail_cache_lookup_iter_init(struct mail_cache_view *view, uint32_t seq,
    Note that this may trigger re-reading and reallocating cache fields. */
 int mail_cache_lookup_iter_next(struct mail_cache_lookup_iterate_ctx *ctx,
 				struct mail_cache_iterate_field *field_r);
+/* Decompress the field returned by the last mail_cache_lookup_iter_next()
+   call, if it's compressed. This is done only when the field's data is
+   actually needed, since most of the iterated fields are skipped. The
+   decompressed data is valid until the next call. Returns 0 if ok, -1 if
+   error. */
+int mail_cache_lookup_iter_decompress(struct mail_cache_lookup_iterate_ctx *ctx,
+				      struct mail_cache_iterate_field *field);
 const struct mail_cache_record *
 mail_cache_transaction_lookup_rec(struct mail_cache_transaction_ctx *ctx,
 				  unsigned int seq,
@@ -419,6 +459,30 @@ mail_cache_purge_drop_test(struct mail_cache_purge_drop_ctx *ctx,
 int mail_cache_expunge_handler(struct mail_index_sync_map_ctx *sync_ctx,
 			       const void *data, void **sync_context);
 
+/* Returns TRUE if the cache can be compressed (zstd support is built in). */
+bool mail_cache_compress_supported(void);
+/* Train a compression dictionary from the samples into dict. Returns FALSE
+   if it couldn't be done, e.g. because there weren't enough samples. */
+bool mail_cache_compress_train(const void *samples, const size_t *sample_sizes,
+			       unsigned int samples_count, buffer_t *dict,
+			       const char **error_r);
+struct mail_cache_compress *
+mail_cache_compress_init(const void *dict, size_t dict_size);
+void mail_cache_compress_deinit(struct mail_cache_compress **compress);
+size_t mail_cache_compress_dict_size(const struct mail_cache_compress *compress);
+/* Compress data into dest. Returns FALSE if the compressed data wouldn't
+   be smaller. */
+bool mail_cache_compress(struct mail_cache_compress *compress,
+			 const void *data, size_t size, buffer_t *dest);
+/* Decompress data into dest. Returns 0 if ok, -1 if the data is broken. */
+int mail_cache_decompress(struct mail_cache_compress *compress,
+			  const void *data, size_t size, buffer_t *dest,
+			  const char **error_r);
+/* Load the dictionary of the current cache file to cache->compress.
+   Returns 0 if ok, -1 if the cache is corrupted or I/O error. Note that this
+   may remap the cache file. */
+int mail_cache_compress_open(struct mail_cache *cache);
+
 void mail_cache_set_syscall_error(struct mail_cache *cache,
 				  const char *function) ATTR_COLD;
 
@@ -13,6 +13,14 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+/* The compression dictionary is trained from the fields of this many
+   messages, spread evenly across the mailbox */
+#define MAIL_CACHE_COMPRESS_SAMPLE_MESSAGES 1000
+#define MAIL_CACHE_COMPRESS_SAMPLES_MAX_SIZE (1024*1024)
+/* Don't bother compressing small cache files. The dictionary alone could
+   be larger than the savings. */
+#define MAIL_CACHE_COMPRESS_SAMPLES_MIN_SIZE (MAIL_CACHE_COMPRESS_DICT_MAX_SIZE*8)
+
 struct mail_cache_copy_context {
 	struct mail_cache *cache;
 	struct event *event;
@@ -22,6 +30,11 @@ struct mail_cache_copy_context {
 	ARRAY(unsigned int) bitmask_pos;
 	uint32_t *field_file_map;
 
+	/* Non-NULL if the new file has compressed fields */
+	struct mail_cache_compress *compress;
+	buffer_t *compress_buf;
+	unsigned int compressed_fields_count;
+
 	uint8_t field_seen_value;
 	bool new_msg;
 };
@@ -44,12 +57,51 @@ mail_cache_merge_bitmask(struct mail_cache_copy_context *ctx,
 		dest[i] |= ((const unsigned char*)field->data)[i];
 }
 
+static bool
+mail_cache_purge_want_field(struct mail_cache_copy_context *ctx,
+			    unsigned int field_idx)
+{
+	enum mail_cache_decision_type dec =
+		ctx->cache->fields[field_idx].field.decision &
+		ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED);
+
+	if (ctx->new_msg)
+		return dec != MAIL_CACHE_DECISION_NO;
+	else
+		return dec == MAIL_CACHE_DECISION_YES;
+}
+
+static bool
+mail_cache_purge_compress_field(struct mail_cache_copy_context *ctx,
+				const struct mail_cache_iterate_field *field)
+{
+	uint32_t size32;
+
+	if (ctx->compress == NULL ||
+	    field->size < MAIL_CACHE_COMPRESS_FIELD_MIN_SIZE ||
+	    field->size > MAIL_CACHE_COMPRESS_FIELD_MAX_SIZE)
+		return FALSE;
+
+	buffer_set_used_size(ctx->compress_buf, 0);
+	if (!mail_cache_compress(ctx->compress, field->data, field->size,
+				 ctx->compress_buf))
+		return FALSE;
+
+	size32 = ctx->compress_buf->used | MAIL_CACHE_FIELD_SIZE_COMPRESSED;
+	buffer_append(ctx->buffer, &size32, sizeof(size32));
+	buffer_append_buf(ctx->buffer, ctx->compress_buf, 0, SIZE_MAX);
+	if ((ctx->compress_buf->used & 3) != 0)
+		buffer_append_zero(ctx->buffer, 4 - (ctx->compress_buf->used & 3));
+	ctx->compressed_fields_count++;
+	return TRUE;
+}
+
 static void
 mail_cache_purge_field(struct mail_cache_copy_context *ctx,
-		       const struct mail_cache_iterate_field *field)
+		       struct mail_cache_lookup_iterate_ctx *iter,
+		       struct mail_cache_iterate_field *field)
 {
         struct mail_cache_field *cache_field;
-	enum mail_cache_decision_type dec;
 	uint32_t file_field_idx, size32;
 	uint8_t *field_seen;
 
@@ -69,18 +121,18 @@ mail_cache_purge_field(struct mail_cache_copy_context *ctx,
 	}
 	*field_seen = ctx->field_seen_value;
 
-	dec = cache_field->decision & ENUM_NEGATE(MAIL_CACHE_DECISION_FORCED);
-	if (ctx->new_msg) {
-		if (dec == MAIL_CACHE_DECISION_NO)
-			return;
-	} else {
-		if (dec != MAIL_CACHE_DECISION_YES)
-			return;
+	if (!mail_cache_purge_want_field(ctx, field->field_idx))
+		return;
+	if (mail_cache_lookup_iter_decompress(iter, field) < 0) {
+		/* the cache was marked corrupted - drop the field */
+		return;
 	}
 
 	buffer_append(ctx->buffer, &file_field_idx, sizeof(file_field_idx));
 
 	if (cache_field->field_size == UINT_MAX) {
+		if (mail_cache_purge_compress_field(ctx, field))
+			return;
 		size32 = (uint32_t)field->size;
 		buffer_append(ctx->buffer, &size32, sizeof(size32));
 	}
@@ -198,6 +250,102 @@ mail_cache_purge_check_field(struct mail_cache_copy_context *ctx,
 	return priv->used;
 }
 
+static bool
+mail_cache_purge_train(struct mail_cache_copy_context *ctx,
+		       struct mail_cache_view *cache_view,
+		       struct mail_index_transaction *trans,
+		       uint32_t seq, uint32_t message_count,
+		       uint32_t first_new_seq, buffer_t *dict)
+{
+	struct mail_cache_lookup_iterate_ctx iter;
+	struct mail_cache_iterate_field field;
+	ARRAY(size_t) sample_sizes;
+	buffer_t *samples;
+	const char *error;
+	uint32_t step;
+	bool ret = FALSE;
+
+	if (seq > message_count)
+		return FALSE;
+	step = (message_count - seq) / MAIL_CACHE_COMPRESS_SAMPLE_MESSAGES + 1;
+
+	samples = buffer_create_dynamic(default_pool, 64*1024);
+	i_array_init(&sample_sizes, 256);
+	for (; seq <= message_count &&
+	       samples->used < MAIL_CACHE_COMPRESS_SAMPLES_MAX_SIZE;
+	     seq += step) {
+		if (mail_index_transaction_is_expunged(trans, seq))
+			continue;
+		ctx->new_msg = seq >= first_new_seq;
+
+		mail_cache_lookup_iter_init(cache_view, seq, &iter);
+		while (mail_cache_lookup_iter_next(&iter, &field) > 0) {
+			if (ctx->field_file_map[field.field_idx] == (uint32_t)-1 ||
+			    ctx->cache->fields[field.field_idx].field.field_size != UINT_MAX ||
+			    !mail_cache_purge_want_field(ctx, field.field_idx) ||
+			    mail_cache_lookup_iter_decompress(&iter, &field) < 0 ||
+			    field.size < MAIL_CACHE_COMPRESS_FIELD_MIN_SIZE ||
+			    field.size > MAIL_CACHE_COMPRESS_FIELD_MAX_SIZE)
+				continue;
+
+			size_t size = field.size;
+			buffer_append(samples, field.data, field.size);
+			array_push_back(&sample_sizes, &size);
+		}
+	}
+
+	if (samples->used < MAIL_CACHE_COMPRESS_SAMPLES_MIN_SIZE) {
+		/* too little data */
+	} else if (!mail_cache_compress_train(samples->data,
+					      array_front(&sample_sizes),
+					      array_count(&sample_sizes),
+					      dict, &error)) {
+		e_debug(ctx->event, "Failed to train compression dictionary "
+			"from %u samples: %s", array_count(&sample_sizes),
+			error);
+	} else {
+		e_debug(ctx->event, "Trained compression dictionary "
+			"(%zu bytes) from %u samples (%zu bytes)", dict->used,
+			array_count(&sample_sizes), samples->used);
+		ret = TRUE;
+	}
+	array_free(&sample_sizes);
+	buffer_free(&samples);
+	return ret;
+}
+
+static void
+mail_cache_purge_compress_init(struct mail_cache_copy_context *ctx,
+			       struct mail_cache_view *cache_view,
+			       struct mail_index_transaction *trans,
+			       uint32_t seq, uint32_t message_count,
+			       uint32_t first_new_seq, struct ostream *output,
+			       struct mail_cache_header *hdr)
+{
+	static const unsigned char pad[3] = { 0, 0, 0 };
+	struct mail_cache_compress_header chdr;
+	buffer_t *dict;
+
+	dict = buffer_create_dynamic(default_pool,
+				     MAIL_CACHE_COMPRESS_DICT_MAX_SIZE);
+	if (mail_cache_purge_train(ctx, cache_view, trans, seq, message_count,
+				   first_new_seq, dict)) {
+		i_zero(&chdr);
+		chdr.dict_size = dict->used;
+		o_stream_nsend(output, &chdr, sizeof(chdr));
+		o_stream_nsend(output, dict->data, dict->used);
+		if ((dict->used & 3) != 0)
+			o_stream_nsend(output, pad, 4 - (dict->used & 3));
+
+		hdr->major_version = MAIL_CACHE_MAJOR_VERSION_COMPRESSED;
+		ctx->compress = mail_cache_compress_init(dict->data,
+							 dict->used);
+		ctx->compress_buf = buffer_create_dynamic(default_pool, 1024);
+		event_add_int(ctx->event, "compress_dict_size", dict->used);
+	}
+	buffer_free(&dict);
+}
+
 static int
 mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		struct event *event, int fd, const char *reason,
@@ -282,6 +430,13 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 		seq = trans->first_new_seq;
 	}
 
+	if (cache->index->optimization_set.cache.compress &&
+	    mail_cache_compress_supported()) {
+		mail_cache_purge_compress_init(&ctx, cache_view, trans, seq,
+					       message_count, first_new_seq,
+					       output, &hdr);
+	}
+
 	*ext_first_seq_r = seq;
 	i_array_init(ext_offsets, message_count); record_count = 0;
 	for (; seq <= message_count; seq++) {
@@ -306,7 +461,7 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 
 		mail_cache_lookup_iter_init(cache_view, seq, &iter);
 		while (mail_cache_lookup_iter_next(&iter, &field) > 0)
-			mail_cache_purge_field(&ctx, &field);
+			mail_cache_purge_field(&ctx, &iter, &field);
 
 		if (ctx.buffer->used == sizeof(cache_rec) ||
 		    ctx.buffer->used > cache->index->optimization_set.cache.record_max_size) {
@@ -336,6 +491,12 @@ mail_cache_copy(struct mail_cache *cache, struct mail_index_transaction *trans,
 	}
 
 	hdr.backwards_compat_used_file_size = output->offset;
+	if (ctx.compress != NULL) {
+		event_add_int(event, "compressed_fields",
+			      ctx.compressed_fields_count);
+		mail_cache_compress_deinit(&ctx.compress);
+		buffer_free(&ctx.compress_buf);
+	}
 	buffer_free(&ctx.buffer);
 	buffer_free(&ctx.field_seen);
 
@@ -283,7 +283,9 @@ static bool mail_cache_verify_header(struct mail_cache *cache,
 		return FALSE;
 	}
 
-	if (hdr->major_version != MAIL_CACHE_MAJOR_VERSION) {
+	if (hdr->major_version != MAIL_CACHE_MAJOR_VERSION &&
+	    (hdr->major_version != MAIL_CACHE_MAJOR_VERSION_COMPRESSED ||
+	     !mail_cache_compress_supported())) {
 		/* version changed - upgrade silently */
 		mail_cache_set_corrupted(cache, "Unsupported major version (%u)",
 					 hdr->major_version);
@@ -620,6 +622,7 @@ void mail_cache_free(struct mail_cache **_cache)
 
 	mail_index_unregister_expunge_handler(cache->index, cache->ext_id);
 	mail_cache_file_close(cache);
+	mail_cache_compress_deinit(&cache->compress);
 
 	buffer_free(&cache->read_buf);
 	hash_table_destroy(&cache->field_name_hash);
@@ -977,6 +980,7 @@ void mail_cache_view_close(struct mail_cache_view **_view)
 
 	DLLIST_REMOVE(&view->cache->views, view);
 	buffer_free(&view->cached_exists_buf);
+	buffer_free(&view->decompress_buf);
 	i_free(view);
 }
 
@@ -184,6 +184,14 @@ int mail_cache_lookup_headers(struct mail_cache_view *view, string_t *dest,
 			      uint32_t seq, const unsigned int field_idxs[],
 			      unsigned int fields_count);
 
+/* Tell the kernel that the cache records of messages seq1..seq2 are going to
+   be looked up soon. The record offsets are resolved and sorted first, and
+   nearby records are merged into larger requests, so the file is read ahead
+   in file order instead of page faulting randomly one record at a time.
+   Returns the number of readahead requests issued. */
+unsigned int mail_cache_prefetch(struct mail_cache_view *view,
+				 uint32_t seq1, uint32_t seq2);
+
 /* "Error in index cache file %s: ...". */
 void mail_cache_set_corrupted(struct mail_cache *cache, const char *fmt, ...)
 	ATTR_FORMAT(2, 3) ATTR_COLD;
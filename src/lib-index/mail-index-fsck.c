@@ -332,6 +332,9 @@ mail_index_fsck_records(struct mail_index *index, struct mail_index_map *map,
 	bool logged_unordered_uids = FALSE, logged_zero_uids = FALSE;
 	bool records_dropped = FALSE;
 
+	/* records may be dropped below */
+	mail_index_record_map_columns_free(map->rec_map);
+
 	hdr->messages_count = 0;
 	hdr->seen_messages_count = 0;
 	hdr->deleted_messages_count = 0;
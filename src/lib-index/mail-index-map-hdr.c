@@ -264,6 +264,8 @@ static void mail_index_map_clear_recent_flags(struct mail_index_map *map)
 	for (seq = 1; seq <= map->hdr.messages_count; seq++) {
 		rec = MAIL_INDEX_REC_AT_SEQ(map, seq);
 		rec->flags &= ENUM_NEGATE(MAIL_RECENT);
+		mail_index_record_map_columns_set_flags(map->rec_map, seq,
+							rec->flags);
 	}
 }
 
@@ -11,6 +11,14 @@
 #include "mail-index-modseq.h"
 #include "ioloop.h"
 
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* Sparse maps reserve address space for this many % of the file size to be
+   appended before the map needs to be moved to memory. */
+#define MAIL_INDEX_SPARSE_MAP_RESERVE_PERCENTAGE 25
+
 static void mail_index_map_copy_hdr(struct mail_index_map *map,
 				    const struct mail_index_header *hdr)
 {
@@ -28,6 +36,46 @@ static void mail_index_map_copy_hdr(struct mail_index_map *map,
 	map->hdr.unused_old_recent_messages_count = 0;
 }
 
+static void *
+mail_index_mmap_sparse(struct mail_index *index, size_t file_size,
+		       size_t *reserved_size_r)
+{
+#ifdef MAP_ANONYMOUS
+	size_t page_size = mmap_get_page_size();
+	size_t mapped_size, reserved_size;
+	void *base;
+
+	/* Reserve the address space for the whole map first with anonymous
+	   memory and then map the file over its beginning. The reserved pages
+	   after the file are allocated only when records are appended. */
+	mapped_size = (file_size + page_size - 1) / page_size * page_size;
+	reserved_size = mapped_size - file_size +
+		(file_size / 100 * MAIL_INDEX_SPARSE_MAP_RESERVE_PERCENTAGE +
+		 page_size - 1) / page_size * page_size;
+	if (reserved_size > SSIZE_T_MAX - file_size)
+		reserved_size = 0;
+
+	base = mmap(NULL, file_size + reserved_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED)
+		return MAP_FAILED;
+	if (mmap(base, file_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_FIXED, index->fd, 0) == MAP_FAILED) {
+		int old_errno = errno;
+		if (munmap(base, file_size + reserved_size) < 0)
+			mail_index_set_syscall_error(index, "munmap()");
+		errno = old_errno;
+		return MAP_FAILED;
+	}
+	*reserved_size_r = reserved_size;
+	return base;
+#else
+	*reserved_size_r = 0;
+	return mmap(NULL, file_size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE, index->fd, 0);
+#endif
+}
+
 static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 {
 	struct mail_index *index = map->index;
@@ -45,10 +93,20 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 		return -1;
 	}
 
-	rec_map->mmap_base = mmap(NULL, file_size, PROT_READ | PROT_WRITE,
-				  MAP_PRIVATE, index->fd, 0);
+	if (index->optimization_set.index.shared_map ||
+	    (index->optimization_set.index.sparse_map_min_size != 0 &&
+	     file_size >= index->optimization_set.index.sparse_map_min_size)) {
+		rec_map->mmap_base =
+			mail_index_mmap_sparse(index, file_size,
+					       &rec_map->mmap_reserved_size);
+	} else {
+		rec_map->mmap_base = mmap(NULL, file_size,
+					  PROT_READ | PROT_WRITE,
+					  MAP_PRIVATE, index->fd, 0);
+	}
 	if (rec_map->mmap_base == MAP_FAILED) {
 		rec_map->mmap_base = NULL;
+		rec_map->mmap_reserved_size = 0;
 		if (ioloop_time != index->last_mmap_error_time) {
 			index->last_mmap_error_time = ioloop_time;
 			mail_index_set_syscall_error(index, t_strdup_printf(
@@ -104,6 +162,7 @@ static int mail_index_mmap(struct mail_index_map *map, uoff_t file_size)
 	buffer_append(map->hdr_copy_buf, rec_map->mmap_base, hdr->header_size);
 
 	rec_map->records = PTR_OFFSET(rec_map->mmap_base, map->hdr.header_size);
+	mail_index_record_map_columns_free(rec_map);
 	return 1;
 }
 
@@ -246,6 +305,7 @@ mail_index_try_read_map(struct mail_index_map *map,
 	map->rec_map->records =
 		buffer_get_modifiable_data(map->rec_map->buffer, NULL);
 	map->rec_map->records_count = records_count;
+	mail_index_record_map_columns_free(map->rec_map);
 
 	mail_index_map_copy_hdr(map, hdr);
 	i_assert(map->hdr_copy_buf->used == map->hdr.header_size);
@@ -473,6 +533,27 @@ mail_index_map_latest_sync(struct mail_index *index,
 	return ret;
 }
 
+static bool mail_index_map_want_reshare(struct mail_index *index)
+{
+	struct stat st1, st2;
+
+	if (!index->optimization_set.index.shared_map ||
+	    !MAIL_INDEX_MAP_IS_IN_MEMORY(index->map) ||
+	    (index->flags & MAIL_INDEX_OPEN_FLAG_MMAP_DISABLE) != 0 ||
+	    index->fd == -1)
+		return FALSE;
+
+	/* Our records were copied to memory. If another process has
+	   rewritten the index since then, it's going to be mmap()ed and the
+	   pages shared with the other processes. */
+	if (fstat(index->fd, &st1) < 0 ||
+	    nfs_safe_stat(index->filepath, &st2) < 0)
+		return FALSE;
+	if (st1.st_ino == st2.st_ino && CMP_DEV_T(st1.st_dev, st2.st_dev))
+		return FALSE;
+	return st2.st_size > MAIL_INDEX_MMAP_MIN_SIZE;
+}
+
 static int
 mail_index_map_real(struct mail_index *index,
 		    enum mail_index_sync_handler_type type)
@@ -495,6 +576,9 @@ mail_index_map_real(struct mail_index *index,
 		/* it's likely more efficient to reopen the index file than
 		   sync from the transaction log. */
 		ret = 0;
+	} else if (mail_index_map_want_reshare(index)) {
+		/* use the rewritten index instead of our private copy */
+		ret = 0;
 	} else {
 		/* sync the map from the transaction log. */
 		ret = mail_index_sync_map(&index->map, type, &reason);
@@ -274,10 +274,12 @@ static void mail_index_record_map_free(struct mail_index_map *map,
 		buffer_free(&rec_map->buffer);
 	} else if (rec_map->mmap_base != NULL) {
 		i_assert(rec_map->buffer == NULL);
-		if (munmap(rec_map->mmap_base, rec_map->mmap_size) < 0)
+		if (munmap(rec_map->mmap_base, rec_map->mmap_size +
+			   rec_map->mmap_reserved_size) < 0)
 			mail_index_set_syscall_error(map->index, "munmap()");
 		rec_map->mmap_base = NULL;
 	}
+	mail_index_record_map_columns_free(rec_map);
 	array_free(&rec_map->maps);
 	i_free(rec_map);
 }
@@ -328,6 +330,14 @@ static void mail_index_map_copy_records(struct mail_index_record_map *dest,
 
 	dest->records = buffer_get_modifiable_data(dest->buffer, NULL);
 	dest->records_count = src->records_count;
+
+	if (dest != src && array_is_created(&src->uid_column)) {
+		i_assert(!array_is_created(&dest->uid_column));
+		i_array_init(&dest->uid_column, src->records_count + 64);
+		i_array_init(&dest->flags_column, src->records_count + 64);
+		array_append_array(&dest->uid_column, &src->uid_column);
+		array_append_array(&dest->flags_column, &src->flags_column);
+	}
 }
 
 static void mail_index_map_copy_header(struct mail_index_map *dest,
@@ -445,11 +455,38 @@ void mail_index_record_map_move_to_private(struct mail_index_map *map)
 			rec = MAIL_INDEX_REC_AT_SEQ(map, new_map->records_count);
 			new_map->last_appended_uid = rec->uid;
 		}
-		buffer_set_used_size(new_map->buffer, new_map->records_count *
-				     map->hdr.record_size);
+		if (new_map->buffer != NULL) {
+			buffer_set_used_size(new_map->buffer,
+					     new_map->records_count *
+					     map->hdr.record_size);
+		} else {
+			/* sparse maps just leave the rest of the records
+			   unused */
+			new_map->mmap_used_size = map->hdr.header_size +
+				new_map->records_count * map->hdr.record_size;
+		}
+		if (array_is_created(&new_map->uid_column)) {
+			array_delete(&new_map->uid_column, new_map->records_count,
+				     array_count(&new_map->uid_column) -
+				     new_map->records_count);
+			array_delete(&new_map->flags_column, new_map->records_count,
+				     array_count(&new_map->flags_column) -
+				     new_map->records_count);
+		}
 	}
 }
 
+bool mail_index_map_sparse_can_append(struct mail_index_map *map)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+
+	if (!MAIL_INDEX_MAP_IS_SPARSE(map))
+		return FALSE;
+	return map->hdr.header_size +
+		(size_t)(rec_map->records_count + 1) * map->hdr.record_size <=
+		rec_map->mmap_size + rec_map->mmap_reserved_size;
+}
+
 void mail_index_map_move_to_memory(struct mail_index_map *map)
 {
 	struct mail_index_record_map *new_map;
@@ -476,9 +513,11 @@ void mail_index_map_move_to_memory(struct mail_index_map *map)
 		mail_index_record_map_unlink(map);
 		map->rec_map = new_map;
 	} else {
-		if (munmap(new_map->mmap_base, new_map->mmap_size) < 0)
+		if (munmap(new_map->mmap_base, new_map->mmap_size +
+			   new_map->mmap_reserved_size) < 0)
 			mail_index_set_syscall_error(map->index, "munmap()");
 		new_map->mmap_base = NULL;
+		new_map->mmap_reserved_size = 0;
 	}
 }
 
@@ -496,18 +535,122 @@ bool mail_index_map_get_ext_idx(struct mail_index_map *map,
 	return *idx_r != (uint32_t)-1;
 }
 
+static void
+mail_index_record_map_columns_build(struct mail_index_record_map *rec_map,
+				    unsigned int record_size)
+{
+	const struct mail_index_record *rec;
+	unsigned int i;
+
+	i_array_init(&rec_map->uid_column, rec_map->records_count + 64);
+	i_array_init(&rec_map->flags_column, rec_map->records_count + 64);
+	for (i = 0; i < rec_map->records_count; i++) {
+		rec = CONST_PTR_OFFSET(rec_map->records, i * record_size);
+		array_push_back(&rec_map->uid_column, &rec->uid);
+		array_push_back(&rec_map->flags_column, &rec->flags);
+	}
+}
+
+bool mail_index_map_get_columns(struct mail_index_map *map,
+				const uint32_t **uids_r,
+				const uint8_t **flags_r)
+{
+	struct mail_index_record_map *rec_map = map->rec_map;
+
+	if (!array_is_created(&rec_map->uid_column)) {
+		if (rec_map->records_count < MAIL_INDEX_MAP_COLUMNS_MIN_RECORDS ||
+		    rec_map->mmap_base != NULL) {
+			/* mmap()ed records may change without us noticing */
+			return FALSE;
+		}
+		mail_index_record_map_columns_build(rec_map,
+						    map->hdr.record_size);
+	}
+	i_assert(array_count(&rec_map->uid_column) == rec_map->records_count);
+	i_assert(array_count(&rec_map->flags_column) == rec_map->records_count);
+
+	*uids_r = array_front(&rec_map->uid_column);
+	*flags_r = array_front(&rec_map->flags_column);
+	return TRUE;
+}
+
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map)
+{
+	if (array_is_created(&rec_map->uid_column)) {
+		array_free(&rec_map->uid_column);
+		array_free(&rec_map->flags_column);
+	}
+}
+
+void mail_index_record_map_columns_append(struct mail_index_record_map *rec_map,
+					  const struct mail_index_record *rec)
+{
+	if (!array_is_created(&rec_map->uid_column))
+		return;
+
+	array_push_back(&rec_map->uid_column, &rec->uid);
+	array_push_back(&rec_map->flags_column, &rec->flags);
+	i_assert(array_count(&rec_map->uid_column) == rec_map->records_count);
+}
+
+void mail_index_record_map_columns_set_flags(struct mail_index_record_map *rec_map,
+					     uint32_t seq, uint8_t flags)
+{
+	if (array_is_created(&rec_map->flags_column))
+		array_idx_set(&rec_map->flags_column, seq - 1, &flags);
+}
+
+void mail_index_record_map_columns_expunge(struct mail_index_record_map *rec_map,
+					   const struct seq_range *range,
+					   unsigned int count)
+{
+	uint32_t *uids;
+	uint8_t *flags;
+	unsigned int i, src_count, src_idx, dest_idx, move_count;
+
+	if (!array_is_created(&rec_map->uid_column))
+		return;
+
+	uids = array_get_modifiable(&rec_map->uid_column, &src_count);
+	flags = array_front_modifiable(&rec_map->flags_column);
+	src_idx = dest_idx = 0;
+	for (i = 0; i <= count; i++) {
+		/* move the records between the expunged ranges */
+		move_count = (i < count ? range[i].seq1 - 1 : src_count) -
+			src_idx;
+		if (move_count > 0 && src_idx != dest_idx) {
+			memmove(uids + dest_idx, uids + src_idx,
+				move_count * sizeof(*uids));
+			memmove(flags + dest_idx, flags + src_idx,
+				move_count * sizeof(*flags));
+		}
+		dest_idx += move_count;
+		if (i < count)
+			src_idx = range[i].seq2;
+	}
+	array_delete(&rec_map->uid_column, dest_idx, src_count - dest_idx);
+	array_delete(&rec_map->flags_column, dest_idx, src_count - dest_idx);
+	i_assert(array_count(&rec_map->uid_column) == rec_map->records_count);
+}
+
+static inline uint32_t
+mail_index_map_uid_at_idx(const struct mail_index_map *map,
+			  const uint32_t *uid_column, uint32_t idx)
+{
+	if (uid_column != NULL)
+		return uid_column[idx];
+	return MAIL_INDEX_MAP_IDX(map, idx)->uid;
+}
+
 static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
+				       const uint32_t *uid_column,
 				       uint32_t uid, uint32_t left_idx,
 				       int nearest_side)
 {
-	const struct mail_index_record *rec_base, *rec;
-	uint32_t idx, right_idx, record_size;
+	uint32_t idx, right_idx, rec_uid;
 
 	i_assert(map->hdr.messages_count <= map->rec_map->records_count);
 
-	rec_base = map->rec_map->records;
-	record_size = map->hdr.record_size;
-
 	idx = left_idx;
 	right_idx = I_MIN(map->hdr.messages_count, uid);
 
@@ -515,25 +658,25 @@ static uint32_t mail_index_bsearch_uid(struct mail_index_map *map,
 	while (left_idx < right_idx) {
 		idx = (left_idx + right_idx) / 2;
 
-                rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
-		if (rec->uid < uid)
+		rec_uid = mail_index_map_uid_at_idx(map, uid_column, idx);
+		if (rec_uid < uid)
 			left_idx = idx+1;
-		else if (rec->uid > uid)
+		else if (rec_uid > uid)
 			right_idx = idx;
 		else
 			break;
 	}
 	i_assert(idx < map->hdr.messages_count);
 
-	rec = CONST_PTR_OFFSET(rec_base, idx * record_size);
-	if (rec->uid != uid) {
+	rec_uid = mail_index_map_uid_at_idx(map, uid_column, idx);
+	if (rec_uid != uid) {
 		if (nearest_side > 0) {
 			/* we want uid or larger */
-			return rec->uid > uid ? idx+1 :
+			return rec_uid > uid ? idx+1 :
 				(idx == map->hdr.messages_count-1 ? 0 : idx+2);
 		} else {
 			/* we want uid or smaller */
-			return rec->uid < uid ? idx + 1 : idx;
+			return rec_uid < uid ? idx + 1 : idx;
 		}
 	}
 
@@ -545,6 +688,9 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 				     uint32_t *first_seq_r,
 				     uint32_t *last_seq_r)
 {
+	const uint32_t *uid_column;
+	const uint8_t *flags_column;
+
 	i_assert(first_uid > 0);
 	i_assert(first_uid <= last_uid);
 
@@ -553,9 +699,15 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 		return;
 	}
 
-	*first_seq_r = mail_index_bsearch_uid(map, first_uid, 0, 1);
+	/* with large maps the binary search jumps around the records,
+	   so use the more cache friendly uid column when possible */
+	if (!mail_index_map_get_columns(map, &uid_column, &flags_column))
+		uid_column = NULL;
+
+	*first_seq_r = mail_index_bsearch_uid(map, uid_column, first_uid, 0, 1);
 	if (*first_seq_r == 0 ||
-	    MAIL_INDEX_REC_AT_SEQ(map, *first_seq_r)->uid > last_uid) {
+	    mail_index_map_uid_at_idx(map, uid_column,
+				      *first_seq_r - 1) > last_uid) {
 		*first_seq_r = *last_seq_r = 0;
 		return;
 	}
@@ -576,7 +728,7 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 		*last_seq_r = *first_seq_r;
 	else {
 		/* optimization - binary lookup only from right side: */
-		*last_seq_r = mail_index_bsearch_uid(map, last_uid,
+		*last_seq_r = mail_index_bsearch_uid(map, uid_column, last_uid,
 						     *first_seq_r - 1, -1);
 	}
 	i_assert(*last_seq_r >= *first_seq_r);
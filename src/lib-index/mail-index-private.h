@@ -22,12 +22,19 @@ struct mail_index_sync_map_ctx;
 /* Large extension header sizes are probably caused by file corruption, so
    try to catch them by limiting the header size. */
 #define MAIL_INDEX_EXT_HEADER_MAX_SIZE (1024*1024*16-1)
+/* Build the column-oriented copies of the records' uid and flags fields
+   only for maps with at least this many records. */
+#define MAIL_INDEX_MAP_COLUMNS_MIN_RECORDS 1024
 
 #define MAIL_INDEX_IS_IN_MEMORY(index) \
 	((index)->dir == NULL)
 
 #define MAIL_INDEX_MAP_IS_IN_MEMORY(map) \
 	((map)->rec_map->mmap_base == NULL)
+/* Sparse maps are mmap()ed with some address space reserved after the file
+   for appending new records. */
+#define MAIL_INDEX_MAP_IS_SPARSE(map) \
+	((map)->rec_map->mmap_reserved_size > 0)
 
 #define MAIL_INDEX_MAP_IDX(map, idx) \
 	((struct mail_index_record *) \
@@ -126,12 +133,23 @@ struct mail_index_record_map {
 
 	void *mmap_base;
 	size_t mmap_size, mmap_used_size;
+	/* Size of the anonymous memory reserved after mmap_size for sparse
+	   maps, or 0. The kernel allocates the pages only when written to,
+	   and modified pages of the file get copied one page at a time. */
+	size_t mmap_reserved_size;
 
 	buffer_t *buffer;
 
 	void *records; /* struct mail_index_record[] */
 	unsigned int records_count;
 
+	/* Column-oriented copies of the records' uid and flags fields, so
+	   scanning them doesn't need to touch the rest of the records. Built
+	   lazily by mail_index_map_get_columns() for in-memory maps and kept
+	   up to date while syncing. Not created when unavailable. */
+	ARRAY(uint32_t) uid_column;
+	ARRAY(uint8_t) flags_column;
+
 	uint32_t last_appended_uid;
 };
 
@@ -198,6 +216,9 @@ struct mail_index_error {
 };
 
 struct mail_index {
+	/* Linked list of all the indexes allocated by this process */
+	struct mail_index *prev, *next;
+
 	/* Directory path for the index, or NULL for in-memory indexes. */
 	char *dir;
 	/* Filename prefix for the index, e.g. "dovecot.index." */
@@ -367,6 +388,9 @@ void mail_index_unmap(struct mail_index_map **map);
 struct mail_index_map *mail_index_map_clone(const struct mail_index_map *map);
 /* Make sure the map has its own private rec_map, cloning it if necessary. */
 void mail_index_record_map_move_to_private(struct mail_index_map *map);
+/* Returns TRUE if a new record can be appended to the sparse map without
+   moving it to memory. */
+bool mail_index_map_sparse_can_append(struct mail_index_map *map);
 /* If map points to mmap()ed index, copy it to the memory. */
 void mail_index_map_move_to_memory(struct mail_index_map *map);
 
@@ -389,6 +413,28 @@ void mail_index_map_lookup_seq_range(struct mail_index_map *map,
 				     uint32_t *first_seq_r,
 				     uint32_t *last_seq_r);
 
+/* Get the column-oriented copies of the map's uid and flags fields, building
+   them if necessary. The arrays are indexed by seq-1 and they're valid until
+   the map is modified. Returns FALSE if the columns aren't available, because
+   the map is too small or it's mmap()ed. */
+bool mail_index_map_get_columns(struct mail_index_map *map,
+				const uint32_t **uids_r,
+				const uint8_t **flags_r);
+/* Free the columns. They'll be rebuilt the next time they're needed. This
+   needs to be called whenever the records are modified other than via the
+   functions below. */
+void mail_index_record_map_columns_free(struct mail_index_record_map *rec_map);
+/* Update the columns after a record was appended to the rec_map. */
+void mail_index_record_map_columns_append(struct mail_index_record_map *rec_map,
+					  const struct mail_index_record *rec);
+/* Update the columns after the record's flags were changed. */
+void mail_index_record_map_columns_set_flags(struct mail_index_record_map *rec_map,
+					     uint32_t seq, uint8_t flags);
+/* Update the columns after the given sequence ranges were expunged. */
+void mail_index_record_map_columns_expunge(struct mail_index_record_map *rec_map,
+					   const struct seq_range *range,
+					   unsigned int count);
+
 /* Returns TRUE if indexid is ok, FALSE if it has either unexpectedly changed,
    or it couldn't be determined easily whether it has changed permanently or
    temporarily. If FALSE is returned, the mailbox should be reopened. */
@@ -69,7 +69,7 @@ static void mail_index_sync_replace_map(struct mail_index_sync_map_ctx *ctx,
 }
 
 static struct mail_index_map *
-mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+mail_index_sync_get_private_map(struct mail_index_sync_map_ctx *ctx)
 {
 	struct mail_index_map *map = ctx->view->map;
 
@@ -80,6 +80,13 @@ mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
 		mail_index_sync_replace_map(ctx, map);
 		i_assert(ctx->view->map == map);
 	}
+	return map;
+}
+
+static struct mail_index_map *
+mail_index_sync_move_to_private_memory(struct mail_index_sync_map_ctx *ctx)
+{
+	struct mail_index_map *map = mail_index_sync_get_private_map(ctx);
 
 	if (!MAIL_INDEX_MAP_IS_IN_MEMORY(ctx->view->map)) {
 		/* map points to mmap()ed area, copy it into memory. */
@@ -99,6 +106,23 @@ mail_index_sync_get_atomic_map(struct mail_index_sync_map_ctx *ctx)
 	return ctx->view->map;
 }
 
+static struct mail_index_map *
+mail_index_sync_get_atomic_records(struct mail_index_sync_map_ctx *ctx)
+{
+	struct mail_index_map *map;
+
+	/* Sparse maps can be modified in place as long as the rec_map isn't
+	   shared with other maps. Only the modified pages get copied. */
+	if (MAIL_INDEX_MAP_IS_SPARSE(ctx->view->map)) {
+		map = mail_index_sync_get_private_map(ctx);
+		if (array_count(&map->rec_map->maps) == 1) {
+			mail_index_record_map_move_to_private(map);
+			return map;
+		}
+	}
+	return mail_index_sync_get_atomic_map(ctx);
+}
+
 static int
 mail_index_header_update_counts(struct mail_index_header *hdr,
 				uint8_t old_flags, uint8_t new_flags,
@@ -246,8 +270,8 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 	if (count == 0)
 		return;
 
-	/* Get a private in-memory rec_map, which we can modify. */
-	map = mail_index_sync_get_atomic_map(ctx);
+	/* Get a private rec_map, which we can modify. */
+	map = mail_index_sync_get_atomic_records(ctx);
 
 	/* call the expunge handlers first */
 	if (sync_expunge_handlers_init(ctx)) {
@@ -295,6 +319,12 @@ sync_expunge_range(struct mail_index_sync_map_ctx *ctx, const ARRAY_TYPE(seq_ran
 			MAIL_INDEX_REC_AT_SEQ(map, prev_seq2+1),
 			final_move_count * map->hdr.record_size);
 	}
+	if (map->rec_map->buffer == NULL) {
+		/* sparse map expunged in place */
+		map->rec_map->mmap_used_size = map->hdr.header_size +
+			map->rec_map->records_count * map->hdr.record_size;
+	}
+	mail_index_record_map_columns_expunge(map->rec_map, range, count);
 }
 
 static void *sync_append_record(struct mail_index_map *map)
@@ -303,6 +333,13 @@ static void *sync_append_record(struct mail_index_map *map)
 	void *ret;
 
 	append_pos = map->rec_map->records_count * map->hdr.record_size;
+	if (map->rec_map->buffer == NULL) {
+		/* sparse map - write to the space reserved after the file */
+		i_assert(mail_index_map_sparse_can_append(map));
+		map->rec_map->mmap_used_size = map->hdr.header_size +
+			append_pos + map->hdr.record_size;
+		return PTR_OFFSET(map->rec_map->records, append_pos);
+	}
 	ret = buffer_get_space_unsafe(map->rec_map->buffer, append_pos,
 				      map->hdr.record_size);
 	map->rec_map->records =
@@ -388,8 +425,12 @@ static int sync_append(const struct mail_index_record *rec,
 
 	/* We'll need to append a new record. If map currently points to
 	   mmap()ed index, it first needs to be moved to memory since we can't
-	   write past the mmap()ed memory area. */
-	map = mail_index_sync_move_to_private_memory(ctx);
+	   write past the mmap()ed memory area. Sparse maps have space
+	   reserved for it. */
+	if (mail_index_map_sparse_can_append(map))
+		map = mail_index_sync_get_private_map(ctx);
+	else
+		map = mail_index_sync_move_to_private_memory(ctx);
 
 	if (rec->uid <= map->rec_map->last_appended_uid) {
 		i_assert(map->hdr.messages_count < map->rec_map->records_count);
@@ -408,6 +449,7 @@ static int sync_append(const struct mail_index_record *rec,
 		       map->hdr.record_size - sizeof(*rec));
 		map->rec_map->records_count++;
 		map->rec_map->last_appended_uid = rec->uid;
+		mail_index_record_map_columns_append(map->rec_map, rec);
 		new_flags = rec->flags;
 
 		mail_index_modseq_update_to_highest(
@@ -453,6 +495,8 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 		for (seq = seq1; seq <= seq2; seq++) {
 			rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
+			mail_index_record_map_columns_set_flags(
+				view->map->rec_map, seq, rec->flags);
 		}
 	} else {
 		for (seq = seq1; seq <= seq2; seq++) {
@@ -460,6 +504,8 @@ static int sync_flag_update(const struct mail_transaction_flag_update *u,
 
 			old_flags = rec->flags;
 			rec->flags = (rec->flags & flag_mask) | u->add_flags;
+			mail_index_record_map_columns_set_flags(
+				view->map->rec_map, seq, rec->flags);
 
 			mail_index_header_update_lowwaters(ctx, rec->uid,
 							   rec->flags);
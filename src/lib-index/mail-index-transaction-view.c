@@ -259,6 +259,22 @@ static void tview_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static const uint8_t *
+tview_lookup_flags_column(struct mail_index_view *view, bool keywords)
+{
+	struct mail_index_view_transaction *tview =
+		(struct mail_index_view_transaction *)view;
+
+	/* the transaction's own changes aren't in the column */
+	if (tview->t->reset || tview->t->last_new_seq != 0 ||
+	    array_is_created(&tview->t->updates))
+		return NULL;
+	/* nor are its keyword changes in the records */
+	if (keywords && array_is_created(&tview->t->keyword_updates))
+		return NULL;
+	return tview->super->lookup_flags_column(view, keywords);
+}
+
 static void keyword_index_add(ARRAY_TYPE(keyword_indexes) *keywords,
 			      unsigned int idx)
 {
@@ -504,6 +520,7 @@ static struct mail_index_view_vfuncs trans_view_vfuncs = {
 	tview_lookup_uid,
 	tview_lookup_seq_range,
 	tview_lookup_first,
+	tview_lookup_flags_column,
 	tview_lookup_keywords,
 	tview_lookup_ext_full,
 	tview_get_header_ext,
@@ -26,6 +26,10 @@ struct mail_index_view_vfuncs {
 	void (*lookup_first)(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+	/* If keywords is TRUE, the caller also reads the keywords directly
+	   from the map's records. */
+	const uint8_t *(*lookup_flags_column)(struct mail_index_view *view,
+					      bool keywords);
 	void (*lookup_keywords)(struct mail_index_view *view, uint32_t seq,
 				ARRAY_TYPE(keyword_indexes) *keyword_idx);
 	void (*lookup_ext_full)(struct mail_index_view *view, uint32_t seq,
@@ -256,6 +256,8 @@ static void view_lookup_first(struct mail_index_view *view,
 	STMT_START { if ((x) > low_uid) low_uid = x; } STMT_END
 	const struct mail_index_header *hdr = &view->map->hdr;
 	const struct mail_index_record *rec;
+	const uint32_t *uid_column;
+	const uint8_t *flags_column;
 	uint32_t seq, seq2, low_uid = 1;
 
 	*seq_r = 0;
@@ -274,6 +276,16 @@ static void view_lookup_first(struct mail_index_view *view,
 	}
 
 	i_assert(hdr->messages_count <= view->map->rec_map->records_count);
+	if (mail_index_map_get_columns(view->map, &uid_column,
+				       &flags_column)) {
+		for (; seq <= hdr->messages_count; seq++) {
+			if ((flags_column[seq-1] & flags_mask) == (uint8_t)flags) {
+				*seq_r = seq;
+				break;
+			}
+		}
+		return;
+	}
 	for (; seq <= hdr->messages_count; seq++) {
 		rec = MAIL_INDEX_REC_AT_SEQ(view->map, seq);
 		if ((rec->flags & flags_mask) == (uint8_t)flags) {
@@ -283,6 +295,23 @@ static void view_lookup_first(struct mail_index_view *view,
 	}
 }
 
+static const uint8_t *
+view_lookup_flags_column(struct mail_index_view *view,
+			 bool keywords ATTR_UNUSED)
+{
+	const uint32_t *uid_column;
+	const uint8_t *flags_column;
+
+	if (view->map != view->index->map) {
+		/* the latest flags may be in the head map, see
+		   view_lookup_full() */
+		return NULL;
+	}
+	if (!mail_index_map_get_columns(view->map, &uid_column, &flags_column))
+		return NULL;
+	return flags_column;
+}
+
 static void
 mail_index_data_lookup_keywords(struct mail_index_map *map,
 				const unsigned char *data,
@@ -524,6 +553,182 @@ void mail_index_lookup_first(struct mail_index_view *view,
 	view->v.lookup_first(view, flags, flags_mask, seq_r);
 }
 
+const uint8_t *mail_index_lookup_flags_column(struct mail_index_view *view)
+{
+	return view->v.lookup_flags_column(view, FALSE);
+}
+
+static bool
+mail_index_keywords_filter_init(struct mail_index_map *map,
+				const ARRAY_TYPE(keyword_indexes) *keywords,
+				bool set, uint8_t *mask, uint8_t *bits,
+				uint16_t record_size)
+{
+	const unsigned int *keyword_idx_map, *kw_idx;
+	unsigned int i, count;
+
+	if (keywords == NULL)
+		return TRUE;
+
+	if (!array_is_created(&map->keyword_idx_map)) {
+		keyword_idx_map = NULL;
+		count = 0;
+	} else {
+		keyword_idx_map = array_get(&map->keyword_idx_map, &count);
+	}
+	array_foreach(keywords, kw_idx) {
+		/* keyword_idx_map[] contains file => index keyword mapping */
+		for (i = 0; i < count; i++) {
+			if (keyword_idx_map[i] == *kw_idx)
+				break;
+		}
+		if (i == count || i / CHAR_BIT >= record_size) {
+			/* no message has this keyword */
+			if (set)
+				return FALSE;
+			continue;
+		}
+		mask[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+		if (set)
+			bits[i / CHAR_BIT] |= 1 << (i % CHAR_BIT);
+	}
+	return TRUE;
+}
+
+static bool
+mail_index_keywords_filter_match(const uint8_t *data, const uint8_t *mask,
+				 const uint8_t *bits, uint16_t size)
+{
+	for (uint16_t i = 0; i < size; i++) {
+		if ((data[i] & mask[i]) != bits[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Returns TRUE if any byte in the word is zero. */
+#define WORD_HAS_ZERO_BYTE(w) \
+	((((w) - 0x0101010101010101ULL) & ~(w) & 0x8080808080808080ULL) != 0)
+
+static void
+mail_index_seqs_run_flush(ARRAY_TYPE(seq_range) *seqs,
+			  const struct seq_range *run)
+{
+	const struct seq_range *last;
+
+	if (run->seq1 > run->seq2)
+		return;
+	last = array_is_empty(seqs) ? NULL : array_back(seqs);
+	if (last == NULL || last->seq2 + 1 < run->seq1) {
+		/* the common case - avoid the binary searches */
+		array_push_back(seqs, run);
+	} else {
+		seq_range_array_add_range(seqs, run->seq1, run->seq2);
+	}
+}
+
+static inline void
+mail_index_seqs_run_add(ARRAY_TYPE(seq_range) *seqs, struct seq_range *run,
+			uint32_t seq1, uint32_t seq2)
+{
+	if (run->seq2 + 1 == seq1 && run->seq1 <= run->seq2) {
+		run->seq2 = seq2;
+		return;
+	}
+	mail_index_seqs_run_flush(seqs, run);
+	run->seq1 = seq1;
+	run->seq2 = seq2;
+}
+
+static void
+mail_index_lookup_seqs_matching_real(struct mail_index_view *view,
+				     const uint8_t *flags_column,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_record_filter *filter,
+				     ARRAY_TYPE(seq_range) *seqs)
+{
+	struct mail_index_map *map = view->map;
+	const struct mail_index_ext *ext;
+	uint8_t *kw_mask = NULL, *kw_bits = NULL;
+	uint32_t seq, next_seq, ext_idx, kw_offset = 0;
+	uint16_t kw_size = 0;
+	uint64_t word, mask8, flags8;
+	struct seq_range run;
+
+	if (filter->keywords != NULL || filter->not_keywords != NULL) {
+		if (mail_index_map_get_ext_idx(map, view->index->keywords_ext_id,
+					       &ext_idx)) {
+			ext = array_idx(&map->extensions, ext_idx);
+			if (ext->record_offset != 0) {
+				kw_offset = ext->record_offset;
+				kw_size = ext->record_size;
+			}
+		}
+		kw_mask = t_malloc0(kw_size + 1);
+		kw_bits = t_malloc0(kw_size + 1);
+		if (!mail_index_keywords_filter_init(map, filter->keywords, TRUE,
+						     kw_mask, kw_bits, kw_size) ||
+		    !mail_index_keywords_filter_init(map, filter->not_keywords,
+						     FALSE, kw_mask, kw_bits,
+						     kw_size))
+			return;
+		/* skip the keyword checks if none of the keywords exist */
+		while (kw_size > 0 && kw_mask[kw_size-1] == 0)
+			kw_size--;
+	}
+
+	/* Compare 8 flag bytes at a time. A byte becomes zero in the word
+	   only if the message's flags match. The matching sequences are
+	   collected into run and added to seqs only when the run ends. */
+	mask8 = 0x0101010101010101ULL * filter->flags_mask;
+	flags8 = 0x0101010101010101ULL * (filter->flags & filter->flags_mask);
+	run.seq1 = 1; run.seq2 = 0;
+	for (seq = seq1; seq <= seq2; seq = next_seq) {
+		next_seq = seq2 - seq >= 8 ? seq + 8 : seq2 + 1;
+		if (next_seq - seq == 8) {
+			memcpy(&word, flags_column + seq - 1, sizeof(word));
+			word = (word & mask8) ^ flags8;
+			if (!WORD_HAS_ZERO_BYTE(word))
+				continue;
+			if (word == 0 && kw_size == 0) {
+				mail_index_seqs_run_add(seqs, &run, seq, seq + 7);
+				continue;
+			}
+		}
+		for (; seq < next_seq; seq++) {
+			if ((flags_column[seq-1] & filter->flags_mask) !=
+			    (filter->flags & filter->flags_mask))
+				continue;
+			if (kw_size > 0 &&
+			    !mail_index_keywords_filter_match(
+					CONST_PTR_OFFSET(MAIL_INDEX_REC_AT_SEQ(map, seq),
+							 kw_offset),
+					kw_mask, kw_bits, kw_size))
+				continue;
+			mail_index_seqs_run_add(seqs, &run, seq, seq);
+		}
+	}
+	mail_index_seqs_run_flush(seqs, &run);
+}
+
+bool mail_index_lookup_seqs_matching(struct mail_index_view *view,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_record_filter *filter,
+				     ARRAY_TYPE(seq_range) *seqs)
+{
+	const uint8_t *flags_column;
+
+	flags_column = view->v.lookup_flags_column(view,
+		filter->keywords != NULL || filter->not_keywords != NULL);
+	if (flags_column == NULL)
+		return FALSE;
+	i_assert(seq1 > 0 && seq2 <= view->map->hdr.messages_count);
+
+	mail_index_lookup_seqs_matching_real(view, flags_column,
+					     seq1, seq2, filter, seqs);
+	return TRUE;
+}
+
 void mail_index_lookup_ext(struct mail_index_view *view, uint32_t seq,
 			   uint32_t ext_id, const void **data_r,
 			   bool *expunged_r)
@@ -591,6 +796,7 @@ static struct mail_index_view_vfuncs view_vfuncs = {
 	view_lookup_uid,
 	view_lookup_seq_range,
 	view_lookup_first,
+	view_lookup_flags_column,
 	view_lookup_keywords,
 	view_lookup_ext_full,
 	view_get_header_ext,
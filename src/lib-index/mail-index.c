@@ -6,6 +6,7 @@
 #include "buffer.h"
 #include "eacces-error.h"
 #include "hash.h"
+#include "llist.h"
 #include "str-sanitize.h"
 #include "mmap-util.h"
 #include "nfs-workarounds.h"
@@ -31,6 +32,10 @@ struct event_category event_category_mail_index = {
 	.name = "mail-index",
 };
 
+ARRAY_DEFINE_TYPE(const_rec_map, const struct mail_index_record_map *);
+
+static struct mail_index *mail_indexes = NULL;
+
 static void mail_index_close_nonopened(struct mail_index *index);
 
 static const struct mail_index_optimization_settings default_optimization_set = {
@@ -88,6 +93,7 @@ struct mail_index *mail_index_alloc(struct event *parent_event,
 			  strcase_hash, strcasecmp);
 	index->log = mail_transaction_log_alloc(index);
 	mail_index_modseq_init(index);
+	DLLIST_PREPEND(&mail_indexes, index);
 	return index;
 }
 
@@ -99,6 +105,7 @@ void mail_index_free(struct mail_index **_index)
 
 	i_assert(index->open_count == 0);
 
+	DLLIST_REMOVE(&mail_indexes, index);
 	mail_transaction_log_free(&index->log);
 	hash_table_destroy(&index->keywords_hash);
 	pool_unref(&index->extension_pool);
@@ -195,6 +202,10 @@ void mail_index_set_optimization_settings(struct mail_index *index,
 		dest->index.rewrite_min_log_bytes = set->index.rewrite_min_log_bytes;
 	if (set->index.rewrite_max_log_bytes != 0)
 		dest->index.rewrite_max_log_bytes = set->index.rewrite_max_log_bytes;
+	if (set->index.sparse_map_min_size != 0)
+		dest->index.sparse_map_min_size = set->index.sparse_map_min_size;
+	if (set->index.shared_map)
+		dest->index.shared_map = TRUE;
 
 	/* log */
 	if (set->log.min_size != 0)
@@ -228,6 +239,8 @@ void mail_index_set_optimization_settings(struct mail_index *index,
 
 	dest->cache.max_header_name_length = set->cache.max_header_name_length;
 	dest->cache.max_headers_count = set->cache.max_headers_count;
+	if (set->cache.compress)
+		dest->cache.compress = TRUE;
 }
 
 void mail_index_set_ext_init_data(struct mail_index *index, uint32_t ext_id,
@@ -970,6 +983,70 @@ int mail_index_move_to_memory(struct mail_index *index)
 	return 0;
 }
 
+static void
+mail_index_record_map_get_memory_usage(const struct mail_index_record_map *rec_map,
+				       struct mail_index_memory_usage *usage)
+{
+	if (rec_map->buffer != NULL)
+		usage->private_size += rec_map->buffer->used;
+	else {
+		usage->shared_size += rec_map->mmap_size;
+		/* records appended to a sparse map */
+		if (rec_map->mmap_used_size > rec_map->mmap_size) {
+			usage->private_size += rec_map->mmap_used_size -
+				rec_map->mmap_size;
+		}
+	}
+	if (array_is_created(&rec_map->uid_column))
+		usage->private_size += array_count(&rec_map->uid_column) *
+			sizeof(uint32_t);
+	if (array_is_created(&rec_map->flags_column))
+		usage->private_size += array_count(&rec_map->flags_column);
+}
+
+static void
+mail_index_map_get_memory_usage(ARRAY_TYPE(const_rec_map) *rec_maps,
+				const struct mail_index_map *map,
+				struct mail_index_memory_usage *usage)
+{
+	const struct mail_index_record_map *rec_map;
+
+	if (map == NULL || map->rec_map == NULL)
+		return;
+	/* the same rec_map is commonly shared by multiple maps, so count
+	   each one only once. */
+	array_foreach_elem(rec_maps, rec_map) {
+		if (rec_map == map->rec_map)
+			return;
+	}
+	rec_map = map->rec_map;
+	array_push_back(rec_maps, &rec_map);
+	mail_index_record_map_get_memory_usage(rec_map, usage);
+}
+
+void mail_index_get_memory_usage(struct mail_index_memory_usage *usage_r)
+{
+	struct mail_index_view *view;
+	struct mail_index *index;
+
+	i_zero(usage_r);
+	T_BEGIN {
+		ARRAY_TYPE(const_rec_map) rec_maps;
+
+		t_array_init(&rec_maps, 8);
+		for (index = mail_indexes; index != NULL; index = index->next) {
+			mail_index_map_get_memory_usage(&rec_maps, index->map,
+							usage_r);
+			/* views may still be using older maps */
+			for (view = index->views; view != NULL; view = view->next) {
+				mail_index_map_get_memory_usage(&rec_maps,
+								view->map,
+								usage_r);
+			}
+		}
+	} T_END;
+}
+
 void mail_index_mark_corrupted(struct mail_index *index)
 {
 	index->indexid = 0;
@@ -191,6 +191,15 @@ struct mail_keywords {
 	unsigned int idx[FLEXIBLE_ARRAY_MEMBER];
 };
 
+struct mail_index_record_filter {
+	/* Match records with (flags & flags_mask) == flags */
+	uint8_t flags, flags_mask;
+	/* Keyword indexes that must be set / unset in the matching records.
+	   These may be NULL. */
+	const ARRAY_TYPE(keyword_indexes) *keywords;
+	const ARRAY_TYPE(keyword_indexes) *not_keywords;
+};
+
 enum mail_index_transaction_flags {
 	/* If transaction is marked as hidden, the changes are marked with
 	   hidden=TRUE when the view is synchronized. */
@@ -317,6 +326,15 @@ struct mail_index_base_optimization_settings {
 	   from the .log on refresh is between these min/max values. */
 	uoff_t rewrite_min_log_bytes;
 	uoff_t rewrite_max_log_bytes;
+	/* Keep the index mmap()ed as a sparse map when it's at least this
+	   large: appends and expunges are done in place, so only the modified
+	   pages get copied instead of the whole index. 0 = disabled. */
+	uoff_t sparse_map_min_size;
+	/* Try to keep the index records shared with the other processes
+	   using the same index: all mmap()ed maps are sparse, and when
+	   another process has rewritten dovecot.index, the new file is
+	   mmap()ed instead of keeping the records copied in memory. */
+	bool shared_map;
 };
 
 struct mail_index_log_optimization_settings {
@@ -355,6 +373,9 @@ struct mail_index_cache_optimization_settings {
 	/* Purge the file when we need to follow more than n next_offsets to
 	   find the latest cache header. */
 	unsigned int purge_header_continue_count;
+	/* Compress variable sized fields while purging, using a dictionary
+	   trained from the mailbox's cached fields. */
+	bool compress;
 };
 
 struct mail_index_optimization_settings {
@@ -363,6 +384,15 @@ struct mail_index_optimization_settings {
 	struct mail_index_cache_optimization_settings cache;
 };
 
+struct mail_index_memory_usage {
+	/* Bytes of records copied to this process's memory */
+	size_t private_size;
+	/* Bytes of records mmap()ed from index files. The kernel shares these
+	   pages with the other processes mmap()ing the same files, except for
+	   the pages this process has modified. */
+	size_t shared_size;
+};
+
 struct mail_index;
 struct mail_index_map;
 struct mail_index_view;
@@ -414,6 +444,9 @@ int mail_index_unlink(struct mail_index *index);
 bool mail_index_is_in_memory(struct mail_index *index);
 /* Move the index into memory. Returns 0 if ok, -1 if error occurred. */
 int mail_index_move_to_memory(struct mail_index *index);
+/* Get the memory used by the records of all the indexes allocated by this
+   process. */
+void mail_index_get_memory_usage(struct mail_index_memory_usage *usage_r);
 
 struct mail_cache *mail_index_get_cache(struct mail_index *index);
 
@@ -629,6 +662,21 @@ bool mail_index_lookup_seq(struct mail_index_view *view,
 void mail_index_lookup_first(struct mail_index_view *view,
 			     enum mail_flags flags, uint8_t flags_mask,
 			     uint32_t *seq_r);
+/* Returns the flags of all the messages in the view as an array indexed by
+   seq-1, or NULL if it's not available (e.g. the mailbox is small). This is
+   faster than mail_index_lookup() for scanning the flags of large mailboxes.
+   The array is valid until the view or the index is synced. */
+const uint8_t *mail_index_lookup_flags_column(struct mail_index_view *view);
+/* Add the messages in seq1..seq2 range that match the filter to seqs. The
+   flags column is scanned a word at a time, so this is much faster than
+   looking up the messages one by one. Returns FALSE without modifying seqs if
+   the lookup isn't possible, because mail_index_lookup_flags_column() would
+   return NULL or because the filter has keywords and the view is a
+   transaction view with keyword changes. */
+bool mail_index_lookup_seqs_matching(struct mail_index_view *view,
+				     uint32_t seq1, uint32_t seq2,
+				     const struct mail_index_record_filter *filter,
+				     ARRAY_TYPE(seq_range) *seqs);
 
 /* Append a new record to index. */
 void mail_index_append(struct mail_index_transaction *t, uint32_t uid,
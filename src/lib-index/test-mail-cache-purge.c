@@ -921,6 +921,129 @@ static void test_mail_cache_purge_bitmask(void)
 }
 
 
+static const char *test_mail_cache_compress_value(uint32_t seq)
+{
+	return t_strdup_printf(
+		"Received: from mx%u.example.com (mx%u.example.com [192.0.2.%u])\r\n"
+		"\tby imap.example.org with LMTP id %08x\r\n"
+		"\tfor <user%u@example.org>; Thu, 01 Jan 2015 00:00:%02u +0000\r\n"
+		"From: Sender %u <sender%u@example.com>\r\n"
+		"To: User %u <user%u@example.org>\r\n"
+		"Subject: Weekly report number %u\r\n"
+		"Message-ID: <%u.%08x@mx.example.com>\r\n",
+		seq % 7, seq % 7, seq % 250, seq * 2654435761U, seq % 100,
+		seq % 60, seq % 13, seq % 13, seq % 100, seq % 100, seq,
+		seq, seq * 40503U);
+}
+
+static void test_mail_cache_purge_compress(void)
+{
+	struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.compress = TRUE,
+		},
+	};
+	const unsigned int messages_count = 2000;
+	struct test_mail_cache_ctx ctx;
+	struct mail_index_transaction *trans;
+	struct mail_index_view *updated_view;
+	struct mail_cache_view *cache_view;
+	struct mail_cache_transaction_ctx *cache_trans;
+	uint32_t seq, uid_validity = 12345;
+	const char *value;
+
+	test_begin("mail cache purge compress");
+	test_mail_cache_init(test_mail_index_init(TRUE), &ctx);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+	/* settings that don't set compress don't disable it */
+	i_zero(&optimization_set);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+	test_assert(ctx.index->optimization_set.cache.compress);
+
+	trans = mail_index_transaction_begin(ctx.view, 0);
+	updated_view = mail_index_transaction_open_updated_view(trans);
+	cache_view = mail_cache_view_open(ctx.cache, updated_view);
+	cache_trans = mail_cache_get_transaction(cache_view, trans);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (unsigned int i = 1; i <= messages_count; i++) T_BEGIN {
+		mail_index_append(trans, i, &seq);
+		value = test_mail_cache_compress_value(seq);
+		mail_cache_add(cache_trans, seq, ctx.cache_field.idx,
+			       value, strlen(value));
+		/* too small to be compressed */
+		mail_cache_add(cache_trans, seq, ctx.cache_field2.idx, "bar", 3);
+	} T_END;
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&updated_view);
+	mail_cache_view_close(&cache_view);
+	test_mail_cache_view_sync(&ctx);
+
+	test_assert(mail_cache_purge(ctx.cache, (uint32_t)-1, "test") == 0);
+	if (mail_cache_compress_supported()) {
+		test_assert(ctx.cache->hdr->major_version ==
+			    MAIL_CACHE_MAJOR_VERSION_COMPRESSED);
+	} else {
+		test_assert(ctx.cache->hdr->major_version ==
+			    MAIL_CACHE_MAJOR_VERSION);
+	}
+
+	/* the iterator returns the compressed data as-is until it's
+	   explicitly decompressed */
+	if (mail_cache_compress_supported()) {
+		struct mail_cache_lookup_iterate_ctx iter;
+		struct mail_cache_iterate_field field;
+
+		value = test_mail_cache_compress_value(1);
+		cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+		mail_cache_lookup_iter_init(cache_view, 1, &iter);
+		while (mail_cache_lookup_iter_next(&iter, &field) > 0) {
+			if (field.field_idx != ctx.cache_field.idx)
+				continue;
+			test_assert(field.compressed);
+			test_assert(field.size < strlen(value));
+			test_assert(mail_cache_lookup_iter_decompress(&iter,
+								      &field) == 0);
+			test_assert(!field.compressed);
+			test_assert(field.size == strlen(value) &&
+				    memcmp(field.data, value, field.size) == 0);
+		}
+		mail_cache_view_close(&cache_view);
+	}
+
+	/* new fields added after purging are left uncompressed */
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx,
+				 test_mail_cache_compress_value(messages_count + 1));
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	for (seq = 1; seq <= messages_count + 1; seq++) T_BEGIN {
+		test_assert_idx(cache_equals(cache_view, seq,
+			ctx.cache_field.idx,
+			test_mail_cache_compress_value(seq)), seq);
+		test_assert_idx(cache_equals(cache_view, seq,
+			ctx.cache_field2.idx,
+			seq <= messages_count ? "bar" : NULL), seq);
+	} T_END;
+	mail_cache_view_close(&cache_view);
+
+	/* purging again retrains the dictionary and decompresses the old
+	   fields while copying them */
+	test_assert(mail_cache_purge(ctx.cache, (uint32_t)-1, "test") == 0);
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	for (seq = 1; seq <= messages_count + 1; seq++) T_BEGIN {
+		test_assert_idx(cache_equals(cache_view, seq,
+			ctx.cache_field.idx,
+			test_mail_cache_compress_value(seq)), seq);
+	} T_END;
+	mail_cache_view_close(&cache_view);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
+
 static void
 test_mail_cache_update_need_purge_continued_records_int(bool big_min_size)
 {
@@ -1104,6 +1227,7 @@ int main(void)
 		test_mail_cache_purge_field_changes4,
 		test_mail_cache_purge_already_done,
 		test_mail_cache_purge_bitmask,
+		test_mail_cache_purge_compress,
 		test_mail_cache_update_need_purge_continued_records,
 		test_mail_cache_update_need_purge_continued_records2,
 		test_mail_cache_update_need_purge_deleted_records,
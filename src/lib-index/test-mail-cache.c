@@ -806,6 +806,49 @@ static void test_mail_cache_duplicate_fields(void)
 	test_end();
 }
 
+static void test_mail_cache_prefetch(void)
+{
+	const struct mail_index_optimization_settings optimization_set = {
+		.cache = {
+			.record_max_size = 256*1024,
+		},
+	};
+	struct test_mail_cache_ctx ctx;
+	struct mail_cache_view *cache_view;
+	string_t *str = t_str_new(128);
+	char *huge_field;
+
+	test_begin("mail cache prefetch");
+	test_mail_cache_init(test_mail_index_init(TRUE), &ctx);
+	mail_index_set_optimization_settings(ctx.index, &optimization_set);
+	test_mail_cache_add_mail(&ctx, UINT_MAX, NULL);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo2");
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo3");
+	/* the huge record makes a gap between the records that is too
+	   large to be merged */
+	huge_field = i_malloc(128*1024 + 1);
+	memset(huge_field, 'x', 128*1024);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, huge_field);
+	test_mail_cache_add_mail(&ctx, ctx.cache_field.idx, "foo5");
+	i_free(huge_field);
+
+	cache_view = mail_cache_view_open(ctx.cache, ctx.view);
+	test_assert(mail_cache_prefetch(cache_view, 1, 1) == 0);
+	test_assert(mail_cache_prefetch(cache_view, 1, 3) == 1);
+	test_assert(mail_cache_prefetch(cache_view, 2, 4) == 1);
+	test_assert(mail_cache_prefetch(cache_view, 1, 5) == 2);
+
+	/* lookups work normally afterwards */
+	test_assert(mail_cache_lookup_field(cache_view, str, 5,
+					    ctx.cache_field.idx) == 1);
+	test_assert_strcmp(str_c(str), "foo5");
+	mail_cache_view_close(&cache_view);
+
+	test_mail_cache_deinit(&ctx);
+	test_mail_index_delete();
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
@@ -820,6 +863,7 @@ int main(void)
 		test_mail_cache_in_memory,
 		test_mail_cache_size_corruption,
 		test_mail_cache_duplicate_fields,
+		test_mail_cache_prefetch,
 		NULL
 	};
 	return test_run(test_functions);
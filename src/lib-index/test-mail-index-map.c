@@ -47,10 +47,47 @@ static void test_mail_index_map_lookup_seq_range(void)
 	test_end();
 }
 
+static void test_mail_index_map_lookup_seq_range_columns(void)
+{
+	struct mail_index_record_map rec_map;
+	struct mail_index_map map;
+	uint32_t seq, first_uid, last_uid, first_seq, last_seq, max_uid;
+	const uint32_t last_uid_offsets[] = { 0, 1, 7, 100 };
+
+	test_begin("mail index map lookup seq range with columns");
+	i_zero(&map);
+	i_zero(&rec_map);
+	map.rec_map = &rec_map;
+	map.hdr.messages_count = MAIL_INDEX_MAP_COLUMNS_MIN_RECORDS + 5;
+	map.hdr.record_size = sizeof(struct mail_index_record);
+	rec_map.records_count = map.hdr.messages_count;
+	rec_map.records = i_new(struct mail_index_record, map.hdr.messages_count);
+
+	for (seq = 1; seq <= map.hdr.messages_count; seq++)
+		MAIL_INDEX_REC_AT_SEQ(&map, seq)->uid = seq*2;
+	max_uid = (seq-1)*2;
+	map.hdr.next_uid = max_uid + 1;
+
+	for (first_uid = 2; first_uid <= max_uid; first_uid++) {
+		for (unsigned int i = 0; i < N_ELEMENTS(last_uid_offsets); i++) {
+			last_uid = I_MIN(first_uid + last_uid_offsets[i], max_uid);
+			if (first_uid == last_uid && first_uid%2 != 0)
+				continue;
+			mail_index_map_lookup_seq_range(&map, first_uid, last_uid, &first_seq, &last_seq);
+			test_assert((first_uid+1)/2 == first_seq && last_uid/2 == last_seq);
+		}
+	}
+	test_assert(array_is_created(&rec_map.uid_column));
+	mail_index_record_map_columns_free(&rec_map);
+	i_free(rec_map.records);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_map_lookup_seq_range,
+		test_mail_index_map_lookup_seq_range_columns,
 		NULL
 	};
 	return test_run(test_functions);
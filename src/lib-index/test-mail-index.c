@@ -158,11 +158,426 @@ static void test_mail_index_new_extension(void)
 	test_end();
 }
 
+static void test_mail_index_flags_column_check(struct mail_index *index)
+{
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	const uint8_t *flags_column;
+	uint32_t seq, count, seq1, seq2;
+
+	view = mail_index_view_open(index);
+	count = mail_index_view_get_messages_count(view);
+	flags_column = mail_index_lookup_flags_column(view);
+	test_assert(flags_column != NULL);
+	for (seq = 1; seq <= count && flags_column != NULL; seq++) {
+		rec = mail_index_lookup(view, seq);
+		test_assert_idx(flags_column[seq-1] == rec->flags, seq);
+		test_assert_idx(mail_index_lookup_seq_range(view, rec->uid,
+							    rec->uid,
+							    &seq1, &seq2) &&
+				seq1 == seq && seq2 == seq, seq);
+	}
+	mail_index_view_close(&view);
+}
+
+static void test_mail_index_flags_column(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view, *view2;
+	struct mail_index_transaction *trans;
+	uint32_t seq, count = MAIL_INDEX_MAP_COLUMNS_MIN_RECORDS * 2;
+	uint32_t uid_validity = 123456;
+
+	test_begin("mail index flags column");
+	index = mail_index_alloc(NULL, NULL, "(in-memory)");
+	test_assert(mail_index_open_or_create(index,
+			MAIL_INDEX_OPEN_FLAG_CREATE) == 1);
+
+	/* too small mailbox doesn't have the column */
+	view = mail_index_view_open(index);
+	test_assert(mail_index_lookup_flags_column(view) == NULL);
+
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uint32_t uid = 1; uid <= count; uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (uid % 3 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_flags_column_check(index);
+
+	/* flag changes and expunges are synced to the existing column */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags_range(trans, 100, 200, MODIFY_ADD,
+				      MAIL_DELETED);
+	mail_index_update_flags_range(trans, 150, 300, MODIFY_REMOVE,
+				      MAIL_SEEN);
+	for (seq = 10; seq <= 20; seq++)
+		mail_index_expunge(trans, seq);
+	mail_index_expunge(trans, 500);
+	mail_index_expunge(trans, count);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_flags_column_check(index);
+
+	/* the same while another view keeps the old map referenced */
+	view2 = mail_index_view_open(index);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_flags_range(trans, 1, count / 2, MODIFY_REPLACE,
+				      MAIL_FLAGGED);
+	mail_index_expunge(trans, 1);
+	mail_index_append(trans, count + 1, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+	test_mail_index_flags_column_check(index);
+	mail_index_view_close(&view2);
+
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_end();
+}
+
+static void test_mail_index_sparse_map_check(struct mail_index *index,
+					     uint32_t messages_count,
+					     bool expunged)
+{
+	struct mail_index_view *view;
+	const struct mail_index_record *rec;
+	uint32_t seq, uid, count, expunge_count = expunged ? 5 : 0;
+	uint8_t flags;
+
+	view = mail_index_view_open(index);
+	count = mail_index_view_get_messages_count(view);
+	test_assert(count == messages_count - expunge_count + 100);
+	for (seq = 1; seq <= count; seq++) {
+		/* uids 5..9 were expunged */
+		uid = seq < 5 ? seq : seq + expunge_count;
+		flags = uid > messages_count || uid % 3 != 0 ? 0 : MAIL_SEEN;
+		if (uid >= 20 && uid <= 30)
+			flags |= MAIL_FLAGGED;
+		rec = mail_index_lookup(view, seq);
+		test_assert_idx(rec->uid == uid && rec->flags == flags, seq);
+	}
+	mail_index_view_close(&view);
+}
+
+static void test_mail_index_sparse_map_update(struct mail_index *index,
+					      uint32_t messages_count,
+					      bool expunge)
+{
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq;
+
+	/* external transaction, so the expunges are applied immediately */
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view,
+			MAIL_INDEX_TRANSACTION_FLAG_EXTERNAL);
+	mail_index_update_flags_range(trans, 20, 30, MODIFY_ADD, MAIL_FLAGGED);
+	for (seq = 5; seq <= 9 && expunge; seq++)
+		mail_index_expunge(trans, seq);
+	for (uint32_t uid = 1; uid <= 100; uid++)
+		mail_index_append(trans, messages_count + uid, &seq);
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+}
+
+static struct mail_index *
+test_mail_index_sparse_map_open(uint32_t messages_count,
+	const struct mail_index_optimization_settings *optimization_set)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	uint32_t seq, file_seq, uid_validity = 123456;
+	uoff_t file_offset;
+
+	index = test_mail_index_init(TRUE);
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	for (uint32_t uid = 1; uid <= messages_count; uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (uid % 3 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	/* write the records to dovecot.index, so it gets mmap()ed */
+	test_assert(mail_transaction_log_sync_lock(index->log, "test",
+						   &file_seq, &file_offset) == 0);
+	mail_index_write(index, TRUE, "test");
+	mail_transaction_log_sync_unlock(index->log, "test");
+	test_mail_index_close(&index);
+
+	index = mail_index_alloc(NULL, TESTDIR_NAME, "test.dovecot.index");
+	mail_index_set_optimization_settings(index, optimization_set);
+	test_assert(mail_index_open(index, 0) == 1);
+	test_assert(MAIL_INDEX_MAP_IS_SPARSE(index->map));
+	return index;
+}
+
+static void test_mail_index_sparse_map(void)
+{
+	const struct mail_index_optimization_settings optimization_set = {
+		.index = {
+			.sparse_map_min_size = 1,
+		},
+	};
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	uint32_t messages_count = 10000;
+
+	test_begin("mail index sparse map");
+	/* flag changes and appends keep the map mmap()ed */
+	index = test_mail_index_sparse_map_open(messages_count,
+						&optimization_set);
+	test_mail_index_sparse_map_update(index, messages_count, FALSE);
+	test_assert(MAIL_INDEX_MAP_IS_SPARSE(index->map));
+	test_mail_index_sparse_map_check(index, messages_count, FALSE);
+	test_mail_index_deinit(&index);
+
+	/* expunges while another view keeps the old map referenced */
+	index = test_mail_index_sparse_map_open(messages_count,
+						&optimization_set);
+	view = mail_index_view_open(index);
+	test_mail_index_sparse_map_update(index, messages_count, TRUE);
+	test_mail_index_sparse_map_check(index, messages_count, TRUE);
+	test_assert(mail_index_view_get_messages_count(view) == messages_count);
+	mail_index_view_close(&view);
+	test_mail_index_deinit(&index);
+
+	/* expunges while the rec_map isn't shared are done in place */
+	index = test_mail_index_sparse_map_open(messages_count,
+						&optimization_set);
+	index2 = test_mail_index_open(FALSE);
+	test_mail_index_sparse_map_update(index2, messages_count, TRUE);
+	test_mail_index_close(&index2);
+	test_assert(mail_index_refresh(index) == 0);
+	test_assert(MAIL_INDEX_MAP_IS_SPARSE(index->map));
+	test_assert(index->map->rec_map->mmap_used_size ==
+		    index->map->hdr.header_size +
+		    index->map->rec_map->records_count *
+		    index->map->hdr.record_size);
+	test_mail_index_sparse_map_check(index, messages_count, TRUE);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static void test_mail_index_shared_map(void)
+{
+	const struct mail_index_optimization_settings optimization_set = {
+		.index = {
+			.shared_map = TRUE,
+		},
+	};
+	struct mail_index_optimization_settings empty_optimization_set;
+	struct mail_index_memory_usage usage;
+	struct mail_index *index, *index2;
+	struct mail_index_view *view;
+	uint32_t file_seq, messages_count = 10000;
+	size_t records_size = messages_count * sizeof(struct mail_index_record);
+	uoff_t file_offset;
+
+	test_begin("mail index shared map");
+	index = test_mail_index_sparse_map_open(messages_count,
+						&optimization_set);
+	/* settings that don't set shared_map don't disable it */
+	i_zero(&empty_optimization_set);
+	mail_index_set_optimization_settings(index, &empty_optimization_set);
+	test_assert(index->optimization_set.index.shared_map);
+	mail_index_get_memory_usage(&usage);
+	test_assert(usage.shared_size >= records_size);
+	test_assert(usage.private_size == 0);
+
+	/* expunging while another view keeps the old map referenced copies
+	   the records to memory */
+	view = mail_index_view_open(index);
+	test_mail_index_sparse_map_update(index, messages_count, TRUE);
+	mail_index_view_close(&view);
+	test_assert(MAIL_INDEX_MAP_IS_IN_MEMORY(index->map));
+	mail_index_get_memory_usage(&usage);
+	test_assert(usage.private_size >= records_size);
+
+	/* another process rewrites the index */
+	index2 = test_mail_index_open(FALSE);
+	test_assert(mail_transaction_log_sync_lock(index2->log, "test",
+						   &file_seq, &file_offset) == 0);
+	mail_index_write(index2, TRUE, "test");
+	mail_transaction_log_sync_unlock(index2->log, "test");
+	test_mail_index_close(&index2);
+
+	/* refreshing mmap()s the rewritten index instead of keeping the
+	   private copy */
+	test_assert(mail_index_refresh(index) == 0);
+	test_assert(!MAIL_INDEX_MAP_IS_IN_MEMORY(index->map));
+	test_mail_index_sparse_map_check(index, messages_count, TRUE);
+	mail_index_get_memory_usage(&usage);
+	test_assert(usage.shared_size >= records_size);
+	test_assert(usage.private_size < records_size);
+	test_mail_index_deinit(&index);
+	test_end();
+}
+
+static bool
+test_seqs_matching_expected(uint32_t seq, const struct mail_index_record *rec,
+			    const struct mail_index_record_filter *filter,
+			    bool want_kw1, bool want_not_kw2)
+{
+	if ((rec->flags & filter->flags_mask) != filter->flags)
+		return FALSE;
+	if (want_kw1 && seq % 5 != 0)
+		return FALSE;
+	if (want_not_kw2 && seq % 7 == 0)
+		return FALSE;
+	return TRUE;
+}
+
+static void
+test_seqs_matching_check(struct mail_index_view *view,
+			 const struct mail_index_record_filter *filter,
+			 bool want_kw1, bool want_not_kw2)
+{
+	ARRAY_TYPE(seq_range) seqs;
+	const struct mail_index_record *rec;
+	uint32_t seq, count = mail_index_view_get_messages_count(view);
+
+	t_array_init(&seqs, 32);
+	test_assert(mail_index_lookup_seqs_matching(view, 3, count - 3,
+						    filter, &seqs));
+	for (seq = 1; seq <= count; seq++) {
+		rec = mail_index_lookup(view, seq);
+		bool expected = seq >= 3 && seq <= count - 3 &&
+			test_seqs_matching_expected(seq, rec, filter,
+						    want_kw1, want_not_kw2);
+		test_assert_idx(seq_range_exists(&seqs, seq) == expected, seq);
+	}
+}
+
+static void test_mail_index_lookup_seqs_matching(void)
+{
+	struct mail_index *index;
+	struct mail_index_view *view;
+	struct mail_index_transaction *trans;
+	struct mail_index_record_filter filter;
+	struct mail_keywords *kw1, *kw2;
+	ARRAY_TYPE(keyword_indexes) keywords, not_keywords, missing;
+	ARRAY_TYPE(seq_range) seqs;
+	const char *kw1_names[] = { "kw1", NULL };
+	const char *kw2_names[] = { "kw2", NULL };
+	const char *missing_names[] = { "missing", NULL };
+	struct mail_keywords *kw_missing;
+	uint32_t seq, count = MAIL_INDEX_MAP_COLUMNS_MIN_RECORDS * 2 + 5;
+	uint32_t uid_validity = 123456;
+
+	test_begin("mail index lookup seqs matching");
+	index = mail_index_alloc(NULL, NULL, "(in-memory)");
+	test_assert(mail_index_open_or_create(index,
+			MAIL_INDEX_OPEN_FLAG_CREATE) == 1);
+
+	view = mail_index_view_open(index);
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_header(trans,
+		offsetof(struct mail_index_header, uid_validity),
+		&uid_validity, sizeof(uid_validity), TRUE);
+	kw1 = mail_index_keywords_create(index, kw1_names);
+	kw2 = mail_index_keywords_create(index, kw2_names);
+	for (uint32_t uid = 1; uid <= count; uid++) {
+		mail_index_append(trans, uid, &seq);
+		if (uid % 3 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD, MAIL_SEEN);
+		if (uid % 4 == 0)
+			mail_index_update_flags(trans, seq, MODIFY_ADD,
+						MAIL_DELETED);
+		if (uid % 5 == 0)
+			mail_index_update_keywords(trans, seq, MODIFY_ADD, kw1);
+		if (uid % 7 == 0)
+			mail_index_update_keywords(trans, seq, MODIFY_ADD, kw2);
+	}
+	test_assert(mail_index_transaction_commit(&trans) == 0);
+	mail_index_view_close(&view);
+
+	/* keyword that doesn't exist in the index yet */
+	kw_missing = mail_index_keywords_create(index, missing_names);
+	t_array_init(&keywords, 1);
+	array_push_back(&keywords, &kw1->idx[0]);
+	t_array_init(&not_keywords, 1);
+	array_push_back(&not_keywords, &kw2->idx[0]);
+	t_array_init(&missing, 1);
+	array_push_back(&missing, &kw_missing->idx[0]);
+
+	view = mail_index_view_open(index);
+	i_zero(&filter);
+	test_seqs_matching_check(view, &filter, FALSE, FALSE);
+	filter.flags = MAIL_SEEN;
+	filter.flags_mask = MAIL_SEEN | MAIL_DELETED;
+	test_seqs_matching_check(view, &filter, FALSE, FALSE);
+	filter.flags = 0;
+	test_seqs_matching_check(view, &filter, FALSE, FALSE);
+
+	filter.keywords = &keywords;
+	test_seqs_matching_check(view, &filter, TRUE, FALSE);
+	filter.not_keywords = &not_keywords;
+	test_seqs_matching_check(view, &filter, TRUE, TRUE);
+	filter.keywords = NULL;
+	test_seqs_matching_check(view, &filter, FALSE, TRUE);
+
+	/* unknown keyword can't be set in any message */
+	filter.not_keywords = &missing;
+	test_seqs_matching_check(view, &filter, FALSE, FALSE);
+	filter.keywords = &missing;
+	t_array_init(&seqs, 4);
+	test_assert(mail_index_lookup_seqs_matching(view, 1, count, &filter,
+						    &seqs));
+	test_assert(array_count(&seqs) == 0);
+
+	/* keyword changes in a transaction aren't in the map records, so
+	   the transaction view can't be used for keyword lookups */
+	struct mail_index_view *tview;
+	trans = mail_index_transaction_begin(view, 0);
+	mail_index_update_keywords(trans, 1, MODIFY_ADD, kw1);
+	tview = mail_index_transaction_open_updated_view(trans);
+	i_zero(&filter);
+	filter.keywords = &keywords;
+	test_assert(!mail_index_lookup_seqs_matching(tview, 1, count, &filter,
+						     &seqs));
+	filter.keywords = NULL;
+	filter.not_keywords = &not_keywords;
+	test_assert(!mail_index_lookup_seqs_matching(tview, 1, count, &filter,
+						     &seqs));
+	/* flags can still be looked up */
+	filter.not_keywords = NULL;
+	test_seqs_matching_check(tview, &filter, FALSE, FALSE);
+	mail_index_view_close(&tview);
+	mail_index_transaction_rollback(&trans);
+	mail_index_view_close(&view);
+
+	mail_index_keywords_unref(&kw1);
+	mail_index_keywords_unref(&kw2);
+	mail_index_keywords_unref(&kw_missing);
+	mail_index_close(index);
+	mail_index_free(&index);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_mail_index_rotate,
 		test_mail_index_new_extension,
+		test_mail_index_flags_column,
+		test_mail_index_lookup_seqs_matching,
+		test_mail_index_sparse_map,
+		test_mail_index_shared_map,
 		NULL
 	};
 	return test_run(test_functions);
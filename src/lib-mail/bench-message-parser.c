@@ -0,0 +1,157 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "base64.h"
+#include "istream.h"
+#include "randgen.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "message-parser.h"
+
+#include <stdio.h>
+
+/**
+ * Generates a corpus of multipart mails with text and base64 encoded
+ * attachment parts and measures how quickly message_parser goes through
+ * them. Each mail is parsed via an istream with a small buffer so that the
+ * boundary scanning is also done across block boundaries.
+ */
+
+#define BENCH_MSG_BOUNDARY "=-bench-boundary-0123456789"
+#define BENCH_MSG_INPUT_MAX_BUFFER_SIZE 8192
+
+static void bench_msg_text_part(string_t *dest, unsigned int lines)
+{
+	static const char *words[] = {
+		"hello", "world", "the", "mail", "server", "is", "-", "--",
+		"parsing", "this", "message", "quickly", "and", "correctly",
+	};
+	unsigned int i, len;
+
+	str_append(dest, "--"BENCH_MSG_BOUNDARY"\r\n"
+		   "Content-Type: text/plain; charset=utf-8\r\n\r\n");
+	for (i = 0; i < lines; i++) {
+		for (len = 0; len < 70; ) {
+			const char *word = words[i_rand_limit(N_ELEMENTS(words))];
+			str_append(dest, word);
+			str_append_c(dest, ' ');
+			len += strlen(word) + 1;
+		}
+		str_append(dest, "\r\n");
+	}
+}
+
+static void
+bench_msg_create(string_t *dest, unsigned int parts, size_t attachment_size)
+{
+	buffer_t *attachment, *encoded;
+	unsigned int i;
+
+	attachment = buffer_create_dynamic(default_pool, attachment_size);
+	random_fill(buffer_append_space_unsafe(attachment, attachment_size),
+		    attachment_size);
+	encoded = buffer_create_dynamic(default_pool,
+		MAX_BASE64_ENCODED_SIZE(attachment_size));
+	base64_encode(attachment->data, attachment->used, encoded);
+
+	str_append(dest, "From: sender@example.com\r\n"
+		   "To: recipient@example.com\r\n"
+		   "Subject: benchmark\r\n"
+		   "MIME-Version: 1.0\r\n"
+		   "Content-Type: multipart/mixed; boundary=\""
+		   BENCH_MSG_BOUNDARY"\"\r\n\r\n"
+		   "This is a multi-part message in MIME format.\r\n");
+	for (i = 0; i < parts; i++) {
+		bench_msg_text_part(dest, 50);
+		/* base64 encoded attachments are wrapped to 76 char lines */
+		str_append(dest, "--"BENCH_MSG_BOUNDARY"\r\n"
+			   "Content-Type: application/octet-stream\r\n"
+			   "Content-Transfer-Encoding: base64\r\n\r\n");
+		for (size_t pos = 0; pos < encoded->used; pos += 76) {
+			str_append_data(dest, CONST_PTR_OFFSET(encoded->data, pos),
+					I_MIN(76, encoded->used - pos));
+			str_append(dest, "\r\n");
+		}
+	}
+	str_append(dest, "--"BENCH_MSG_BOUNDARY"--\r\n");
+
+	buffer_free(&attachment);
+	buffer_free(&encoded);
+}
+
+static void bench_msg_parse(const string_t *msg)
+{
+	const struct message_parser_settings set = {
+		.flags = MESSAGE_PARSER_FLAG_INCLUDE_MULTIPART_BLOCKS,
+	};
+	struct message_parser_ctx *parser;
+	struct message_block block;
+	struct message_part *parts;
+	struct istream *input;
+	pool_t pool;
+	int ret;
+
+	pool = pool_alloconly_create("message parts", 4096);
+	input = i_stream_create_from_data(str_data(msg), str_len(msg));
+	i_stream_set_max_buffer_size(input, BENCH_MSG_INPUT_MAX_BUFFER_SIZE);
+	parser = message_parser_init(pool, input, &set);
+	while ((ret = message_parser_parse_next_block(parser, &block)) > 0) ;
+	i_assert(ret < 0);
+	message_parser_deinit(&parser, &parts);
+	i_assert(parts->children != NULL);
+	i_stream_unref(&input);
+	pool_unref(&pool);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<mails> [<parts per mail> [<attachment size>]]]\n", prog);
+	fprintf(stderr, "Runs with 100 mails, 4 parts per mail and 64 kB attachments if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int mail_count = 100, part_count = 4;
+	unsigned long attachment_size = 64*1024;
+	string_t **mails;
+	uoff_t total_size = 0;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+
+	lib_init();
+
+	if (argc > 4)
+		print_usage(argv[0]);
+	if ((argc > 1 && str_to_uint(argv[1], &mail_count) < 0) ||
+	    (argc > 2 && str_to_uint(argv[2], &part_count) < 0) ||
+	    (argc > 3 && str_to_ulong(argv[3], &attachment_size) < 0) ||
+	    mail_count == 0 || part_count == 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	mails = i_new(string_t *, mail_count);
+	for (i = 0; i < mail_count; i++) {
+		mails[i] = str_new(default_pool,
+				   part_count * (attachment_size * 2 + 4096));
+		bench_msg_create(mails[i], part_count, attachment_size);
+		total_size += str_len(mails[i]);
+	}
+	printf("%u mails, %u parts per mail, %"PRIuUOFF_T" bytes in total\n",
+	       mail_count, part_count * 2, total_size);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < mail_count; i++)
+		bench_msg_parse(mails[i]);
+	ts_1 = i_nanoseconds();
+	printf("\tParse: %0.02lf MB/s\n",
+	       ((double)total_size * 1000.0) / (double)(ts_1 - ts_0 + 1));
+
+	for (i = 0; i < mail_count; i++)
+		str_free(&mails[i]);
+	i_free(mails);
+	lib_deinit();
+	return 0;
+}
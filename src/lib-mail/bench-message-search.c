@@ -0,0 +1,171 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "str.h"
+#include "istream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "unichar.h"
+#include "message-search.h"
+
+#include <stdio.h>
+
+/**
+ * Generates a corpus of multipart mails with text parts and searches them
+ * for multiple keys. The keys are searched first one by one with separate
+ * message_search contexts, which is how each BODY/TEXT search arg was
+ * searched before, and then all at once with message_search_init_multi().
+ * The keys are pairs of random words, so some of them match and some
+ * don't. The results of both searches are verified to be the same.
+ */
+
+#define BENCH_MSG_BOUNDARY "=-bench-boundary-0123456789"
+
+static const char *words[] = {
+	"hello", "world", "the", "mail", "server", "is", "searching",
+	"this", "message", "quickly", "and", "correctly", "for", "keys",
+};
+
+static void bench_msg_create(string_t *dest, unsigned int parts)
+{
+	unsigned int i, line, len;
+
+	str_append(dest, "From: sender@example.com\r\n"
+		   "To: recipient@example.com\r\n"
+		   "Subject: benchmark\r\n"
+		   "MIME-Version: 1.0\r\n"
+		   "Content-Type: multipart/mixed; boundary=\""
+		   BENCH_MSG_BOUNDARY"\"\r\n\r\n"
+		   "This is a multi-part message in MIME format.\r\n");
+	for (i = 0; i < parts; i++) {
+		str_append(dest, "--"BENCH_MSG_BOUNDARY"\r\n"
+			   "Content-Type: text/plain; charset=utf-8\r\n\r\n");
+		for (line = 0; line < 200; line++) {
+			for (len = 0; len < 70; ) {
+				const char *word =
+					words[i_rand_limit(N_ELEMENTS(words))];
+				str_append(dest, word);
+				str_append_c(dest, ' ');
+				len += strlen(word) + 1;
+			}
+			str_append(dest, "\r\n");
+		}
+	}
+	str_append(dest, "--"BENCH_MSG_BOUNDARY"--\r\n");
+}
+
+static bool
+bench_msg_search(struct message_search_context *ctx, const string_t *msg)
+{
+	struct istream *input;
+	const char *error;
+	int ret;
+
+	input = i_stream_create_from_data(str_data(msg), str_len(msg));
+	ret = message_search_msg(ctx, input, NULL, &error);
+	if (ret < 0)
+		i_fatal("message_search_msg() failed: %s", error);
+	i_stream_unref(&input);
+	return ret > 0;
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<mails> [<keys> [<parts per mail>]]]\n", prog);
+	fprintf(stderr, "Runs with 100 mails, 8 keys and 4 parts per mail if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int mail_count = 100, key_count = 8, part_count = 4;
+	struct message_search_context **single_ctx, *multi_ctx;
+	enum message_search_flags *key_flags;
+	const char **keys;
+	string_t **mails;
+	pool_t keys_pool;
+	bool *matches;
+	uoff_t total_size = 0;
+	uint64_t ts_0, ts_1;
+	unsigned int i, j;
+
+	lib_init();
+
+	if (argc > 4)
+		print_usage(argv[0]);
+	if ((argc > 1 && str_to_uint(argv[1], &mail_count) < 0) ||
+	    (argc > 2 && str_to_uint(argv[2], &key_count) < 0) ||
+	    (argc > 3 && str_to_uint(argv[3], &part_count) < 0) ||
+	    mail_count == 0 || key_count == 0 || part_count == 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	mails = i_new(string_t *, mail_count);
+	for (i = 0; i < mail_count; i++) {
+		mails[i] = str_new(default_pool, part_count * 16384);
+		bench_msg_create(mails[i], part_count);
+		total_size += str_len(mails[i]);
+	}
+
+	/* every other key is searched only from bodies, like BODY */
+	keys_pool = pool_alloconly_create("search keys", 1024);
+	keys = i_new(const char *, key_count);
+	key_flags = i_new(enum message_search_flags, key_count);
+	single_ctx = i_new(struct message_search_context *, key_count);
+	for (i = 0; i < key_count; i++) {
+		keys[i] = p_strdup_printf(keys_pool, "%s %s",
+			words[i_rand_limit(N_ELEMENTS(words))],
+			words[i_rand_limit(N_ELEMENTS(words))]);
+		if (i % 2 == 1)
+			key_flags[i] = MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
+		single_ctx[i] = message_search_init(keys[i], NULL,
+						    key_flags[i]);
+	}
+	multi_ctx = message_search_init_multi(keys, key_flags, key_count,
+					      NULL);
+	matches = i_new(bool, mail_count * key_count);
+
+	printf("%u mails, %u text parts per mail, %u keys, "
+	       "%"PRIuUOFF_T" bytes in total\n",
+	       mail_count, part_count, key_count, total_size);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < mail_count; i++) {
+		for (j = 0; j < key_count; j++) {
+			matches[i * key_count + j] =
+				bench_msg_search(single_ctx[j], mails[i]);
+		}
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tSearch per key: %0.02lf MB/s\n",
+	       ((double)total_size * 1000.0) / (double)(ts_1 - ts_0 + 1));
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < mail_count; i++) {
+		(void)bench_msg_search(multi_ctx, mails[i]);
+		for (j = 0; j < key_count; j++) {
+			if (message_search_multi_is_matched(multi_ctx, j) !=
+			    matches[i * key_count + j])
+				i_panic("Search results differ for key '%s'",
+					keys[j]);
+		}
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tSearch multi:   %0.02lf MB/s\n",
+	       ((double)total_size * 1000.0) / (double)(ts_1 - ts_0 + 1));
+
+	message_search_deinit(&multi_ctx);
+	for (i = 0; i < key_count; i++)
+		message_search_deinit(&single_ctx[i]);
+	i_free(single_ctx);
+	i_free(key_flags);
+	i_free(keys);
+	pool_unref(&keys_pool);
+	i_free(matches);
+	for (i = 0; i < mail_count; i++)
+		str_free(&mails[i]);
+	i_free(mails);
+	lib_deinit();
+	return 0;
+}
@@ -292,6 +292,39 @@ boundary_line_find(struct message_parser_ctx *ctx,
 	return 1;
 }
 
+static const unsigned char *
+boundary_line_next_lf(const unsigned char *cur, const unsigned char *end)
+{
+	const unsigned char *pos = cur, *dash;
+
+	/* Boundary lines begin with "--", so instead of looking at every
+	   line, skip directly to the dashes. This way for example base64
+	   encoded parts can be skipped with a single memchr(). */
+	if (cur >= end)
+		return NULL;
+	while (end - pos >= 3) {
+		dash = memchr(pos + 1, '-', end - pos - 1);
+		if (dash == NULL)
+			break;
+		if (dash[-1] == '\n' && dash + 1 < end && dash[1] == '-')
+			return dash - 1;
+		/* the next boundary line can't begin before the next LF */
+		pos = memchr(dash, '\n', end - dash);
+		if (pos == NULL)
+			break;
+		if (end - pos >= 3 && pos[1] == '-' && pos[2] == '-')
+			return pos;
+	}
+
+	/* There's not enough data after the last LFs to know whether they
+	   begin a boundary line. */
+	if (end - cur >= 2 && end[-2] == '\n')
+		return end - 2;
+	if (end[-1] == '\n')
+		return end - 1;
+	return NULL;
+}
+
 static int parse_next_mime_header_init(struct message_parser_ctx *ctx,
 				       struct message_block *block_r)
 {
@@ -418,10 +451,10 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 	i_assert(block_r->size > 0);
 	boundary_start = 0;
 
-	/* skip to beginning of the next line. the first line was
-	   handled already. */
+	/* skip to beginning of the next line that may be a boundary line.
+	   the first line was handled already. */
 	cur = data; end = data + block_r->size;
-	while ((next = memchr(cur, '\n', end - cur)) != NULL) {
+	while ((next = boundary_line_next_lf(cur, end)) != NULL) {
 		cur = next + 1;
 
 		boundary_start = next - data;
@@ -443,6 +476,19 @@ static int parse_next_body_to_boundary(struct message_parser_ctx *ctx,
 		}
 	}
 
+	if (next == NULL) {
+		/* the lines after the last checked LF can't be boundaries.
+		   find the beginning of the last line so it's left to the
+		   buffer. */
+		const unsigned char *last_lf = i_memrchr(cur, '\n', end - cur);
+
+		if (last_lf != NULL) {
+			boundary_start = last_lf - data;
+			if (boundary_start > 0 && data[boundary_start-1] == '\r')
+				boundary_start--;
+		}
+	}
+
 	if (next != NULL) {
 		/* found / need more data */
 		i_assert(ret >= 0);
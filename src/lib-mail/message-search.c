@@ -1,15 +1,24 @@
 /* Copyright (c) 2002-2018 Dovecot authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "buffer.h"
 #include "istream.h"
 #include "str.h"
 #include "str-find.h"
+#include "str-multi-find.h"
 #include "rfc822-parser.h"
 #include "message-decoder.h"
 #include "message-parser.h"
 #include "message-search.h"
 
+struct message_search_key {
+	/* Key is searched only from message bodies */
+	bool body_only;
+	/* Index to the keys in text_find_ctx or body_find_ctx */
+	unsigned int find_idx;
+};
+
 struct message_search_context {
 	enum message_search_flags flags;
 	normalizer_func_t *normalizer;
@@ -17,6 +26,13 @@ struct message_search_context {
 	struct str_find_context *str_find_ctx;
 	struct message_part *prev_part;
 
+	/* Multiple keys: Keys that are searched from both headers and bodies
+	   are in text_find_ctx. Keys that are searched only from bodies are
+	   in body_find_ctx. */
+	struct str_multi_find_context *text_find_ctx, *body_find_ctx;
+	struct message_search_key *keys;
+	unsigned int keys_count;
+
 	struct message_decoder_context *decoder;
 	bool content_type_text:1; /* text/any or message/any */
 };
@@ -37,16 +53,132 @@ message_search_init(const char *normalized_key_utf8,
 	return ctx;
 }
 
+static void
+message_search_init_finders(struct message_search_context *ctx,
+			    const char *const *keys,
+			    const enum message_search_flags *key_flags)
+{
+	ARRAY_TYPE(const_string) text_keys, body_keys;
+	unsigned int i;
+
+	t_array_init(&text_keys, ctx->keys_count);
+	t_array_init(&body_keys, ctx->keys_count);
+	for (i = 0; i < ctx->keys_count; i++) {
+		i_assert(*keys[i] != '\0');
+
+		if ((key_flags[i] & MESSAGE_SEARCH_FLAG_SKIP_HEADERS) != 0) {
+			ctx->keys[i].body_only = TRUE;
+			ctx->keys[i].find_idx = array_count(&body_keys);
+			array_push_back(&body_keys, &keys[i]);
+		} else {
+			ctx->keys[i].find_idx = array_count(&text_keys);
+			array_push_back(&text_keys, &keys[i]);
+		}
+	}
+	if (array_count(&text_keys) > 0) {
+		ctx->text_find_ctx =
+			str_multi_find_init(default_pool,
+					    array_front(&text_keys),
+					    array_count(&text_keys));
+	} else {
+		/* none of the keys want headers */
+		ctx->flags |= MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
+	}
+	if (array_count(&body_keys) > 0) {
+		ctx->body_find_ctx =
+			str_multi_find_init(default_pool,
+					    array_front(&body_keys),
+					    array_count(&body_keys));
+	}
+}
+
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  const enum message_search_flags *key_flags,
+			  unsigned int keys_count,
+			  normalizer_func_t *normalizer)
+{
+	struct message_search_context *ctx;
+
+	i_assert(keys_count > 0);
+
+	ctx = i_new(struct message_search_context, 1);
+	ctx->decoder = message_decoder_init(normalizer, 0);
+	ctx->keys = i_new(struct message_search_key, keys_count);
+	ctx->keys_count = keys_count;
+	T_BEGIN {
+		message_search_init_finders(ctx, normalized_keys_utf8,
+					    key_flags);
+	} T_END;
+	return ctx;
+}
+
 void message_search_deinit(struct message_search_context **_ctx)
 {
 	struct message_search_context *ctx = *_ctx;
 
 	*_ctx = NULL;
-	str_find_deinit(&ctx->str_find_ctx);
+	if (ctx->str_find_ctx != NULL)
+		str_find_deinit(&ctx->str_find_ctx);
+	if (ctx->text_find_ctx != NULL)
+		str_multi_find_deinit(&ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_multi_find_deinit(&ctx->body_find_ctx);
 	message_decoder_deinit(&ctx->decoder);
+	i_free(ctx->keys);
 	i_free(ctx);
 }
 
+bool message_search_multi_is_matched(struct message_search_context *ctx,
+				     unsigned int key_idx)
+{
+	const struct message_search_key *key;
+
+	i_assert(key_idx < ctx->keys_count);
+
+	key = &ctx->keys[key_idx];
+	return str_multi_find_is_matched(key->body_only ? ctx->body_find_ctx :
+					 ctx->text_find_ctx, key->find_idx);
+}
+
+static bool message_search_multi_all_matched(struct message_search_context *ctx)
+{
+	return (ctx->text_find_ctx == NULL ||
+		str_multi_find_all_matched(ctx->text_find_ctx)) &&
+		(ctx->body_find_ctx == NULL ||
+		 str_multi_find_all_matched(ctx->body_find_ctx));
+}
+
+static bool message_search_find_more(struct message_search_context *ctx,
+				     const unsigned char *data, size_t size,
+				     bool header)
+{
+	if (ctx->str_find_ctx != NULL)
+		return str_find_more(ctx->str_find_ctx, data, size);
+
+	if (ctx->text_find_ctx != NULL)
+		(void)str_multi_find_more(ctx->text_find_ctx, data, size);
+	if (ctx->body_find_ctx != NULL && !header)
+		(void)str_multi_find_more(ctx->body_find_ctx, data, size);
+	return message_search_multi_all_matched(ctx);
+}
+
+static void message_search_part_reset(struct message_search_context *ctx)
+{
+	/* Content-Type defaults to text/plain */
+	ctx->content_type_text = TRUE;
+
+	ctx->prev_part = NULL;
+	if (ctx->str_find_ctx != NULL)
+		str_find_reset(ctx->str_find_ctx);
+	/* the keys that were already found in earlier parts stay found */
+	if (ctx->text_find_ctx != NULL)
+		str_multi_find_reset(ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_multi_find_reset(ctx->body_find_ctx);
+	message_decoder_decode_reset(ctx->decoder);
+}
+
 static void parse_content_type(struct message_search_context *ctx,
 			       struct message_header_line *hdr)
 {
@@ -84,14 +216,14 @@ static bool search_header(struct message_search_context *ctx,
 {
 	static const unsigned char crlf[2] = { '\r', '\n' };
 
-	return str_find_more(ctx->str_find_ctx,
-			     (const unsigned char *)hdr->name, hdr->name_len) ||
-		str_find_more(ctx->str_find_ctx,
-			      hdr->middle, hdr->middle_len) ||
-		str_find_more(ctx->str_find_ctx, hdr->full_value,
-			      hdr->full_value_len) ||
+	return message_search_find_more(ctx, (const unsigned char *)hdr->name,
+					hdr->name_len, TRUE) ||
+		message_search_find_more(ctx, hdr->middle, hdr->middle_len,
+					 TRUE) ||
+		message_search_find_more(ctx, hdr->full_value,
+					 hdr->full_value_len, TRUE) ||
 		(!hdr->no_newline &&
-		 str_find_more(ctx->str_find_ctx, crlf, 2));
+		 message_search_find_more(ctx, crlf, 2, TRUE));
 }
 
 static bool message_search_more_decoded2(struct message_search_context *ctx,
@@ -101,7 +233,8 @@ static bool message_search_more_decoded2(struct message_search_context *ctx,
 		if (search_header(ctx, block->hdr))
 			return TRUE;
 	} else {
-		if (str_find_more(ctx->str_find_ctx, block->data, block->size))
+		if (message_search_find_more(ctx, block->data, block->size,
+					     FALSE))
 			return TRUE;
 	}
 	return FALSE;
@@ -128,7 +261,7 @@ bool message_search_more_get_decoded(struct message_search_context *ctx,
 	if (raw_block->part != ctx->prev_part) {
 		/* part changes. we must change this before looking at
 		   content type */
-		message_search_reset(ctx);
+		message_search_part_reset(ctx);
 		ctx->prev_part = raw_block->part;
 
 		if (hdr == NULL) {
@@ -174,7 +307,7 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 {
 	if (block->part != ctx->prev_part) {
 		/* part changes */
-		message_search_reset(ctx);
+		message_search_part_reset(ctx);
 		ctx->prev_part = block->part;
 	}
 
@@ -183,12 +316,11 @@ bool message_search_more_decoded(struct message_search_context *ctx,
 
 void message_search_reset(struct message_search_context *ctx)
 {
-	/* Content-Type defaults to text/plain */
-	ctx->content_type_text = TRUE;
-
-	ctx->prev_part = NULL;
-	str_find_reset(ctx->str_find_ctx);
-	message_decoder_decode_reset(ctx->decoder);
+	message_search_part_reset(ctx);
+	if (ctx->text_find_ctx != NULL)
+		str_multi_find_clear(ctx->text_find_ctx);
+	if (ctx->body_find_ctx != NULL)
+		str_multi_find_clear(ctx->body_find_ctx);
 }
 
 int message_search_msg(struct message_search_context *ctx,
@@ -15,9 +15,25 @@ struct message_search_context *
 message_search_init(const char *normalized_key_utf8,
 		    normalizer_func_t *normalizer,
 		    enum message_search_flags flags);
+/* Search for multiple keys at once. The message is scanned only once
+   regardless of the number of keys. key_flags[] gives the flags separately
+   for each key. The keys must be given in UTF-8 charset and they must not be
+   empty. */
+struct message_search_context *
+message_search_init_multi(const char *const *normalized_keys_utf8,
+			  const enum message_search_flags *key_flags,
+			  unsigned int keys_count,
+			  normalizer_func_t *normalizer);
 void message_search_deinit(struct message_search_context **ctx);
 
-/* Returns TRUE if key is found from input buffer, FALSE if not. */
+/* Returns TRUE if the key (index to the keys given to
+   message_search_init_multi()) has been found since the last
+   message_search_reset(). */
+bool message_search_multi_is_matched(struct message_search_context *ctx,
+				     unsigned int key_idx);
+
+/* Returns TRUE if key is found from input buffer, FALSE if not. With
+   multiple keys, returns TRUE only after all the keys have been found. */
 bool message_search_more(struct message_search_context *ctx,
 			 struct message_block *raw_block);
 /* Same as message_search_more(), but return the decoded block. If the same
@@ -29,9 +45,13 @@ bool message_search_more_get_decoded(struct message_search_context *ctx,
 /* The data has already passed through decoder. */
 bool message_search_more_decoded(struct message_search_context *ctx,
 				 struct message_block *block);
+/* Reset the search for a new message. With multiple keys this also forgets
+   the keys that were already found. */
 void message_search_reset(struct message_search_context *ctx);
 /* Search a full message. Returns 1 if match was found, 0 if not,
-   -1 if error (if stream_error == 0, the parts contained broken data) */
+   -1 if error (if stream_error == 0, the parts contained broken data).
+   With multiple keys 1 is returned only if all the keys were found. Use
+   message_search_multi_is_matched() to check the individual keys. */
 int message_search_msg(struct message_search_context *ctx,
 		       struct istream *input, struct message_part *parts,
 		       const char **error_r)
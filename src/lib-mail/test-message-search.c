@@ -510,11 +510,99 @@ static void test_message_search_more_get_decoded(void)
 	test_end();
 }
 
+static void test_message_search_multi(void)
+{
+	static const char input[] =
+		"From: sender@example.com\n"
+		"Subject: first header\n"
+		"Content-Type: multipart/mixed; boundary=\"a\"\n"
+		"\n"
+		"--a\n"
+		"Content-Type: text/plain\n"
+		"\n"
+		"plain body\n"
+		"--a\n"
+		"Content-Type: text/plain; charset=utf-8\n"
+		"Content-Transfer-Encoding: base64\n"
+		"\n"
+		"cMO2w7YgZW5jb2RlZA==\n"
+		"--a\n"
+		"Content-Type: application/octet-stream\n"
+		"\n"
+		"binary data\n"
+		"--a--\n";
+	static const struct {
+		const char *key;
+		enum message_search_flags flags;
+		bool expect_found;
+	} keys[] = {
+		{ "first header", 0, TRUE },
+		{ "plain body", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, TRUE },
+		{ "p\xC3\xB6\xC3\xB6 enc", 0, TRUE },
+		{ "p\xC3\xB6\xC3\xB6", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, TRUE },
+		{ "multipart/mixed", 0, TRUE },
+		/* the rest aren't found */
+		{ "first header", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, FALSE },
+		{ "multipart/mixed", MESSAGE_SEARCH_FLAG_SKIP_HEADERS, FALSE },
+		/* spans the MIME part boundary */
+		{ "body\np", 0, FALSE },
+		/* not text/ or message/ */
+		{ "binary", 0, FALSE },
+		{ "nonexistent", 0, FALSE },
+	};
+	const char *key_strs[N_ELEMENTS(keys)];
+	enum message_search_flags key_flags[N_ELEMENTS(keys)];
+	struct message_search_context *ctx, *single_ctx;
+	struct istream *input_stream;
+	const char *error;
+	unsigned int i, round;
+
+	test_begin("message search multi");
+	for (i = 0; i < N_ELEMENTS(keys); i++) {
+		key_strs[i] = keys[i].key;
+		key_flags[i] = keys[i].flags;
+	}
+	input_stream = test_istream_create(input);
+	ctx = message_search_init_multi(key_strs, key_flags,
+					N_ELEMENTS(keys), NULL);
+	/* the second round verifies that the matches are reset */
+	for (round = 0; round < 2; round++) {
+		i_stream_seek(input_stream, 0);
+		test_assert(message_search_msg(ctx, input_stream, NULL,
+					       &error) == 0);
+		for (i = 0; i < N_ELEMENTS(keys); i++) {
+			test_assert_idx(message_search_multi_is_matched(ctx, i) ==
+					keys[i].expect_found, i);
+		}
+	}
+	message_search_deinit(&ctx);
+
+	/* compare to the single key searches */
+	for (i = 0; i < N_ELEMENTS(keys); i++) {
+		single_ctx = message_search_init(keys[i].key, NULL,
+						 keys[i].flags);
+		i_stream_seek(input_stream, 0);
+		test_assert_idx(message_search_msg(single_ctx, input_stream,
+						   NULL, &error) ==
+				(keys[i].expect_found ? 1 : 0), i);
+		message_search_deinit(&single_ctx);
+	}
+
+	/* only the keys that are found */
+	ctx = message_search_init_multi(key_strs, key_flags, 5, NULL);
+	i_stream_seek(input_stream, 0);
+	test_assert(message_search_msg(ctx, input_stream, NULL, &error) == 1);
+	message_search_deinit(&ctx);
+	i_stream_unref(&input_stream);
+	test_end();
+}
+
 int main(void)
 {
 	static void (*const test_functions[])(void) = {
 		test_message_search,
 		test_message_search_more_get_decoded,
+		test_message_search_multi,
 		NULL
 	};
 	return test_run(test_functions);
@@ -0,0 +1,214 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "lib-signals.h"
+#include "istream.h"
+#include "ostream.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "iostream-openssl.h"
+#include "iostream-ssl.h"
+#include "iostream-ssl-test.h"
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+/**
+ * Measures the TLS bulk transfer throughput of the SSL iostreams. The server
+ * sends the wanted amount of data to the client over a UNIX socketpair, and
+ * the client reads and discards it. Both ends run in the same process, so
+ * the result includes both encryption and decryption.
+ */
+
+#define BENCH_DEFAULT_MBYTES 512
+#define BENCH_BLOCK_SIZE 8192
+
+struct bench_endpoint {
+	int fd;
+	struct ssl_iostream_context *ctx;
+	struct ssl_iostream *iostream;
+	struct istream *input;
+	struct ostream *output;
+	struct io *io;
+	uint64_t bytes;
+
+	struct bench_endpoint *other;
+};
+
+static unsigned char bench_block[BENCH_BLOCK_SIZE];
+static uint64_t bench_total_bytes;
+
+static void bench_handshake_input(struct bench_endpoint *ep)
+{
+	if (ssl_iostream_handshake(ep->iostream) < 0)
+		i_fatal("handshake failed: %s",
+			ssl_iostream_get_last_error(ep->iostream));
+	if (ssl_iostream_is_handshaked(ep->iostream) &&
+	    ssl_iostream_is_handshaked(ep->other->iostream))
+		io_loop_stop(current_ioloop);
+}
+
+static int bench_server_output(struct bench_endpoint *ep)
+{
+	size_t size;
+	ssize_t ret;
+
+	while (ep->bytes < bench_total_bytes) {
+		size = I_MIN(sizeof(bench_block),
+			     bench_total_bytes - ep->bytes);
+		size = I_MIN(size, o_stream_get_buffer_avail_size(ep->output));
+		if (size == 0)
+			break;
+		ret = o_stream_send(ep->output, bench_block, size);
+		if (ret < 0) {
+			i_fatal("o_stream_send() failed: %s",
+				o_stream_get_error(ep->output));
+		}
+		ep->bytes += ret;
+	}
+	if (o_stream_flush(ep->output) < 0) {
+		i_fatal("o_stream_flush() failed: %s",
+			o_stream_get_error(ep->output));
+	}
+	/* call again when more data can be sent */
+	return ep->bytes < bench_total_bytes ? 0 : 1;
+}
+
+static void bench_server_input(struct bench_endpoint *ep)
+{
+	/* The client doesn't send anything, but the TLS layer may still need
+	   to read to be able to continue writing. */
+	if (i_stream_read(ep->input) == -1 && ep->input->stream_errno != 0) {
+		i_fatal("i_stream_read() failed: %s",
+			i_stream_get_error(ep->input));
+	}
+}
+
+static void bench_client_input(struct bench_endpoint *ep)
+{
+	const unsigned char *data;
+	size_t size;
+
+	while (i_stream_read_more(ep->input, &data, &size) > 0) {
+		ep->bytes += size;
+		i_stream_skip(ep->input, size);
+	}
+	if (ep->input->stream_errno != 0) {
+		i_fatal("i_stream_read() failed: %s",
+			i_stream_get_error(ep->input));
+	}
+	if (ep->bytes >= bench_total_bytes)
+		io_loop_stop(current_ioloop);
+}
+
+static void
+bench_endpoint_init(struct bench_endpoint *ep, int fd, bool client)
+{
+	struct ssl_iostream_settings set;
+	const char *error;
+	int ret;
+
+	i_zero(ep);
+	ep->fd = fd;
+	fd_set_nonblock(fd, TRUE);
+	ep->input = i_stream_create_fd(fd, IO_BLOCK_SIZE);
+	ep->output = o_stream_create_fd(fd, IO_BLOCK_SIZE);
+
+	if (client) {
+		ssl_iostream_test_settings_client(&set);
+		set.allow_invalid_cert = TRUE;
+		ret = ssl_iostream_context_init_client(&set, &ep->ctx, &error);
+	} else {
+		ssl_iostream_test_settings_server(&set);
+		ret = ssl_iostream_context_init_server(&set, &ep->ctx, &error);
+	}
+	if (ret < 0)
+		i_fatal("ssl_iostream_context_init() failed: %s", error);
+
+	if (client) {
+		ret = io_stream_create_ssl_client(ep->ctx, "localhost", NULL, 0,
+						  &ep->input, &ep->output,
+						  &ep->iostream, &error);
+	} else {
+		ret = io_stream_create_ssl_server(ep->ctx, NULL,
+						  &ep->input, &ep->output,
+						  &ep->iostream, &error);
+	}
+	if (ret < 0)
+		i_fatal("io_stream_create_ssl() failed: %s", error);
+	ep->io = io_add_istream(ep->input, bench_handshake_input, ep);
+}
+
+static void bench_endpoint_deinit(struct bench_endpoint *ep)
+{
+	io_remove(&ep->io);
+	i_stream_unref(&ep->input);
+	o_stream_unref(&ep->output);
+	ssl_iostream_destroy(&ep->iostream);
+	ssl_iostream_context_unref(&ep->ctx);
+	i_close_fd(&ep->fd);
+}
+
+static void bench_iostream_ssl(void)
+{
+	struct bench_endpoint server, client;
+	struct ioloop *ioloop;
+	uint64_t ts_0, ts_1;
+	int fd[2];
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fd) < 0)
+		i_fatal("socketpair() failed: %m");
+
+	ioloop = io_loop_create();
+	bench_endpoint_init(&server, fd[0], FALSE);
+	bench_endpoint_init(&client, fd[1], TRUE);
+	server.other = &client;
+	client.other = &server;
+	if (ssl_iostream_handshake(client.iostream) < 0)
+		i_fatal("handshake failed");
+	io_loop_run(ioloop);
+
+	io_remove(&server.io);
+	io_remove(&client.io);
+	server.io = io_add_istream(server.input, bench_server_input, &server);
+	client.io = io_add_istream(client.input, bench_client_input, &client);
+	o_stream_set_flush_callback(server.output, bench_server_output,
+				    &server);
+
+	ts_0 = i_nanoseconds();
+	o_stream_set_flush_pending(server.output, TRUE);
+	io_loop_run(ioloop);
+	ts_1 = i_nanoseconds();
+
+	i_assert(client.bytes == bench_total_bytes);
+	printf("%"PRIu64" MB in %.03f secs: %.01f MB/s\n",
+	       bench_total_bytes / (1024*1024), (ts_1 - ts_0) / 1e9,
+	       (double)bench_total_bytes / (1024*1024) /
+	       ((ts_1 - ts_0) / 1e9));
+
+	bench_endpoint_deinit(&client);
+	bench_endpoint_deinit(&server);
+	io_loop_destroy(&ioloop);
+	ssl_iostream_context_cache_free();
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int mbytes = BENCH_DEFAULT_MBYTES;
+
+	lib_init();
+	lib_signals_init();
+	/* the peer may already be closed when sending the TLS shutdown */
+	lib_signals_ignore(SIGPIPE, TRUE);
+	if (argc > 1 && str_to_uint(argv[1], &mbytes) < 0)
+		i_fatal("Usage: %s [<mbytes>]", argv[0]);
+	bench_total_bytes = (uint64_t)mbytes * 1024*1024;
+
+	ssl_iostream_openssl_init();
+	bench_iostream_ssl();
+	ssl_iostream_openssl_deinit();
+	lib_signals_deinit();
+	lib_deinit();
+	return 0;
+}
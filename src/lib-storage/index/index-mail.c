@@ -1984,6 +1984,14 @@ void index_mail_update_access_parts_pre(struct mail *_mail)
 			(data->cache_flags & MAIL_CACHE_FLAG_HAS_NULS) != 0;
 		_mail->has_no_nuls =
 			(data->cache_flags & MAIL_CACHE_FLAG_HAS_NO_NULS) != 0;
+		/* The flags may not be cached for mails that were saved
+		   before the flags' caching decision was set. Cached
+		   mime.parts know the nul state as well. Knowing that there
+		   are no NULs allows IMAP to send the mail without filtering
+		   it through istream-nonuls, i.e. with sendfile(). */
+		if ((data->wanted_fields & MAIL_FETCH_NUL_STATE) != 0 &&
+		    !_mail->has_nuls && !_mail->has_no_nuls)
+			(void)get_cached_parts(mail);
 		/* we currently don't forcibly set the nul state. if it's not
 		   already cached, the caller can figure out itself what to
 		   do when neither is set */
@@ -2223,6 +2231,18 @@ bool index_mail_prefetch(struct mail *_mail)
 	return !mail->data.prefetch_sent;
 }
 
+void index_mail_cache_prefetch(struct mail *_mail, uint32_t seq1, uint32_t seq2)
+{
+	struct index_mail *mail = INDEX_MAIL(_mail);
+
+	if ((mail->mail.wanted_fields & ENUM_NEGATE(MAIL_FETCH_FLAGS)) == 0 &&
+	    mail->mail.wanted_headers == NULL) {
+		/* flags come from the index - nothing to read from cache */
+		return;
+	}
+	(void)mail_cache_prefetch(_mail->transaction->cache_view, seq1, seq2);
+}
+
 bool index_mail_set_uid(struct mail *_mail, uint32_t uid)
 {
 	struct index_mail *mail = INDEX_MAIL(_mail);
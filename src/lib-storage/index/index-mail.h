@@ -179,6 +179,9 @@ void index_mail_set_seq(struct mail *mail, uint32_t seq, bool saving);
 bool index_mail_set_uid(struct mail *mail, uint32_t uid);
 void index_mail_set_uid_cache_updates(struct mail *mail, bool set);
 bool index_mail_prefetch(struct mail *mail);
+/* Read ahead the cache records of messages seq1..seq2, if the mail's wanted
+   fields are going to be looked up from the cache. */
+void index_mail_cache_prefetch(struct mail *mail, uint32_t seq1, uint32_t seq2);
 void index_mail_add_temp_wanted_fields(struct mail *mail,
 				       enum mail_fetch_field fields,
 				       struct mailbox_header_lookup_ctx *headers);
@@ -19,11 +19,28 @@ struct index_search_context {
 	struct mailbox_header_lookup_ctx *extra_wanted_headers;
 
 	uint32_t seq1, seq2;
+	/* The next sequence whose cache records haven't been prefetched yet,
+	   (uint32_t)-1 if prefetching isn't done. */
+	uint32_t cache_prefetch_seq;
+	/* Flags and keywords that all the matching mails must have set / unset
+	   according to the top-level flag and keyword search args. */
+	enum mail_flags prefilter_flags_set, prefilter_flags_unset;
+	ARRAY_TYPE(keyword_indexes) prefilter_keywords, prefilter_not_keywords;
+	/* Sequences that match the above, looked up in bulk from the index.
+	   Not created if the lookup wasn't possible. */
+	ARRAY_TYPE(seq_range) prefilter_seqs;
+	unsigned int prefilter_seqs_idx;
 	struct mail *cur_mail;
 	struct index_mail *cur_imail;
 	struct mail_thread_context *thread_ctx;
 	pool_t temp_pool;
 
+	/* BODY and TEXT search args that are searched at the same time with
+	   body_search_ctx. The index in the array is the key index in the
+	   context. */
+	ARRAY(struct mail_search_arg *) body_search_args;
+	struct message_search_context *body_search_ctx;
+
 	struct timeval last_nonblock_timeval;
 	struct timeval interrupt_start_time;
 	unsigned long long cost, next_time_check_cost;
@@ -34,6 +51,7 @@ struct index_search_context {
 	bool have_index_args:1;
 	bool have_mailbox_args:1;
 	bool have_nonmatch_always:1;
+	bool body_search_initialized:1;
 };
 
 struct mail *index_search_get_mail(struct index_search_context *ctx);
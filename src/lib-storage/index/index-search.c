@@ -31,6 +31,11 @@
 #define SEARCH_COST_KBYTE 15ULL
 #define SEARCH_COST_CACHE 1ULL
 
+/* Read ahead the cache records only for searches/fetches of at least this
+   many messages, and this many messages at a time. */
+#define SEARCH_CACHE_PREFETCH_MIN_MESSAGES 64
+#define SEARCH_CACHE_PREFETCH_WINDOW 1024
+
 #define SEARCH_MIN_NONBLOCK_USECS 200000
 #define SEARCH_MAX_NONBLOCK_USECS 250000
 #define SEARCH_INITIAL_MAX_COST 30000
@@ -59,6 +64,10 @@ struct search_body_context {
         struct index_search_context *index_ctx;
 	struct istream *input;
 	struct message_part *part;
+
+	/* Result of searching the message with index_ctx->body_search_ctx */
+	int body_search_ret;
+	bool body_searched:1;
 };
 
 static void search_parse_msgset_args(unsigned int messages_count,
@@ -702,27 +711,100 @@ static void search_header(struct message_header_line *hdr,
 	}
 }
 
-static void search_body(struct mail_search_arg *arg,
-			struct search_body_context *ctx)
+static void
+search_body_multi_add_args(struct index_search_context *ctx,
+			   struct mail_search_arg *args,
+			   ARRAY_TYPE(const_string) *keys)
 {
-	struct message_search_context *msg_search_ctx;
-	const char *error;
-	int ret;
+	const char *key;
+	string_t *dtc;
 
-	switch (arg->type) {
-	case SEARCH_BODY:
-	case SEARCH_TEXT:
-		break;
-	default:
-		return;
+	for (; args != NULL; args = args->next) {
+		switch (args->type) {
+		case SEARCH_OR:
+		case SEARCH_SUB:
+			search_body_multi_add_args(ctx, args->value.subargs,
+						   keys);
+			break;
+		case SEARCH_BODY:
+		case SEARCH_TEXT:
+			dtc = t_str_new(128);
+			if (ctx->mail_ctx.normalizer(args->value.str,
+						     strlen(args->value.str),
+						     dtc) < 0)
+				i_panic("search key not utf8: %s",
+					args->value.str);
+			/* empty keys are handled by search_body() as
+			   non-matches */
+			if (str_len(dtc) == 0)
+				break;
+
+			key = str_c(dtc);
+			array_push_back(keys, &key);
+			array_push_back(&ctx->body_search_args, &args);
+			break;
+		default:
+			break;
+		}
 	}
+}
 
-	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
-	if (msg_search_ctx == NULL) {
-		ARG_SET_RESULT(arg, 0);
+static void search_body_multi_init(struct index_search_context *ctx)
+{
+	ARRAY_TYPE(const_string) keys;
+	struct mail_search_arg *const *args;
+	enum message_search_flags *key_flags;
+	unsigned int i, count;
+
+	i_assert(!ctx->body_search_initialized);
+	ctx->body_search_initialized = TRUE;
+
+	i_array_init(&ctx->body_search_args, 8);
+	t_array_init(&keys, 8);
+	search_body_multi_add_args(ctx, ctx->mail_ctx.args->args, &keys);
+	args = array_get(&ctx->body_search_args, &count);
+	if (count < 2) {
+		/* a single key is searched faster by itself */
+		array_free(&ctx->body_search_args);
 		return;
 	}
 
+	key_flags = t_new(enum message_search_flags, count);
+	for (i = 0; i < count; i++) {
+		if (args[i]->type == SEARCH_BODY)
+			key_flags[i] = MESSAGE_SEARCH_FLAG_SKIP_HEADERS;
+	}
+	ctx->body_search_ctx =
+		message_search_init_multi(array_front(&keys), key_flags,
+					  count, ctx->mail_ctx.normalizer);
+}
+
+static bool
+search_body_multi_find_key(struct index_search_context *ctx,
+			   struct mail_search_arg *arg, unsigned int *key_idx_r)
+{
+	struct mail_search_arg *const *args;
+	unsigned int i, count;
+
+	if (ctx->body_search_ctx == NULL)
+		return FALSE;
+
+	args = array_get(&ctx->body_search_args, &count);
+	for (i = 0; i < count; i++) {
+		if (args[i] == arg) {
+			*key_idx_r = i;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static int search_body_msg(struct search_body_context *ctx,
+			   struct message_search_context *msg_search_ctx)
+{
+	const char *error;
+	int ret;
+
 	i_stream_seek(ctx->input, 0);
 	ret = message_search_msg(msg_search_ctx, ctx->input, ctx->part, &error);
 	if (ret < 0 && ctx->input->stream_errno == 0) {
@@ -738,8 +820,52 @@ static void search_body(struct mail_search_arg *arg,
 			"read(%s) failed: %s", i_stream_get_name(ctx->input),
 			i_stream_get_error(ctx->input));
 	}
+	return ret;
+}
+
+static void search_body(struct mail_search_arg *arg,
+			struct search_body_context *ctx)
+{
+	struct message_search_context *msg_search_ctx;
+	unsigned int key_idx;
+
+	switch (arg->type) {
+	case SEARCH_BODY:
+	case SEARCH_TEXT:
+		break;
+	default:
+		return;
+	}
 
-	ARG_SET_RESULT(arg, ret);
+	if (!ctx->index_ctx->body_search_initialized) T_BEGIN {
+		search_body_multi_init(ctx->index_ctx);
+	} T_END;
+	if (search_body_multi_find_key(ctx->index_ctx, arg, &key_idx)) {
+		/* all the BODY and TEXT keys are searched with a single pass
+		   through the message */
+		msg_search_ctx = ctx->index_ctx->body_search_ctx;
+		if (!ctx->body_searched) {
+			ctx->body_search_ret =
+				search_body_msg(ctx, msg_search_ctx);
+			ctx->body_searched = TRUE;
+		}
+		if (ctx->body_search_ret < 0)
+			ARG_SET_RESULT(arg, -1);
+		else if (message_search_multi_is_matched(msg_search_ctx,
+							 key_idx))
+			ARG_SET_RESULT(arg, 1);
+		else
+			ARG_SET_RESULT(arg, 0);
+		return;
+	}
+
+	msg_search_ctx = msg_search_arg_context(ctx->index_ctx, arg);
+	if (msg_search_ctx == NULL) {
+		ARG_SET_RESULT(arg, 0);
+		return;
+	}
+
+	ARG_SET_RESULT(arg, search_body_msg(ctx, msg_search_ctx));
 }
 
 static int search_arg_match_text(struct mail_search_arg *args,
@@ -1111,6 +1237,105 @@ static bool search_limit_by_hdr(struct index_search_context *ctx,
 	return *seq1 <= *seq2;
 }
 
+static void
+search_init_keywords_prefilter(struct index_search_context *ctx,
+			       struct mail_search_arg *arg)
+{
+	const struct mail_keywords *kw = arg->initialized.keywords;
+	ARRAY_TYPE(keyword_indexes) *dest;
+	unsigned int invalid_idx = UINT_MAX;
+
+	if (kw == NULL || (kw->count != 1 && arg->match_not))
+		return;
+
+	dest = arg->match_not ? &ctx->prefilter_not_keywords :
+		&ctx->prefilter_keywords;
+	if (!array_is_created(dest))
+		i_array_init(dest, 4);
+	if (kw->count == 0) {
+		/* invalid keyword - never matches. use a keyword index
+		   that can't exist. */
+		array_push_back(dest, &invalid_idx);
+	} else {
+		array_append(dest, kw->idx, kw->count);
+	}
+}
+
+static void search_init_prefilter(struct index_search_context *ctx,
+				  struct mail_search_arg *args)
+{
+	enum mail_flags flags, ignore_flags;
+
+	/* recent flag isn't in the index records, and private flags are
+	   looked up from a different view */
+	ignore_flags = MAIL_RECENT | mailbox_get_private_flags_mask(ctx->box);
+
+	for (; args != NULL; args = args->next) {
+		if (args->type == SEARCH_KEYWORDS) {
+			search_init_keywords_prefilter(ctx, args);
+			continue;
+		}
+		if (args->type != SEARCH_FLAGS)
+			continue;
+
+		if (!args->match_not) {
+			flags = args->value.flags & ENUM_NEGATE(ignore_flags);
+			ctx->prefilter_flags_set |= flags;
+		} else if ((args->value.flags & ignore_flags) == 0 &&
+			   (args->value.flags & (args->value.flags - 1)) == 0) {
+			/* NOT of a single flag. With multiple flags only
+			   some of them need to be unset. */
+			ctx->prefilter_flags_unset |= args->value.flags;
+		}
+	}
+}
+
+static void search_lookup_prefilter_seqs(struct index_search_context *ctx)
+{
+	struct mail_index_record_filter filter;
+
+	if (ctx->prefilter_flags_set == 0 && ctx->prefilter_flags_unset == 0 &&
+	    !array_is_created(&ctx->prefilter_keywords) &&
+	    !array_is_created(&ctx->prefilter_not_keywords))
+		return;
+	if (ctx->seq1 > ctx->seq2 ||
+	    ctx->seq2 > mail_index_view_get_messages_count(ctx->view))
+		return;
+
+	i_zero(&filter);
+	filter.flags = ctx->prefilter_flags_set;
+	filter.flags_mask = ctx->prefilter_flags_set |
+		ctx->prefilter_flags_unset;
+	if (array_is_created(&ctx->prefilter_keywords))
+		filter.keywords = &ctx->prefilter_keywords;
+	if (array_is_created(&ctx->prefilter_not_keywords))
+		filter.not_keywords = &ctx->prefilter_not_keywords;
+
+	i_array_init(&ctx->prefilter_seqs, 128);
+	if (!mail_index_lookup_seqs_matching(ctx->view, ctx->seq1, ctx->seq2,
+					     &filter, &ctx->prefilter_seqs))
+		array_free(&ctx->prefilter_seqs);
+}
+
+/* Move seq forward to the next sequence that may match the prefilter.
+   Returns FALSE if there are no more such sequences. */
+static bool
+search_prefilter_next_seq(struct index_search_context *ctx, uint32_t *seq)
+{
+	const struct seq_range *range;
+	unsigned int count;
+
+	range = array_get(&ctx->prefilter_seqs, &count);
+	for (; ctx->prefilter_seqs_idx < count; ctx->prefilter_seqs_idx++) {
+		if (range[ctx->prefilter_seqs_idx].seq2 >= *seq) {
+			if (range[ctx->prefilter_seqs_idx].seq1 > *seq)
+				*seq = range[ctx->prefilter_seqs_idx].seq1;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
 static void search_get_seqset(struct index_search_context *ctx,
 			      unsigned int messages_count,
 			      struct mail_search_arg *args)
@@ -1348,6 +1573,7 @@ index_storage_search_init(struct mailbox_transaction_context *t,
 	ctx->mail_ctx.wanted_fields |= wanted_fields;
 
 	search_get_seqset(ctx, status.messages, args->args);
+	search_init_prefilter(ctx, args->args);
 	(void)mail_search_args_foreach(args->args, search_init_arg, ctx);
 
 	/* Need to reset results for match_always cases */
@@ -1404,6 +1630,16 @@ int index_storage_search_deinit(struct mail_search_context *_ctx)
 	if (ctx->failed)
 		mail_storage_last_error_pop(ctx->box->storage);
 	array_free(&ctx->mail_ctx.mails);
+	if (array_is_created(&ctx->prefilter_keywords))
+		array_free(&ctx->prefilter_keywords);
+	if (array_is_created(&ctx->prefilter_not_keywords))
+		array_free(&ctx->prefilter_not_keywords);
+	if (array_is_created(&ctx->prefilter_seqs))
+		array_free(&ctx->prefilter_seqs);
+	if (ctx->body_search_ctx != NULL)
+		message_search_deinit(&ctx->body_search_ctx);
+	if (array_is_created(&ctx->body_search_args))
+		array_free(&ctx->body_search_args);
 	pool_unref(&ctx->temp_pool);
 	i_free(ctx);
 	return ret;
@@ -1635,6 +1871,22 @@ int index_storage_search_next_match_mail(struct mail_search_context *_ctx,
 	return 0;
 }
 
+static void search_cache_prefetch(struct index_search_context *ctx,
+				  struct mail *mail)
+{
+	uint32_t seq1 = ctx->mail_ctx.seq, seq2;
+
+	if (ctx->cache_prefetch_seq == 0 &&
+	    ctx->seq2 - seq1 < SEARCH_CACHE_PREFETCH_MIN_MESSAGES) {
+		/* small fetch - looking up the records as needed is fine */
+		ctx->cache_prefetch_seq = (uint32_t)-1;
+		return;
+	}
+	seq2 = I_MIN(ctx->seq2, seq1 + SEARCH_CACHE_PREFETCH_WINDOW - 1);
+	index_mail_cache_prefetch(mail, seq1, seq2);
+	ctx->cache_prefetch_seq = seq2 + 1;
+}
+
 static int search_more_with_mail(struct index_search_context *ctx,
 				 struct mail *mail)
 {
@@ -1660,6 +1912,8 @@ static int search_more_with_mail(struct index_search_context *ctx,
 		} T_END;
 		if (!more)
 			break;
+		if (_ctx->seq >= ctx->cache_prefetch_seq)
+			search_cache_prefetch(ctx, mail);
 		mail_set_seq(mail, _ctx->seq);
 
 		T_BEGIN {
@@ -1894,6 +2148,7 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 	if (_ctx->seq == 0) {
 		/* first time */
 		_ctx->seq = ctx->seq1;
+		search_lookup_prefilter_seqs(ctx);
 	} else {
 		_ctx->seq++;
 	}
@@ -1906,6 +2161,14 @@ bool index_storage_search_next_update_seq(struct mail_search_context *_ctx)
 
 	ret = 0;
 	while (_ctx->seq <= ctx->seq2) {
+		/* skip directly to the next mail with matching flags and
+		   keywords */
+		if (array_is_created(&ctx->prefilter_seqs) &&
+		    !search_prefilter_next_seq(ctx, &_ctx->seq)) {
+			_ctx->seq = ctx->seq2 + 1;
+			break;
+		}
+
 		/* check if the sequence matches */
 		ret = mail_search_args_foreach(ctx->mail_ctx.args->args,
 					       search_seqset_arg, ctx);
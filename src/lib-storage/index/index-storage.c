@@ -280,6 +280,8 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 		.index = {
 			.rewrite_min_log_bytes = set->mail_index_rewrite_min_log_bytes,
 			.rewrite_max_log_bytes = set->mail_index_rewrite_max_log_bytes,
+			.sparse_map_min_size = set->mail_index_sparse_map_min_size,
+			.shared_map = set->mail_index_shared_map,
 		},
 		.log = {
 			.min_size = set->mail_index_log_rotate_min_size,
@@ -297,6 +299,7 @@ int index_storage_mailbox_alloc_index(struct mailbox *box)
 			.purge_delete_percentage = set->mail_cache_purge_delete_percentage,
 			.purge_continued_percentage = set->mail_cache_purge_continued_percentage,
 			.purge_header_continue_count = set->mail_cache_purge_header_continue_count,
+			.compress = set->mail_cache_compress,
 		},
 	};
 	mail_index_set_optimization_settings(box->index, &optimization_set);
@@ -57,8 +57,11 @@ static const struct setting_define mail_storage_setting_defines[] = {
 	DEF(UINT_HIDDEN, mail_cache_purge_delete_percentage),
 	DEF(UINT_HIDDEN, mail_cache_purge_continued_percentage),
 	DEF(UINT_HIDDEN, mail_cache_purge_header_continue_count),
+	DEF(BOOL, mail_cache_compress),
 	DEF(SIZE_HIDDEN, mail_index_rewrite_min_log_bytes),
 	DEF(SIZE_HIDDEN, mail_index_rewrite_max_log_bytes),
+	DEF(SIZE, mail_index_sparse_map_min_size),
+	DEF(BOOL, mail_index_shared_map),
 	DEF(SIZE_HIDDEN, mail_index_log_rotate_min_size),
 	DEF(SIZE_HIDDEN, mail_index_log_rotate_max_size),
 	DEF(TIME_HIDDEN, mail_index_log_rotate_min_age),
@@ -131,8 +134,11 @@ const struct mail_storage_settings mail_storage_default_settings = {
 	.mail_cache_purge_delete_percentage = 20,
 	.mail_cache_purge_continued_percentage = 200,
 	.mail_cache_purge_header_continue_count = 4,
+	.mail_cache_compress = FALSE,
 	.mail_index_rewrite_min_log_bytes = 8 * 1024,
 	.mail_index_rewrite_max_log_bytes = 128 * 1024,
+	.mail_index_sparse_map_min_size = 0,
+	.mail_index_shared_map = FALSE,
 	.mail_index_log_rotate_min_size = 32 * 1024,
 	.mail_index_log_rotate_max_size = 1024 * 1024,
 	.mail_index_log_rotate_min_age = 5 * 60,
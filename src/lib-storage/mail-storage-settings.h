@@ -48,8 +48,11 @@ struct mail_storage_settings {
 	unsigned int mail_cache_purge_delete_percentage;
 	unsigned int mail_cache_purge_continued_percentage;
 	unsigned int mail_cache_purge_header_continue_count;
+	bool mail_cache_compress;
 	uoff_t mail_index_rewrite_min_log_bytes;
 	uoff_t mail_index_rewrite_max_log_bytes;
+	uoff_t mail_index_sparse_map_min_size;
+	bool mail_index_shared_map;
 	uoff_t mail_index_log_rotate_min_size;
 	uoff_t mail_index_log_rotate_max_size;
 	unsigned int mail_index_log_rotate_min_age;
@@ -5,6 +5,7 @@
 #include "istream.h"
 #include "master-service.h"
 #include "message-size.h"
+#include "mail-search-build.h"
 #include "test-mail-storage-common.h"
 
 static struct event *test_event;
@@ -726,6 +727,318 @@ static void test_mail_get_last_internal_error(void)
 	test_mail_storage_deinit(&ctx);
 }
 
+static unsigned int
+test_mail_search_flags_count(struct mailbox *box, enum mail_flags flags,
+			     enum mail_flags not_flags)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	struct mail *mail;
+	unsigned int count = 0;
+
+	args = mail_search_build_init();
+	if (flags != 0) {
+		arg = mail_search_build_add(args, SEARCH_FLAGS);
+		arg->value.flags = flags;
+	}
+	if (not_flags != 0) {
+		arg = mail_search_build_add(args, SEARCH_FLAGS);
+		arg->value.flags = not_flags;
+		arg->match_not = TRUE;
+	}
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, args, NULL, 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		enum mail_flags mail_flags = mail_get_flags(mail);
+		test_assert_idx((mail_flags & flags) == flags, mail->seq);
+		test_assert_idx(not_flags == 0 ||
+				(mail_flags & not_flags) != not_flags,
+				mail->seq);
+		count++;
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mail_search_args_unref(&args);
+	return count;
+}
+
+static unsigned int
+test_mail_search_keyword_count_trans(struct mailbox_transaction_context *trans,
+				     const char *keyword, bool match_not)
+{
+	struct mail_search_context *search_ctx;
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	struct mail *mail;
+	unsigned int count = 0;
+
+	args = mail_search_build_init();
+	arg = mail_search_build_add(args, SEARCH_KEYWORDS);
+	arg->value.str = p_strdup(args->pool, keyword);
+	arg->match_not = match_not;
+	/* looks up the keywords */
+	mail_search_args_init(args, mailbox_transaction_get_mailbox(trans),
+			      FALSE, NULL);
+
+	search_ctx = mailbox_search_init(trans, args, NULL, 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail)) {
+		const char *const *keywords = mail_get_keywords(mail);
+		test_assert_idx(str_array_find(keywords, keyword) != match_not,
+				mail->seq);
+		count++;
+	}
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	mail_search_args_deinit(args);
+	mail_search_args_unref(&args);
+	return count;
+}
+
+static unsigned int
+test_mail_search_keyword_count(struct mailbox *box, const char *keyword,
+			       bool match_not)
+{
+	struct mailbox_transaction_context *trans;
+	unsigned int count;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	count = test_mail_search_keyword_count_trans(trans, keyword, match_not);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	return count;
+}
+
+static void test_mail_search_flags(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	struct mailbox_transaction_context *trans;
+	struct mailbox *box;
+	struct istream *input;
+	struct mail *mail;
+	const char *mail_input = "Subject: test\n\nbody\n";
+	const unsigned int count = 1100;
+	unsigned int seq, seen_count = 0, seen_undeleted_count = 0;
+	enum mail_flags flags;
+	const char *keyword_names[] = { "$kw", NULL };
+	struct mail_keywords *keywords;
+
+	test_begin("mail search flags");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(box) < 0)
+		i_fatal("Failed to open mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+
+	/* large enough mailbox that the index's flags column is used */
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (seq = 1; seq <= count; seq++) {
+		input = i_stream_create_from_data(mail_input,
+						  strlen(mail_input));
+		if (test_mail_save_trans(trans, input) < 0)
+			i_fatal("Failed to save mail: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&trans) < 0 ||
+	    mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to save mails: %s",
+			mailbox_get_last_internal_error(box, NULL));
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	keywords = mailbox_keywords_create_valid(box, keyword_names);
+	mail = mail_alloc(trans, 0, NULL);
+	for (seq = 1; seq <= count; seq++) {
+		flags = 0;
+		if (seq % 3 == 0)
+			flags |= MAIL_SEEN;
+		if (seq % 5 == 0)
+			flags |= MAIL_DELETED;
+		if ((flags & MAIL_SEEN) != 0) {
+			seen_count++;
+			if ((flags & MAIL_DELETED) == 0)
+				seen_undeleted_count++;
+		}
+		mail_set_seq(mail, seq);
+		mail_update_flags(mail, MODIFY_REPLACE, flags);
+		if (seq % 7 == 0)
+			mail_update_keywords(mail, MODIFY_ADD, keywords);
+	}
+	mail_free(&mail);
+	mailbox_keywords_unref(&keywords);
+	if (mailbox_transaction_commit(&trans) < 0 ||
+	    mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to update flags: %s",
+			mailbox_get_last_internal_error(box, NULL));
+
+	test_assert(test_mail_search_flags_count(box, MAIL_SEEN, 0) ==
+		    seen_count);
+	test_assert(test_mail_search_flags_count(box, 0, MAIL_SEEN) ==
+		    count - seen_count);
+	test_assert(test_mail_search_flags_count(box, MAIL_SEEN,
+						 MAIL_DELETED) ==
+		    seen_undeleted_count);
+	test_assert(test_mail_search_flags_count(box, 0,
+						 MAIL_SEEN | MAIL_DELETED) ==
+		    count - count / 15);
+	test_assert(test_mail_search_keyword_count(box, "$kw", FALSE) ==
+		    count / 7);
+	test_assert(test_mail_search_keyword_count(box, "$kw", TRUE) ==
+		    count - count / 7);
+	test_assert(test_mail_search_keyword_count(box, "$nonexistent",
+						   FALSE) == 0);
+	test_assert(test_mail_search_keyword_count(box, "$nonexistent",
+						   TRUE) == count);
+
+	/* searches see the keyword changes made in the same transaction */
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	keywords = mailbox_keywords_create_valid(box, keyword_names);
+	mail = mail_alloc(trans, 0, NULL);
+	mail_set_seq(mail, 1);
+	mail_update_keywords(mail, MODIFY_ADD, keywords);
+	mail_set_seq(mail, 2);
+	mail_update_keywords(mail, MODIFY_ADD, keywords);
+	mail_set_seq(mail, 7);
+	mail_update_keywords(mail, MODIFY_REMOVE, keywords);
+	mail_free(&mail);
+	mailbox_keywords_unref(&keywords);
+	test_assert(test_mail_search_keyword_count_trans(trans, "$kw", FALSE) ==
+		    count / 7 + 1);
+	test_assert(test_mail_search_keyword_count_trans(trans, "$kw", TRUE) ==
+		    count - count / 7 - 1);
+	mailbox_transaction_rollback(&trans);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
+static struct mail_search_arg *
+test_mail_search_body_arg(struct mail_search_args *args,
+			  struct mail_search_arg **next,
+			  enum mail_search_arg_type type, const char *key)
+{
+	struct mail_search_arg *arg;
+
+	arg = p_new(args->pool, struct mail_search_arg, 1);
+	arg->type = type;
+	arg->value.str = p_strdup(args->pool, key);
+	arg->next = *next;
+	*next = arg;
+	return arg;
+}
+
+static unsigned int
+test_mail_search_body_seqs(struct mailbox *box, struct mail_search_args *args)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_context *search_ctx;
+	struct mail *mail;
+	unsigned int seqs = 0;
+
+	mail_search_args_init(args, box, FALSE, NULL);
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_ctx = mailbox_search_init(trans, args, NULL, 0, NULL);
+	while (mailbox_search_next(search_ctx, &mail))
+		seqs |= 1U << mail->seq;
+	test_assert(mailbox_search_deinit(&search_ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	mail_search_args_deinit(args);
+	mail_search_args_unref(&args);
+	return seqs;
+}
+
+static void test_mail_search_body(void)
+{
+	struct test_mail_storage_ctx *ctx;
+	struct test_mail_storage_settings set = {
+		.driver = "sdbox",
+	};
+	static const char *mails[] = {
+		"Subject: apple\n\nbanana cherry\n",
+		"Subject: banana\n\napple\n",
+		"Subject: test\n\ncherry\n",
+		"Subject: test\n\nbanana apple cherry\n",
+	};
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *args;
+	struct mail_search_arg *arg;
+	struct mailbox *box;
+	struct istream *input;
+	unsigned int i;
+
+	test_begin("mail search body");
+	ctx = test_mail_storage_init();
+	test_mail_storage_init_user(ctx, &set);
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(box) < 0)
+		i_fatal("Failed to open mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (i = 0; i < N_ELEMENTS(mails); i++) {
+		input = i_stream_create_from_data(mails[i], strlen(mails[i]));
+		if (test_mail_save_trans(trans, input) < 0)
+			i_fatal("Failed to save mail: %s",
+				mailbox_get_last_internal_error(box, NULL));
+		i_stream_unref(&input);
+	}
+	if (mailbox_transaction_commit(&trans) < 0 ||
+	    mailbox_sync(box, 0) < 0)
+		i_fatal("Failed to save mails: %s",
+			mailbox_get_last_internal_error(box, NULL));
+
+	/* single BODY key */
+	args = mail_search_build_init();
+	test_mail_search_body_arg(args, &args->args, SEARCH_BODY, "apple");
+	test_assert(test_mail_search_body_seqs(box, args) ==
+		    (1U << 2 | 1U << 4));
+
+	/* TEXT apple BODY banana */
+	args = mail_search_build_init();
+	test_mail_search_body_arg(args, &args->args, SEARCH_BODY, "banana");
+	test_mail_search_body_arg(args, &args->args, SEARCH_TEXT, "apple");
+	test_assert(test_mail_search_body_seqs(box, args) ==
+		    (1U << 1 | 1U << 4));
+
+	/* BODY apple BODY cherry */
+	args = mail_search_build_init();
+	test_mail_search_body_arg(args, &args->args, SEARCH_BODY, "cherry");
+	test_mail_search_body_arg(args, &args->args, SEARCH_BODY, "apple");
+	test_assert(test_mail_search_body_seqs(box, args) == 1U << 4);
+
+	/* OR BODY apple BODY cherry TEXT banana */
+	args = mail_search_build_init();
+	test_mail_search_body_arg(args, &args->args, SEARCH_TEXT, "banana");
+	arg = test_mail_search_body_arg(args, &args->args, SEARCH_OR, NULL);
+	test_mail_search_body_arg(args, &arg->value.subargs,
+				  SEARCH_BODY, "cherry");
+	test_mail_search_body_arg(args, &arg->value.subargs,
+				  SEARCH_BODY, "apple");
+	test_assert(test_mail_search_body_seqs(box, args) ==
+		    (1U << 1 | 1U << 2 | 1U << 4));
+
+	/* NOT BODY banana TEXT cherry */
+	args = mail_search_build_init();
+	test_mail_search_body_arg(args, &args->args, SEARCH_TEXT, "cherry");
+	arg = test_mail_search_body_arg(args, &args->args,
+					SEARCH_BODY, "banana");
+	arg->match_not = TRUE;
+	test_assert(test_mail_search_body_seqs(box, args) == 1U << 3);
+
+	mailbox_free(&box);
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	test_end();
+}
+
 int main(int argc, char **argv)
 {
 	void (*const tests[])(void) = {
@@ -736,6 +1049,8 @@ int main(int argc, char **argv)
 		test_mail_set_critical,
 		test_mail_set_critical_different_mailboxes,
 		test_mail_get_last_internal_error,
+		test_mail_search_flags,
+		test_mail_search_body,
 		NULL
 	};
 	int ret;
@@ -599,6 +599,44 @@ base64_skip_whitespace(struct base64_decoder *dec, const unsigned char *src_c,
 		(*src_pos)++;
 }
 
+#define BASE64_DECODE_BULK_GROUPS 64
+
+/* Decode as many complete 4-character groups without any whitespace or
+   padding as possible. Returns the number of source bytes consumed, which is
+   always a multiple of 4. */
+static size_t
+base64_decode_bulk(const unsigned char *decmap, const unsigned char *src_c,
+		   size_t src_size, size_t dst_avail, buffer_t *dest)
+{
+	unsigned char out[BASE64_DECODE_BULK_GROUPS * 3];
+	size_t groups, i, src_pos = 0;
+	uint32_t a, b, c, d, v;
+
+	groups = I_MIN(src_size / 4, dst_avail / 3);
+	while (groups > 0) {
+		size_t count = I_MIN(groups, BASE64_DECODE_BULK_GROUPS);
+
+		for (i = 0; i < count; i++, src_pos += 4) {
+			a = decmap[src_c[src_pos]];
+			b = decmap[src_c[src_pos + 1]];
+			c = decmap[src_c[src_pos + 2]];
+			d = decmap[src_c[src_pos + 3]];
+			/* valid values are 0..63, invalid ones are 0xff */
+			if (unlikely(((a | b | c | d) & 0xc0) != 0))
+				break;
+			v = (a << 18) | (b << 12) | (c << 6) | d;
+			out[i * 3] = (v >> 16) & 0xff;
+			out[i * 3 + 1] = (v >> 8) & 0xff;
+			out[i * 3 + 2] = v & 0xff;
+		}
+		buffer_append(dest, out, i * 3);
+		if (i < count)
+			break;
+		groups -= count;
+	}
+	return src_pos;
+}
+
 int base64_decode_more(struct base64_decoder *dec,
 		       const void *src, size_t src_size, size_t *src_pos_r,
 		       buffer_t *dest)
@@ -661,8 +699,26 @@ int base64_decode_more(struct base64_decoder *dec,
 	}
 
 	for (; !dec->seen_padding && src_pos < src_size; src_pos++) {
-		unsigned char in = src_c[src_pos];
-		unsigned char dm = b64->decmap[in];
+		unsigned char in, dm;
+
+		if (dec->sub_pos == 0) {
+			/* at a group boundary: decode the following complete
+			   groups in bulk and fall back to handling one
+			   character at a time only for whitespace, padding
+			   and invalid input. */
+			size_t bulk_size =
+				base64_decode_bulk(b64->decmap,
+						   src_c + src_pos,
+						   src_size - src_pos,
+						   dst_avail, dest);
+			src_pos += bulk_size;
+			dst_avail -= bulk_size / 4 * 3;
+			if (src_pos == src_size)
+				break;
+		}
+
+		in = src_c[src_pos];
+		dm = b64->decmap[in];
 
 		if (dm == 0xff) {
 			if (no_whitespace) {
@@ -0,0 +1,132 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "buffer.h"
+#include "base64.h"
+#include "randgen.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+/**
+ * Encodes and decodes random data with each base64 scheme and reports the
+ * throughput. The decoding is done both for unbroken input and for input
+ * wrapped into 76 character CRLF-terminated lines, like in MIME parts.
+ */
+
+#define BENCH_BASE64_LINE_LEN 76
+
+static double bench_mb_per_sec(size_t size, uint64_t nsecs)
+{
+	if (nsecs == 0)
+		nsecs = 1;
+	return ((double)size * 1000.0) / (double)nsecs;
+}
+
+static void
+bench_base64_scheme(const char *name, const struct base64_scheme *b64,
+		    const buffer_t *input, unsigned int rounds)
+{
+	struct base64_encoder enc;
+	struct base64_decoder dec;
+	buffer_t *encoded, *encoded_lines, *decoded;
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+
+	encoded = buffer_create_dynamic(default_pool,
+		MAX_BASE64_ENCODED_SIZE(input->used));
+	encoded_lines = buffer_create_dynamic(default_pool,
+		MAX_BASE64_ENCODED_SIZE(input->used) * 2);
+	decoded = buffer_create_dynamic(default_pool, input->used);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(encoded, 0);
+		base64_encode_init(&enc, b64, 0, 0);
+		if (!base64_encode_more(&enc, input->data, input->used,
+					NULL, encoded) ||
+		    !base64_encode_finish(&enc, encoded))
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	printf("%s\n", name);
+	printf("\tEncode: %0.02lf MB/s\n",
+	       bench_mb_per_sec(input->used * rounds, ts_1 - ts_0));
+
+	base64_encode_init(&enc, b64, BASE64_ENCODE_FLAG_CRLF,
+			   BENCH_BASE64_LINE_LEN);
+	if (!base64_encode_more(&enc, input->data, input->used,
+				NULL, encoded_lines) ||
+	    !base64_encode_finish(&enc, encoded_lines))
+		i_unreached();
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		base64_decode_init(&dec, b64, 0);
+		if (base64_decode_more(&dec, encoded->data, encoded->used,
+				       NULL, decoded) < 0 ||
+		    base64_decode_finish(&dec) < 0)
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	i_assert(buffer_cmp(decoded, input));
+	printf("\tDecode: %0.02lf MB/s\n",
+	       bench_mb_per_sec(encoded->used * rounds, ts_1 - ts_0));
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < rounds; i++) {
+		buffer_set_used_size(decoded, 0);
+		base64_decode_init(&dec, b64, 0);
+		if (base64_decode_more(&dec, encoded_lines->data,
+				       encoded_lines->used, NULL, decoded) < 0 ||
+		    base64_decode_finish(&dec) < 0)
+			i_unreached();
+	}
+	ts_1 = i_nanoseconds();
+	i_assert(buffer_cmp(decoded, input));
+	printf("\tDecode (%u char lines): %0.02lf MB/s\n\n",
+	       BENCH_BASE64_LINE_LEN,
+	       bench_mb_per_sec(encoded_lines->used * rounds, ts_1 - ts_0));
+
+	buffer_free(&encoded);
+	buffer_free(&encoded_lines);
+	buffer_free(&decoded);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<data size> [<rounds>]]\n", prog);
+	fprintf(stderr, "Runs with 1 MB of data and 100 rounds if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned long data_size = 1024*1024;
+	unsigned int rounds = 100;
+	buffer_t *input;
+
+	lib_init();
+
+	if (argc > 3)
+		print_usage(argv[0]);
+	if ((argc > 1 && str_to_ulong(argv[1], &data_size) < 0) ||
+	    (argc > 2 && str_to_uint(argv[2], &rounds) < 0) ||
+	    data_size == 0 || rounds == 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	input = buffer_create_dynamic(default_pool, data_size);
+	random_fill(buffer_append_space_unsafe(input, data_size), data_size);
+	printf("Input data is %lu bytes, %u rounds\n\n", data_size, rounds);
+
+	bench_base64_scheme("base64", &base64_scheme, input, rounds);
+	bench_base64_scheme("base64url", &base64url_scheme, input, rounds);
+
+	buffer_free(&input);
+	lib_deinit();
+	return 0;
+}
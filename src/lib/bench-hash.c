@@ -0,0 +1,229 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "hash.h"
+#include "randgen.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+/**
+ * Compares the chained and the flat hash table implementations. Both are
+ * filled with the same random keys, which are then looked up in random
+ * order, looked up with keys that don't exist, iterated and removed.
+ * This is done both with direct pointer keys and with string keys.
+ */
+
+struct bench_hash_result {
+	uint64_t insert, lookup, lookup_missing, iterate, remove;
+};
+
+static double bench_mops(unsigned int count, uint64_t nsecs)
+{
+	if (nsecs == 0)
+		nsecs = 1;
+	return (double)count * 1000.0 / (double)nsecs;
+}
+
+static void
+bench_hash_print(const char *name, unsigned int count,
+		 const struct bench_hash_result *result)
+{
+	printf("%s\n", name);
+	printf("\tInsert: %0.02lf Mops/s\n", bench_mops(count, result->insert));
+	printf("\tLookup: %0.02lf Mops/s\n", bench_mops(count, result->lookup));
+	printf("\tLookup missing: %0.02lf Mops/s\n",
+	       bench_mops(count, result->lookup_missing));
+	printf("\tIterate: %0.02lf Mops/s\n",
+	       bench_mops(count, result->iterate));
+	printf("\tRemove: %0.02lf Mops/s\n", bench_mops(count, result->remove));
+}
+
+static void
+bench_hash_direct(unsigned int count, const unsigned int *keys,
+		  const unsigned int *order, bool flat,
+		  struct bench_hash_result *result_r)
+{
+	HASH_TABLE(void *, void *) hash;
+	struct hash_iterate_context *iter;
+	void *key, *value;
+	unsigned int i, found = 0;
+	uint64_t ts_0, ts_1;
+
+	if (flat)
+		hash_table_create_direct_flat(&hash, default_pool, 0);
+	else
+		hash_table_create_direct(&hash, default_pool, 0);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, POINTER_CAST(keys[i]), POINTER_CAST(1));
+	ts_1 = i_nanoseconds();
+	result_r->insert = ts_1 - ts_0;
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, POINTER_CAST(keys[order[i]])) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	result_r->lookup = ts_1 - ts_0;
+	i_assert(found == count);
+
+	/* the keys are all odd */
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, POINTER_CAST(keys[i] + 1)) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	result_r->lookup_missing = ts_1 - ts_0;
+	i_assert(found == count);
+
+	found = 0;
+	ts_0 = i_nanoseconds();
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		found++;
+	hash_table_iterate_deinit(&iter);
+	ts_1 = i_nanoseconds();
+	result_r->iterate = ts_1 - ts_0;
+	i_assert(found == count);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, POINTER_CAST(keys[order[i]]));
+	ts_1 = i_nanoseconds();
+	result_r->remove = ts_1 - ts_0;
+	i_assert(hash_table_count(hash) == 0);
+
+	hash_table_destroy(&hash);
+}
+
+static void
+bench_hash_str(unsigned int count, char *const *keys,
+	       char *const *missing_keys, const unsigned int *order, bool flat,
+	       struct bench_hash_result *result_r)
+{
+	HASH_TABLE(char *, void *) hash;
+	struct hash_iterate_context *iter;
+	char *key;
+	void *value;
+	unsigned int i, found = 0;
+	uint64_t ts_0, ts_1;
+
+	if (flat)
+		hash_table_create_flat(&hash, default_pool, 0, str_hash, strcmp);
+	else
+		hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_insert(hash, keys[i], POINTER_CAST(1));
+	ts_1 = i_nanoseconds();
+	result_r->insert = ts_1 - ts_0;
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, keys[order[i]]) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	result_r->lookup = ts_1 - ts_0;
+	i_assert(found == count);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++) {
+		if (hash_table_lookup(hash, missing_keys[i]) != NULL)
+			found++;
+	}
+	ts_1 = i_nanoseconds();
+	result_r->lookup_missing = ts_1 - ts_0;
+	i_assert(found == count);
+
+	found = 0;
+	ts_0 = i_nanoseconds();
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value))
+		found++;
+	hash_table_iterate_deinit(&iter);
+	ts_1 = i_nanoseconds();
+	result_r->iterate = ts_1 - ts_0;
+	i_assert(found == count);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < count; i++)
+		hash_table_remove(hash, keys[order[i]]);
+	ts_1 = i_nanoseconds();
+	result_r->remove = ts_1 - ts_0;
+	i_assert(hash_table_count(hash) == 0);
+
+	hash_table_destroy(&hash);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<keys>]\n", prog);
+	fprintf(stderr, "Runs with 1000000 keys if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	struct bench_hash_result result;
+	unsigned int count = 1000000, i, j, tmp;
+	unsigned int *keys, *order;
+	char **str_keys, **str_missing_keys;
+	pool_t pool;
+
+	lib_init();
+
+	if (argc > 2)
+		print_usage(argv[0]);
+	if (argc > 1 && (str_to_uint(argv[1], &count) < 0 || count == 0 ||
+			 count > INT_MAX)) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	/* unique random odd keys, and a random lookup order */
+	keys = i_new(unsigned int, count);
+	order = i_new(unsigned int, count);
+	for (i = 0; i < count; i++) {
+		keys[i] = i * 2 + 1;
+		order[i] = i;
+	}
+	for (i = count - 1; i > 0; i--) {
+		j = i_rand_limit(i + 1);
+		tmp = keys[i]; keys[i] = keys[j]; keys[j] = tmp;
+		j = i_rand_limit(i + 1);
+		tmp = order[i]; order[i] = order[j]; order[j] = tmp;
+	}
+
+	pool = pool_alloconly_create("bench hash keys", count * 64);
+	str_keys = p_new(pool, char *, count);
+	str_missing_keys = p_new(pool, char *, count);
+	for (i = 0; i < count; i++) {
+		str_keys[i] = p_strdup_printf(pool, "<%u.%x@example.com>",
+					      keys[i], keys[i] * 2654435761U);
+		str_missing_keys[i] = p_strdup_printf(pool,
+			"<%u.%x@example.com>", keys[i] + 1, keys[i]);
+	}
+	printf("%u keys\n\n", count);
+
+	bench_hash_direct(count, keys, order, FALSE, &result);
+	bench_hash_print("Chained, direct keys", count, &result);
+	bench_hash_direct(count, keys, order, TRUE, &result);
+	bench_hash_print("Flat, direct keys", count, &result);
+	bench_hash_str(count, str_keys, str_missing_keys, order, FALSE, &result);
+	bench_hash_print("Chained, string keys", count, &result);
+	bench_hash_str(count, str_keys, str_missing_keys, order, TRUE, &result);
+	bench_hash_print("Flat, string keys", count, &result);
+
+	pool_unref(&pool);
+	i_free(keys);
+	i_free(order);
+	lib_deinit();
+	return 0;
+}
@@ -0,0 +1,130 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "net.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+#include <unistd.h>
+
+/**
+ * Creates a number of idle socketpairs (mimicking idling IMAP connections)
+ * and measures how quickly the ioloop notices input on a small random subset
+ * of them. The ioloop backend is chosen at compile time with
+ * ./configure --with-ioloop, so compare the results from different builds.
+ */
+
+struct bench_conn {
+	int fd[2];
+	struct io *io;
+};
+
+struct bench_ctx {
+	unsigned int pending;
+	uint64_t events;
+};
+
+#ifdef IOLOOP_URING
+#  define BENCH_IOLOOP_NAME "uring"
+#elif defined(IOLOOP_EPOLL)
+#  define BENCH_IOLOOP_NAME "epoll"
+#elif defined(IOLOOP_KQUEUE)
+#  define BENCH_IOLOOP_NAME "kqueue"
+#elif defined(IOLOOP_POLL)
+#  define BENCH_IOLOOP_NAME "poll"
+#else
+#  define BENCH_IOLOOP_NAME "select"
+#endif
+
+static struct bench_ctx bench_ctx;
+
+static void bench_conn_input(struct bench_conn *conn)
+{
+	char buf[64];
+
+	if (read(conn->fd[0], buf, sizeof(buf)) <= 0)
+		i_fatal("read() failed: %m");
+	bench_ctx.events++;
+	i_assert(bench_ctx.pending > 0);
+	if (--bench_ctx.pending == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<connections> [<rounds> [<active per round>]]]\n", prog);
+	fprintf(stderr, "Runs with 10000 connections, 1000 rounds and 10 active connections per round if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int conn_count = 10000, round_count = 1000, active_count = 10;
+	struct bench_conn *conns;
+	struct ioloop *ioloop;
+	uint64_t ts_0, ts_1;
+	unsigned int i, r;
+
+	lib_init();
+
+	if (argc > 4)
+		print_usage(argv[0]);
+	if ((argc > 1 && str_to_uint(argv[1], &conn_count) < 0) ||
+	    (argc > 2 && str_to_uint(argv[2], &round_count) < 0) ||
+	    (argc > 3 && str_to_uint(argv[3], &active_count) < 0) ||
+	    conn_count == 0 || active_count == 0) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+	active_count = I_MIN(active_count, conn_count);
+
+	ioloop = io_loop_create();
+	conns = i_new(struct bench_conn, conn_count);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < conn_count; i++) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, conns[i].fd) < 0)
+			i_fatal("socketpair() failed: %m (increase ulimit -n?)");
+		net_set_nonblock(conns[i].fd[0], TRUE);
+		conns[i].io = io_add(conns[i].fd[0], IO_READ,
+				     bench_conn_input, &conns[i]);
+	}
+	ts_1 = i_nanoseconds();
+	printf("ioloop=%s: %u connections, %u rounds, %u active per round\n",
+	       BENCH_IOLOOP_NAME, conn_count, round_count, active_count);
+	printf("\tSetup: %0.02lf us/connection\n",
+	       (double)(ts_1 - ts_0) / conn_count / 1000.0);
+
+	ts_0 = i_nanoseconds();
+	for (r = 0; r < round_count; r++) {
+		bench_ctx.pending = active_count;
+		for (i = 0; i < active_count; i++) {
+			struct bench_conn *conn =
+				&conns[(r * active_count + i) % conn_count];
+			if (write(conn->fd[1], "x", 1) != 1)
+				i_fatal("write() failed: %m");
+		}
+		io_loop_run(ioloop);
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tWakeups: %0.02lf us/round, %0.02lf us/event\n",
+	       (double)(ts_1 - ts_0) / round_count / 1000.0,
+	       (double)(ts_1 - ts_0) / bench_ctx.events / 1000.0);
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < conn_count; i++) {
+		io_remove(&conns[i].io);
+		i_close_fd(&conns[i].fd[0]);
+		i_close_fd(&conns[i].fd[1]);
+	}
+	ts_1 = i_nanoseconds();
+	printf("\tTeardown: %0.02lf us/connection\n",
+	       (double)(ts_1 - ts_0) / conn_count / 1000.0);
+
+	i_free(conns);
+	io_loop_destroy(&ioloop);
+	lib_deinit();
+	return 0;
+}
@@ -72,26 +72,34 @@ struct data_stack_frame {
 };
 #endif
 
-unsigned int data_stack_frame_id = 0;
+/* Each thread has its own data stack, so all of its state is thread-local.
+   The first thread to initialize the data stack is the main thread. */
+THREAD_LOCAL unsigned int data_stack_frame_id = 0;
 
-static bool data_stack_initialized = FALSE;
-static data_stack_frame_t root_frame_id;
+static bool data_stack_main_initialized = FALSE;
+static THREAD_LOCAL bool data_stack_initialized = FALSE;
+/* TRUE if this isn't the main thread */
+static THREAD_LOCAL bool data_stack_thread = FALSE;
+static THREAD_LOCAL data_stack_frame_t root_frame_id;
 
-static struct stack_frame *current_frame;
+static THREAD_LOCAL struct stack_frame *current_frame;
 
 /* The latest block currently used for allocation. current_block->next is
    always NULL. */
-static struct stack_block *current_block;
+static THREAD_LOCAL struct stack_block *current_block;
 /* The largest block that data stack has allocated so far, which was already
    freed. This can prevent rapid malloc()+free()ing when data stack is grown
    and shrunk constantly. */
-static struct stack_block *unused_block = NULL;
+static THREAD_LOCAL struct stack_block *unused_block = NULL;
 
+/* Events aren't thread-safe, so these are used only by the main thread. */
 static struct event *event_datastack = NULL;
 static bool event_datastack_deinitialized = FALSE;
 
-static struct stack_block *last_buffer_block;
-static size_t last_buffer_size;
+static THREAD_LOCAL struct stack_block *last_buffer_block;
+static THREAD_LOCAL size_t last_buffer_size;
+/* The out of memory handling is shared by all threads. The process is
+   going to die anyway. */
 static bool outofmem = FALSE;
 
 static union {
@@ -401,8 +409,8 @@ static void data_stack_send_grow_event(size_t last_alloc_size)
 	   but the previous one. */
 	struct stack_frame *frame = current_frame->prev;
 
-	if (event_datastack_deinitialized) {
-		/* already in the deinitialization code -
+	if (event_datastack_deinitialized || data_stack_thread) {
+		/* already in the deinitialization code or in a thread -
 		   don't send more events */
 		return;
 	}
@@ -753,9 +761,15 @@ void data_stack_init(void)
 	data_stack_initialized = TRUE;
 	data_stack_frame_id = 1;
 
-	outofmem_area.block.size = outofmem_area.block.left =
-		sizeof(outofmem_area) - sizeof(outofmem_area.block);
-	outofmem_area.block.canary = BLOCK_CANARY;
+	if (data_stack_main_initialized) {
+		/* auto-initialization in a thread */
+		data_stack_thread = TRUE;
+	} else {
+		data_stack_main_initialized = TRUE;
+		outofmem_area.block.size = outofmem_area.block.left =
+			sizeof(outofmem_area) - sizeof(outofmem_area.block);
+		outofmem_area.block.canary = BLOCK_CANARY;
+	}
 
 	current_block = mem_block_alloc(INITIAL_STACK_SIZE);
 	current_frame = NULL;
@@ -766,6 +780,26 @@ void data_stack_init(void)
 	root_frame_id = t_push("data_stack_init");
 }
 
+void data_stack_thread_init(void)
+{
+#ifndef HAVE_THREAD_LOCAL
+	i_panic("data stack: Threads not supported without thread-local storage");
+#endif
+	i_assert(data_stack_main_initialized);
+	i_assert(!data_stack_initialized);
+
+	data_stack_init();
+	i_assert(data_stack_thread);
+}
+
+void data_stack_thread_deinit(void)
+{
+	i_assert(data_stack_thread);
+
+	data_stack_deinit();
+	data_stack_initialized = FALSE;
+}
+
 void data_stack_deinit_event(void)
 {
 	event_unref(&event_datastack);
@@ -37,7 +37,7 @@ typedef unsigned int data_stack_frame_t;
 typedef struct data_stack_frame *data_stack_frame_t;
 #endif
 
-extern unsigned int data_stack_frame_id;
+extern THREAD_LOCAL unsigned int data_stack_frame_id;
 
 /* All t_..() allocations between t_push*() and t_pop() are freed after t_pop()
    is called. Returns the current stack frame number, which can be used
@@ -161,6 +161,14 @@ size_t data_stack_get_used_size(void);
 void data_stack_free_unused(void);
 
 void data_stack_init(void);
+/* Initialize a data stack for the calling thread. Each thread has its own
+   data stack, so t_*() functions and pool_datastack_create() can be used
+   within worker threads as long as the allocated memory isn't accessed by
+   the other threads. data_stack_thread_deinit() must be called before the
+   thread exits. The main thread must have called data_stack_init() (i.e.
+   lib_init()) before any threads are created. */
+void data_stack_thread_init(void);
+void data_stack_thread_deinit(void);
 void data_stack_deinit_event(void);
 void data_stack_deinit(void);
 
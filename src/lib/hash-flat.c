@@ -0,0 +1,387 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "bits.h"
+#include "hash-flat.h"
+
+#ifdef __SSE2__
+#  include <emmintrin.h>
+#endif
+
+/* Number of control bytes compared at a time. The table's capacity is
+   always a power of 2 and a multiple of this. */
+#define HASH_FLAT_GROUP_SIZE 16
+#define HASH_FLAT_MIN_CAPACITY HASH_FLAT_GROUP_SIZE
+/* Grow the table when more than 7/8 of the slots are used. */
+#define HASH_FLAT_MAX_LOAD(capacity) ((capacity) - (capacity) / 8)
+
+/* Control bytes of unused slots have the highest bit set. Used slots contain
+   the lowest 7 bits of the key's hash (H2). */
+#define HASH_FLAT_CTRL_EMPTY 0x80
+#define HASH_FLAT_CTRL_DELETED 0xfe
+#define HASH_FLAT_CTRL_IS_USED(ctrl) (((ctrl) & 0x80) == 0)
+
+/* The group is selected with H1 and the lowest 7 bits are stored to the
+   control byte as H2. */
+#define HASH_FLAT_H1(hash) ((unsigned int)((hash) >> 7))
+#define HASH_FLAT_H2(hash) ((uint8_t)((hash) & 0x7f))
+
+struct hash_flat_slot {
+	void *key;
+	void *value;
+};
+
+struct hash_flat_table {
+	unsigned int initial_capacity, capacity;
+	unsigned int count, deleted_count;
+	/* Number of empty slots that can still be used before the table
+	   needs to grow. Deleted slots can be reused without affecting it. */
+	unsigned int growth_left;
+	int frozen, iterating;
+
+	uint8_t *ctrl;
+	struct hash_flat_slot *slots;
+
+	hash_callback_t *hash_cb;
+	hash_cmp_callback_t *key_compare_cb;
+};
+
+#ifdef __SSE2__
+static inline unsigned int
+hash_flat_group_match(const uint8_t *group, uint8_t ctrl)
+{
+	__m128i bytes = _mm_loadu_si128((const __m128i *)group);
+
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes,
+						_mm_set1_epi8((char)ctrl)));
+}
+
+static inline unsigned int hash_flat_group_match_unused(const uint8_t *group)
+{
+	return _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group));
+}
+#else
+static inline unsigned int
+hash_flat_group_match(const uint8_t *group, uint8_t ctrl)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HASH_FLAT_GROUP_SIZE; i++) {
+		if (group[i] == ctrl)
+			mask |= 1U << i;
+	}
+	return mask;
+}
+
+static inline unsigned int hash_flat_group_match_unused(const uint8_t *group)
+{
+	unsigned int i, mask = 0;
+
+	for (i = 0; i < HASH_FLAT_GROUP_SIZE; i++) {
+		if (!HASH_FLAT_CTRL_IS_USED(group[i]))
+			mask |= 1U << i;
+	}
+	return mask;
+}
+#endif
+
+static inline unsigned int hash_flat_mask_first(unsigned int mask)
+{
+#if __GNUC__ > 3 || (__GNUC__ == 3 && __GNUC_MINOR__ >= 4)
+	return __builtin_ctz(mask);
+#else
+	unsigned int i;
+
+	for (i = 0; (mask & 1) == 0; i++)
+		mask >>= 1;
+	return i;
+#endif
+}
+
+static inline uint64_t
+hash_flat_hash(const struct hash_flat_table *table, const void *key)
+{
+	/* The hash callbacks are often weak (e.g. pointers with the lowest
+	   bits always 0), so mix all the bits before using them. This is
+	   the splitmix64 finalizer. */
+	uint64_t hash = table->hash_cb(key);
+
+	hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebULL;
+	return hash ^ (hash >> 31);
+}
+
+static unsigned int hash_flat_get_capacity(unsigned int count)
+{
+	/* leave the table half empty after resizing */
+	size_t capacity = nearest_power((size_t)count * 2);
+
+	i_assert(capacity <= UINT_MAX / 2);
+	return I_MAX(capacity, HASH_FLAT_MIN_CAPACITY);
+}
+
+static void
+hash_flat_alloc_slots(struct hash_flat_table *table, unsigned int capacity)
+{
+	table->capacity = capacity;
+	table->ctrl = i_malloc(capacity);
+	memset(table->ctrl, HASH_FLAT_CTRL_EMPTY, capacity);
+	table->slots = i_new(struct hash_flat_slot, capacity);
+	table->growth_left = HASH_FLAT_MAX_LOAD(capacity);
+	table->count = 0;
+	table->deleted_count = 0;
+}
+
+struct hash_flat_table *
+hash_flat_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_flat_table *table;
+
+	table = i_new(struct hash_flat_table, 1);
+	table->initial_capacity = hash_flat_get_capacity(initial_size);
+	table->hash_cb = hash_cb;
+	table->key_compare_cb = key_compare_cb;
+	hash_flat_alloc_slots(table, table->initial_capacity);
+	return table;
+}
+
+void hash_flat_destroy(struct hash_flat_table **_table)
+{
+	struct hash_flat_table *table = *_table;
+
+	*_table = NULL;
+	i_assert(table->frozen == 0);
+
+	i_free(table->ctrl);
+	i_free(table->slots);
+	i_free(table);
+}
+
+void hash_flat_clear(struct hash_flat_table *table)
+{
+	i_assert(table->frozen == 0);
+
+	memset(table->ctrl, HASH_FLAT_CTRL_EMPTY, table->capacity);
+	memset(table->slots, 0, sizeof(*table->slots) * table->capacity);
+	table->growth_left = HASH_FLAT_MAX_LOAD(table->capacity);
+	table->count = 0;
+	table->deleted_count = 0;
+}
+
+static struct hash_flat_slot *
+hash_flat_find(const struct hash_flat_table *table, const void *key,
+	       uint64_t hash)
+{
+	unsigned int group_mask = table->capacity / HASH_FLAT_GROUP_SIZE - 1;
+	unsigned int group = HASH_FLAT_H1(hash) & group_mask;
+	uint8_t h2 = HASH_FLAT_H2(hash);
+	const uint8_t *ctrl;
+	unsigned int probe, mask, idx;
+
+	/* Triangular probing visits all the groups exactly once, since the
+	   number of groups is a power of 2. */
+	for (probe = 1; probe <= group_mask + 1; probe++) {
+		ctrl = table->ctrl + group * HASH_FLAT_GROUP_SIZE;
+		mask = hash_flat_group_match(ctrl, h2);
+		while (mask != 0) {
+			idx = group * HASH_FLAT_GROUP_SIZE +
+				hash_flat_mask_first(mask);
+			if (table->key_compare_cb(table->slots[idx].key,
+						  key) == 0)
+				return &table->slots[idx];
+			mask &= mask - 1;
+		}
+		/* Keys are never inserted past a group that has empty
+		   slots, so the key can't be found from later groups. */
+		if (hash_flat_group_match(ctrl, HASH_FLAT_CTRL_EMPTY) != 0)
+			return NULL;
+		group = (group + probe) & group_mask;
+	}
+	return NULL;
+}
+
+static unsigned int
+hash_flat_find_unused(const struct hash_flat_table *table, uint64_t hash)
+{
+	unsigned int group_mask = table->capacity / HASH_FLAT_GROUP_SIZE - 1;
+	unsigned int group = HASH_FLAT_H1(hash) & group_mask;
+	unsigned int probe, mask;
+
+	for (probe = 1; probe <= group_mask + 1; probe++) {
+		mask = hash_flat_group_match_unused(table->ctrl +
+			group * HASH_FLAT_GROUP_SIZE);
+		if (mask != 0) {
+			return group * HASH_FLAT_GROUP_SIZE +
+				hash_flat_mask_first(mask);
+		}
+		group = (group + probe) & group_mask;
+	}
+	return UINT_MAX;
+}
+
+static void hash_flat_resize(struct hash_flat_table *table)
+{
+	uint8_t *old_ctrl = table->ctrl;
+	struct hash_flat_slot *old_slots = table->slots;
+	unsigned int i, idx, old_capacity = table->capacity;
+	unsigned int count = table->count;
+	uint64_t hash;
+
+	i_assert(table->iterating == 0);
+
+	hash_flat_alloc_slots(table, I_MAX(hash_flat_get_capacity(count + 1),
+					   table->initial_capacity));
+	for (i = 0; i < old_capacity; i++) {
+		if (!HASH_FLAT_CTRL_IS_USED(old_ctrl[i]))
+			continue;
+
+		hash = hash_flat_hash(table, old_slots[i].key);
+		idx = hash_flat_find_unused(table, hash);
+		i_assert(idx != UINT_MAX);
+		table->ctrl[idx] = HASH_FLAT_H2(hash);
+		table->slots[idx] = old_slots[i];
+	}
+	table->count = count;
+	table->growth_left -= count;
+
+	i_free(old_ctrl);
+	i_free(old_slots);
+}
+
+static void hash_flat_shrink_if_needed(struct hash_flat_table *table)
+{
+	if (table->frozen == 0 && table->capacity > table->initial_capacity &&
+	    table->count < table->capacity / 8)
+		hash_flat_resize(table);
+}
+
+bool hash_flat_lookup(const struct hash_flat_table *table, const void *key,
+		      void **orig_key_r, void **value_r)
+{
+	struct hash_flat_slot *slot;
+
+	slot = hash_flat_find(table, key, hash_flat_hash(table, key));
+	if (slot == NULL)
+		return FALSE;
+	*orig_key_r = slot->key;
+	*value_r = slot->value;
+	return TRUE;
+}
+
+void hash_flat_insert(struct hash_flat_table *table, void *key, void *value,
+		      bool update)
+{
+	struct hash_flat_slot *slot;
+	unsigned int idx;
+	uint64_t hash;
+
+	i_assert(table->count < UINT_MAX);
+	i_assert(key != NULL);
+
+	hash = hash_flat_hash(table, key);
+	slot = hash_flat_find(table, key, hash);
+	if (slot != NULL) {
+		i_assert(update);
+		slot->value = value;
+		return;
+	}
+
+	if (table->growth_left == 0 && table->iterating == 0) {
+		/* this also drops the deleted slots */
+		hash_flat_resize(table);
+	}
+	idx = hash_flat_find_unused(table, hash);
+	if (idx == UINT_MAX) {
+		/* can't resize while iterating */
+		i_panic("hash table is full while iterating");
+	}
+
+	if (table->ctrl[idx] == HASH_FLAT_CTRL_DELETED)
+		table->deleted_count--;
+	else if (table->growth_left > 0)
+		table->growth_left--;
+	table->ctrl[idx] = HASH_FLAT_H2(hash);
+	table->slots[idx].key = key;
+	table->slots[idx].value = value;
+	table->count++;
+}
+
+bool hash_flat_try_remove(struct hash_flat_table *table, const void *key)
+{
+	struct hash_flat_slot *slot;
+	unsigned int idx;
+	const uint8_t *group;
+
+	slot = hash_flat_find(table, key, hash_flat_hash(table, key));
+	if (slot == NULL)
+		return FALSE;
+
+	idx = slot - table->slots;
+	group = table->ctrl + (idx & ~(HASH_FLAT_GROUP_SIZE - 1));
+	if (hash_flat_group_match(group, HASH_FLAT_CTRL_EMPTY) != 0) {
+		/* no lookup continues past this group, so the slot can be
+		   marked empty */
+		table->ctrl[idx] = HASH_FLAT_CTRL_EMPTY;
+		table->growth_left++;
+	} else {
+		table->ctrl[idx] = HASH_FLAT_CTRL_DELETED;
+		table->deleted_count++;
+	}
+	slot->key = NULL;
+	slot->value = NULL;
+	table->count--;
+
+	hash_flat_shrink_if_needed(table);
+	return TRUE;
+}
+
+unsigned int hash_flat_count(const struct hash_flat_table *table)
+{
+	return table->count;
+}
+
+void hash_flat_freeze(struct hash_flat_table *table, bool iterating)
+{
+	table->frozen++;
+	if (iterating)
+		table->iterating++;
+}
+
+void hash_flat_thaw(struct hash_flat_table *table, bool iterating)
+{
+	i_assert(table->frozen > 0);
+
+	if (iterating) {
+		i_assert(table->iterating > 0);
+		table->iterating--;
+	}
+	if (--table->frozen > 0)
+		return;
+
+	if (table->growth_left == 0) {
+		/* nodes were added while iterating */
+		hash_flat_resize(table);
+	} else {
+		hash_flat_shrink_if_needed(table);
+	}
+}
+
+bool hash_flat_iterate(const struct hash_flat_table *table, unsigned int *pos,
+		       void **key_r, void **value_r)
+{
+	unsigned int idx;
+
+	for (idx = *pos; idx < table->capacity; idx++) {
+		if (HASH_FLAT_CTRL_IS_USED(table->ctrl[idx])) {
+			*key_r = table->slots[idx].key;
+			*value_r = table->slots[idx].value;
+			*pos = idx + 1;
+			return TRUE;
+		}
+	}
+	*pos = idx;
+	return FALSE;
+}
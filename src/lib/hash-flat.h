@@ -0,0 +1,37 @@
+#ifndef HASH_FLAT_H
+#define HASH_FLAT_H
+
+#include "hash.h"
+
+/* Open-addressing implementation behind hash_table_create_flat(). The keys
+   and values are stored directly in the table's slot array, and each slot
+   has a 1 byte control byte containing 7 bits of the key's hash. Lookups
+   compare a group of 16 control bytes at a time and only access the slots
+   whose control bytes match. These are only called via hash.c. */
+struct hash_flat_table;
+
+struct hash_flat_table *
+hash_flat_create(unsigned int initial_size, hash_callback_t *hash_cb,
+		 hash_cmp_callback_t *key_compare_cb);
+void hash_flat_destroy(struct hash_flat_table **table);
+void hash_flat_clear(struct hash_flat_table *table);
+
+bool hash_flat_lookup(const struct hash_flat_table *table, const void *key,
+		      void **orig_key_r, void **value_r);
+/* If the key already exists, assert-crash if update=FALSE. Otherwise
+   preserve the original key and update only the value. */
+void hash_flat_insert(struct hash_flat_table *table, void *key, void *value,
+		      bool update);
+bool hash_flat_try_remove(struct hash_flat_table *table, const void *key);
+unsigned int hash_flat_count(const struct hash_flat_table *table);
+
+/* The table isn't shrunk while it's frozen. While iterating it also isn't
+   grown, so the slots don't move. */
+void hash_flat_freeze(struct hash_flat_table *table, bool iterating);
+void hash_flat_thaw(struct hash_flat_table *table, bool iterating);
+/* Returns the next node after *pos and updates *pos. Returns FALSE if there
+   are no more nodes. */
+bool hash_flat_iterate(const struct hash_flat_table *table, unsigned int *pos,
+		       void **key_r, void **value_r);
+
+#endif
@@ -4,6 +4,7 @@
 
 #include "lib.h"
 #include "hash.h"
+#include "hash-flat.h"
 #include "primes.h"
 
 #include <ctype.h>
@@ -12,6 +13,8 @@
 
 #undef hash_table_create
 #undef hash_table_create_direct
+#undef hash_table_create_flat
+#undef hash_table_create_direct_flat
 #undef hash_table_destroy
 #undef hash_table_clear
 #undef hash_table_lookup
@@ -44,6 +47,10 @@ struct hash_table {
 
 	hash_callback_t *hash_cb;
 	hash_cmp_callback_t *key_compare_cb;
+
+	/* Non-NULL if created with hash_table_create_flat(). All the
+	   operations are then done by it. */
+	struct hash_flat_table *flat;
 };
 
 struct hash_iterate_context {
@@ -98,6 +105,28 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 			  direct_hash, direct_cmp);
 }
 
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size, hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb)
+{
+	struct hash_table *table;
+
+	pool_ref(node_pool);
+	table = i_new(struct hash_table, 1);
+	table->node_pool = node_pool;
+	table->hash_cb = hash_cb;
+	table->key_compare_cb = key_compare_cb;
+	table->flat = hash_flat_create(initial_size, hash_cb, key_compare_cb);
+	*table_r = table;
+}
+
+void hash_table_create_direct_flat(struct hash_table **table_r,
+				   pool_t node_pool, unsigned int initial_size)
+{
+	hash_table_create_flat(table_r, node_pool, initial_size,
+			       direct_hash, direct_cmp);
+}
+
 static void free_node(struct hash_table *table, struct hash_node *node)
 {
 	if (!table->node_pool->alloconly_pool)
@@ -139,7 +168,9 @@ void hash_table_destroy(struct hash_table **_table)
 
 	i_assert(table->frozen == 0);
 
-	if (!table->node_pool->alloconly_pool) {
+	if (table->flat != NULL)
+		hash_flat_destroy(&table->flat);
+	else if (!table->node_pool->alloconly_pool) {
 		hash_table_destroy_nodes(table);
 		destroy_node_list(table, table->free_nodes);
 	}
@@ -153,6 +184,11 @@ void hash_table_clear(struct hash_table *table, bool free_nodes)
 {
 	i_assert(table->frozen == 0);
 
+	if (table->flat != NULL) {
+		hash_flat_clear(table->flat);
+		return;
+	}
+
 	if (!table->node_pool->alloconly_pool)
 		hash_table_destroy_nodes(table);
 
@@ -191,6 +227,14 @@ void *hash_table_lookup(const struct hash_table *table, const void *key)
 {
 	struct hash_node *node;
 
+	if (table->flat != NULL) {
+		void *orig_key, *value;
+
+		if (!hash_flat_lookup(table->flat, key, &orig_key, &value))
+			return NULL;
+		return value;
+	}
+
 	node = hash_table_lookup_node(table, key, table->hash_cb(key));
 	return node != NULL ? node->value : NULL;
 }
@@ -201,6 +245,11 @@ bool hash_table_lookup_full(const struct hash_table *table,
 {
 	struct hash_node *node;
 
+	if (table->flat != NULL) {
+		return hash_flat_lookup(table->flat, lookup_key,
+					orig_key, value);
+	}
+
 	node = hash_table_lookup_node(table, lookup_key,
 				      table->hash_cb(lookup_key));
 	if (node == NULL)
@@ -297,12 +346,18 @@ hash_table_insert_node(struct hash_table *table, void *key, void *value,
 
 void hash_table_insert(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
+	if (table->flat != NULL)
+		hash_flat_insert(table->flat, key, value, FALSE);
+	else
+		hash_table_insert_node(table, key, value, HASH_TABLE_OP_INSERT);
 }
 
 void hash_table_update(struct hash_table *table, void *key, void *value)
 {
-	hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
+	if (table->flat != NULL)
+		hash_flat_insert(table->flat, key, value, TRUE);
+	else
+		hash_table_insert_node(table, key, value, HASH_TABLE_OP_UPDATE);
 }
 
 static void
@@ -347,6 +402,9 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 	struct hash_node *node;
 	unsigned int hash;
 
+	if (table->flat != NULL)
+		return hash_flat_try_remove(table->flat, key);
+
 	hash = table->hash_cb(key);
 
 	node = hash_table_lookup_node(table, key, hash);
@@ -365,6 +423,8 @@ bool hash_table_try_remove(struct hash_table *table, const void *key)
 
 unsigned int hash_table_count(const struct hash_table *table)
 {
+	if (table->flat != NULL)
+		return hash_flat_count(table->flat);
 	return table->nodes_count;
 }
 
@@ -372,11 +432,15 @@ struct hash_iterate_context *hash_table_iterate_init(struct hash_table *table)
 {
 	struct hash_iterate_context *ctx;
 
-	hash_table_freeze(table);
+	if (table->flat != NULL)
+		hash_flat_freeze(table->flat, TRUE);
+	else
+		hash_table_freeze(table);
 
 	ctx = i_new(struct hash_iterate_context, 1);
 	ctx->table = table;
-	ctx->next = &table->nodes[0];
+	if (table->flat == NULL)
+		ctx->next = &table->nodes[0];
 	return ctx;
 }
 
@@ -403,6 +467,15 @@ bool hash_table_iterate(struct hash_iterate_context *ctx,
 {
 	struct hash_node *node;
 
+	if (ctx->table->flat != NULL) {
+		if (!hash_flat_iterate(ctx->table->flat, &ctx->pos,
+				       key_r, value_r)) {
+			*key_r = *value_r = NULL;
+			return FALSE;
+		}
+		return TRUE;
+	}
+
 	node = ctx->next;
 	if (node != NULL && node->key == NULL)
 		node = hash_table_iterate_next(ctx, node);
@@ -425,17 +498,28 @@ void hash_table_iterate_deinit(struct hash_iterate_context **_ctx)
 		return;
 
 	*_ctx = NULL;
-	hash_table_thaw(ctx->table);
+	if (ctx->table->flat != NULL)
+		hash_flat_thaw(ctx->table->flat, TRUE);
+	else
+		hash_table_thaw(ctx->table);
 	i_free(ctx);
 }
 
 void hash_table_freeze(struct hash_table *table)
 {
-	table->frozen++;
+	if (table->flat != NULL)
+		hash_flat_freeze(table->flat, FALSE);
+	else
+		table->frozen++;
 }
 
 void hash_table_thaw(struct hash_table *table)
 {
+	if (table->flat != NULL) {
+		hash_flat_thaw(table->flat, FALSE);
+		return;
+	}
+
 	i_assert(table->frozen > 0);
 
 	if (--table->frozen > 0)
@@ -22,8 +22,7 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		       unsigned int initial_size,
 		       hash_callback_t *hash_cb,
 		       hash_cmp_callback_t *key_compare_cb);
-#define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
-	TYPE_CHECKS(void, \
+#define HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb) \
 	/* NOLINTBEGIN(bugprone-sizeof-expression) */ \
 	COMPILE_ERROR_IF_TRUE( \
 		sizeof((*table)._key) != sizeof(void *) || \
@@ -37,8 +36,11 @@ void hash_table_create(struct hash_table **table_r, pool_t node_pool,
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
 			unsigned int (*)(typeof((*table)._key))) && \
 		!__builtin_types_compatible_p(typeof(&hash_cb), \
-		unsigned int (*)(typeof((*table)._const_key)))), \
-	/* NOLINTEND(bugprone-sizeof-expression) */ \
+		unsigned int (*)(typeof((*table)._const_key)))) \
+	/* NOLINTEND(bugprone-sizeof-expression) */
+#define hash_table_create(table, pool, size, hash_cb, key_cmp_cb) \
+	TYPE_CHECKS(void, \
+	HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb), \
 	hash_table_create(&(*table)._table, pool, size, \
 		(hash_callback_t *)hash_cb, \
 		(hash_cmp_callback_t *)key_cmp_cb))
@@ -55,6 +57,36 @@ void hash_table_create_direct(struct hash_table **table_r, pool_t node_pool,
 	/* NOLINTEND(bugprone-sizeof-expression) */ \
 	hash_table_create_direct(&(*table)._table, pool, size))
 
+/* Same as hash_table_create*(), but the hash table uses open addressing:
+   keys and values are stored directly in a single array, which is probed
+   by comparing 16 bytes of hash bits at a time. Lookups in large tables
+   access much less memory than with the linked nodes. All the other
+   hash_table_*() functions work the same way, except that node_pool isn't
+   used for anything and while iterating new nodes can be added only as long
+   as the table has free slots left. There are always at least 1/8 of the
+   table size free slots when the iteration begins. */
+void hash_table_create_flat(struct hash_table **table_r, pool_t node_pool,
+			    unsigned int initial_size,
+			    hash_callback_t *hash_cb,
+			    hash_cmp_callback_t *key_compare_cb);
+#define hash_table_create_flat(table, pool, size, hash_cb, key_cmp_cb) \
+	TYPE_CHECKS(void, \
+	HASH_TABLE_CREATE_TYPE_CHECKS(table, hash_cb, key_cmp_cb), \
+	hash_table_create_flat(&(*table)._table, pool, size, \
+		(hash_callback_t *)hash_cb, \
+		(hash_cmp_callback_t *)key_cmp_cb))
+void hash_table_create_direct_flat(struct hash_table **table_r,
+				   pool_t node_pool,
+				   unsigned int initial_size);
+#define hash_table_create_direct_flat(table, pool, size) \
+	TYPE_CHECKS(void, \
+	/* NOLINTBEGIN(bugprone-sizeof-expression) */ \
+	COMPILE_ERROR_IF_TRUE( \
+		sizeof((*table)._key) != sizeof(void *) || \
+		sizeof((*table)._value) != sizeof(void *)), \
+	/* NOLINTEND(bugprone-sizeof-expression) */ \
+	hash_table_create_direct_flat(&(*table)._table, pool, size))
+
 #define hash_table_is_created(table) \
 	((table)._table != NULL)
 
@@ -0,0 +1,483 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "sleep.h"
+#include "ioloop-private.h"
+#include "ioloop-iolist.h"
+
+#ifdef IOLOOP_URING
+
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/* This backend replaces only the readiness notification: it's the io_uring
+   equivalent of ioloop-epoll.c, and it's selected the same way at compile
+   time with ./configure --with-ioloop=uring. The fds are watched with
+   one-shot IORING_OP_POLL_ADD requests. The actual read() and write() calls
+   in istream-file.c and ostream-file.c are still done directly, because
+   submitting them through the ring would require asynchronous file
+   streams. */
+
+/* Size of the submission queue. The completion queue is twice as large, and
+   the kernel buffers any overflowing completions (IORING_FEAT_NODROP), so
+   this doesn't limit the number of file descriptors being watched. */
+#define IOLOOP_URING_ENTRIES 256
+
+/* user_data for SQEs whose completions are ignored (poll removals) */
+#define IOLOOP_URING_USER_DATA_IGNORE 0
+
+#define IO_URING_POLL_ERROR (POLLERR | POLLHUP)
+#define IO_URING_POLL_INPUT (POLLIN | POLLPRI | IO_URING_POLL_ERROR)
+#define IO_URING_POLL_OUTPUT (POLLOUT | IO_URING_POLL_ERROR)
+
+struct io_uring_fd {
+	struct io_list list;
+	int fd;
+
+	/* Incremented every time a new poll request is armed for the fd.
+	   Completions of older requests are recognized by their generation
+	   and ignored. */
+	uint32_t generation;
+	/* Poll mask of the currently armed poll request, 0 if none */
+	unsigned int armed_mask;
+};
+
+struct io_uring_sq {
+	unsigned int *head, *tail, *array;
+	unsigned int mask, entries;
+	struct io_uring_sqe *sqes;
+	/* tail that hasn't been published to the kernel yet */
+	unsigned int local_tail;
+};
+
+struct io_uring_cq {
+	unsigned int *head, *tail;
+	unsigned int mask;
+	struct io_uring_cqe *cqes;
+};
+
+struct ioloop_handler_context {
+	int ring_fd;
+	struct io_uring_sq sq;
+	struct io_uring_cq cq;
+
+	void *sq_ring_ptr, *cq_ring_ptr;
+	size_t sq_ring_size, cq_ring_size, sqes_size;
+	unsigned int to_submit;
+
+	ARRAY(struct io_uring_fd *) fd_index;
+	ARRAY(struct io_uring_cqe) events;
+};
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int
+sys_io_uring_enter(int ring_fd, unsigned int to_submit,
+		   unsigned int min_complete, unsigned int flags,
+		   const void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit,
+			    min_complete, flags, arg, argsz);
+}
+
+static void *
+io_uring_mmap(int ring_fd, size_t size, off_t offset, const char *name)
+{
+	void *ptr;
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ring_fd, offset);
+	if (ptr == MAP_FAILED)
+		i_fatal("mmap(io_uring %s) failed: %m", name);
+	return ptr;
+}
+
+void io_loop_handler_init(struct ioloop *ioloop, unsigned int initial_fd_count)
+{
+	struct ioloop_handler_context *ctx;
+	struct io_uring_params params;
+	unsigned char *sq_ptr, *cq_ptr;
+
+	ioloop->handler_context = ctx = i_new(struct ioloop_handler_context, 1);
+
+	i_array_init(&ctx->fd_index, initial_fd_count);
+	i_array_init(&ctx->events, IOLOOP_URING_ENTRIES * 2);
+
+	i_zero(&params);
+	ctx->ring_fd = sys_io_uring_setup(IOLOOP_URING_ENTRIES, &params);
+	if (ctx->ring_fd < 0) {
+		if (errno != ENOMEM)
+			i_fatal("io_uring_setup(): %m");
+		i_fatal("io_uring_setup(): %m (you may need to increase "
+			"the locked memory limit)");
+	}
+	fd_close_on_exec(ctx->ring_fd, TRUE);
+
+	if ((params.features & IORING_FEAT_NODROP) == 0 ||
+	    (params.features & IORING_FEAT_EXT_ARG) == 0) {
+		i_fatal("io_uring: Kernel is missing required features "
+			"(Linux v5.11+ needed)");
+	}
+
+	ctx->sq_ring_size = params.sq_off.array +
+		params.sq_entries * sizeof(unsigned int);
+	ctx->cq_ring_size = params.cq_off.cqes +
+		params.cq_entries * sizeof(struct io_uring_cqe);
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ctx->sq_ring_size = I_MAX(ctx->sq_ring_size, ctx->cq_ring_size);
+		ctx->cq_ring_size = ctx->sq_ring_size;
+	}
+	ctx->sq_ring_ptr = io_uring_mmap(ctx->ring_fd, ctx->sq_ring_size,
+					 IORING_OFF_SQ_RING, "sq ring");
+	if ((params.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		ctx->cq_ring_ptr = ctx->sq_ring_ptr;
+	else {
+		ctx->cq_ring_ptr = io_uring_mmap(ctx->ring_fd,
+						 ctx->cq_ring_size,
+						 IORING_OFF_CQ_RING, "cq ring");
+	}
+	ctx->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ctx->sq.sqes = io_uring_mmap(ctx->ring_fd, ctx->sqes_size,
+				     IORING_OFF_SQES, "sqes");
+
+	sq_ptr = ctx->sq_ring_ptr;
+	ctx->sq.head = (unsigned int *)(sq_ptr + params.sq_off.head);
+	ctx->sq.tail = (unsigned int *)(sq_ptr + params.sq_off.tail);
+	ctx->sq.array = (unsigned int *)(sq_ptr + params.sq_off.array);
+	ctx->sq.mask = *(unsigned int *)(sq_ptr + params.sq_off.ring_mask);
+	ctx->sq.entries = params.sq_entries;
+	ctx->sq.local_tail = *ctx->sq.tail;
+
+	cq_ptr = ctx->cq_ring_ptr;
+	ctx->cq.head = (unsigned int *)(cq_ptr + params.cq_off.head);
+	ctx->cq.tail = (unsigned int *)(cq_ptr + params.cq_off.tail);
+	ctx->cq.mask = *(unsigned int *)(cq_ptr + params.cq_off.ring_mask);
+	ctx->cq.cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+}
+
+void io_loop_handler_deinit(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	struct io_uring_fd **list;
+	unsigned int i, count;
+
+	list = array_get_modifiable(&ctx->fd_index, &count);
+	for (i = 0; i < count; i++)
+		i_free(list[i]);
+
+	if (munmap(ctx->sq.sqes, ctx->sqes_size) < 0)
+		i_error("munmap(io_uring sqes) failed: %m");
+	if (ctx->cq_ring_ptr != ctx->sq_ring_ptr &&
+	    munmap(ctx->cq_ring_ptr, ctx->cq_ring_size) < 0)
+		i_error("munmap(io_uring cq ring) failed: %m");
+	if (munmap(ctx->sq_ring_ptr, ctx->sq_ring_size) < 0)
+		i_error("munmap(io_uring sq ring) failed: %m");
+	if (close(ctx->ring_fd) < 0)
+		i_error("close(io_uring) failed: %m");
+	array_free(&ioloop->handler_context->fd_index);
+	array_free(&ioloop->handler_context->events);
+	i_free(ioloop->handler_context);
+}
+
+static void io_uring_reap_events(struct ioloop_handler_context *ctx)
+{
+	unsigned int head, tail;
+
+	head = *ctx->cq.head;
+	tail = __atomic_load_n(ctx->cq.tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		const struct io_uring_cqe *cqe = &ctx->cq.cqes[head & ctx->cq.mask];
+
+		if (cqe->user_data != IOLOOP_URING_USER_DATA_IGNORE)
+			array_push_back(&ctx->events, cqe);
+	}
+	__atomic_store_n(ctx->cq.head, head, __ATOMIC_RELEASE);
+}
+
+static void io_uring_submit(struct ioloop_handler_context *ctx)
+{
+	int ret;
+
+	__atomic_store_n(ctx->sq.tail, ctx->sq.local_tail, __ATOMIC_RELEASE);
+	while (ctx->to_submit > 0) {
+		ret = sys_io_uring_enter(ctx->ring_fd, ctx->to_submit, 0, 0,
+					 NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EBUSY) {
+				/* The completion queue has overflowed. Move
+				   the completions to the events array, so the
+				   kernel can flush its overflow list and
+				   accept new submissions. The events are
+				   handled by the next ioloop run. */
+				io_uring_reap_events(ctx);
+				continue;
+			}
+			i_fatal("io_uring_enter(submit) failed: %m");
+		}
+		i_assert((unsigned int)ret <= ctx->to_submit);
+		ctx->to_submit -= ret;
+	}
+}
+
+static struct io_uring_sqe *io_uring_get_sqe(struct ioloop_handler_context *ctx)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ctx->sq.local_tail -
+	    __atomic_load_n(ctx->sq.head, __ATOMIC_ACQUIRE) >= ctx->sq.entries) {
+		/* submission queue is full - flush it to the kernel */
+		io_uring_submit(ctx);
+	}
+
+	idx = ctx->sq.local_tail & ctx->sq.mask;
+	sqe = &ctx->sq.sqes[idx];
+	i_zero(sqe);
+	ctx->sq.array[idx] = idx;
+	ctx->sq.local_tail++;
+	ctx->to_submit++;
+	return sqe;
+}
+
+static uint64_t io_uring_fd_user_data(const struct io_uring_fd *ufd)
+{
+	i_assert(ufd->generation != 0);
+	return ((uint64_t)ufd->fd << 32) | ufd->generation;
+}
+
+static unsigned int io_uring_poll_mask(const struct io_list *list)
+{
+	unsigned int events = 0;
+	struct io_file *io;
+	int i;
+
+	for (i = 0; i < IOLOOP_IOLIST_IOS_PER_FD; i++) {
+		io = list->ios[i];
+
+		if (io == NULL)
+			continue;
+
+		if ((io->io.condition & IO_READ) != 0)
+			events |= IO_URING_POLL_INPUT;
+		if ((io->io.condition & IO_WRITE) != 0)
+			events |= IO_URING_POLL_OUTPUT;
+		if ((io->io.condition & IO_ERROR) != 0)
+			events |= IO_URING_POLL_ERROR;
+	}
+	return events;
+}
+
+static void
+io_uring_fd_update(struct ioloop_handler_context *ctx, struct io_uring_fd *ufd)
+{
+	struct io_uring_sqe *sqe;
+	unsigned int mask = io_uring_poll_mask(&ufd->list);
+
+	if (ufd->armed_mask == mask)
+		return;
+
+	if (ufd->armed_mask != 0) {
+		/* poll requests can't be modified in place with older kernels,
+		   so cancel the old one and arm a new one */
+		sqe = io_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = io_uring_fd_user_data(ufd);
+		sqe->user_data = IOLOOP_URING_USER_DATA_IGNORE;
+		ufd->armed_mask = 0;
+	}
+	if (mask != 0) {
+		if (++ufd->generation == 0)
+			ufd->generation++;
+		sqe = io_uring_get_sqe(ctx);
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = ufd->fd;
+		sqe->poll32_events = mask;
+		sqe->user_data = io_uring_fd_user_data(ufd);
+		ufd->armed_mask = mask;
+	}
+}
+
+void io_loop_handle_add(struct io_file *io)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd **ufdp;
+
+	ufdp = array_idx_get_space(&ctx->fd_index, io->fd);
+	if (*ufdp == NULL) {
+		*ufdp = i_new(struct io_uring_fd, 1);
+		(*ufdp)->fd = io->fd;
+	}
+
+	(void)ioloop_iolist_add(&(*ufdp)->list, io);
+	io_uring_fd_update(ctx, *ufdp);
+	/* Submit new poll requests immediately, similar to epoll_ctl(). This
+	   way fds that are already readable get their events reported in the
+	   same order as they became ready. Re-arming is still batched to the
+	   next io_uring_enter() call. */
+	io_uring_submit(ctx);
+}
+
+void io_loop_handle_remove(struct io_file *io, bool closed ATTR_UNUSED)
+{
+	struct ioloop_handler_context *ctx = io->io.ioloop->handler_context;
+	struct io_uring_fd *ufd;
+
+	ufd = array_idx_elem(&ctx->fd_index, io->fd);
+	(void)ioloop_iolist_del(&ufd->list, io);
+	/* Unlike with epoll, a pending poll request keeps a reference to the
+	   file, so it must be cancelled even if the fd was already closed. */
+	io_uring_fd_update(ctx, ufd);
+	if (ufd->armed_mask == 0) {
+		/* The fd is most likely closed next. Submit the removal
+		   immediately, so the poll request doesn't keep the file
+		   open and its completion can't be mixed up with a new fd
+		   that reuses the same number. */
+		io_uring_submit(ctx);
+	}
+	i_free(io);
+}
+
+static void
+io_uring_wait(struct ioloop_handler_context *ctx, int msecs)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+	int ret;
+
+	__atomic_store_n(ctx->sq.tail, ctx->sq.local_tail, __ATOMIC_RELEASE);
+
+	i_zero(&arg);
+	if (msecs >= 0) {
+		ts.tv_sec = msecs / 1000;
+		ts.tv_nsec = (msecs % 1000) * 1000000LL;
+		arg.ts = (uintptr_t)&ts;
+	}
+	ret = sys_io_uring_enter(ctx->ring_fd, ctx->to_submit,
+				 msecs == 0 ? 0 : 1, flags, &arg, sizeof(arg));
+	if (ret < 0) {
+		/* EBUSY means that the completion queue has overflowed.
+		   Nothing was submitted, but the completions are reaped
+		   after this and the submission is retried below. */
+		if (errno != EINTR && errno != ETIME && errno != EBUSY)
+			i_fatal("io_uring_enter(): %m");
+	} else {
+		i_assert((unsigned int)ret <= ctx->to_submit);
+		ctx->to_submit -= ret;
+	}
+	if (ctx->to_submit > 0) {
+		if (ret < 0 && errno == EBUSY)
+			io_uring_reap_events(ctx);
+		io_uring_submit(ctx);
+	}
+}
+
+static struct io_uring_fd *
+io_uring_event_get_fd(struct ioloop_handler_context *ctx,
+		      const struct io_uring_cqe *event)
+{
+	struct io_uring_fd *ufd;
+	int fd = (int)(event->user_data >> 32);
+
+	ufd = array_idx_elem(&ctx->fd_index, fd);
+	if (ufd == NULL || ufd->armed_mask == 0 ||
+	    io_uring_fd_user_data(ufd) != event->user_data) {
+		/* completion of an already replaced poll request */
+		return NULL;
+	}
+	/* poll requests are one-shot */
+	ufd->armed_mask = 0;
+	return ufd;
+}
+
+void io_loop_handler_run_internal(struct ioloop *ioloop)
+{
+	struct ioloop_handler_context *ctx = ioloop->handler_context;
+	const struct io_uring_cqe *event;
+	struct io_uring_fd *ufd;
+	struct io_file *io;
+	struct timeval tv;
+	unsigned int i, count, revents;
+	int msecs, j;
+	bool call;
+
+	i_assert(ctx != NULL);
+
+	/* get the time left for next timeout task */
+	msecs = io_loop_run_get_wait_time(ioloop, &tv);
+	/* don't block if completions were already reaped while submitting */
+	if (array_count(&ctx->events) > 0)
+		msecs = 0;
+
+	if (ioloop->io_files != NULL)
+		io_uring_wait(ctx, msecs);
+	else {
+		/* no I/Os, but we should have some timeouts.
+		   just wait for them. */
+		i_assert(msecs >= 0);
+		if (ctx->to_submit > 0)
+			io_uring_submit(ctx);
+		i_sleep_intr_msecs(msecs);
+	}
+	io_uring_reap_events(ctx);
+
+	/* execute timeout handlers */
+	io_loop_handle_timeouts(ioloop);
+
+	count = array_count(&ctx->events);
+	for (i = 0; i < count && ioloop->running; i++) {
+		event = array_idx(&ctx->events, i);
+		ufd = io_uring_event_get_fd(ctx, event);
+		if (ufd == NULL)
+			continue;
+		revents = event->res < 0 ? POLLERR : (unsigned int)event->res;
+
+		for (j = 0; j < IOLOOP_IOLIST_IOS_PER_FD; j++) {
+			io = ufd->list.ios[j];
+			if (io == NULL)
+				continue;
+
+			call = FALSE;
+			if ((revents & (POLLHUP | POLLERR)) != 0)
+				call = TRUE;
+			else if ((io->io.condition & IO_READ) != 0)
+				call = (revents & (POLLIN | POLLPRI)) != 0;
+			else if ((io->io.condition & IO_WRITE) != 0)
+				call = (revents & POLLOUT) != 0;
+			else if ((io->io.condition & IO_ERROR) != 0)
+				call = (revents & IO_URING_POLL_ERROR) != 0;
+
+			if (call) {
+				io_loop_call_io(&io->io);
+				if (!ioloop->running)
+					break;
+			}
+		}
+		/* re-arm unless the callbacks already did it */
+		io_uring_fd_update(ctx, ufd);
+	}
+	for (; i < count; i++) {
+		/* ioloop was stopped before all events were handled. Unlike
+		   epoll the poll requests aren't level-triggered, so re-arm
+		   them to get the events reported again on the next run. */
+		ufd = io_uring_event_get_fd(ctx, array_idx(&ctx->events, i));
+		if (ufd != NULL)
+			io_uring_fd_update(ctx, ufd);
+	}
+	/* The callbacks may have reaped more completions to the end of the
+	   array. Keep them for the next run. */
+	array_delete(&ctx->events, 0, count);
+}
+
+#endif	/* IOLOOP_URING */
@@ -218,6 +218,7 @@ void lib_deinit(void)
 	restrict_access_deinit();
 	i_close_fd(&dev_null_fd);
 	data_stack_deinit();
+	pool_slab_free_unused();
 	failures_deinit();
 	process_title_deinit();
 	random_deinit();
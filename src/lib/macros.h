@@ -123,6 +123,17 @@
 #else
 #  define ATTR_DEPRECATED(str)
 #endif
+#if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 1)
+/* GCC 4.1 and later. The initial-exec model avoids calling
+   __tls_get_addr() on each access from within libdovecot.so. */
+#  define HAVE_THREAD_LOCAL
+#  define THREAD_LOCAL __thread __attribute__((tls_model("initial-exec")))
+#elif defined(__STDC_VERSION__) && __STDC_VERSION__ >= 201112L
+#  define HAVE_THREAD_LOCAL
+#  define THREAD_LOCAL _Thread_local
+#else
+#  define THREAD_LOCAL
+#endif
 
 /* Macros to provide type safety for callback functions' context parameters.
    This is used like:
@@ -0,0 +1,295 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "mempool.h"
+
+/*
+ * Thread-safe alloconly pools can be shared by multiple threads without
+ * any locking. Like with the normal alloconly pools, the memory can't be
+ * freed, except by destroying the whole pool.
+ *
+ * Implementation
+ * ==============
+ *
+ * The pool has a linked list of blocks, similar to the normal alloconly
+ * pools. The blocks are calloc()ed and the memory is never reused, so the
+ * allocations don't need to be zeroed separately.
+ *
+ * Allocation
+ * ----------
+ *
+ * Memory is allocated from the latest block by atomically moving its
+ * "used" offset forward with compare-and-swap. If the block is full, a new
+ * larger block is allocated, the allocation is placed at its beginning and
+ * the block is atomically made the latest block. If another thread managed
+ * to add a new block first, the new block is freed and the allocation is
+ * retried.
+ *
+ * Reallocation
+ * ------------
+ *
+ * If the allocation is the latest one in its block, it's attempted to be
+ * grown in place with compare-and-swap. Otherwise new memory is allocated
+ * and the data is copied there.
+ *
+ * Freeing
+ * -------
+ *
+ * A no-op.
+ *
+ * Clearing
+ * --------
+ *
+ * All blocks except the first one are freed and the first one is zeroed.
+ * This must not be done while other threads may be using the pool.
+ *
+ * Destruction
+ * -----------
+ *
+ * The reference count is updated atomically. When it drops to zero, all
+ * the blocks and the pool structure are freed.
+ */
+
+struct threadsafe_pool_block {
+	struct threadsafe_pool_block *prev;
+
+	size_t size;
+	/* Updated atomically */
+	size_t used;
+};
+
+#define SIZEOF_THREADSAFE_POOLBLOCK \
+	MEM_ALIGN(sizeof(struct threadsafe_pool_block))
+#define THREADSAFE_POOLBLOCK_DATA(block) \
+	((unsigned char *)(block) + SIZEOF_THREADSAFE_POOLBLOCK)
+
+struct threadsafe_pool {
+	struct pool pool;
+	/* Updated atomically */
+	int refcount;
+
+	/* The latest block. Updated atomically. */
+	struct threadsafe_pool_block *block;
+};
+
+static const char *pool_threadsafe_get_name(pool_t pool);
+static void pool_threadsafe_ref(pool_t pool);
+static void pool_threadsafe_unref(pool_t *pool);
+static void *pool_threadsafe_malloc(pool_t pool, size_t size);
+static void pool_threadsafe_free(pool_t pool, void *mem);
+static void *pool_threadsafe_realloc(pool_t pool, void *mem,
+				     size_t old_size, size_t new_size);
+static void pool_threadsafe_clear(pool_t pool);
+static size_t pool_threadsafe_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_threadsafe_pool_vfuncs = {
+	pool_threadsafe_get_name,
+
+	pool_threadsafe_ref,
+	pool_threadsafe_unref,
+
+	pool_threadsafe_malloc,
+	pool_threadsafe_free,
+
+	pool_threadsafe_realloc,
+
+	pool_threadsafe_clear,
+	pool_threadsafe_get_max_easy_alloc_size
+};
+
+static const struct pool static_threadsafe_pool = {
+	.v = &static_threadsafe_pool_vfuncs,
+
+	.alloconly_pool = TRUE,
+	.datastack_pool = FALSE
+};
+
+static struct threadsafe_pool_block *threadsafe_block_alloc(size_t size)
+{
+	struct threadsafe_pool_block *block;
+
+	i_assert(size <= SSIZE_T_MAX - SIZEOF_THREADSAFE_POOLBLOCK);
+
+	block = calloc(SIZEOF_THREADSAFE_POOLBLOCK + size, 1);
+	if (unlikely(block == NULL)) {
+		i_fatal_status(FATAL_OUTOFMEM, "calloc(%zu): Out of memory",
+			       SIZEOF_THREADSAFE_POOLBLOCK + size);
+	}
+	block->size = size;
+	return block;
+}
+
+pool_t pool_alloconly_create_threadsafe(const char *name ATTR_UNUSED,
+					size_t size)
+{
+	struct threadsafe_pool *tpool;
+
+	tpool = i_new(struct threadsafe_pool, 1);
+	tpool->pool = static_threadsafe_pool;
+	tpool->refcount = 1;
+	tpool->block = threadsafe_block_alloc(I_MAX(MEM_ALIGN(size),
+						    MEM_ALIGN_SIZE));
+	return &tpool->pool;
+}
+
+static void pool_threadsafe_free_blocks(struct threadsafe_pool_block *block)
+{
+	struct threadsafe_pool_block *prev;
+
+	for (; block != NULL; block = prev) {
+		prev = block->prev;
+		free(block);
+	}
+}
+
+static const char *pool_threadsafe_get_name(pool_t pool ATTR_UNUSED)
+{
+	return "alloconly threadsafe";
+}
+
+static void pool_threadsafe_ref(pool_t pool)
+{
+	struct threadsafe_pool *tpool =
+		container_of(pool, struct threadsafe_pool, pool);
+
+	(void)__atomic_add_fetch(&tpool->refcount, 1, __ATOMIC_RELAXED);
+}
+
+static void pool_threadsafe_unref(pool_t *pool)
+{
+	struct threadsafe_pool *tpool =
+		container_of(*pool, struct threadsafe_pool, pool);
+	int refcount;
+
+	/* erase the pointer before freeing anything, as the pointer may
+	   exist inside the pool's memory area */
+	*pool = NULL;
+
+	refcount = __atomic_sub_fetch(&tpool->refcount, 1, __ATOMIC_ACQ_REL);
+	i_assert(refcount >= 0);
+	if (refcount > 0)
+		return;
+
+	pool_external_refs_unref(&tpool->pool);
+	pool_threadsafe_free_blocks(tpool->block);
+	i_free(tpool);
+}
+
+static bool
+pool_threadsafe_block_reserve(struct threadsafe_pool_block *block,
+			      size_t old_used, size_t new_used)
+{
+	return __atomic_compare_exchange_n(&block->used, &old_used, new_used,
+					   FALSE, __ATOMIC_RELAXED,
+					   __ATOMIC_RELAXED);
+}
+
+static void *pool_threadsafe_malloc(pool_t pool, size_t size)
+{
+	struct threadsafe_pool *tpool =
+		container_of(pool, struct threadsafe_pool, pool);
+	struct threadsafe_pool_block *block, *new_block;
+	size_t alloc_size = MEM_ALIGN(size), used;
+
+	block = __atomic_load_n(&tpool->block, __ATOMIC_ACQUIRE);
+	for (;;) {
+		used = __atomic_load_n(&block->used, __ATOMIC_RELAXED);
+		if (block->size - used >= alloc_size) {
+			if (pool_threadsafe_block_reserve(block, used,
+							  used + alloc_size))
+				return THREADSAFE_POOLBLOCK_DATA(block) + used;
+			/* another thread allocated from the block - retry */
+			continue;
+		}
+
+		/* the block is full - add a new one with the allocation
+		   already reserved from its beginning */
+		new_block = threadsafe_block_alloc(
+			nearest_power(MALLOC_ADD(block->size, alloc_size)));
+		new_block->prev = block;
+		new_block->used = alloc_size;
+		if (__atomic_compare_exchange_n(&tpool->block, &block,
+						new_block, FALSE,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE))
+			return THREADSAFE_POOLBLOCK_DATA(new_block);
+		/* another thread added a new block - block now points to
+		   it, so retry with it */
+		free(new_block);
+	}
+}
+
+static void pool_threadsafe_free(pool_t pool ATTR_UNUSED,
+				 void *mem ATTR_UNUSED)
+{
+}
+
+static bool
+pool_threadsafe_try_grow(struct threadsafe_pool *tpool, void *mem,
+			 size_t old_size, size_t new_size)
+{
+	struct threadsafe_pool_block *block =
+		__atomic_load_n(&tpool->block, __ATOMIC_ACQUIRE);
+	unsigned char *data = THREADSAFE_POOLBLOCK_DATA(block);
+	size_t used, old_alloc_size = MEM_ALIGN(old_size);
+	size_t new_alloc_size = MEM_ALIGN(new_size);
+
+	/* see if the memory is the last allocation in the latest block */
+	used = __atomic_load_n(&block->used, __ATOMIC_RELAXED);
+	if ((unsigned char *)mem < data ||
+	    (unsigned char *)mem + old_alloc_size != data + used)
+		return FALSE;
+	if (block->size - used < new_alloc_size - old_alloc_size)
+		return FALSE;
+	return pool_threadsafe_block_reserve(block, used,
+		used + (new_alloc_size - old_alloc_size));
+}
+
+static void *pool_threadsafe_realloc(pool_t pool, void *mem,
+				     size_t old_size, size_t new_size)
+{
+	struct threadsafe_pool *tpool =
+		container_of(pool, struct threadsafe_pool, pool);
+	void *new_mem;
+
+	i_assert(old_size < SIZE_MAX);
+
+	if (new_size <= old_size)
+		return mem;
+
+	/* the memory after old_size is still zero, since it was never
+	   allocated to anyone else */
+	if (pool_threadsafe_try_grow(tpool, mem, old_size, new_size))
+		return mem;
+
+	new_mem = pool_threadsafe_malloc(pool, new_size);
+	memcpy(new_mem, mem, old_size);
+	return new_mem;
+}
+
+static void pool_threadsafe_clear(pool_t pool)
+{
+	struct threadsafe_pool *tpool =
+		container_of(pool, struct threadsafe_pool, pool);
+	struct threadsafe_pool_block *block = tpool->block;
+
+	/* free all but the first block */
+	while (block->prev != NULL) {
+		tpool->block = block->prev;
+		free(block);
+		block = tpool->block;
+	}
+	memset(THREADSAFE_POOLBLOCK_DATA(block), 0, block->used);
+	block->used = 0;
+}
+
+static size_t pool_threadsafe_get_max_easy_alloc_size(pool_t pool)
+{
+	struct threadsafe_pool *tpool =
+		container_of(pool, struct threadsafe_pool, pool);
+	struct threadsafe_pool_block *block =
+		__atomic_load_n(&tpool->block, __ATOMIC_ACQUIRE);
+
+	return block->size - __atomic_load_n(&block->used, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,392 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+#include "lib.h"
+#include "bits.h"
+#include "llist.h"
+#include "mempool.h"
+
+/*
+ * Slab pools support both allocating and freeing memory, similar to
+ * allocfree pools. The difference is that the freed memory isn't returned
+ * back to the system, but kept in per-process free lists where it can be
+ * reused by any slab pool. This is intended for short-lived pools that are
+ * created and destroyed constantly, such as the ones used for commands and
+ * authentication requests.
+ *
+ * Implementation
+ * ==============
+ *
+ * Each allocation is rounded up to a size class. There are 16 byte classes
+ * up to 128 bytes, and after that each power of 2 is split into 4 classes
+ * up to SLAB_MAX_SIZE. Each allocation (struct slab_chunk) has a header,
+ * which links it to the pool's doubly-linked list of allocations.
+ *
+ * Allocation
+ * ----------
+ *
+ * The allocation is taken from the size class's free list. Only if the
+ * free list is empty, a new chunk is calloc()ed. Allocations larger than
+ * SLAB_MAX_SIZE are always calloc()ed.
+ *
+ * Freeing
+ * -------
+ *
+ * The chunk is removed from the pool's list and added to the size class's
+ * free list. If the free list is already at its maximum size, the chunk is
+ * free()d instead.
+ *
+ * Reallocation
+ * ------------
+ *
+ * If the new size still fits into the chunk's size class, the same memory
+ * is returned. Otherwise a new chunk is allocated, the data is copied and
+ * the old chunk is freed (see above).
+ *
+ * Clearing
+ * --------
+ *
+ * All the chunks in the pool are freed (see above).
+ *
+ * Destruction
+ * -----------
+ *
+ * The pool is cleared and the pool structure itself is freed. The pool
+ * structure is also allocated as a chunk, so it's recycled as well.
+ *
+ * The free lists aren't thread-safe, so slab pools can be used only by the
+ * main thread.
+ */
+
+#define SLAB_MAX_SIZE 8192
+/* 8 classes for the sizes up to 128 bytes, and 4 classes for each of the
+   following powers of 2 up to SLAB_MAX_SIZE. */
+#define SLAB_CLASS_COUNT (8 + 4 * 6)
+#define SLAB_CLASS_LARGE UINT_MAX
+/* Maximum number of bytes kept in each size class's free list */
+#define SLAB_FREE_LIST_MAX_BYTES (128 * 1024)
+
+struct slab_chunk {
+	/* The pool's list of allocations, or the free list */
+	struct slab_chunk *prev, *next;
+
+	/* Usable size of the chunk */
+	size_t size;
+	unsigned int class_idx;
+};
+
+#define SIZEOF_SLAB_CHUNK MEM_ALIGN(sizeof(struct slab_chunk))
+#define SLAB_CHUNK_DATA(chunk) PTR_OFFSET(chunk, SIZEOF_SLAB_CHUNK)
+
+struct slab_pool {
+	struct pool pool;
+	int refcount;
+
+	struct slab_chunk *chunks;
+	/* Statistics of this pool's allocations. cached_bytes is unused. */
+	struct pool_slab_stats stats;
+#ifdef DEBUG
+	char *name;
+#endif
+};
+
+static struct slab_chunk *slab_free_lists[SLAB_CLASS_COUNT];
+static size_t slab_free_list_bytes[SLAB_CLASS_COUNT];
+static struct pool_slab_stats slab_stats;
+
+static const char *pool_slab_get_name(pool_t pool);
+static void pool_slab_ref(pool_t pool);
+static void pool_slab_unref(pool_t *pool);
+static void *pool_slab_malloc(pool_t pool, size_t size);
+static void pool_slab_free(pool_t pool, void *mem);
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size);
+static void pool_slab_clear(pool_t pool);
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool);
+
+static const struct pool_vfuncs static_slab_pool_vfuncs = {
+	pool_slab_get_name,
+
+	pool_slab_ref,
+	pool_slab_unref,
+
+	pool_slab_malloc,
+	pool_slab_free,
+
+	pool_slab_realloc,
+
+	pool_slab_clear,
+	pool_slab_get_max_easy_alloc_size
+};
+
+static const struct pool static_slab_pool = {
+	.v = &static_slab_pool_vfuncs,
+
+	.alloconly_pool = FALSE,
+	.datastack_pool = FALSE
+};
+
+static unsigned int slab_get_class(size_t size)
+{
+	unsigned int bits;
+
+	i_assert(size > 0);
+	if (size > SLAB_MAX_SIZE)
+		return SLAB_CLASS_LARGE;
+	if (size <= 128)
+		return (size + 15) / 16 - 1;
+
+	/* size-1 is within [2^(bits-1), 2^bits) - split it into 4 classes */
+	bits = bits_required64(size - 1);
+	return 8 + (bits - 8) * 4 +
+		((size - 1) - ((size_t)1 << (bits - 1))) / ((size_t)1 << (bits - 3));
+}
+
+static size_t slab_get_class_size(unsigned int class_idx)
+{
+	unsigned int bits;
+
+	if (class_idx < 8)
+		return (class_idx + 1) * 16;
+	class_idx -= 8;
+	bits = 8 + class_idx / 4;
+	return ((size_t)1 << (bits - 1)) +
+		(class_idx % 4 + 1) * ((size_t)1 << (bits - 3));
+}
+
+/* Update the process-wide and the pool's (if not NULL) statistics */
+static void
+slab_stats_alloc(struct pool_slab_stats *pool_stats, size_t size, bool system)
+{
+	slab_stats.alloc_count++;
+	slab_stats.alloc_bytes += size;
+	if (system) {
+		slab_stats.system_alloc_count++;
+		slab_stats.system_alloc_bytes += size;
+	}
+	if (pool_stats != NULL) {
+		pool_stats->alloc_count++;
+		pool_stats->alloc_bytes += size;
+		if (system) {
+			pool_stats->system_alloc_count++;
+			pool_stats->system_alloc_bytes += size;
+		}
+	}
+}
+
+static struct slab_chunk *
+slab_chunk_alloc(struct pool_slab_stats *pool_stats, size_t size)
+{
+	unsigned int class_idx = slab_get_class(size);
+	struct slab_chunk *chunk;
+
+	if (class_idx != SLAB_CLASS_LARGE) {
+		chunk = slab_free_lists[class_idx];
+		if (chunk != NULL) {
+			slab_free_lists[class_idx] = chunk->next;
+			slab_free_list_bytes[class_idx] -= chunk->size;
+			slab_stats.cached_bytes -= chunk->size;
+			slab_stats_alloc(pool_stats, chunk->size, FALSE);
+			memset(SLAB_CHUNK_DATA(chunk), 0, size);
+			chunk->prev = chunk->next = NULL;
+			return chunk;
+		}
+		size = slab_get_class_size(class_idx);
+	}
+
+	chunk = calloc(1, SIZEOF_SLAB_CHUNK + size);
+	if (unlikely(chunk == NULL)) {
+		i_fatal_status(FATAL_OUTOFMEM, "calloc(1, %zu): Out of memory",
+			       SIZEOF_SLAB_CHUNK + size);
+	}
+	chunk->size = size;
+	chunk->class_idx = class_idx;
+	slab_stats_alloc(pool_stats, size, TRUE);
+	return chunk;
+}
+
+static void
+slab_chunk_free(struct pool_slab_stats *pool_stats, struct slab_chunk *chunk)
+{
+	unsigned int class_idx = chunk->class_idx;
+
+	i_assert(slab_stats.alloc_bytes >= chunk->size);
+	slab_stats.alloc_bytes -= chunk->size;
+	if (pool_stats != NULL) {
+		i_assert(pool_stats->alloc_bytes >= chunk->size);
+		pool_stats->alloc_bytes -= chunk->size;
+	}
+	if (class_idx == SLAB_CLASS_LARGE ||
+	    slab_free_list_bytes[class_idx] + chunk->size >
+	    SLAB_FREE_LIST_MAX_BYTES) {
+		free(chunk);
+		return;
+	}
+	chunk->prev = NULL;
+	chunk->next = slab_free_lists[class_idx];
+	slab_free_lists[class_idx] = chunk;
+	slab_free_list_bytes[class_idx] += chunk->size;
+	slab_stats.cached_bytes += chunk->size;
+}
+
+static struct slab_chunk *slab_chunk_get(void *mem)
+{
+	/* cannot use PTR_OFFSET because of negative value */
+	i_assert((uintptr_t)mem >= SIZEOF_SLAB_CHUNK);
+	return (struct slab_chunk *)((unsigned char *)mem - SIZEOF_SLAB_CHUNK);
+}
+
+pool_t pool_slab_create(const char *name ATTR_UNUSED)
+{
+	struct slab_chunk *chunk;
+	struct slab_pool *spool;
+
+	/* the pool itself isn't part of the pool's chunks list */
+	chunk = slab_chunk_alloc(NULL, sizeof(struct slab_pool));
+	spool = SLAB_CHUNK_DATA(chunk);
+#ifdef DEBUG
+	spool->name = i_strdup(name);
+#endif
+	spool->pool = static_slab_pool;
+	spool->refcount = 1;
+	return &spool->pool;
+}
+
+static void pool_slab_destroy(struct slab_pool *spool)
+{
+	pool_slab_clear(&spool->pool);
+	pool_external_refs_unref(&spool->pool);
+#ifdef DEBUG
+	i_free(spool->name);
+#endif
+	slab_chunk_free(NULL, slab_chunk_get(spool));
+}
+
+static const char *pool_slab_get_name(pool_t pool ATTR_UNUSED)
+{
+#ifdef DEBUG
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	return spool->name;
+#else
+	return "slab";
+#endif
+}
+
+static void pool_slab_ref(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+	spool->refcount++;
+}
+
+static void pool_slab_unref(pool_t *_pool)
+{
+	struct slab_pool *spool = container_of(*_pool, struct slab_pool, pool);
+
+	i_assert(spool->refcount > 0);
+
+	/* erase the pointer before freeing anything, as the pointer may
+	   exist inside the pool's memory area */
+	*_pool = NULL;
+
+	if (--spool->refcount > 0)
+		return;
+	pool_slab_destroy(spool);
+}
+
+static void *pool_slab_malloc(pool_t pool, size_t size)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_chunk *chunk;
+
+	chunk = slab_chunk_alloc(&spool->stats, size);
+	DLLIST_PREPEND(&spool->chunks, chunk);
+	return SLAB_CHUNK_DATA(chunk);
+}
+
+static void pool_slab_free(pool_t pool, void *mem)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_chunk *chunk = slab_chunk_get(mem);
+
+	i_assert((chunk->prev == NULL || chunk->prev->next == chunk) &&
+		 (chunk->next == NULL || chunk->next->prev == chunk));
+	DLLIST_REMOVE(&spool->chunks, chunk);
+	slab_chunk_free(&spool->stats, chunk);
+}
+
+static void *pool_slab_realloc(pool_t pool, void *mem,
+			       size_t old_size, size_t new_size)
+{
+	struct slab_chunk *chunk = slab_chunk_get(mem);
+	void *new_mem;
+
+	if (old_size == SIZE_MAX || old_size > chunk->size)
+		old_size = chunk->size;
+
+	if (new_size <= chunk->size) {
+		/* fits into the same chunk */
+		if (new_size > old_size) {
+			memset(PTR_OFFSET(mem, old_size), 0,
+			       new_size - old_size);
+		}
+		return mem;
+	}
+
+	new_mem = pool_slab_malloc(pool, new_size);
+	memcpy(new_mem, mem, old_size);
+	pool_slab_free(pool, mem);
+	return new_mem;
+}
+
+static void pool_slab_clear(pool_t pool)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+	struct slab_chunk *chunk;
+
+	while (spool->chunks != NULL) {
+		chunk = spool->chunks;
+		spool->chunks = chunk->next;
+		slab_chunk_free(&spool->stats, chunk);
+	}
+}
+
+static size_t pool_slab_get_max_easy_alloc_size(pool_t pool ATTR_UNUSED)
+{
+	return 0;
+}
+
+void pool_slab_get_stats(struct pool_slab_stats *stats_r)
+{
+	*stats_r = slab_stats;
+}
+
+bool pool_slab_get_pool_stats(pool_t pool, struct pool_slab_stats *stats_r)
+{
+	struct slab_pool *spool = container_of(pool, struct slab_pool, pool);
+
+	if (pool->v != &static_slab_pool_vfuncs) {
+		i_zero(stats_r);
+		return FALSE;
+	}
+	*stats_r = spool->stats;
+	return TRUE;
+}
+
+void pool_slab_free_unused(void)
+{
+	struct slab_chunk *chunk;
+	unsigned int i;
+
+	for (i = 0; i < SLAB_CLASS_COUNT; i++) {
+		while (slab_free_lists[i] != NULL) {
+			chunk = slab_free_lists[i];
+			slab_free_lists[i] = chunk->next;
+			free(chunk);
+		}
+		slab_free_list_bytes[i] = 0;
+	}
+	slab_stats.cached_bytes = 0;
+}
@@ -73,6 +73,11 @@ pool_t pool_alloconly_create(const char *name, size_t size);
    pool, and be sure that it gets cleared from the memory when it's no longer
    needed. */
 pool_t pool_alloconly_create_clean(const char *name, size_t size);
+/* Like alloconly pool, but the pool can be shared by multiple threads.
+   Allocations and references are done without locks using atomic
+   operations. Freeing is a no-op, even for the last allocation. p_clear()
+   must not be called while other threads are using the pool. */
+pool_t pool_alloconly_create_threadsafe(const char *name, size_t size);
 
 /* When allocating memory from returned pool, the data stack frame must be
    the same as it was when calling this function. pool_unref() also checks
@@ -87,6 +92,34 @@ pool_t pool_allocfree_create(const char *name);
    See pool_alloconly_create_clean. */
 pool_t pool_allocfree_create_clean(const char *name);
 
+/* Create a new slab pool. It supports freeing memory like alloc pool, but
+   the allocations are rounded up to size classes and the freed memory is
+   kept in per-process free lists, which are shared by all the slab pools.
+   This avoids most malloc() and free() calls for pools that are created
+   and destroyed constantly. Slab pools can't be used by threads. */
+pool_t pool_slab_create(const char *name);
+
+struct pool_slab_stats {
+	/* Number of allocations done from slab pools */
+	uint64_t alloc_count;
+	/* Number of allocations that had to be malloc()ed, because there
+	   was nothing to reuse in the free lists */
+	uint64_t system_alloc_count;
+	uint64_t system_alloc_bytes;
+	/* Number of bytes currently allocated from slab pools */
+	size_t alloc_bytes;
+	/* Number of bytes currently kept in the free lists */
+	size_t cached_bytes;
+};
+/* Get the process-wide statistics of all the slab pools. */
+void pool_slab_get_stats(struct pool_slab_stats *stats_r);
+/* Get the statistics of the allocations done from the given slab pool since
+   it was created. cached_bytes is always 0, because the free lists are
+   shared by all the pools. Returns FALSE if the pool isn't a slab pool. */
+bool pool_slab_get_pool_stats(pool_t pool, struct pool_slab_stats *stats_r);
+/* Free all the memory in slab pools' free lists. */
+void pool_slab_free_unused(void);
+
 /* Similar to nearest_power(), but try not to exceed buffer's easy
    allocation size. If you don't have any explicit minimum size, use
    old_size + 1. */
@@ -846,6 +846,7 @@ io_stream_sendfile(struct ostream_private *outstream,
 		foutstream->real_offset += ret;
 		foutstream->buffer_offset += ret;
 		outstream->ostream.offset += ret;
+		outstream->sendfile_bytes += ret;
 	}
 
 	i_stream_seek(instream, v_offset);
@@ -37,6 +37,8 @@ struct ostream_private {
 
 	int fd;
 	struct timeval last_write_timeval;
+	/* bytes sent with sendfile() */
+	uoff_t sendfile_bytes;
 
 	stream_flush_callback_t *callback;
 	void *context;
@@ -25,6 +25,11 @@ int o_stream_get_fd(struct ostream *stream)
 	return stream->real_stream->fd;
 }
 
+uoff_t o_stream_get_sendfile_bytes(struct ostream *stream)
+{
+	return stream->real_stream->sendfile_bytes;
+}
+
 const char *o_stream_get_error(struct ostream *stream)
 {
 	struct ostream *s;
@@ -95,6 +95,10 @@ const char *o_stream_get_name(struct ostream *stream);
 
 /* Return file descriptor for stream, or -1 if none is available. */
 int o_stream_get_fd(struct ostream *stream);
+/* Returns the number of bytes that o_stream_send_istream() has sent directly
+   from the istream's fd with sendfile() without copying them via userspace
+   buffers. This is always 0 for streams that don't write to a fd. */
+uoff_t o_stream_get_sendfile_bytes(struct ostream *stream);
 /* Returns error string for the previous error. */
 const char *o_stream_get_error(struct ostream *stream);
 /* Returns human-readable reason for why ostream was disconnected.
@@ -0,0 +1,250 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "str.h"
+#include "strnum.h"
+#include "stats-histogram.h"
+
+/* Number of bits used for the linear sub-buckets within each power of 2 */
+#define STATS_HISTOGRAM_SUB_BITS 4
+#define STATS_HISTOGRAM_SUB_COUNT (1 << STATS_HISTOGRAM_SUB_BITS)
+
+struct stats_histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[STATS_HISTOGRAM_BUCKET_COUNT];
+};
+
+static unsigned int stats_histogram_get_bucket(uint64_t value)
+{
+	unsigned int shift;
+
+	if (value < STATS_HISTOGRAM_SUB_COUNT * 2)
+		return value;
+	/* keep the highest SUB_BITS+1 bits of the value. The highest bit is
+	   always 1, so the rest of the bits are the sub-bucket index. */
+	shift = bits_required64(value) - (STATS_HISTOGRAM_SUB_BITS + 1);
+	return (shift + 1) * STATS_HISTOGRAM_SUB_COUNT +
+		(value >> shift) - STATS_HISTOGRAM_SUB_COUNT;
+}
+
+static uint64_t stats_histogram_get_bucket_max(unsigned int idx)
+{
+	unsigned int shift;
+	uint64_t min;
+
+	if (idx < STATS_HISTOGRAM_SUB_COUNT * 2)
+		return idx;
+	shift = idx / STATS_HISTOGRAM_SUB_COUNT - 1;
+	min = (uint64_t)(idx % STATS_HISTOGRAM_SUB_COUNT +
+			 STATS_HISTOGRAM_SUB_COUNT) << shift;
+	return min + ((1ULL << shift) - 1);
+}
+
+struct stats_histogram *stats_histogram_init(void)
+{
+	return i_new(struct stats_histogram, 1);
+}
+
+void stats_histogram_deinit(struct stats_histogram **_hist)
+{
+	i_free_and_null(*_hist);
+}
+
+void stats_histogram_reset(struct stats_histogram *hist)
+{
+	i_zero(hist);
+}
+
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value)
+{
+	hist->buckets[stats_histogram_get_bucket(value)]++;
+	if (hist->count == 0)
+		hist->min = hist->max = value;
+	else if (hist->min > value)
+		hist->min = value;
+	else if (hist->max < value)
+		hist->max = value;
+	hist->count++;
+	hist->sum += value;
+}
+
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0)
+		return;
+
+	for (i = 0; i < STATS_HISTOGRAM_BUCKET_COUNT; i++)
+		dest->buckets[i] += src->buckets[i];
+	if (dest->count == 0) {
+		dest->min = src->min;
+		dest->max = src->max;
+	} else {
+		dest->min = I_MIN(dest->min, src->min);
+		dest->max = I_MAX(dest->max, src->max);
+	}
+	dest->count += src->count;
+	dest->sum += src->sum;
+}
+
+uint64_t stats_histogram_get_count(const struct stats_histogram *hist)
+{
+	return hist->count;
+}
+
+uint64_t stats_histogram_get_sum(const struct stats_histogram *hist)
+{
+	return hist->sum;
+}
+
+uint64_t stats_histogram_get_min(const struct stats_histogram *hist)
+{
+	return hist->min;
+}
+
+uint64_t stats_histogram_get_max(const struct stats_histogram *hist)
+{
+	return hist->max;
+}
+
+double stats_histogram_get_avg(const struct stats_histogram *hist)
+{
+	if (hist->count == 0)
+		return 0;
+
+	return (double)hist->sum / hist->count;
+}
+
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction)
+{
+	uint64_t rank, seen = 0, value;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+
+	/* rank is the 1-based position of the wanted event, similar to
+	   stats_dist_get_percentile() */
+	if (fraction >= 1.)
+		rank = hist->count;
+	else if (fraction <= 0.)
+		rank = 1;
+	else {
+		double rank_float = hist->count * fraction;
+
+		rank = rank_float;
+		/* exact boundaries belong to the open range below them */
+		if (rank_float - rank >= 1e-8 * hist->count)
+			rank++;
+		if (rank == 0)
+			rank = 1;
+	}
+
+	for (i = 0;; i++) {
+		i_assert(i < STATS_HISTOGRAM_BUCKET_COUNT);
+		seen += hist->buckets[i];
+		if (seen >= rank)
+			break;
+	}
+	/* the bucket's maximum may be larger than hist->max */
+	value = stats_histogram_get_bucket_max(i);
+	return I_MIN(value, hist->max);
+}
+
+bool stats_histogram_iterate(const struct stats_histogram *hist,
+			     unsigned int *idx, uint64_t *max_value_r,
+			     uint64_t *count_r)
+{
+	for (; *idx < STATS_HISTOGRAM_BUCKET_COUNT; (*idx)++) {
+		if (hist->buckets[*idx] != 0) {
+			*max_value_r = stats_histogram_get_bucket_max(*idx);
+			*count_r = hist->buckets[*idx];
+			(*idx)++;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+void stats_histogram_export(const struct stats_histogram *hist,
+			    string_t *dest)
+{
+	unsigned int i;
+
+	str_printfa(dest, "%"PRIu64" %"PRIu64" %"PRIu64" %"PRIu64,
+		    hist->count, hist->sum, hist->min, hist->max);
+	for (i = 0; i < STATS_HISTOGRAM_BUCKET_COUNT; i++) {
+		if (hist->buckets[i] != 0)
+			str_printfa(dest, " %u:%"PRIu64, i, hist->buckets[i]);
+	}
+}
+
+static int
+stats_histogram_import_buckets(struct stats_histogram *hist,
+			       const char *const *args, const char **error_r)
+{
+	const char *p;
+	uint64_t bucket_count, count = 0;
+	unsigned int idx;
+
+	for (; *args != NULL; args++) {
+		if (str_parse_uint(*args, &idx, &p) < 0 || *p != ':' ||
+		    str_to_uint64(p + 1, &bucket_count) < 0) {
+			*error_r = t_strdup_printf("Invalid bucket: %s", *args);
+			return -1;
+		}
+		if (idx >= STATS_HISTOGRAM_BUCKET_COUNT) {
+			*error_r = t_strdup_printf(
+				"Bucket index too large: %u", idx);
+			return -1;
+		}
+		hist->buckets[idx] += bucket_count;
+		count += bucket_count;
+	}
+	if (count != hist->count) {
+		*error_r = t_strdup_printf(
+			"Bucket counts don't match total count %"PRIu64,
+			hist->count);
+		return -1;
+	}
+	return 0;
+}
+
+int stats_histogram_import(struct stats_histogram *hist, const char *str,
+			   const char **error_r)
+{
+	struct stats_histogram *imported;
+	const char *const *args = t_strsplit_spaces(str, " ");
+	int ret = 0;
+
+	if (str_array_length(args) < 4) {
+		*error_r = "Too few fields";
+		return -1;
+	}
+
+	imported = stats_histogram_init();
+	if (str_to_uint64(args[0], &imported->count) < 0 ||
+	    str_to_uint64(args[1], &imported->sum) < 0 ||
+	    str_to_uint64(args[2], &imported->min) < 0 ||
+	    str_to_uint64(args[3], &imported->max) < 0) {
+		*error_r = "Invalid count, sum, min or max";
+		ret = -1;
+	} else if (imported->min > imported->max) {
+		*error_r = "min is larger than max";
+		ret = -1;
+	} else {
+		ret = stats_histogram_import_buckets(imported, args + 4,
+						     error_r);
+	}
+	if (ret == 0)
+		stats_histogram_merge(hist, imported);
+	stats_histogram_deinit(&imported);
+	return ret;
+}
@@ -0,0 +1,60 @@
+#ifndef STATS_HISTOGRAM_H
+#define STATS_HISTOGRAM_H
+
+/* Log-linear histogram (similar to HdrHistogram) for tracking the
+   distribution of uint64_t values with fixed memory usage. Values below 32
+   are counted exactly. Larger values are counted in buckets, which split
+   each power of 2 into 16 linear sub-buckets, so the bucket width is at
+   most 1/16 of its values. The histograms can be merged without losing
+   any accuracy. */
+
+/* Maximum number of buckets in a histogram */
+#define STATS_HISTOGRAM_BUCKET_COUNT (16 * 61)
+
+struct stats_histogram *stats_histogram_init(void);
+void stats_histogram_deinit(struct stats_histogram **hist);
+
+/* Reset all events. */
+void stats_histogram_reset(struct stats_histogram *hist);
+
+/* Add a new event. */
+void stats_histogram_add(struct stats_histogram *hist, uint64_t value);
+/* Add all the events from src histogram to dest histogram. */
+void stats_histogram_merge(struct stats_histogram *dest,
+			   const struct stats_histogram *src);
+
+/* Returns number of events added. */
+uint64_t stats_histogram_get_count(const struct stats_histogram *hist);
+/* Returns the sum of all events. */
+uint64_t stats_histogram_get_sum(const struct stats_histogram *hist);
+/* Returns events' minimum. */
+uint64_t stats_histogram_get_min(const struct stats_histogram *hist);
+/* Returns events' maximum. */
+uint64_t stats_histogram_get_max(const struct stats_histogram *hist);
+/* Returns events' average. */
+double stats_histogram_get_avg(const struct stats_histogram *hist);
+/* Returns events' percentile. The returned value is the largest value in
+   the percentile's bucket, limited to the events' maximum.
+   fraction parameter is in the range (0., 1.], so 95th %-ile is 0.95. */
+uint64_t stats_histogram_get_percentile(const struct stats_histogram *hist,
+					double fraction);
+
+/* Iterate through the non-empty buckets in increasing order. *idx must be
+   initialized to 0 before the first call. Returns the largest value that
+   belongs to the bucket and the number of events in it. Returns FALSE
+   after the last bucket. */
+bool stats_histogram_iterate(const struct stats_histogram *hist,
+			     unsigned int *idx, uint64_t *max_value_r,
+			     uint64_t *count_r);
+
+/* Export the histogram as a string, which can be imported by another
+   process. */
+void stats_histogram_export(const struct stats_histogram *hist,
+			    string_t *dest);
+/* Import the exported string and merge it to the histogram. Returns 0 on
+   success, -1 if the string is invalid. The histogram isn't modified on
+   failure. */
+int stats_histogram_import(struct stats_histogram *hist, const char *str,
+			   const char **error_r);
+
+#endif
@@ -0,0 +1,300 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+/* @UNSAFE: whole file */
+
+#include "lib.h"
+#include "str-find.h"
+#include "str-multi-find.h"
+
+/* Maximum number of cells in the DFA table. The keys may come from
+   clients, and the table size grows by the keys' total length multiplied
+   by the number of distinct bytes in them. If the table would be larger,
+   each key is searched separately with str_find instead. */
+#define STR_MULTI_FIND_MAX_DFA_CELLS (1024*1024)
+
+/* The automaton is a full DFA: each state has a transition for each input
+   character class, so scanning needs only a single table lookup per input
+   byte. To keep the table small, the bytes that don't exist in any of the
+   keys are mapped to class 0, which always leads back to the root state.
+
+   Each key's last character leads to a terminal state. Terminal states
+   that are reachable via the failure links (i.e. keys that are suffixes of
+   other keys) are found via report_states[] and dict_links[]. */
+
+struct str_multi_find_context {
+	pool_t pool;
+
+	/* If non-NULL, the DFA would have been too large and each key is
+	   searched separately. [keys_count] */
+	struct str_find_context **key_finds;
+	bool *key_matched;
+
+	unsigned int class_count;
+	unsigned int states_count;
+	/* [states_count * class_count] */
+	uint32_t *delta;
+	/* Terminal state to report when entering the state, 0 if none */
+	uint32_t *report_states;
+	/* The next terminal state reachable via the failure links, 0 if
+	   none */
+	uint32_t *dict_links;
+	bool *matched_states;
+
+	/* key index -> terminal state */
+	uint32_t *key_states;
+	unsigned int keys_count;
+	unsigned int terminal_count, matched_count;
+
+	uint32_t state;
+	uint8_t classes[UCHAR_MAX+1];
+};
+
+static void str_multi_find_build_classes(struct str_multi_find_context *ctx,
+					 const char *const *keys)
+{
+	const unsigned char *p;
+	unsigned int i;
+
+	ctx->class_count = 1;
+	for (i = 0; i < ctx->keys_count; i++) {
+		for (p = (const unsigned char *)keys[i]; *p != '\0'; p++) {
+			if (ctx->classes[*p] == 0)
+				ctx->classes[*p] = ctx->class_count++;
+		}
+	}
+}
+
+static void str_multi_find_build_trie(struct str_multi_find_context *ctx,
+				      const char *const *keys)
+{
+	const unsigned char *p;
+	uint32_t state, *next;
+	unsigned int i;
+
+	ctx->states_count = 1;
+	for (i = 0; i < ctx->keys_count; i++) {
+		i_assert(keys[i][0] != '\0');
+
+		state = 0;
+		for (p = (const unsigned char *)keys[i]; *p != '\0'; p++) {
+			next = &ctx->delta[state * ctx->class_count +
+					   ctx->classes[*p]];
+			if (*next == 0)
+				*next = ctx->states_count++;
+			state = *next;
+		}
+		if (ctx->report_states[state] == 0) {
+			ctx->report_states[state] = state;
+			ctx->terminal_count++;
+		}
+		ctx->key_states[i] = state;
+	}
+}
+
+static void str_multi_find_build_links(struct str_multi_find_context *ctx)
+{
+	unsigned int class_count = ctx->class_count;
+	uint32_t *fail, *queue, *row, state, child, fail_state;
+	unsigned int c, queue_head = 0, queue_tail = 0;
+
+	fail = i_new(uint32_t, ctx->states_count);
+	queue = i_new(uint32_t, ctx->states_count);
+
+	/* the root's children fail back to the root. The root's missing
+	   transitions are already 0 = root. */
+	for (c = 1; c < class_count; c++) {
+		child = ctx->delta[c];
+		if (child != 0)
+			queue[queue_tail++] = child;
+	}
+	/* breadth-first order guarantees that the failure state's row has
+	   already been completed */
+	while (queue_head < queue_tail) {
+		state = queue[queue_head++];
+		row = &ctx->delta[state * class_count];
+		for (c = 1; c < class_count; c++) {
+			fail_state = ctx->delta[fail[state] * class_count + c];
+			child = row[c];
+			if (child == 0) {
+				row[c] = fail_state;
+				continue;
+			}
+			fail[child] = fail_state;
+			/* report_states[] points to itself only for terminal
+			   states */
+			ctx->dict_links[child] =
+				ctx->report_states[fail_state] == fail_state ?
+				fail_state : ctx->dict_links[fail_state];
+			if (ctx->report_states[child] == 0) {
+				ctx->report_states[child] =
+					ctx->dict_links[child];
+			}
+			queue[queue_tail++] = child;
+		}
+	}
+	i_free(fail);
+	i_free(queue);
+}
+
+static void
+str_multi_find_init_keys(struct str_multi_find_context *ctx,
+			 const char *const *keys)
+{
+	unsigned int i;
+
+	ctx->key_finds = p_new(ctx->pool, struct str_find_context *,
+			       ctx->keys_count);
+	ctx->key_matched = p_new(ctx->pool, bool, ctx->keys_count);
+	for (i = 0; i < ctx->keys_count; i++) {
+		i_assert(keys[i][0] != '\0');
+		ctx->key_finds[i] = str_find_init(ctx->pool, keys[i]);
+	}
+	ctx->terminal_count = ctx->keys_count;
+}
+
+struct str_multi_find_context *
+str_multi_find_init(pool_t pool, const char *const *keys,
+		    unsigned int keys_count)
+{
+	struct str_multi_find_context *ctx;
+	size_t max_states = 1;
+	unsigned int i;
+
+	i_assert(keys_count > 0);
+
+	ctx = p_new(pool, struct str_multi_find_context, 1);
+	ctx->pool = pool;
+	ctx->keys_count = keys_count;
+	for (i = 0; i < keys_count; i++)
+		max_states = MALLOC_ADD(max_states, strlen(keys[i]));
+
+	str_multi_find_build_classes(ctx, keys);
+	if (max_states > STR_MULTI_FIND_MAX_DFA_CELLS / ctx->class_count) {
+		str_multi_find_init_keys(ctx, keys);
+		return ctx;
+	}
+	ctx->delta = p_new(pool, uint32_t,
+			   MALLOC_MULTIPLY(max_states, ctx->class_count));
+	ctx->report_states = p_new(pool, uint32_t, max_states);
+	ctx->dict_links = p_new(pool, uint32_t, max_states);
+	ctx->matched_states = p_new(pool, bool, max_states);
+	ctx->key_states = p_new(pool, uint32_t, keys_count);
+
+	str_multi_find_build_trie(ctx, keys);
+	str_multi_find_build_links(ctx);
+	return ctx;
+}
+
+void str_multi_find_deinit(struct str_multi_find_context **_ctx)
+{
+	struct str_multi_find_context *ctx = *_ctx;
+
+	*_ctx = NULL;
+	if (ctx->key_finds != NULL) {
+		for (unsigned int i = 0; i < ctx->keys_count; i++)
+			str_find_deinit(&ctx->key_finds[i]);
+		p_free(ctx->pool, ctx->key_finds);
+		p_free(ctx->pool, ctx->key_matched);
+		p_free(ctx->pool, ctx);
+		return;
+	}
+	p_free(ctx->pool, ctx->key_states);
+	p_free(ctx->pool, ctx->matched_states);
+	p_free(ctx->pool, ctx->dict_links);
+	p_free(ctx->pool, ctx->report_states);
+	p_free(ctx->pool, ctx->delta);
+	p_free(ctx->pool, ctx);
+}
+
+static void
+str_multi_find_report(struct str_multi_find_context *ctx, uint32_t state)
+{
+	/* When a terminal state is marked matched, everything in its
+	   dict_links chain is marked as well. So the loop can stop at the
+	   first already matched state. */
+	while (state != 0 && !ctx->matched_states[state]) {
+		ctx->matched_states[state] = TRUE;
+		ctx->matched_count++;
+		state = ctx->dict_links[state];
+	}
+}
+
+static bool
+str_multi_find_more_keys(struct str_multi_find_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->keys_count; i++) {
+		if (!ctx->key_matched[i] &&
+		    str_find_more(ctx->key_finds[i], data, size)) {
+			ctx->key_matched[i] = TRUE;
+			ctx->matched_count++;
+		}
+	}
+	return ctx->matched_count == ctx->terminal_count;
+}
+
+bool str_multi_find_more(struct str_multi_find_context *ctx,
+			 const unsigned char *data, size_t size)
+{
+	const uint32_t *delta = ctx->delta;
+	const uint8_t *classes = ctx->classes;
+	unsigned int class_count = ctx->class_count;
+	uint32_t state = ctx->state, report;
+	size_t i;
+
+	if (ctx->matched_count == ctx->terminal_count)
+		return TRUE;
+	if (ctx->key_finds != NULL)
+		return str_multi_find_more_keys(ctx, data, size);
+
+	for (i = 0; i < size; i++) {
+		state = delta[state * class_count + classes[data[i]]];
+		report = ctx->report_states[state];
+		if (unlikely(report != 0) && !ctx->matched_states[report]) {
+			str_multi_find_report(ctx, report);
+			if (ctx->matched_count == ctx->terminal_count)
+				break;
+		}
+	}
+	ctx->state = state;
+	return ctx->matched_count == ctx->terminal_count;
+}
+
+bool str_multi_find_is_matched(const struct str_multi_find_context *ctx,
+			       unsigned int key_idx)
+{
+	i_assert(key_idx < ctx->keys_count);
+
+	if (ctx->key_finds != NULL)
+		return ctx->key_matched[key_idx];
+	return ctx->matched_states[ctx->key_states[key_idx]];
+}
+
+bool str_multi_find_all_matched(const struct str_multi_find_context *ctx)
+{
+	return ctx->matched_count == ctx->terminal_count;
+}
+
+void str_multi_find_reset(struct str_multi_find_context *ctx)
+{
+	ctx->state = 0;
+	if (ctx->key_finds != NULL) {
+		for (unsigned int i = 0; i < ctx->keys_count; i++)
+			str_find_reset(ctx->key_finds[i]);
+	}
+}
+
+void str_multi_find_clear(struct str_multi_find_context *ctx)
+{
+	str_multi_find_reset(ctx);
+	ctx->matched_count = 0;
+	if (ctx->key_finds != NULL) {
+		memset(ctx->key_matched, 0,
+		       sizeof(ctx->key_matched[0]) * ctx->keys_count);
+	} else {
+		memset(ctx->matched_states, 0,
+		       sizeof(ctx->matched_states[0]) * ctx->states_count);
+	}
+}
@@ -0,0 +1,33 @@
+#ifndef STR_MULTI_FIND_H
+#define STR_MULTI_FIND_H
+
+/* Search for multiple keys at once using the Aho-Corasick algorithm. The
+   input is scanned only once regardless of the number of keys. If the keys
+   are so long that the automaton would use too much memory, each key is
+   searched separately with str_find instead. */
+
+struct str_multi_find_context;
+
+/* The keys must not be empty. The same key may be given multiple times. */
+struct str_multi_find_context *
+str_multi_find_init(pool_t pool, const char *const *keys,
+		    unsigned int keys_count);
+void str_multi_find_deinit(struct str_multi_find_context **ctx);
+
+/* Returns TRUE if all the keys have been found. It's possible to send the
+   data in arbitrary blocks and have the keys still match. */
+bool str_multi_find_more(struct str_multi_find_context *ctx,
+			 const unsigned char *data, size_t size);
+/* Returns TRUE if the key (index to the keys given to str_multi_find_init())
+   has been found. */
+bool str_multi_find_is_matched(const struct str_multi_find_context *ctx,
+			       unsigned int key_idx);
+/* Returns TRUE if all the keys have been found. */
+bool str_multi_find_all_matched(const struct str_multi_find_context *ctx);
+/* Reset input data. The next str_multi_find_more() call won't try to match
+   the keys to earlier data. The keys that were already found stay found. */
+void str_multi_find_reset(struct str_multi_find_context *ctx);
+/* Reset input data and forget the keys that were found. */
+void str_multi_find_clear(struct str_multi_find_context *ctx);
+
+#endif
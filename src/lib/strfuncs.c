@@ -2,6 +2,11 @@
 
 /* @UNSAFE: whole file */
 
+#ifdef HAVE_CONFIG_H
+#  include "config.h"
+#endif
+
+#define _GNU_SOURCE /* for memrchr() */
 #include "lib.h"
 #include "str.h"
 #include "printf-format-fix.h"
@@ -714,6 +719,21 @@ size_t i_memcspn(const void *data, size_t data_len,
 	return ptr - start;
 }
 
+const void *i_memrchr(const void *data, unsigned char chr, size_t data_len)
+{
+#ifdef HAVE_MEMRCHR
+	return memrchr(data, chr, data_len);
+#else
+	const unsigned char *p = CONST_PTR_OFFSET(data, data_len);
+
+	while (p > (const unsigned char *)data) {
+		if (*--p == chr)
+			return p;
+	}
+	return NULL;
+#endif
+}
+
 bool t_split_key_value(const char *arg, char separator,
 		       const char **key_r, const char **value_r)
 {
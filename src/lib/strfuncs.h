@@ -165,6 +165,9 @@ size_t i_memspn(const void *data, size_t data_len,
 */
 size_t i_memcspn(const void *data, size_t data_len,
 		 const void *reject, size_t reject_len);
+/* Returns pointer to the last occurrence of chr in data, or NULL if not
+   found. Like memrchr(), which isn't available everywhere. */
+const void *i_memrchr(const void *data, unsigned char chr, size_t data_len);
 
 static inline char *i_strchr_to_next(const char *str, char chr)
 {
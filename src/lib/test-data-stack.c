@@ -1,10 +1,30 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "str.h"
 #include "lib-event-private.h"
 #include "event-filter.h"
 #include "data-stack.h"
 
+#include <pthread.h>
+
+#define TEST_DS_THREAD_COUNT 8
+#define TEST_DS_THREAD_ROUNDS 200
+#define TEST_DS_THREAD_STRINGS 100
+
+struct test_ds_thread {
+	pthread_t thread;
+	unsigned int idx;
+	pool_t shared_pool;
+
+	/* allocated from shared_pool */
+	const char *strings[TEST_DS_THREAD_ROUNDS];
+	unsigned int *numbers;
+	unsigned int numbers_count;
+
+	bool failed;
+};
+
 static int ds_grow_event_count = 0;
 
 static bool
@@ -280,12 +300,11 @@ static void test_ds_recurse(int depth, int number, size_t size)
 	test_assert_idx(t_pop(&t_id), depth);
 }
 
-static void test_ds_recursive(void)
+static void test_ds_recursive_run(void)
 {
 	int count = 20, depth = 80;
 	int i;
 
-	test_begin("data-stack recursive");
 	size_t init_size = data_stack_get_used_size();
 	for(i = 0; i < count; i++) T_BEGIN {
 			int number=i_rand_limit(100)+50;
@@ -293,6 +312,12 @@ static void test_ds_recursive(void)
 			test_ds_recurse(depth, number, size);
 		} T_END;
 	test_assert_cmp(init_size, ==, data_stack_get_used_size());
+}
+
+static void test_ds_recursive(void)
+{
+	test_begin("data-stack recursive");
+	test_ds_recursive_run();
 	test_end();
 }
 
@@ -342,6 +367,94 @@ static void test_ds_pass_str(void)
 	test_end();
 }
 
+static bool test_ds_thread_round(struct test_ds_thread *thread,
+				 unsigned int round)
+{
+	const char *strings[TEST_DS_THREAD_STRINGS];
+	string_t *str = t_str_new(32);
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(strings); i++) {
+		strings[i] = t_strdup_printf("%u.%u.%u", thread->idx, round, i);
+		str_append(str, strings[i]);
+		/* grow the data stack every now and then */
+		if (i % 30 == 0) T_BEGIN {
+			(void)t_malloc0(1024 * (i + 1));
+		} T_END;
+	}
+	/* verify that the other threads didn't overwrite anything */
+	str_truncate(str, 0);
+	for (i = 0; i < N_ELEMENTS(strings); i++) {
+		if (strcmp(strings[i], t_strdup_printf("%u.%u.%u", thread->idx,
+							round, i)) != 0)
+			return FALSE;
+		str_append(str, strings[i]);
+	}
+	thread->strings[round] = p_strdup(thread->shared_pool, str_c(str));
+
+	/* grow the same allocation while the other threads allocate */
+	thread->numbers = p_realloc_type(thread->shared_pool, thread->numbers,
+					 unsigned int, thread->numbers_count,
+					 thread->numbers_count + 1);
+	thread->numbers[thread->numbers_count++] = round;
+	return TRUE;
+}
+
+static void *test_ds_thread_run(void *context)
+{
+	struct test_ds_thread *thread = context;
+	unsigned int round;
+
+	data_stack_thread_init();
+	for (round = 0; round < TEST_DS_THREAD_ROUNDS; round++) {
+		T_BEGIN {
+			if (!test_ds_thread_round(thread, round))
+				thread->failed = TRUE;
+		} T_END;
+	}
+	if (data_stack_get_used_size() > 1024)
+		thread->failed = TRUE;
+	data_stack_thread_deinit();
+	return NULL;
+}
+
+static void test_ds_threads(void)
+{
+	struct test_ds_thread threads[TEST_DS_THREAD_COUNT];
+	unsigned int i, j, round;
+	pool_t pool;
+
+	test_begin("data-stack threads");
+	pool = pool_alloconly_create_threadsafe("test threads", 1024);
+	i_zero(&threads);
+	for (i = 0; i < N_ELEMENTS(threads); i++) {
+		threads[i].idx = i;
+		threads[i].shared_pool = pool;
+		test_assert(pthread_create(&threads[i].thread, NULL,
+					   test_ds_thread_run, &threads[i]) == 0);
+	}
+	/* use the data stack in the main thread at the same time */
+	test_ds_recursive_run();
+
+	for (i = 0; i < N_ELEMENTS(threads); i++) {
+		test_assert(pthread_join(threads[i].thread, NULL) == 0);
+		test_assert_idx(!threads[i].failed, i);
+		test_assert_idx(threads[i].numbers_count == TEST_DS_THREAD_ROUNDS, i);
+
+		string_t *str = t_str_new(1024);
+		for (round = 0; round < TEST_DS_THREAD_ROUNDS; round++) {
+			str_truncate(str, 0);
+			for (j = 0; j < TEST_DS_THREAD_STRINGS; j++)
+				str_printfa(str, "%u.%u.%u", i, round, j);
+			test_assert_idx(strcmp(threads[i].strings[round],
+					       str_c(str)) == 0, round);
+			test_assert_idx(threads[i].numbers[round] == round, round);
+		}
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
 void test_data_stack(void)
 {
 	void (*tests[])(void) = {
@@ -353,6 +466,7 @@ void test_data_stack(void)
 		test_ds_realloc,
 		test_ds_recursive,
 		test_ds_pass_str,
+		test_ds_threads,
 	};
 	for (unsigned int i = 0; i < N_ELEMENTS(tests); i++) {
 		ds_grow_event_count = 0;
@@ -1,10 +1,11 @@
 /* Copyright (c) 2014-2018 Dovecot authors, see the included COPYING file */
 
 #include "test-lib.h"
+#include "str.h"
 #include "hash.h"
 
 
-static void test_hash_random_pool(pool_t pool)
+static void test_hash_random_pool(pool_t pool, bool flat)
 {
 	const unsigned int keymax = ON_VALGRIND ? 10000 : 100000;
 	HASH_TABLE(void *, void *) hash;
@@ -12,7 +13,10 @@ static void test_hash_random_pool(pool_t pool)
 	unsigned int i, key, keyidx, delidx;
 
 	keys = i_new(unsigned int, keymax); keyidx = 0;
-	hash_table_create_direct(&hash, pool, 0);
+	if (flat)
+		hash_table_create_direct_flat(&hash, pool, 0);
+	else
+		hash_table_create_direct(&hash, pool, 0);
 	for (i = 0; i < keymax; i++) {
 		key = (i_rand_limit(keymax)) + 1;
 		if (i_rand_limit(5) > 0) {
@@ -29,21 +33,95 @@ static void test_hash_random_pool(pool_t pool)
 			keyidx--;
 		}
 	}
+	test_assert(hash_table_count(hash) == keyidx);
 	for (i = 0; i < keyidx; i++)
 		hash_table_remove(hash, POINTER_CAST(keys[i]));
+	test_assert(hash_table_count(hash) == 0);
 	hash_table_destroy(&hash);
 	i_free(keys);
 }
 
+static void test_hash_iterate(bool flat)
+{
+	const unsigned int keymax = 1000;
+	HASH_TABLE(char *, void *) hash;
+	struct hash_iterate_context *iter;
+	pool_t pool = pool_alloconly_create("test hash keys", 1024);
+	const char *lookup_key;
+	char *key, *orig_key;
+	void *value;
+	unsigned int i, count = 0, removed = 0;
+
+	if (flat)
+		hash_table_create_flat(&hash, default_pool, 0, str_hash, strcmp);
+	else
+		hash_table_create(&hash, default_pool, 0, str_hash, strcmp);
+	for (i = 1; i <= keymax; i++) {
+		key = p_strdup_printf(pool, "key%u", i);
+		hash_table_insert(hash, key, POINTER_CAST(i));
+	}
+	/* update preserves the original key */
+	key = p_strdup(pool, "key1");
+	hash_table_update(hash, key, POINTER_CAST(keymax + 1));
+	lookup_key = "key1";
+	test_assert(hash_table_lookup_full(hash, lookup_key, &orig_key, &value));
+	test_assert(orig_key != key &&
+		    POINTER_CAST_TO(value, unsigned int) == keymax + 1);
+	lookup_key = "nonexistent";
+	test_assert(hash_table_lookup(hash, lookup_key) == NULL);
+
+	/* remove every other node while iterating and add some new ones */
+	iter = hash_table_iterate_init(hash);
+	while (hash_table_iterate(iter, hash, &key, &value)) {
+		/* the new nodes may or may not be returned */
+		if (!str_begins_with(key, "key"))
+			continue;
+		if (++count % 2 == 0) {
+			hash_table_remove(hash, key);
+			removed++;
+		}
+		if (count <= 10) {
+			key = p_strdup_printf(pool, "new%u", count);
+			hash_table_insert(hash, key, POINTER_CAST(count));
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	test_assert(count == keymax);
+	test_assert(hash_table_count(hash) == keymax + 10 - removed);
+	for (i = 1; i <= 10; i++) {
+		test_assert_idx(POINTER_CAST_TO(hash_table_lookup(hash,
+			t_strdup_printf("new%u", i)), unsigned int) == i, i);
+	}
+
+	hash_table_clear(hash, TRUE);
+	test_assert(hash_table_count(hash) == 0);
+	lookup_key = "key2";
+	test_assert(hash_table_lookup(hash, lookup_key) == NULL);
+	hash_table_destroy(&hash);
+	pool_unref(&pool);
+}
+
 void test_hash(void)
 {
 	pool_t pool;
 
 	test_begin("hash table (random)");
-	test_hash_random_pool(default_pool);
+	test_hash_random_pool(default_pool, FALSE);
 
 	pool = pool_alloconly_create("test hash", 1024);
-	test_hash_random_pool(pool);
+	test_hash_random_pool(pool, FALSE);
 	pool_unref(&pool);
 	test_end();
+
+	test_begin("hash table flat (random)");
+	test_hash_random_pool(default_pool, TRUE);
+	test_end();
+
+	test_begin("hash table iterate");
+	test_hash_iterate(FALSE);
+	test_end();
+
+	test_begin("hash table flat iterate");
+	test_hash_iterate(TRUE);
+	test_end();
 }
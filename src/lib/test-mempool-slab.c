@@ -0,0 +1,163 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+
+#define SENSE 0xAB
+
+static bool mem_is_zero(const void *mem, size_t size)
+{
+	const unsigned char *bytes = mem;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (bytes[i] != 0)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void test_mempool_slab_alloc(void)
+{
+	pool_t pool;
+	unsigned char *mem[200];
+	unsigned int i;
+	size_t size;
+
+	test_begin("mempool_slab alloc");
+	pool = pool_slab_create("test");
+	for (i = 0; i < N_ELEMENTS(mem); i++) {
+		/* cover all the size classes and some large allocations */
+		size = i * 47 + 1;
+		mem[i] = p_malloc(pool, size);
+		test_assert_idx(mem_is_zero(mem[i], size), i);
+		memset(mem[i], SENSE, size);
+	}
+	for (i = 0; i < N_ELEMENTS(mem); i += 2)
+		p_free(pool, mem[i]);
+	/* the freed memory is reused, but it must be zeroed */
+	for (i = 0; i < N_ELEMENTS(mem); i += 2) {
+		size = i * 47 + 1;
+		mem[i] = p_malloc(pool, size);
+		test_assert_idx(mem_is_zero(mem[i], size), i);
+		memset(mem[i], SENSE, size);
+	}
+	for (i = 0; i < N_ELEMENTS(mem); i++) {
+		size = i * 47 + 1;
+		test_assert_idx(mem[i][0] == SENSE && mem[i][size-1] == SENSE, i);
+	}
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_realloc(void)
+{
+	pool_t pool;
+	unsigned char *mem, *mem2;
+	size_t size = 10;
+
+	test_begin("mempool_slab realloc");
+	pool = pool_slab_create("test");
+	mem = p_malloc(pool, size);
+	memset(mem, SENSE, size);
+	/* fits into the same size class */
+	mem2 = p_realloc(pool, mem, size, 16);
+	test_assert(mem2 == mem);
+	test_assert(mem[size-1] == SENSE && mem_is_zero(mem + size, 16 - size));
+
+	/* grow until it's a large allocation */
+	for (size = 16; size < 20000; size *= 2) {
+		memset(mem, SENSE, size);
+		mem = p_realloc(pool, mem, size, size * 2);
+		test_assert_idx(mem[0] == SENSE && mem[size-1] == SENSE, size);
+		test_assert_idx(mem_is_zero(mem + size, size), size);
+	}
+	/* unknown old size */
+	mem = p_realloc(pool, mem, SIZE_MAX, size * 2);
+	test_assert(mem[0] == SENSE && mem_is_zero(mem + size, size));
+
+	p_clear(pool);
+	mem = p_malloc(pool, 100);
+	test_assert(mem_is_zero(mem, 100));
+	pool_unref(&pool);
+	test_end();
+}
+
+static void test_mempool_slab_recycle(void)
+{
+	struct pool_slab_stats stats1, stats2;
+	pool_t pool;
+	unsigned int i, round;
+
+	test_begin("mempool_slab recycle");
+	for (round = 0; round < 3; round++) {
+		pool_slab_get_stats(&stats1);
+		pool = pool_slab_create("test");
+		for (i = 1; i <= 100; i++)
+			(void)p_malloc(pool, i * 10);
+		pool_unref(&pool);
+		pool_slab_get_stats(&stats2);
+
+		test_assert(stats2.alloc_count == stats1.alloc_count + 101);
+		test_assert(stats2.alloc_bytes == stats1.alloc_bytes);
+		/* after the first round everything comes from the
+		   free lists */
+		if (round > 0) {
+			test_assert_idx(stats2.system_alloc_count ==
+					stats1.system_alloc_count, round);
+		}
+	}
+	test_assert(stats2.cached_bytes > 0);
+	pool_slab_free_unused();
+	pool_slab_get_stats(&stats2);
+	test_assert(stats2.cached_bytes == 0);
+	test_end();
+}
+
+static void test_mempool_slab_pool_stats(void)
+{
+	struct pool_slab_stats stats;
+	pool_t pool1, pool2;
+	void *mem;
+
+	test_begin("mempool_slab pool stats");
+	pool1 = pool_slab_create("test1");
+	pool2 = pool_slab_create("test2");
+	test_assert(pool_slab_get_pool_stats(pool1, &stats));
+	test_assert(stats.alloc_count == 0 && stats.alloc_bytes == 0);
+	test_assert(!pool_slab_get_pool_stats(default_pool, &stats));
+
+	mem = p_malloc(pool1, 100);
+	(void)p_malloc(pool1, 10000);
+	(void)p_malloc(pool2, 10);
+
+	pool_slab_get_pool_stats(pool1, &stats);
+	test_assert(stats.alloc_count == 2);
+	test_assert(stats.alloc_bytes >= 10100);
+	test_assert(stats.system_alloc_count <= 2);
+	test_assert(stats.cached_bytes == 0);
+	/* the large allocation always comes from the system */
+	test_assert(stats.system_alloc_bytes >= 10000);
+
+	p_free(pool1, mem);
+	pool_slab_get_pool_stats(pool1, &stats);
+	test_assert(stats.alloc_count == 2);
+	test_assert(stats.alloc_bytes == 10000);
+	p_clear(pool1);
+	pool_slab_get_pool_stats(pool1, &stats);
+	test_assert(stats.alloc_count == 2 && stats.alloc_bytes == 0);
+
+	pool_slab_get_pool_stats(pool2, &stats);
+	test_assert(stats.alloc_count == 1);
+	test_assert(stats.alloc_bytes == 16);
+	pool_unref(&pool1);
+	pool_unref(&pool2);
+	test_end();
+}
+
+void test_mempool_slab(void)
+{
+	test_mempool_slab_alloc();
+	test_mempool_slab_realloc();
+	test_mempool_slab_recycle();
+	test_mempool_slab_pool_stats();
+}
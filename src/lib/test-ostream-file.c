@@ -156,6 +156,7 @@ static void test_ostream_file_send_istream_sendfile(void)
 	input2 = i_stream_create_limit(input, 4);
 	test_assert(o_stream_send_istream(output, input2) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
 	test_assert(output->offset == 4);
+	test_assert(o_stream_get_sendfile_bytes(output) == 4);
 	test_assert(read(sock_fd[1], buf, sizeof(buf)) == 4 &&
 		    memcmp(buf, "defg", 4) == 0);
 	i_stream_unref(&input2);
@@ -166,6 +167,7 @@ static void test_ostream_file_send_istream_sendfile(void)
 	test_assert(o_stream_send_istream(output, input2) == OSTREAM_SEND_ISTREAM_RESULT_FINISHED);
 	test_assert(input2->v_offset == 10);
 	test_assert(output->offset == 14);
+	test_assert(o_stream_get_sendfile_bytes(output) == 14);
 	i_stream_unref(&input2);
 
 	i_stream_unref(&input);
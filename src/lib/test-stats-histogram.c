@@ -0,0 +1,224 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "bits.h"
+#include "str.h"
+#include "sort.h"
+#include "stats-histogram.h"
+
+static void test_stats_histogram_small(void)
+{
+	struct stats_histogram *hist;
+	uint64_t max_value, count;
+	unsigned int i, idx = 0;
+
+	test_begin("stats histogram small values");
+	hist = stats_histogram_init();
+	test_assert(stats_histogram_get_percentile(hist, 0.5) == 0);
+	test_assert(!stats_histogram_iterate(hist, &idx, &max_value, &count));
+
+	/* values below 32 are counted exactly */
+	for (i = 1; i <= 20; i++)
+		stats_histogram_add(hist, i);
+	test_assert(stats_histogram_get_count(hist) == 20);
+	test_assert(stats_histogram_get_sum(hist) == 210);
+	test_assert(stats_histogram_get_min(hist) == 1);
+	test_assert(stats_histogram_get_max(hist) == 20);
+	test_assert(stats_histogram_get_avg(hist) == 10.5);
+	test_assert(stats_histogram_get_percentile(hist, 0.5) == 10);
+	test_assert(stats_histogram_get_percentile(hist, 0.95) == 19);
+	test_assert(stats_histogram_get_percentile(hist, 1) == 20);
+	test_assert(stats_histogram_get_percentile(hist, 0) == 1);
+
+	idx = 0;
+	for (i = 1; i <= 20; i++) {
+		test_assert_idx(stats_histogram_iterate(hist, &idx, &max_value,
+							&count), i);
+		test_assert_idx(max_value == i && count == 1, i);
+	}
+	test_assert(!stats_histogram_iterate(hist, &idx, &max_value, &count));
+
+	stats_histogram_reset(hist);
+	test_assert(stats_histogram_get_count(hist) == 0);
+	test_assert(stats_histogram_get_max(hist) == 0);
+	stats_histogram_deinit(&hist);
+	test_end();
+}
+
+static void test_stats_histogram_buckets(void)
+{
+	struct stats_histogram *hist;
+	uint64_t value, prev_max = 0, max_value, count;
+	unsigned int i, idx = 0, bucket_count = 0;
+
+	test_begin("stats histogram buckets");
+	hist = stats_histogram_init();
+	/* add values around each power of 2 */
+	for (i = 5; i < 64; i++) {
+		value = 1ULL << i;
+		stats_histogram_add(hist, value - 1);
+		stats_histogram_add(hist, value);
+		stats_histogram_add(hist, value + 1);
+	}
+	stats_histogram_add(hist, UINT64_MAX);
+	test_assert(stats_histogram_get_max(hist) == UINT64_MAX);
+
+	while (stats_histogram_iterate(hist, &idx, &max_value, &count)) {
+		/* 2^n-1 is the last value of its bucket, and 2^n and 2^n+1
+		   are in the same bucket */
+		test_assert_idx(max_value > prev_max, idx);
+		if (max_value == UINT64_MAX)
+			test_assert_idx(count == 1, idx);
+		else if (bits_required64(max_value + 1) ==
+			 bits_required64(max_value) + 1)
+			test_assert_idx(count == 1, idx);
+		else {
+			test_assert_idx(count == 2, idx);
+			/* the bucket width is 1/16 of its minimum */
+			test_assert_idx(max_value - (prev_max + 1) + 1 ==
+					(1ULL << (bits_required64(max_value) - 5)),
+					idx);
+		}
+		prev_max = max_value;
+		bucket_count++;
+	}
+	test_assert(bucket_count == (64 - 5) * 2 + 1);
+	test_assert(idx <= STATS_HISTOGRAM_BUCKET_COUNT);
+	stats_histogram_deinit(&hist);
+	test_end();
+}
+
+static void test_stats_histogram_percentiles(void)
+{
+	static const double fractions[] = {
+		0.01, 0.1, 0.25, 0.5, 0.75, 0.9, 0.95, 0.99, 0.999, 1
+	};
+	const unsigned int value_count = 10000;
+	struct stats_histogram *hist;
+	uint64_t *values, exact, approx;
+	unsigned int i, rank;
+
+	test_begin("stats histogram percentiles");
+	hist = stats_histogram_init();
+	values = i_new(uint64_t, value_count);
+	for (i = 0; i < value_count; i++) {
+		/* roughly log-normal distribution, like durations */
+		values[i] = (uint64_t)i_rand_limit(1000) <<
+			i_rand_limit(24);
+		stats_histogram_add(hist, values[i]);
+	}
+	i_qsort(values, value_count, sizeof(*values), uint64_cmp);
+
+	for (i = 0; i < N_ELEMENTS(fractions); i++) {
+		rank = value_count * fractions[i] + 0.5;
+		exact = values[rank - 1];
+		approx = stats_histogram_get_percentile(hist, fractions[i]);
+		/* the percentile's bucket width is at most 1/16 of it */
+		test_assert_idx(approx >= exact &&
+				approx - exact <= exact / 16, i);
+	}
+	stats_histogram_deinit(&hist);
+	i_free(values);
+	test_end();
+}
+
+static void test_stats_histogram_merge(void)
+{
+	struct stats_histogram *hist1, *hist2, *hist_all, *imported;
+	string_t *str1, *str2;
+	const char *error;
+	uint64_t value;
+	unsigned int i;
+
+	test_begin("stats histogram merge");
+	hist1 = stats_histogram_init();
+	hist2 = stats_histogram_init();
+	hist_all = stats_histogram_init();
+	for (i = 0; i < 1000; i++) {
+		value = i_rand_limit(1000000);
+		stats_histogram_add(i % 3 == 0 ? hist1 : hist2, value);
+		stats_histogram_add(hist_all, value);
+	}
+
+	str1 = t_str_new(256);
+	str2 = t_str_new(256);
+	stats_histogram_merge(hist1, hist2);
+	stats_histogram_export(hist1, str1);
+	stats_histogram_export(hist_all, str2);
+	test_assert_strcmp(str_c(str1), str_c(str2));
+
+	/* merging to an empty histogram via export + import */
+	imported = stats_histogram_init();
+	test_assert(stats_histogram_import(imported, str_c(str2),
+					   &error) == 0);
+	str_truncate(str1, 0);
+	stats_histogram_export(imported, str1);
+	test_assert_strcmp(str_c(str1), str_c(str2));
+
+	/* merging an empty histogram does nothing */
+	stats_histogram_reset(hist2);
+	stats_histogram_merge(imported, hist2);
+	str_truncate(str1, 0);
+	stats_histogram_export(imported, str1);
+	test_assert_strcmp(str_c(str1), str_c(str2));
+	stats_histogram_deinit(&imported);
+
+	/* importing twice doubles the counts */
+	imported = stats_histogram_init();
+	test_assert(stats_histogram_import(imported, str_c(str2),
+					   &error) == 0);
+	test_assert(stats_histogram_import(imported, str_c(str2),
+					   &error) == 0);
+	test_assert(stats_histogram_get_count(imported) == 2000);
+	test_assert(stats_histogram_get_sum(imported) ==
+		    stats_histogram_get_sum(hist_all) * 2);
+	test_assert(stats_histogram_get_percentile(imported, 0.5) ==
+		    stats_histogram_get_percentile(hist_all, 0.5));
+	stats_histogram_deinit(&imported);
+
+	stats_histogram_deinit(&hist1);
+	stats_histogram_deinit(&hist2);
+	stats_histogram_deinit(&hist_all);
+	test_end();
+}
+
+static void test_stats_histogram_import_invalid(void)
+{
+	static const char *invalid[] = {
+		"",
+		"1 2 3",
+		"1 2 3 x",
+		"1 5 5 4 5:1",
+		"1 5 5 5",
+		"1 5 5 5 5:2",
+		"1 5 5 5 5",
+		"1 5 5 5 5:x",
+		"1 5 5 5 976:1",
+		"1 5 5 5 4294967296:1",
+	};
+	struct stats_histogram *hist;
+	const char *error;
+	unsigned int i;
+
+	test_begin("stats histogram import invalid");
+	hist = stats_histogram_init();
+	for (i = 0; i < N_ELEMENTS(invalid); i++) {
+		test_assert_idx(stats_histogram_import(hist, invalid[i],
+						       &error) < 0, i);
+	}
+	test_assert(stats_histogram_get_count(hist) == 0);
+	test_assert(stats_histogram_import(hist, "1 5 5 5 5:1", &error) == 0);
+	test_assert(stats_histogram_get_count(hist) == 1);
+	test_assert(stats_histogram_get_percentile(hist, 0.5) == 5);
+	stats_histogram_deinit(&hist);
+	test_end();
+}
+
+void test_stats_histogram(void)
+{
+	test_stats_histogram_small();
+	test_stats_histogram_buckets();
+	test_stats_histogram_percentiles();
+	test_stats_histogram_merge();
+	test_stats_histogram_import_invalid();
+}
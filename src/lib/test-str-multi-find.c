@@ -0,0 +1,142 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "test-lib.h"
+#include "str.h"
+#include "str-multi-find.h"
+
+static const char *test_random_str(unsigned int max_len)
+{
+	unsigned int i, len = i_rand_minmax(1, max_len);
+	char *str = t_malloc0(len + 1);
+
+	/* small alphabet to get plenty of overlapping keys */
+	for (i = 0; i < len; i++)
+		str[i] = "abcx"[i_rand_limit(4)];
+	return str;
+}
+
+static void test_str_multi_find_random(void)
+{
+	struct str_multi_find_context *ctx;
+	const char *keys[10], *text;
+	unsigned int i, round, keys_count, pos, len;
+	bool all_matched;
+
+	test_begin("str_multi_find random");
+	for (round = 0; round < 1000; round++) T_BEGIN {
+		keys_count = i_rand_minmax(1, N_ELEMENTS(keys));
+		for (i = 0; i < keys_count; i++)
+			keys[i] = test_random_str(5);
+		text = test_random_str(40);
+		ctx = str_multi_find_init(pool_datastack_create(),
+					  keys, keys_count);
+
+		/* feed the text in random sized blocks */
+		all_matched = FALSE;
+		for (pos = 0; pos < strlen(text); pos += len) {
+			len = i_rand_minmax(1, 8);
+			len = I_MIN(len, strlen(text) - pos);
+			all_matched = str_multi_find_more(ctx,
+				(const unsigned char *)text + pos, len);
+		}
+		for (i = 0; i < keys_count; i++) {
+			bool expected = strstr(text, keys[i]) != NULL;
+			test_assert_idx(str_multi_find_is_matched(ctx, i) ==
+					expected, round);
+			if (!expected)
+				test_assert_idx(!all_matched, round);
+		}
+		test_assert_idx(all_matched == str_multi_find_all_matched(ctx),
+				round);
+		str_multi_find_deinit(&ctx);
+	} T_END;
+	test_end();
+}
+
+static void test_str_multi_find_reset(void)
+{
+	static const char *keys[] = { "abc", "bcd", "c", "abc" };
+	struct str_multi_find_context *ctx;
+
+	test_begin("str_multi_find reset");
+	ctx = str_multi_find_init(default_pool, keys, N_ELEMENTS(keys));
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)"xab", 3));
+	test_assert(!str_multi_find_is_matched(ctx, 0));
+	/* matches across blocks */
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)"cx", 2));
+	test_assert(str_multi_find_is_matched(ctx, 0));
+	test_assert(!str_multi_find_is_matched(ctx, 1));
+	test_assert(str_multi_find_is_matched(ctx, 2));
+	test_assert(str_multi_find_is_matched(ctx, 3));
+
+	/* no matching across reset, but the earlier matches are kept */
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)"b", 1));
+	str_multi_find_reset(ctx);
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)"cd", 2));
+	test_assert(!str_multi_find_is_matched(ctx, 1));
+	test_assert(str_multi_find_is_matched(ctx, 0));
+	test_assert(str_multi_find_more(ctx, (const unsigned char *)"bcd", 3));
+	test_assert(str_multi_find_all_matched(ctx));
+
+	str_multi_find_clear(ctx);
+	test_assert(!str_multi_find_all_matched(ctx));
+	test_assert(!str_multi_find_is_matched(ctx, 0));
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)"bc", 2));
+	test_assert(str_multi_find_is_matched(ctx, 2));
+	test_assert(!str_multi_find_is_matched(ctx, 0));
+	str_multi_find_deinit(&ctx);
+	test_end();
+}
+
+static void test_str_multi_find_large_keys(void)
+{
+	struct str_multi_find_context *ctx;
+	const char *keys[3];
+	string_t *text;
+	char *key;
+	unsigned int i, j, pos, len;
+
+	test_begin("str_multi_find large keys");
+	/* the keys use all the byte values, so the DFA would be too large
+	   and the keys are searched separately */
+	for (i = 0; i < N_ELEMENTS(keys); i++) {
+		keys[i] = key = t_malloc0(2001);
+		for (j = 0; j < 2000; j++)
+			key[j] = (char)((i * 7 + j) % 255 + 1);
+	}
+	text = t_str_new(5000);
+	str_append(text, "xx");
+	str_append(text, keys[2]);
+	str_append(text, keys[0]);
+	str_append(text, "xx");
+
+	ctx = str_multi_find_init(default_pool, keys, N_ELEMENTS(keys));
+	for (pos = 0; pos < str_len(text); pos += len) {
+		len = I_MIN(100, str_len(text) - pos);
+		test_assert(!str_multi_find_more(ctx, str_data(text) + pos, len));
+	}
+	test_assert(str_multi_find_is_matched(ctx, 0));
+	test_assert(!str_multi_find_is_matched(ctx, 1));
+	test_assert(str_multi_find_is_matched(ctx, 2));
+	test_assert(!str_multi_find_all_matched(ctx));
+	test_assert(str_multi_find_more(ctx, (const unsigned char *)keys[1],
+					strlen(keys[1])));
+
+	str_multi_find_clear(ctx);
+	test_assert(!str_multi_find_is_matched(ctx, 0));
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)keys[0],
+					 1000));
+	str_multi_find_reset(ctx);
+	test_assert(!str_multi_find_more(ctx, (const unsigned char *)keys[0] +
+					 1000, 1000));
+	test_assert(!str_multi_find_is_matched(ctx, 0));
+	str_multi_find_deinit(&ctx);
+	test_end();
+}
+
+void test_str_multi_find(void)
+{
+	test_str_multi_find_random();
+	test_str_multi_find_reset();
+	test_str_multi_find_large_keys();
+}
@@ -715,6 +715,9 @@ static void print_build_options(void)
 #ifdef IOLOOP_SELECT
 		" ioloop=select"
 #endif
+#ifdef IOLOOP_URING
+		" ioloop=uring"
+#endif
 #ifdef IOLOOP_NOTIFY_INOTIFY
 		" notify=inotify"
 #endif
@@ -0,0 +1,201 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "module-dir.h"
+#include "randgen.h"
+#include "str.h"
+#include "strnum.h"
+#include "time-util.h"
+#include "master-service.h"
+#include "mail-search-build.h"
+#include "test-mail-storage-common.h"
+
+#include <stdio.h>
+
+/**
+ * Saves a number of messages with random words into a mailbox and measures
+ * how quickly they can be indexed into flatcurve the same way as
+ * indexer-worker does it. The number of fts_flatcurve_index_threads can be
+ * given to compare indexing with and without the indexing threads, and the
+ * mail driver to see how much of the time is spent reading the mails.
+ */
+
+#define BENCH_WORDS_PER_MESSAGE 300
+#define BENCH_WORD_VARIATIONS 20000
+
+static const char *bench_random_words(unsigned int count)
+{
+	string_t *str = t_str_new(count * 10);
+
+	for (unsigned int i = 0; i < count; i++) {
+		if (i > 0)
+			str_append_c(str, (i % 12) == 0 ? '\n' : ' ');
+		str_printfa(str, "word%u", i_rand_limit(BENCH_WORD_VARIATIONS));
+	}
+	return str_c(str);
+}
+
+static void bench_save(struct mailbox *box, unsigned int messages_count)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *mail_input;
+	int ret;
+
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (unsigned int i = 0; i < messages_count; i++) T_BEGIN {
+		mail_input = t_strdup_printf(
+			"From: sender%u@example.com\n"
+			"To: rcpt%u@example.com\n"
+			"Subject: %s\n"
+			"Date: Thu, 01 Jan 2015 00:00:00 +0000\n"
+			"Message-ID: <%u@example.com>\n"
+			"\n"
+			"%s\n", i_rand_limit(100), i_rand_limit(100),
+			bench_random_words(5), i,
+			bench_random_words(BENCH_WORDS_PER_MESSAGE));
+		input = i_stream_create_from_data(mail_input,
+						  strlen(mail_input));
+		save_ctx = mailbox_save_alloc(trans);
+		if (mailbox_save_begin(&save_ctx, input) < 0)
+			i_fatal("Failed to save mail");
+		while ((ret = i_stream_read(input)) > 0 || ret == -2) {
+			if (mailbox_save_continue(save_ctx) < 0)
+				i_fatal("Failed to save mail");
+		}
+		i_assert(input->stream_errno == 0);
+		if (mailbox_save_finish(&save_ctx) < 0)
+			i_fatal("Failed to save mail");
+		i_stream_unref(&input);
+	} T_END;
+	if (mailbox_transaction_commit(&trans) < 0) {
+		i_fatal("Failed to save mails: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	if (mailbox_sync(box, 0) < 0) {
+		i_fatal("Failed to sync mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+}
+
+static void bench_index(struct mailbox *box, unsigned int messages_count)
+{
+	struct mailbox_metadata metadata;
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	unsigned int count = 0;
+	uint64_t ts_0, ts_1;
+
+	if (mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS,
+				 &metadata) < 0) {
+		i_fatal("Precache-fields lookup failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+
+	ts_0 = i_nanoseconds();
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC, "indexing");
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	ctx = mailbox_search_init(trans, search_args, NULL,
+				  metadata.precache_fields, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(ctx, &mail)) {
+		if (mail_precache(mail) < 0) {
+			i_fatal("Precache for UID=%u failed: %s", mail->uid,
+				mail_get_last_internal_error(mail, NULL));
+		}
+		count++;
+	}
+	if (mailbox_search_deinit(&ctx) < 0 ||
+	    mailbox_transaction_commit(&trans) < 0) {
+		i_fatal("Indexing failed: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	ts_1 = i_nanoseconds();
+	i_assert(count == messages_count);
+
+	printf("\tIndexing: %0.02lf msgs/s\n",
+	       (double)messages_count * 1000000000.0 / (double)(ts_1 - ts_0 + 1));
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s <plugin dir> [<messages> [<threads> [<driver>]]]\n",
+		prog);
+	fprintf(stderr, "Runs with 10000 messages, no threads and maildir if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *const plugin_names[] = { "fts", "fts_flatcurve", NULL };
+	struct module_dir_load_settings mod_set = {
+		.abi_version = DOVECOT_ABI_VERSION,
+		.require_init_funcs = TRUE,
+	};
+	struct test_mail_storage_ctx *ctx;
+	struct module *modules;
+	struct mailbox *box;
+	unsigned int messages_count = 10000, threads_count = 0;
+	const char *driver = "maildir";
+
+	master_service = master_service_init("bench-fts-flatcurve",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_CONFIG_BUILTIN |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+	if (argc < 2 || argc > 5)
+		print_usage(argv[0]);
+	if ((argc > 2 && (str_to_uint(argv[2], &messages_count) < 0 ||
+			  messages_count == 0)) ||
+	    (argc > 3 && str_to_uint(argv[3], &threads_count) < 0)) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+	if (argc > 4)
+		driver = argv[4];
+
+	/* the storage service doesn't load plugins in the test setup */
+	modules = module_dir_load(argv[1], plugin_names, &mod_set);
+	module_dir_init(modules);
+
+	ctx = test_mail_storage_init();
+	const char *const extra_input[] = {
+		"mail_plugins=fts fts_flatcurve",
+		"fts+=flatcurve",
+		t_strdup_printf("fts_flatcurve_index_threads=%u",
+				threads_count),
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.driver = driver,
+		.extra_input = extra_input,
+	};
+	test_mail_storage_init_user(ctx, &set);
+
+	box = mailbox_alloc(ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(box) < 0) {
+		i_fatal("Failed to open mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	bench_save(box, messages_count);
+	printf("%u messages, %u threads, %s\n", messages_count,
+	       threads_count, driver);
+	bench_index(box, messages_count);
+	mailbox_free(&box);
+
+	test_mail_storage_deinit_user(ctx);
+	test_mail_storage_deinit(&ctx);
+	module_dir_unload(&modules);
+	master_service_deinit(&master_service);
+	return 0;
+}
@@ -7,18 +7,27 @@ extern "C" {
 #include "file-create-locked.h"
 #include "hash.h"
 #include "hex-binary.h"
+#include "ioloop.h"
 #include "message-header-parser.h"
 #include "path-util.h"
 #include "mail-storage-private.h"
 #include "mail-search.h"
 #include "md5.h"
+#include "read-full.h"
+#include "safe-mkstemp.h"
 #include "sleep.h"
 #include "str.h"
+#include "strescape.h"
 #include "unichar.h"
 #include "time-util.h"
+#include "write-full.h"
+#include "fts-indexer.h"
 #include "fts-backend-flatcurve.h"
 #include "fts-backend-flatcurve-xapian.h"
 #include <dirent.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
 };
 #include <cstdio>
 
@@ -37,8 +46,15 @@ extern "C" {
 #endif
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 /* How Xapian DBs work in fts-flatcurve: all data lives in under one
  * per-mailbox directory (FTS_FLATCURVE_LABEL) stored at the root of the
@@ -76,6 +92,31 @@ extern "C" {
  * are not intended to persist between sessions. */
 #define FLATCURVE_XAPIAN_DB_OPTIMIZE "optimize"
 
+/* Deferred commits: if fts_flatcurve_deferred_commit_size is set, new
+ * messages aren't written directly to the current DB. Instead, the Xapian
+ * documents are serialized and appended to the "pending" log in the fts
+ * directory, which is a lot cheaper than committing a Xapian DB for each
+ * delivered mail. The log is written to the current DB in a single commit
+ * once it grows larger than fts_flatcurve_deferred_commit_size, or its
+ * oldest document is older than fts_flatcurve_deferred_commit_time.
+ *
+ * Until then, queries also search an in-memory DB containing the documents
+ * in the log, so the pending messages are found. The log is appended to and
+ * removed only while holding the flatcurve lock. */
+#define FLATCURVE_XAPIAN_PENDING_FNAME "pending"
+#define FLATCURVE_XAPIAN_PENDING_MAGIC 0xfcd0c001
+
+/* Prefix index: if fts_flatcurve_prefix_index is set, each index shard has a
+ * file containing all of its terms in sorted order. Index shards don't get
+ * new documents, so the file needs to be written only once (expunged
+ * documents' terms in it just don't match anything). Prefix searches are
+ * expanded to the matching terms by binary searching the mmap()ed files,
+ * instead of letting Xapian expand wildcards by reading the term lists of
+ * all the shards. The terms of the (small) current shard and the pending
+ * documents are still looked up from Xapian. */
+#define FLATCURVE_XAPIAN_TERMS_FNAME "flatcurve-terms"
+#define FLATCURVE_XAPIAN_TERMS_MAGIC 0xfcd0c002
+
 /* Xapian "recommendations" are that you begin your local prefix identifier
  * with "X" for data that doesn't match with a data type listed as a Xapian
  * "convention". However, this recommendation is for maintaining
@@ -100,10 +141,18 @@ extern "C" {
 		FLATCURVE_XAPIAN_DB_KEY_PREFIX FTS_FLATCURVE_LABEL
 #define FLATCURVE_XAPIAN_DB_VERSION 1
 
+/* Maximum number of messages queued for the indexing threads per thread.
+ * The indexing process blocks when the queue is full. */
+#define FLATCURVE_XAPIAN_PIPELINE_QUEUE_PER_THREAD 8
+
 #define FLATCURVE_DBW_LOCK_RETRY_SECS 1
 #define FLATCURVE_DBW_LOCK_RETRY_MAX 60
 #define FLATCURVE_MANUAL_OPTIMIZE_COMMIT_LIMIT 500
 
+/* With fts_flatcurve_optimize_background, optimizations are done by the
+ * indexer's worker processes instead of the processes serving the user. */
+#define FLATCURVE_XAPIAN_INDEXER_SERVICE "indexer-worker"
+
 /* Lock: needed to ensure we don't run into race conditions when
  * manipulating current directory. */
 #define FLATCURVE_XAPIAN_LOCK_FNAME "flatcurve-lock"
@@ -112,6 +161,28 @@ extern "C" {
 #define ENUM_EMPTY(x) ((enum x) 0)
 
 
+/* Pending log record header. It's followed by the serialized document. */
+struct flatcurve_xapian_pending_hdr {
+	uint32_t magic;
+	uint32_t uid;
+	uint32_t size;
+	uint32_t timestamp;
+};
+
+/* Mailbox whose pending log was left uncommitted */
+struct flatcurve_xapian_pending_box {
+	char *boxname, *db_path, *volatile_dir;
+	/* When fts_flatcurve_deferred_commit_time is reached */
+	time_t commit_time;
+};
+
+/* Prefix index header. It's followed by uint32_t offsets to the terms and
+ * the NUL-terminated terms. */
+struct flatcurve_xapian_terms_hdr {
+	uint32_t magic;
+	uint32_t count;
+};
+
 struct flatcurve_xapian_db_path {
 	const char *fname;
 	const char *path;
@@ -130,10 +201,24 @@ struct flatcurve_xapian_db {
 	Xapian::WritableDatabase *dbw;
 	struct flatcurve_xapian_db_path *dbpath;
 	unsigned int changes;
+	/* Number of documents in dbw when it was opened or last committed.
+	 * Used instead of dbw->get_doccount() while indexing threads may be
+	 * writing to dbw. */
+	unsigned int dbw_doccount;
 	enum flatcurve_xapian_db_type type;
+	/* mmap()ed prefix index, or NULL if not opened */
+	const unsigned char *terms;
+	size_t terms_size;
 };
 HASH_TABLE_DEFINE_TYPE(xapian_db, char *, struct flatcurve_xapian_db *);
 
+struct flatcurve_xapian_optimize_shard {
+	struct flatcurve_xapian_db *xdb;
+	uoff_t size;
+};
+ARRAY_DEFINE_TYPE(flatcurve_xapian_optimize_shard,
+		  struct flatcurve_xapian_optimize_shard);
+
 struct flatcurve_xapian {
 	/* Current database objects. */
 	struct flatcurve_xapian_db *dbw_current;
@@ -156,6 +241,30 @@ struct flatcurve_xapian {
 	unsigned int doc_updates;
 	bool doc_created:1;
 
+	/* Indexing threads, or NULL if fts_flatcurve_index_threads=0. The
+	 * current message is collected into pipeline_msg instead of doc. */
+	struct flatcurve_xapian_pipeline *pipeline;
+	struct flatcurve_xapian_pipeline_msg *pipeline_msg;
+
+	/* Deferred commits: the documents in the pending log are also in
+	 * db_pending, which is part of db_read. pending_buf contains the
+	 * log records that haven't been written to the log yet. */
+	Xapian::WritableDatabase *db_pending;
+	ARRAY_TYPE(uint32_t) pending_uids;
+	buffer_t *pending_buf;
+	/* The pending log's state when it was last read or written. */
+	ino_t pending_file_ino;
+	uoff_t pending_file_size;
+	time_t pending_file_oldest;
+	/* The pending log was committed because it grew too large. Write
+	 * the rest of the mailbox's messages directly to the DB. */
+	bool pending_direct:1;
+	/* Mailboxes that were closed with an uncommitted pending log.
+	 * to_pending commits their logs once they get too old, so that
+	 * they don't wait for the mailbox to be accessed again. */
+	ARRAY(struct flatcurve_xapian_pending_box) pending_boxes;
+	struct timeout *to_pending;
+
 	/* List of mailboxes to optimize at shutdown. */
 	HASH_TABLE(char *, char *) optimize;
 
@@ -171,6 +280,8 @@ struct flatcurve_fts_query_xapian_maybe {
 	ARRAY(struct flatcurve_fts_query_xapian_maybe) maybe_queries;
 
 	bool and_search:1;
+	/* Expand prefixes using the current mailbox's prefix index */
+	bool expand_prefixes:1;
 	bool maybe:1;
 	bool start:1;
  };
@@ -231,9 +342,391 @@ fts_flatcurve_xapian_close_dbs(struct flatcurve_fts_backend *backend,
 			       enum flatcurve_xapian_db_close opts,
 			       const char **error_r);
 static int
+fts_flatcurve_xapian_clear_document(struct flatcurve_fts_backend *backend,
+				    const char **error_r);
+static int
 fts_flatcurve_xapian_db_populate(struct flatcurve_fts_backend *backend,
 				 enum flatcurve_xapian_db_opts opts,
 				 const char **error_r);
+static void
+fts_flatcurve_xapian_pending_timeout(struct flatcurve_fts_backend *backend);
+static void
+fts_flatcurve_xapian_pending_boxes_deinit(struct flatcurve_fts_backend *backend);
+
+/* Indexing pipeline: when fts_flatcurve_index_threads is set, the message
+ * text is still parsed and tokenized by the indexing process's main thread,
+ * but generating the Xapian terms and documents is done by a pool of
+ * threads. The finished documents are written to the current DB by a single
+ * writer thread, since a WritableDatabase can't be used by multiple threads.
+ *
+ * So only the term generation runs in parallel. The Xapian writes (and the
+ * commits, which the main thread does after flushing the pipeline) are still
+ * serialized, and so is everything done by lib-storage and lib-language.
+ * How much the threads help depends on how large a part of the indexing
+ * time is spent in the term generation, which bench-fts-flatcurve can be
+ * used to measure.
+ *
+ * The threads don't call any Dovecot library functions, because they aren't
+ * thread-safe. Errors are stored and returned by the next
+ * fts_flatcurve_xapian_pipeline_flush() call. The main thread must flush
+ * the pipeline before it accesses a WritableDatabase itself. */
+
+struct flatcurve_xapian_pipeline_field {
+	/* Lowercased header name, or empty for body. */
+	std::string hdr_name;
+	std::string data;
+	bool header;
+	bool indexed_hdr;
+};
+
+struct flatcurve_xapian_pipeline_msg {
+	Xapian::WritableDatabase *dbw;
+	uint32_t uid;
+	std::vector<flatcurve_xapian_pipeline_field> fields;
+	Xapian::Document doc;
+};
+
+struct flatcurve_xapian_pipeline {
+	const struct fts_flatcurve_settings *set;
+
+	std::mutex mutex;
+	std::condition_variable build_cond, write_cond, done_cond;
+	std::deque<flatcurve_xapian_pipeline_msg *> build_queue, write_queue;
+	std::vector<std::thread> threads;
+	/* Number of messages queued or being processed */
+	unsigned int pending;
+	unsigned int max_pending;
+	/* First error that happened in the threads */
+	std::string error;
+	bool stop;
+};
+
+static void
+fts_flatcurve_xapian_doc_add_header(Xapian::Document *doc,
+				    const struct fts_flatcurve_settings *set,
+				    const char *hdr_name, bool indexed_hdr,
+				    const unsigned char *data, size_t size)
+{
+	std::string all_term, hdr_term;
+
+	if (*hdr_name != '\0') {
+		doc->add_boolean_term(std::string(
+			FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX) + hdr_name);
+	}
+
+	hdr_term = FLATCURVE_XAPIAN_HEADER_PREFIX;
+	if (indexed_hdr) {
+		for (; *hdr_name != '\0'; hdr_name++)
+			hdr_term += i_toupper(*hdr_name);
+	}
+	size_t hdr_term_start = hdr_term.size();
+
+	const unsigned char *end = data + size;
+	for(; end > data; data += uni_utf8_char_bytes((unsigned char) *data)) {
+		size_t len = end - data;
+		if (len < set->min_term_size)
+			break;
+
+		/* Capital ASCII letters at the beginning of a Xapian term are
+		   treated as a "term prefix". Force to non-uppercase the first
+		   letter of the header value to ensure the term is not
+		   confused with a "term prefix". */
+		all_term = FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX;
+		all_term += i_tolower(*data);
+		all_term.append((const char *)data + 1, len - 1);
+		doc->add_term(all_term);
+
+		if (indexed_hdr) {
+			hdr_term.resize(hdr_term_start);
+			hdr_term += i_tolower(*data);
+			hdr_term.append((const char *)data + 1, len - 1);
+			doc->add_term(hdr_term);
+		}
+
+		if (!set->substring_search)
+			break;
+	}
+}
+
+static void
+fts_flatcurve_xapian_doc_add_body(Xapian::Document *doc,
+				  const struct fts_flatcurve_settings *set,
+				  const unsigned char *data, size_t size)
+{
+	std::string term;
+
+	const unsigned char *end = data + size;
+	for(; end > data; data += uni_utf8_char_bytes((unsigned char) *data)) {
+		size_t len = end - data;
+		if (len < set->min_term_size)
+			break;
+
+		/* Capital ASCII letters at the beginning of a Xapian term are
+		   treated as a "term prefix". Lowercase a leading ASCII
+		   capital to ensure the term is not confused with a "term
+		   prefix". */
+		term.assign(1, i_tolower(*data));
+		term.append((const char *)data + 1, len - 1);
+		doc->add_term(term);
+
+		if (!set->substring_search)
+			break;
+	}
+}
+
+static void
+fts_flatcurve_xapian_pipeline_set_error(struct flatcurve_xapian_pipeline *pl,
+					const std::string &error)
+{
+	std::lock_guard<std::mutex> lock(pl->mutex);
+	if (pl->error.empty())
+		pl->error = error;
+}
+
+static void
+fts_flatcurve_xapian_pipeline_build(struct flatcurve_xapian_pipeline *pl)
+{
+	struct flatcurve_xapian_pipeline_msg *msg;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(pl->mutex);
+			pl->build_cond.wait(lock, [pl] {
+				return pl->stop || !pl->build_queue.empty();
+			});
+			if (pl->build_queue.empty())
+				return;
+			msg = pl->build_queue.front();
+			pl->build_queue.pop_front();
+		}
+
+		try {
+			for (const auto &field : msg->fields) {
+				const unsigned char *data =
+					(const unsigned char *)field.data.data();
+				if (field.header) {
+					fts_flatcurve_xapian_doc_add_header(
+						&msg->doc, pl->set,
+						field.hdr_name.c_str(),
+						field.indexed_hdr,
+						data, field.data.size());
+				} else {
+					fts_flatcurve_xapian_doc_add_body(
+						&msg->doc, pl->set,
+						data, field.data.size());
+				}
+			}
+			msg->fields.clear();
+		} catch (std::bad_alloc &b) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				std::string("Out of memory when indexing mail (") +
+				b.what() + "); UID=" + std::to_string(msg->uid) +
+				" (Hint: increase indexing process vsz_limit or "
+				"define smaller fts_flatcurve_commit_limit)");
+		} catch (Xapian::Error &e) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				"Could not index message data: uid=" +
+				std::to_string(msg->uid) + "; " +
+				e.get_description());
+		} catch (std::exception &e) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				std::string("Unexpected exception: ") + e.what());
+		} catch (...) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				"Unknown exception");
+		}
+
+		std::lock_guard<std::mutex> lock(pl->mutex);
+		pl->write_queue.push_back(msg);
+		pl->write_cond.notify_one();
+	}
+}
+
+static void
+fts_flatcurve_xapian_pipeline_write(struct flatcurve_xapian_pipeline *pl)
+{
+	struct flatcurve_xapian_pipeline_msg *msg;
+	bool failed;
+
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(pl->mutex);
+			pl->write_cond.wait(lock, [pl] {
+				return !pl->write_queue.empty() ||
+					(pl->stop && pl->pending == 0);
+			});
+			if (pl->write_queue.empty())
+				return;
+			msg = pl->write_queue.front();
+			pl->write_queue.pop_front();
+			failed = !pl->error.empty();
+		}
+
+		try {
+			try {
+				if (!failed) {
+					/* Existing documents aren't replaced,
+					   the same as without the indexing
+					   threads. */
+					(void)msg->dbw->get_document(msg->uid);
+				}
+			} catch (Xapian::DocNotFoundError &e) {
+				msg->dbw->replace_document(msg->uid, msg->doc);
+			}
+		} catch (std::bad_alloc &b) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				std::string("Out of memory when writing mail (") +
+				b.what() + "); UID=" +
+				std::to_string(msg->uid));
+		} catch (Xapian::Error &e) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				"Could not write message data: uid=" +
+				std::to_string(msg->uid) + "; " +
+				e.get_description());
+		} catch (std::exception &e) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				std::string("Unexpected exception: ") + e.what());
+		} catch (...) {
+			fts_flatcurve_xapian_pipeline_set_error(pl,
+				"Unknown exception");
+		}
+		delete(msg);
+
+		std::lock_guard<std::mutex> lock(pl->mutex);
+		pl->pending--;
+		pl->done_cond.notify_all();
+	}
+}
+
+static void
+fts_flatcurve_xapian_pipeline_deinit(struct flatcurve_xapian_pipeline **_pl)
+{
+	struct flatcurve_xapian_pipeline *pl = *_pl;
+
+	*_pl = NULL;
+	{
+		std::lock_guard<std::mutex> lock(pl->mutex);
+		pl->stop = TRUE;
+		pl->build_cond.notify_all();
+		pl->write_cond.notify_all();
+	}
+	for (auto &thread : pl->threads)
+		thread.join();
+	i_assert(pl->pending == 0);
+	delete(pl);
+}
+
+static void
+fts_flatcurve_xapian_pipeline_init(struct flatcurve_fts_backend *backend)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	const struct fts_flatcurve_settings *set = backend->fuser->set;
+	struct flatcurve_xapian_pipeline *pl;
+
+	pl = new flatcurve_xapian_pipeline();
+	pl->set = set;
+	pl->max_pending = set->index_threads *
+		FLATCURVE_XAPIAN_PIPELINE_QUEUE_PER_THREAD;
+
+	/* Signals must be handled only by the main thread. The threads
+	   inherit the signal mask, so block them while creating threads. */
+	sigset_t set_all, set_old;
+	sigfillset(&set_all);
+	(void)pthread_sigmask(SIG_SETMASK, &set_all, &set_old);
+	try {
+		pl->threads.emplace_back(
+			fts_flatcurve_xapian_pipeline_write, pl);
+		for (unsigned int i = 0; i < set->index_threads; i++) {
+			pl->threads.emplace_back(
+				fts_flatcurve_xapian_pipeline_build, pl);
+		}
+	} catch (std::system_error &e) {
+		(void)pthread_sigmask(SIG_SETMASK, &set_old, NULL);
+		e_error(backend->event, "Failed to create indexing threads, "
+			"indexing without them: %s", e.what());
+		fts_flatcurve_xapian_pipeline_deinit(&pl);
+		return;
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &set_old, NULL);
+	x->pipeline = pl;
+	e_debug(backend->event, "Indexing with %u threads",
+		set->index_threads);
+}
+
+static void
+fts_flatcurve_xapian_pipeline_add(struct flatcurve_xapian_pipeline *pl,
+				  struct flatcurve_xapian_pipeline_msg *msg)
+{
+	std::unique_lock<std::mutex> lock(pl->mutex);
+	pl->done_cond.wait(lock, [pl] {
+		return pl->pending < pl->max_pending;
+	});
+	pl->pending++;
+	pl->build_queue.push_back(msg);
+	pl->build_cond.notify_one();
+}
+
+/* Wait until all the queued messages are written.
+ * Returns: 0 on success, -1 if writing any of them failed */
+static int
+fts_flatcurve_xapian_pipeline_flush(struct flatcurve_fts_backend *backend,
+				    const char **error_r)
+{
+	struct flatcurve_xapian_pipeline *pl = backend->xapian->pipeline;
+
+	if (pl == NULL)
+		return 0;
+
+	std::unique_lock<std::mutex> lock(pl->mutex);
+	pl->done_cond.wait(lock, [pl] { return pl->pending == 0; });
+	if (pl->error.empty())
+		return 0;
+	*error_r = t_strdup(pl->error.c_str());
+	pl->error.clear();
+	return -1;
+}
+
+/* Returns: TRUE if this process is the indexer-worker doing the background
+ * optimizations queued by fts_flatcurve_xapian_optimize_queue() */
+static bool
+fts_flatcurve_xapian_optimize_is_background(struct flatcurve_fts_backend *backend)
+{
+	return backend->fuser->set->optimize_background &&
+		strcmp(backend->backend.ns->user->service,
+		       FLATCURVE_XAPIAN_INDEXER_SERVICE) == 0;
+}
+
+/* Ask the indexer to optimize the mailbox in the background. The
+ * indexer-worker syncs the mailbox with MAILBOX_SYNC_FLAG_OPTIMIZE, which
+ * goes through all the mailboxes in the user's namespace. In the background
+ * optimization only the mailboxes that need it are optimized (see
+ * fts_flatcurve_xapian_optimize_box()), so one request per user is enough.
+ * Returns: TRUE if the request was sent */
+static bool
+fts_flatcurve_xapian_optimize_queue(struct flatcurve_fts_backend *backend,
+				    const char *boxname)
+{
+	struct mail_user *user = backend->backend.ns->user;
+	const char *path;
+
+	if (!backend->fuser->set->optimize_background ||
+	    fts_flatcurve_xapian_optimize_is_background(backend))
+		return FALSE;
+
+	const char *cmd = t_strdup_printf("OPTIMIZE\t0\t%s\t%s\n",
+					  str_tabescape(user->username),
+					  str_tabescape(boxname));
+	int fd = fts_indexer_cmd(user, cmd, backend->event, &path);
+	if (fd == -1)
+		return FALSE;
+	i_close_fd(&fd);
+
+	e_debug(event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_optimize_queued")->
+		add_str("mailbox", boxname)->event(),
+		"Queued optimization to indexer");
+	return TRUE;
+}
 
 void fts_flatcurve_xapian_init(struct flatcurve_fts_backend *backend)
 {
@@ -251,12 +744,20 @@ void fts_flatcurve_xapian_deinit(struct flatcurve_fts_backend *backend)
 
 	i_assert(x != NULL);
 	x->deinit = TRUE;
+	fts_flatcurve_xapian_pending_boxes_deinit(backend);
 	if (hash_table_is_created(x->optimize)) {
 		struct hash_iterate_context *iter =
 			hash_table_iterate_init(x->optimize);
 
 		void *key, *val;
+		bool queued = FALSE;
 		while (hash_table_iterate(iter, x->optimize, &key, &val)) {
+			/* A single request goes through all the mailboxes */
+			if (queued || fts_flatcurve_xapian_optimize_queue(
+				backend, (const char *)key)) {
+				queued = TRUE;
+				continue;
+			}
 			str_append(backend->boxname, (const char *)key);
 			str_append(backend->db_path, (const char *)val);
 
@@ -270,6 +771,9 @@ void fts_flatcurve_xapian_deinit(struct flatcurve_fts_backend *backend)
 	}
 	if (fts_flatcurve_xapian_close(backend, &error) < 0)
 		e_error(backend->event, "Failed to close Xapian: %s", error);
+	if (x->pipeline != NULL)
+		fts_flatcurve_xapian_pipeline_deinit(&x->pipeline);
+	buffer_free(&x->pending_buf);
 	hash_table_destroy(&x->dbs);
 	pool_unref(&x->pool);
 	x->deinit = FALSE;
@@ -463,8 +967,9 @@ fts_flatcurve_xapian_write_db_get(struct flatcurve_fts_backend *backend,
 	    fts_flatcurve_xapian_check_db_version(backend, xdb, error_r) < 0)
 		return -1;
 
+	xdb->dbw_doccount = xdb->dbw->get_doccount();
 	e_debug(backend->event, "Opened DB (RW, %s) messages=%u version=%u",
-		xdb->dbpath->fname, xdb->dbw->get_doccount(),
+		xdb->dbpath->fname, xdb->dbw_doccount,
 		FLATCURVE_XAPIAN_DB_VERSION);
 
 	return 0;
@@ -531,6 +1036,170 @@ fts_flatcurve_xapian_optimize_mailbox(struct flatcurve_fts_backend *backend)
 				  p_strdup(backend->pool, str_c(backend->db_path)));
 }
 
+static const char *
+fts_flatcurve_xapian_terms_path(struct flatcurve_xapian_db_path *dbpath)
+{
+	return t_strconcat(dbpath->path, "/" FLATCURVE_XAPIAN_TERMS_FNAME,
+			   NULL);
+}
+
+/* Write the prefix index of an index shard.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_terms_write(struct flatcurve_xapian_db_path *dbpath,
+				 const char **error_r)
+{
+	struct flatcurve_xapian_terms_hdr hdr;
+	std::vector<uint32_t> offsets;
+	std::string data;
+
+	try {
+		Xapian::Database db(dbpath->path);
+		for (Xapian::TermIterator t = db.allterms_begin();
+		     t != db.allterms_end(); ++t) {
+			offsets.push_back(data.size());
+			data += *t;
+			data += '\0';
+			if (data.size() > UINT32_MAX) {
+				*error_r = t_strdup_printf(
+					"Too many terms for prefix index (%s)",
+					dbpath->fname);
+				return -1;
+			}
+		}
+	} catch (Xapian::Error &e) {
+		*error_r = t_strdup_printf("Cannot read terms (%s): %s",
+					   dbpath->fname,
+					   e.get_description().c_str());
+		return -1;
+	}
+
+	i_zero(&hdr);
+	hdr.magic = FLATCURVE_XAPIAN_TERMS_MAGIC;
+	hdr.count = offsets.size();
+
+	const char *path = fts_flatcurve_xapian_terms_path(dbpath);
+	string_t *temp_path = t_str_new(256);
+	str_printfa(temp_path, "%s.tmp.", path);
+	int fd = safe_mkstemp(temp_path, 0600, (uid_t)-1, (gid_t)-1);
+	if (fd == -1) {
+		*error_r = t_strdup_printf("safe_mkstemp(%s) failed: %m",
+					   str_c(temp_path));
+		return -1;
+	}
+
+	int ret = 0;
+	if (write_full(fd, &hdr, sizeof(hdr)) < 0 ||
+	    (hdr.count > 0 &&
+	     (write_full(fd, &offsets[0], hdr.count * sizeof(uint32_t)) < 0 ||
+	      write_full(fd, data.data(), data.size()) < 0))) {
+		*error_r = t_strdup_printf("write(%s) failed: %m",
+					   str_c(temp_path));
+		ret = -1;
+	} else if (rename(str_c(temp_path), path) < 0) {
+		*error_r = t_strdup_printf("rename(%s, %s) failed: %m",
+					   str_c(temp_path), path);
+		ret = -1;
+	}
+	i_close_fd(&fd);
+	if (ret < 0)
+		i_unlink_if_exists(str_c(temp_path));
+	return ret;
+}
+
+/* Returns: 1 if the prefix index is mapped, 0 if it doesn't exist or is
+ * corrupted, -1 on error */
+static int
+fts_flatcurve_xapian_terms_open(struct flatcurve_fts_backend *backend,
+				struct flatcurve_xapian_db *xdb,
+				const char **error_r)
+{
+	if (xdb->terms != NULL)
+		return 1;
+
+	const char *path = fts_flatcurve_xapian_terms_path(xdb->dbpath);
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return 0;
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		i_close_fd(&fd);
+		return -1;
+	}
+	size_t size = st.st_size;
+	void *base = NULL;
+	if (size > 0) {
+		base = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+		if (base == MAP_FAILED) {
+			*error_r = t_strdup_printf("mmap(%s) failed: %m", path);
+			i_close_fd(&fd);
+			return -1;
+		}
+	}
+	i_close_fd(&fd);
+
+	const struct flatcurve_xapian_terms_hdr *hdr =
+		(const struct flatcurve_xapian_terms_hdr *)base;
+	size_t data_size = 0;
+	bool valid = size >= sizeof(*hdr) &&
+		hdr->magic == FLATCURVE_XAPIAN_TERMS_MAGIC &&
+		hdr->count <= (size - sizeof(*hdr)) / sizeof(uint32_t);
+	if (valid) {
+		data_size = size - sizeof(*hdr) - hdr->count * sizeof(uint32_t);
+		valid = hdr->count == 0 ||
+			(data_size > 0 && ((const char *)base)[size-1] == '\0');
+	}
+	if (!valid) {
+		e_error(backend->event, "Corrupted prefix index %s - "
+			"rebuilding it", path);
+		if (base != NULL)
+			(void)munmap(base, size);
+		i_unlink_if_exists(path);
+		return 0;
+	}
+	xdb->terms = (const unsigned char *)base;
+	xdb->terms_size = size;
+	return 1;
+}
+
+/* Add all the terms starting with prefix in the prefix index to terms. */
+static void
+fts_flatcurve_xapian_terms_lookup(struct flatcurve_xapian_db *xdb,
+				  const std::string &prefix,
+				  std::vector<std::string> &terms)
+{
+	const struct flatcurve_xapian_terms_hdr *hdr =
+		(const struct flatcurve_xapian_terms_hdr *)xdb->terms;
+	const uint32_t *offsets = (const uint32_t *)(hdr + 1);
+	const char *data = (const char *)(offsets + hdr->count);
+	size_t data_size = xdb->terms_size -
+		((const unsigned char *)data - xdb->terms);
+	unsigned int idx, left = 0, right = hdr->count;
+
+	/* The data ends with NUL, so any offset inside it is a valid string */
+#define TERM(i) (offsets[i] < data_size ? data + offsets[i] : "")
+	while (left < right) {
+		idx = left + (right - left) / 2;
+		if (strcmp(TERM(idx), prefix.c_str()) < 0)
+			left = idx + 1;
+		else
+			right = idx;
+	}
+	for (; left < hdr->count; left++) {
+		const char *term = TERM(left);
+		if (strncmp(term, prefix.c_str(), prefix.size()) != 0)
+			break;
+		terms.push_back(term);
+	}
+#undef TERM
+}
+
 /* Returns: 0 on success, -1 on error */
 static int
 fts_flatcurve_xapian_db_add(struct flatcurve_fts_backend *backend,
@@ -580,6 +1249,14 @@ fts_flatcurve_xapian_db_add(struct flatcurve_fts_backend *backend,
 
 		db->dbpath = newpath;
 		db->type = FLATCURVE_XAPIAN_DB_TYPE_INDEX;
+
+		const char *error;
+		if (!failed && backend->fuser != NULL &&
+		    backend->fuser->set->prefix_index &&
+		    fts_flatcurve_xapian_terms_write(newpath, &error) < 0) {
+			/* It's written later when it's needed */
+			e_error(backend->event, "%s", error);
+		}
 	}
 
 	if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT)
@@ -813,71 +1490,757 @@ fts_flatcurve_xapian_write_db_current(struct flatcurve_fts_backend *backend,
 	return 1;
 }
 
-/* Returns: 0 if DBs table is empty, 1 otherwise, -1 on error */
-static int
-fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
-			     enum flatcurve_xapian_db_opts opts,
-			     Xapian::Database **db_read_r,
-			     const char **error_r)
+static const char *
+fts_flatcurve_xapian_pending_path(struct flatcurve_fts_backend *backend)
 {
-	struct hash_iterate_context *iter;
-	void *key, *val;
-	struct fts_flatcurve_xapian_db_stats stats;
-	struct flatcurve_xapian *x = backend->xapian;
-	struct flatcurve_xapian_db *xdb;
-
-	if (x->db_read != NULL) {
-		try {
-			(void)x->db_read->reopen();
-			if (db_read_r != NULL) *db_read_r = x->db_read;
-			return 1;
-		} catch (Xapian::DatabaseNotFoundError &e) {
-			/* This means that the underlying databases have
-			 * changed (i.e. DB rotation by another process).
-			 * Close all DBs and reopen. */
-			if (fts_flatcurve_xapian_close(backend, error_r) < 0)
-				return -1;
-			return fts_flatcurve_xapian_read_db(
-			       backend, opts, db_read_r, error_r);
-		}
-	}
-
-	if (fts_flatcurve_xapian_db_populate(backend, opts, error_r) < 0)
-		return -1;
+	return t_strconcat(str_c(backend->db_path),
+			   FLATCURVE_XAPIAN_PENDING_FNAME, NULL);
+}
 
-	if (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_IGNORE_EMPTY) &&
-	    (hash_table_count(x->dbs) == 0))
-		return 0;
+static bool
+fts_flatcurve_xapian_deferred_enabled(struct flatcurve_fts_backend *backend)
+{
+	if (backend->fuser == NULL) return FALSE;
+	if (backend->fuser->set->deferred_commit_size == 0) return FALSE;
+	return !backend->xapian->pending_direct;
+}
 
-	x->db_read = new Xapian::Database();
+static bool fts_flatcurve_xapian_pending_exists(struct flatcurve_xapian *x)
+{
+	return x->pending_file_size > 0 ||
+		(x->pending_buf != NULL && x->pending_buf->used > 0);
+}
 
-	iter = hash_table_iterate_init(x->dbs);
-	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
-		xdb = (struct flatcurve_xapian_db *)val;
-		if (fts_flatcurve_xapian_db_read_add(
-			backend, xdb, error_r) < 0)
-			e_error(backend->event, "%s", *error_r);
+static Xapian::WritableDatabase *
+fts_flatcurve_xapian_pending_db_get(struct flatcurve_xapian *x)
+{
+	if (x->db_pending == NULL) {
+		x->db_pending = new Xapian::WritableDatabase(
+			std::string(), Xapian::DB_BACKEND_INMEMORY);
+		i_array_init(&x->pending_uids, 32);
+		if (x->db_read != NULL)
+			x->db_read->add_database(*x->db_pending);
 	}
-	hash_table_iterate_deinit(&iter);
+	return x->db_pending;
+}
 
-	if (fts_flatcurve_xapian_mailbox_stats(backend, &stats, error_r) < 0)
-		return -1;
+static void fts_flatcurve_xapian_pending_db_clear(struct flatcurve_xapian *x)
+{
+	uint32_t uid;
 
-	e_debug(backend->event, "Opened DB (RO) messages=%u version=%u "
-		"shards=%u", stats.messages, stats.version, stats.shards);
+	if (x->db_pending == NULL)
+		return;
 
-	if (db_read_r != NULL) *db_read_r = x->db_read;
-	return 1;
+	array_foreach_elem(&x->pending_uids, uid) {
+		try {
+			x->db_pending->delete_document(uid);
+		} catch (Xapian::DocNotFoundError &e) {
+		}
+	}
+	array_clear(&x->pending_uids);
 }
 
-/* Returns: 0 on success, -1 on error */
-int
-fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
-				   struct fts_flatcurve_xapian_db_check *check,
-				   const char **error_r)
+/* Add the documents in the pending log records to db. If uids isn't NULL,
+ * the UIDs are added to it. If timestamp_r isn't NULL, it's set to the
+ * first record's timestamp.
+ * Returns: number of added documents, -1 on error */
+static int
+fts_flatcurve_xapian_pending_apply(struct flatcurve_fts_backend *backend,
+				   const unsigned char *data, size_t size,
+				   Xapian::WritableDatabase *db,
+				   ARRAY_TYPE(uint32_t) *uids,
+				   time_t *timestamp_r, const char **error_r)
 {
-	static const enum flatcurve_xapian_db_opts opts =
-		(enum flatcurve_xapian_db_opts)
+	struct flatcurve_xapian_pending_hdr hdr;
+	size_t pos = 0;
+	int count = 0;
+
+	while (pos + sizeof(hdr) <= size) {
+		memcpy(&hdr, data + pos, sizeof(hdr));
+		if (hdr.magic != FLATCURVE_XAPIAN_PENDING_MAGIC ||
+		    hdr.size > size - pos - sizeof(hdr))
+			break;
+		pos += sizeof(hdr);
+
+		try {
+			db->replace_document(hdr.uid,
+				Xapian::Document::unserialise(std::string(
+					(const char *)data + pos, hdr.size)));
+		} catch (Xapian::Error &e) {
+			*error_r = t_strdup_printf(
+				"Failed to add pending document uid=%u: %s",
+				hdr.uid, e.get_description().c_str());
+			return -1;
+		}
+		if (uids != NULL)
+			array_push_back(uids, &hdr.uid);
+		if (timestamp_r != NULL && count == 0)
+			*timestamp_r = hdr.timestamp;
+		pos += hdr.size;
+		count++;
+	}
+	if (pos != size) {
+		/* most likely a process died while writing the log */
+		e_error(backend->event, "Corrupted pending log %s: "
+			"Ignoring %zu bytes at offset %zu",
+			fts_flatcurve_xapian_pending_path(backend),
+			size - pos, pos);
+	}
+	return count;
+}
+
+/* Returns: 0 if the log doesn't exist, 1 if it was read, -1 on error */
+static int
+fts_flatcurve_xapian_pending_read(struct flatcurve_fts_backend *backend,
+				  std::string *data_r, struct stat *st_r,
+				  const char **error_r)
+{
+	const char *path = fts_flatcurve_xapian_pending_path(backend);
+
+	int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno == ENOENT) {
+			i_zero(st_r);
+			return 0;
+		}
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+		return -1;
+	}
+
+	int ret = 1;
+	if (fstat(fd, st_r) < 0) {
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+		ret = -1;
+	} else if (st_r->st_size > 0) {
+		data_r->resize(st_r->st_size);
+		int rret = read_full(fd, &(*data_r)[0], st_r->st_size);
+		if (rret < 0) {
+			*error_r = t_strdup_printf("read(%s) failed: %m", path);
+			ret = -1;
+		} else if (rret == 0) {
+			*error_r = t_strdup_printf(
+				"read(%s) failed: Unexpected EOF", path);
+			ret = -1;
+		}
+	}
+	i_close_fd(&fd);
+	return ret;
+}
+
+/* Make sure db_pending contains the documents currently in the pending log.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_load(struct flatcurve_fts_backend *backend,
+				  const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	const char *path = fts_flatcurve_xapian_pending_path(backend);
+	std::string data;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		if (errno != ENOENT) {
+			*error_r = t_strdup_printf("stat(%s) failed: %m", path);
+			return -1;
+		}
+		i_zero(&st);
+	}
+	if (st.st_ino == x->pending_file_ino &&
+	    (uoff_t)st.st_size == x->pending_file_size)
+		return 0;
+
+	if (st.st_ino != 0) {
+		/* Lock to avoid reading partially written records */
+		if (fts_flatcurve_xapian_lock(backend, error_r) < 0)
+			return -1;
+		int ret = fts_flatcurve_xapian_pending_read(backend, &data,
+							    &st, error_r);
+		fts_flatcurve_xapian_unlock(backend);
+		if (ret < 0)
+			return -1;
+	}
+
+	/* The log was changed by another process - rebuild db_pending */
+	fts_flatcurve_xapian_pending_db_clear(x);
+	x->pending_file_ino = st.st_ino;
+	x->pending_file_size = st.st_size;
+	x->pending_file_oldest = 0;
+
+	if (data.empty() &&
+	    (x->pending_buf == NULL || x->pending_buf->used == 0))
+		return 0;
+
+	Xapian::WritableDatabase *db = fts_flatcurve_xapian_pending_db_get(x);
+	if (fts_flatcurve_xapian_pending_apply(backend,
+		(const unsigned char *)data.data(), data.size(), db,
+		&x->pending_uids, &x->pending_file_oldest, error_r) < 0)
+		return -1;
+	if (x->pending_buf != NULL &&
+	    fts_flatcurve_xapian_pending_apply(backend,
+		(const unsigned char *)x->pending_buf->data,
+		x->pending_buf->used, db, &x->pending_uids, NULL, error_r) < 0)
+		return -1;
+	return 0;
+}
+
+/* Append pending_buf to the pending log.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_write(struct flatcurve_fts_backend *backend,
+				   const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_pending_hdr hdr;
+	struct stat st;
+
+	if (x->pending_buf == NULL || x->pending_buf->used == 0)
+		return 0;
+
+	if (mailbox_list_mkdir_root(backend->backend.ns->list,
+				    str_c(backend->db_path),
+				    MAILBOX_LIST_PATH_TYPE_INDEX) < 0) {
+		buffer_set_used_size(x->pending_buf, 0);
+		*error_r = t_strdup_printf("Cannot create DB (RW); %s",
+					   str_c(backend->db_path));
+		return -1;
+	}
+	if (fts_flatcurve_xapian_lock(backend, error_r) < 0) {
+		buffer_set_used_size(x->pending_buf, 0);
+		return -1;
+	}
+
+	const char *path = fts_flatcurve_xapian_pending_path(backend);
+	int ret = -1;
+	int fd = open(path, O_RDWR | O_APPEND | O_CREAT, 0600);
+	if (fd == -1)
+		*error_r = t_strdup_printf("open(%s) failed: %m", path);
+	else if (fstat(fd, &st) < 0)
+		*error_r = t_strdup_printf("fstat(%s) failed: %m", path);
+	else if (st.st_size > 0 &&
+		 pread_full(fd, &hdr, sizeof(hdr), 0) <= 0)
+		*error_r = t_strdup_printf("pread(%s) failed: %m", path);
+	else if (write_full(fd, x->pending_buf->data,
+			    x->pending_buf->used) < 0)
+		*error_r = t_strdup_printf("write(%s) failed: %m", path);
+	else {
+		if (st.st_size == 0)
+			memcpy(&hdr, x->pending_buf->data, sizeof(hdr));
+		if (st.st_ino != x->pending_file_ino ||
+		    (uoff_t)st.st_size != x->pending_file_size) {
+			/* Other processes have changed the log since it was
+			   loaded. Reload it the next time it's needed. */
+			x->pending_file_ino = 0;
+		} else {
+			x->pending_file_ino = st.st_ino;
+		}
+		x->pending_file_size = st.st_size + x->pending_buf->used;
+		x->pending_file_oldest = hdr.timestamp;
+		ret = 0;
+	}
+	if (fd != -1)
+		i_close_fd(&fd);
+	fts_flatcurve_xapian_unlock(backend);
+	buffer_set_used_size(x->pending_buf, 0);
+	return ret;
+}
+
+/* Write all the pending documents to the current DB and remove the pending
+ * log.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_flush(struct flatcurve_fts_backend *backend,
+				   const char **error_r)
+{
+	static const enum flatcurve_xapian_db_opts opts =
+		ENUM_EMPTY(flatcurve_xapian_db_opts);
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db *xdb;
+
+	if (fts_flatcurve_xapian_pipeline_flush(backend, error_r) < 0)
+		return -1;
+	/* Opening the DB for writing waits for any other process that is
+	   committing the log at the same time. */
+	int ret = fts_flatcurve_xapian_write_db_current(
+			backend, opts, &xdb, error_r);
+	if (ret <= 0)
+		return ret;
+	if (fts_flatcurve_xapian_lock(backend, error_r) < 0)
+		return -1;
+
+	std::string data;
+	struct stat st;
+	int count = 0, count2 = 0;
+	ret = fts_flatcurve_xapian_pending_read(backend, &data, &st, error_r);
+	if (ret >= 0) {
+		count = fts_flatcurve_xapian_pending_apply(backend,
+			(const unsigned char *)data.data(), data.size(),
+			xdb->dbw, NULL, NULL, error_r);
+	}
+	if (ret >= 0 && count >= 0 && x->pending_buf != NULL) {
+		count2 = fts_flatcurve_xapian_pending_apply(backend,
+			(const unsigned char *)x->pending_buf->data,
+			x->pending_buf->used, xdb->dbw, NULL, NULL, error_r);
+	}
+	if (ret >= 0 && count >= 0 && count2 >= 0) {
+		try {
+			xdb->dbw->commit();
+			xdb->dbw_doccount = xdb->dbw->get_doccount();
+		} catch (Xapian::Error &e) {
+			*error_r = t_strdup_printf(
+				"Failed to commit pending documents: %s",
+				e.get_description().c_str());
+			ret = -1;
+		}
+	} else {
+		ret = -1;
+	}
+	if (ret > 0 && i_unlink_if_exists(
+		fts_flatcurve_xapian_pending_path(backend)) < 0) {
+		*error_r = "Failed to remove pending log";
+		ret = -1;
+	}
+	fts_flatcurve_xapian_unlock(backend);
+	if (ret < 0)
+		return -1;
+
+	if (x->pending_buf != NULL)
+		buffer_set_used_size(x->pending_buf, 0);
+	fts_flatcurve_xapian_pending_db_clear(x);
+	x->pending_file_ino = 0;
+	x->pending_file_size = 0;
+	x->pending_file_oldest = 0;
+
+	e_debug(backend->event, "Committed %d pending documents to DB "
+		"(RW, %s)", count + count2, xdb->dbpath->fname);
+
+	unsigned int rotate_count = backend->fuser->set->rotate_count;
+	if (rotate_count > 0 && xdb->dbw_doccount >= rotate_count) {
+		return fts_flatcurve_xapian_close_db(backend, xdb,
+			FLATCURVE_XAPIAN_DB_CLOSE_ROTATE, error_r);
+	}
+	return 0;
+}
+
+/* Move the current document to the pending log buffer.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_add(struct flatcurve_fts_backend *backend,
+				 const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_pending_hdr hdr;
+	std::string data;
+	int ret = 0;
+
+	try {
+		data = x->doc->serialise();
+		fts_flatcurve_xapian_pending_db_get(x)->replace_document(
+			x->doc_uid, *x->doc);
+	} catch (Xapian::Error &e) {
+		*error_r = t_strdup_printf(
+			"Could not write message data: uid=%u; %s",
+			x->doc_uid, e.get_description().c_str());
+		ret = -1;
+	}
+
+	if (ret == 0) {
+		i_zero(&hdr);
+		hdr.magic = FLATCURVE_XAPIAN_PENDING_MAGIC;
+		hdr.uid = x->doc_uid;
+		hdr.size = data.size();
+		hdr.timestamp = ioloop_time;
+		if (x->pending_buf == NULL)
+			x->pending_buf = buffer_create_dynamic(default_pool, 4096);
+		buffer_append(x->pending_buf, &hdr, sizeof(hdr));
+		buffer_append(x->pending_buf, data.data(), data.size());
+		array_push_back(&x->pending_uids, &hdr.uid);
+	}
+
+	if (x->doc_created)
+		delete(x->doc);
+	x->doc = NULL;
+	x->doc_created = FALSE;
+	x->doc_uid = 0;
+
+	if (ret < 0)
+		return -1;
+	if (x->pending_file_size + x->pending_buf->used <
+	    backend->fuser->set->deferred_commit_size)
+		return 0;
+
+	/* Probably indexing a lot of messages. Write the rest of them
+	   directly to the DB. */
+	e_debug(backend->event, "Pending log reached deferred commit size; "
+		"size=%" PRIuUOFF_T, backend->fuser->set->deferred_commit_size);
+	x->pending_direct = TRUE;
+	return fts_flatcurve_xapian_pending_flush(backend, error_r);
+}
+
+/* Commit the pending log before the DB is modified directly.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_flush_existing(struct flatcurve_fts_backend *backend,
+					    const char **error_r)
+{
+	if (fts_flatcurve_xapian_pending_load(backend, error_r) < 0)
+		return -1;
+	if (!fts_flatcurve_xapian_pending_exists(backend->xapian))
+		return 0;
+	return fts_flatcurve_xapian_pending_flush(backend, error_r);
+}
+
+static void
+fts_flatcurve_xapian_pending_timeout_update(struct flatcurve_fts_backend *backend)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	const struct flatcurve_xapian_pending_box *pbox;
+	time_t commit_time = 0;
+
+	timeout_remove(&x->to_pending);
+	if (!array_is_created(&x->pending_boxes))
+		return;
+	array_foreach(&x->pending_boxes, pbox) {
+		if (commit_time == 0 || pbox->commit_time < commit_time)
+			commit_time = pbox->commit_time;
+	}
+	if (commit_time == 0)
+		return;
+
+	unsigned int secs = commit_time <= ioloop_time ? 0 :
+		commit_time - ioloop_time;
+	x->to_pending = timeout_add(secs * 1000,
+				    fts_flatcurve_xapian_pending_timeout,
+				    backend);
+}
+
+/* Remember to commit the current mailbox's pending log at commit_time. */
+static void
+fts_flatcurve_xapian_pending_schedule(struct flatcurve_fts_backend *backend,
+				      time_t commit_time)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_pending_box *pbox;
+
+	if (!array_is_created(&x->pending_boxes))
+		i_array_init(&x->pending_boxes, 4);
+	array_foreach_modifiable(&x->pending_boxes, pbox) {
+		if (strcmp(pbox->db_path, str_c(backend->db_path)) == 0) {
+			if (commit_time < pbox->commit_time) {
+				pbox->commit_time = commit_time;
+				fts_flatcurve_xapian_pending_timeout_update(backend);
+			}
+			return;
+		}
+	}
+	pbox = array_append_space(&x->pending_boxes);
+	pbox->boxname = i_strdup(str_c(backend->boxname));
+	pbox->db_path = i_strdup(str_c(backend->db_path));
+	pbox->volatile_dir = i_strdup(str_c(backend->volatile_dir));
+	pbox->commit_time = commit_time;
+	fts_flatcurve_xapian_pending_timeout_update(backend);
+}
+
+static void
+fts_flatcurve_xapian_pending_box_free(struct flatcurve_xapian_pending_box *pbox)
+{
+	i_free(pbox->boxname);
+	i_free(pbox->db_path);
+	i_free(pbox->volatile_dir);
+}
+
+/* Returns: TRUE if the pending box was handled, FALSE if it needs to be
+   tried again later. */
+static bool
+fts_flatcurve_xapian_pending_commit_box(struct flatcurve_fts_backend *backend,
+					const struct flatcurve_xapian_pending_box *pbox)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	const char *error;
+
+	if (str_len(backend->boxname) > 0) {
+		/* Only the open mailbox can be committed without closing
+		   it, and only between messages. */
+		if (strcmp(str_c(backend->db_path), pbox->db_path) != 0 ||
+		    x->doc != NULL || x->pipeline_msg != NULL)
+			return FALSE;
+		if (fts_flatcurve_xapian_pending_flush_existing(
+			backend, &error) < 0)
+			e_error(backend->event, "%s", error);
+		return TRUE;
+	}
+
+	str_append(backend->boxname, pbox->boxname);
+	str_append(backend->db_path, pbox->db_path);
+	str_append(backend->volatile_dir, pbox->volatile_dir);
+	fts_flatcurve_xapian_set_mailbox(backend);
+
+	if (fts_flatcurve_xapian_pending_flush_existing(backend, &error) < 0)
+		e_error(backend->event, "%s", error);
+	if (fts_backend_flatcurve_close_mailbox(backend, &error) < 0)
+		e_error(backend->event, "%s", error);
+	return TRUE;
+}
+
+static void
+fts_flatcurve_xapian_pending_timeout(struct flatcurve_fts_backend *backend)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	unsigned int retry_secs = backend->fuser->set->deferred_commit_time;
+	struct flatcurve_xapian_pending_box pbox;
+
+	timeout_remove(&x->to_pending);
+	for (unsigned int i = 0; i < array_count(&x->pending_boxes); ) {
+		pbox = *array_idx_modifiable(&x->pending_boxes, i);
+		if (pbox.commit_time > ioloop_time) {
+			i++;
+			continue;
+		}
+		/* Committing may schedule the mailbox again */
+		array_delete(&x->pending_boxes, i, 1);
+		if (fts_flatcurve_xapian_pending_commit_box(backend, &pbox)) {
+			fts_flatcurve_xapian_pending_box_free(&pbox);
+			continue;
+		}
+		/* Another mailbox is being accessed. This one's log gets
+		   committed the next time it's accessed, or when trying
+		   again later. */
+		pbox.commit_time = ioloop_time + retry_secs;
+		array_insert(&x->pending_boxes, i, &pbox, 1);
+		i++;
+	}
+	fts_flatcurve_xapian_pending_timeout_update(backend);
+}
+
+static void
+fts_flatcurve_xapian_pending_boxes_deinit(struct flatcurve_fts_backend *backend)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_pending_box *pbox;
+
+	if (!array_is_created(&x->pending_boxes))
+		return;
+
+	/* Commit all the remaining logs. Nothing else would commit them
+	   until the mailbox is accessed again. */
+	array_foreach_modifiable(&x->pending_boxes, pbox)
+		pbox->commit_time = 0;
+	fts_flatcurve_xapian_pending_timeout(backend);
+	timeout_remove(&x->to_pending);
+
+	array_foreach_modifiable(&x->pending_boxes, pbox)
+		fts_flatcurve_xapian_pending_box_free(pbox);
+	array_free(&x->pending_boxes);
+}
+
+/* Called when the mailbox is refreshed or closed: the buffered documents are
+ * appended to the pending log, which is committed to the DB if it has become
+ * too large or old. Otherwise a timeout is added to commit it once it's old
+ * enough.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_pending_commit(struct flatcurve_fts_backend *backend,
+				    const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+
+	if (fts_flatcurve_xapian_clear_document(backend, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_write(backend, error_r) < 0)
+		return -1;
+	if (x->pending_file_size == 0)
+		return 0;
+
+	const struct fts_flatcurve_settings *set = backend->fuser->set;
+	if (x->pending_file_size < set->deferred_commit_size &&
+	    ioloop_time - x->pending_file_oldest <
+	    (time_t)set->deferred_commit_time) {
+		fts_flatcurve_xapian_pending_schedule(backend,
+			x->pending_file_oldest + set->deferred_commit_time);
+		return 0;
+	}
+	return fts_flatcurve_xapian_pending_flush(backend, error_r);
+}
+
+/* Returns: 0 not found, 1 if found */
+static int
+fts_flatcurve_xapian_pending_uid_exists(struct flatcurve_xapian *x,
+					uint32_t uid)
+{
+	if (x->db_pending == NULL)
+		return 0;
+	try {
+		(void)x->db_pending->get_document(uid);
+		return 1;
+	} catch (Xapian::DocNotFoundError &e) {
+		return 0;
+	}
+}
+
+static void fts_flatcurve_xapian_pending_close(struct flatcurve_xapian *x)
+{
+	if (x->db_pending != NULL) {
+		delete(x->db_pending);
+		x->db_pending = NULL;
+		array_free(&x->pending_uids);
+	}
+	if (x->pending_buf != NULL)
+		buffer_set_used_size(x->pending_buf, 0);
+	x->pending_file_ino = 0;
+	x->pending_file_size = 0;
+	x->pending_file_oldest = 0;
+	x->pending_direct = FALSE;
+}
+
+static void
+fts_flatcurve_xapian_terms_lookup_db(Xapian::Database &db,
+				     const std::string &prefix,
+				     std::vector<std::string> &terms)
+{
+	for (Xapian::TermIterator t = db.allterms_begin(prefix);
+	     t != db.allterms_end(prefix); ++t)
+		terms.push_back(*t);
+}
+
+/* Find all the terms in the mailbox starting with prefix.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_terms_expand(struct flatcurve_fts_backend *backend,
+				  const std::string &prefix,
+				  std::vector<std::string> &terms,
+				  const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	struct hash_iterate_context *iter;
+	struct flatcurve_xapian_db *xdb;
+	void *key, *val;
+	int ret = 0;
+
+	if (fts_flatcurve_xapian_db_populate(backend,
+			FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_load(backend, error_r) < 0)
+		return -1;
+
+	iter = hash_table_iterate_init(x->dbs);
+	while (ret == 0 && hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (xdb->type != FLATCURVE_XAPIAN_DB_TYPE_INDEX) {
+			/* The current shard is still being written to */
+			try {
+				Xapian::Database db(xdb->dbpath->path);
+				fts_flatcurve_xapian_terms_lookup_db(
+					db, prefix, terms);
+			} catch (Xapian::Error &e) {
+				*error_r = t_strdup_printf(
+					"Cannot read terms (%s): %s",
+					xdb->dbpath->fname,
+					e.get_description().c_str());
+				ret = -1;
+			}
+			continue;
+		}
+
+		ret = fts_flatcurve_xapian_terms_open(backend, xdb, error_r);
+		if (ret == 0) {
+			/* Shard created by optimization, by another process
+			   without the prefix index or writing it failed. */
+			if (fts_flatcurve_xapian_terms_write(xdb->dbpath,
+							     error_r) < 0)
+				ret = -1;
+			else if ((ret = fts_flatcurve_xapian_terms_open(
+					backend, xdb, error_r)) == 0) {
+				*error_r = t_strdup_printf(
+					"Prefix index of %s disappeared",
+					xdb->dbpath->fname);
+				ret = -1;
+			}
+		}
+		if (ret > 0) {
+			fts_flatcurve_xapian_terms_lookup(xdb, prefix, terms);
+			ret = 0;
+		}
+	}
+	hash_table_iterate_deinit(&iter);
+	if (ret < 0)
+		return -1;
+
+	if (x->db_pending != NULL)
+		fts_flatcurve_xapian_terms_lookup_db(*x->db_pending, prefix, terms);
+
+	std::sort(terms.begin(), terms.end());
+	terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+	return 0;
+}
+
+/* Returns: 0 if DBs table is empty, 1 otherwise, -1 on error */
+static int
+fts_flatcurve_xapian_read_db(struct flatcurve_fts_backend *backend,
+			     enum flatcurve_xapian_db_opts opts,
+			     Xapian::Database **db_read_r,
+			     const char **error_r)
+{
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	struct fts_flatcurve_xapian_db_stats stats;
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_db *xdb;
+
+	if (x->db_read != NULL) {
+		try {
+			(void)x->db_read->reopen();
+			if (fts_flatcurve_xapian_pending_load(backend, error_r) < 0)
+				return -1;
+			if (db_read_r != NULL) *db_read_r = x->db_read;
+			return 1;
+		} catch (Xapian::DatabaseNotFoundError &e) {
+			/* This means that the underlying databases have
+			 * changed (i.e. DB rotation by another process).
+			 * Close all DBs and reopen. */
+			if (fts_flatcurve_xapian_close(backend, error_r) < 0)
+				return -1;
+			return fts_flatcurve_xapian_read_db(
+			       backend, opts, db_read_r, error_r);
+		}
+	}
+
+	if (fts_flatcurve_xapian_db_populate(backend, opts, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_load(backend, error_r) < 0)
+		return -1;
+
+	if (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_IGNORE_EMPTY) &&
+	    (hash_table_count(x->dbs) == 0) &&
+	    (x->db_pending == NULL || array_is_empty(&x->pending_uids)))
+		return 0;
+
+	x->db_read = new Xapian::Database();
+
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		xdb = (struct flatcurve_xapian_db *)val;
+		if (fts_flatcurve_xapian_db_read_add(
+			backend, xdb, error_r) < 0)
+			e_error(backend->event, "%s", *error_r);
+	}
+	hash_table_iterate_deinit(&iter);
+	if (x->db_pending != NULL)
+		x->db_read->add_database(*x->db_pending);
+
+	if (fts_flatcurve_xapian_mailbox_stats(backend, &stats, error_r) < 0)
+		return -1;
+
+	e_debug(backend->event, "Opened DB (RO) messages=%u version=%u "
+		"shards=%u", stats.messages, stats.version, stats.shards);
+
+	if (db_read_r != NULL) *db_read_r = x->db_read;
+	return 1;
+}
+
+/* Returns: 0 on success, -1 on error */
+int
+fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
+				   struct fts_flatcurve_xapian_db_check *check,
+				   const char **error_r)
+{
+	static const enum flatcurve_xapian_db_opts opts =
+		(enum flatcurve_xapian_db_opts)
 			(FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
 			 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
 	struct flatcurve_xapian *x = backend->xapian;
@@ -923,6 +2286,9 @@ int fts_flatcurve_xapian_mailbox_rotate(struct flatcurve_fts_backend *backend,
 			 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
 	struct flatcurve_xapian_db *xdb;
 
+	if (fts_flatcurve_xapian_pending_flush_existing(backend, error_r) < 0)
+		return -1;
+
 	int ret = fts_flatcurve_xapian_write_db_current(
 		backend, opts, &xdb, error_r);
 	if (ret <= 0)
@@ -955,6 +2321,21 @@ fts_flatcurve_xapian_mailbox_stats(struct flatcurve_fts_backend *backend,
 	stats->messages = x->db_read->get_doccount();
 	stats->shards = x->shards;
 	stats->version = FLATCURVE_XAPIAN_DB_VERSION;
+
+	struct hash_iterate_context *iter;
+	void *key, *val;
+	struct stat st;
+
+	stats->prefix_index_size = 0;
+	iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		struct flatcurve_xapian_db *xdb =
+			(struct flatcurve_xapian_db *)val;
+		if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX &&
+		    stat(fts_flatcurve_xapian_terms_path(xdb->dbpath), &st) == 0)
+			stats->prefix_index_size += st.st_size;
+	}
+	hash_table_iterate_deinit(&iter);
 	return 1;
 }
 
@@ -1293,10 +2674,17 @@ fts_flatcurve_xapian_check_commit_limit(struct flatcurve_fts_backend *backend,
 	++xdb->changes;
 
 	if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT &&
-	    fuser->set->rotate_count > 0 &&
-	    xdb->dbw->get_doccount() >= fuser->set->rotate_count) {
-		return fts_flatcurve_xapian_close_db(
-			backend, xdb, FLATCURVE_XAPIAN_DB_CLOSE_ROTATE, error_r);
+	    fuser->set->rotate_count > 0) {
+		/* The indexing threads may be writing to dbw, so the count
+		   is estimated. Expunges and already existing documents make
+		   it too large, which just rotates a bit earlier. */
+		unsigned int doccount = x->pipeline != NULL ?
+			xdb->dbw_doccount + xdb->changes :
+			xdb->dbw->get_doccount();
+		if (doccount >= fuser->set->rotate_count) {
+			return fts_flatcurve_xapian_close_db(backend, xdb,
+				FLATCURVE_XAPIAN_DB_CLOSE_ROTATE, error_r);
+		}
 	}
 
 	if (fuser->set->commit_limit > 0 &&
@@ -1321,8 +2709,10 @@ fts_flatcurve_xapian_clear_document(struct flatcurve_fts_backend *backend,
 
 	struct flatcurve_xapian *x = backend->xapian;
 
-	if (x->doc == NULL)
+	if (x->doc == NULL && x->pipeline_msg == NULL)
 		return 0;
+	if (x->doc != NULL && fts_flatcurve_xapian_deferred_enabled(backend))
+		return fts_flatcurve_xapian_pending_add(backend, error_r);
 
 	struct flatcurve_xapian_db *xdb;
 	int ret = fts_flatcurve_xapian_write_db_current(
@@ -1330,6 +2720,17 @@ fts_flatcurve_xapian_clear_document(struct flatcurve_fts_backend *backend,
 	if (ret <= 0)
 		return ret;
 
+	if (x->pipeline_msg != NULL) {
+		/* The message is written by the indexing threads. Errors are
+		   returned by the next flush. */
+		fts_flatcurve_xapian_pipeline_add(x->pipeline,
+						  x->pipeline_msg);
+		x->pipeline_msg = NULL;
+		x->doc_uid = 0;
+		return fts_flatcurve_xapian_check_commit_limit(
+			backend, xdb, error_r);
+	}
+
 	ret = 0;
 	try {
 		xdb->dbw->replace_document(x->doc_uid, *x->doc);
@@ -1371,6 +2772,10 @@ fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 
 	if (fts_flatcurve_xapian_clear_document(backend, error_r) < 0)
 		return -1;
+	/* Commit and close the DB even if writing some of the messages
+	   failed. The error is returned afterwards. */
+	const char *flush_error = NULL;
+	(void)fts_flatcurve_xapian_pipeline_flush(backend, &flush_error);
 
 	struct timeval start;
 	i_gettimeofday(&start);
@@ -1423,6 +2828,8 @@ fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 
 		xdb->changes = 0;
 		x->doc_updates = 0;
+		if (xdb->dbw != NULL)
+			xdb->dbw_doccount = xdb->dbw->get_doccount();
 
 		if (xdb->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) {
 			if (HAS_ALL_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_ROTATE) ||
@@ -1470,7 +2877,19 @@ fts_flatcurve_xapian_close_db(struct flatcurve_fts_backend *backend,
 		delete(xdb->db);
 		xdb->db = NULL;
 	}
+	if (xdb->terms != NULL &&
+	    HAS_ANY_BITS(opts, FLATCURVE_XAPIAN_DB_CLOSE_DB |
+			       FLATCURVE_XAPIAN_DB_CLOSE_MBOX)) {
+		if (munmap((void *)xdb->terms, xdb->terms_size) < 0)
+			e_error(backend->event, "munmap(%s) failed: %m",
+				xdb->dbpath->path);
+		xdb->terms = NULL;
+	}
 
+	if (flush_error != NULL) {
+		*error_r = flush_error;
+		return -1;
+	}
 	return 0;
 }
 
@@ -1507,6 +2926,8 @@ fts_flatcurve_xapian_close_dbs(struct flatcurve_fts_backend *backend,
 int fts_flatcurve_xapian_refresh(struct flatcurve_fts_backend *backend,
 				 const char **error_r)
 {
+	if (fts_flatcurve_xapian_pending_commit(backend, error_r) < 0)
+		return -1;
 	return fts_flatcurve_xapian_close_dbs(
 		backend, FLATCURVE_XAPIAN_DB_CLOSE_WDB, error_r);
 }
@@ -1516,8 +2937,15 @@ int fts_flatcurve_xapian_close(struct flatcurve_fts_backend *backend,
 			       const char **error_r)
 {
 	struct flatcurve_xapian *x = backend->xapian;
-	int ret = fts_flatcurve_xapian_close_dbs(
-		backend, FLATCURVE_XAPIAN_DB_CLOSE_MBOX, error_r);
+	const char *error;
+	int ret = fts_flatcurve_xapian_pending_commit(backend, error_r);
+	if (fts_flatcurve_xapian_close_dbs(
+		backend, FLATCURVE_XAPIAN_DB_CLOSE_MBOX, &error) < 0) {
+		if (ret < 0)
+			e_error(backend->event, "%s", *error_r);
+		*error_r = error;
+		ret = -1;
+	}
 
 	hash_table_clear(x->dbs, TRUE);
 
@@ -1530,6 +2958,7 @@ int fts_flatcurve_xapian_close(struct flatcurve_fts_backend *backend,
 		delete(x->db_read);
 		x->db_read = NULL;
 	}
+	fts_flatcurve_xapian_pending_close(x);
 
 	p_clear(x->pool);
 	return ret;
@@ -1598,15 +3027,67 @@ int fts_flatcurve_xapian_uid_exists(struct flatcurve_fts_backend *backend,
 	if (ret <= 0)
 		return ret;
 
+	if (fts_flatcurve_xapian_pending_uid_exists(backend->xapian, uid) > 0)
+		return 1;
 	return fts_flatcurve_xapian_uid_exists_db(backend, uid, NULL, error_r);
 }
 
+/* Get the highest UID that may exist in the DBs or in the pending log.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_get_max_uid(struct flatcurve_fts_backend *backend,
+				 uint32_t *max_uid_r, const char **error_r)
+{
+	static const enum flatcurve_xapian_db_opts opts =
+		(enum flatcurve_xapian_db_opts)
+			(FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
+			 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
+	struct flatcurve_xapian *x = backend->xapian;
+	uint32_t uid;
+
+	*max_uid_r = 0;
+	int ret = fts_flatcurve_xapian_read_db(backend, opts, NULL, error_r);
+	if (ret <= 0)
+		return ret;
+
+	void *key, *val;
+	struct hash_iterate_context *iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		struct flatcurve_xapian_db *xdb =
+			(struct flatcurve_xapian_db *)val;
+		try {
+			/* the last docid is an upper bound, even if the
+			   document itself has already been deleted */
+			uid = xdb->db->get_lastdocid();
+		} catch (Xapian::Error &e) {
+			*error_r = t_strdup(e.get_description().c_str());
+			ret = -1;
+			break;
+		}
+		*max_uid_r = I_MAX(*max_uid_r, uid);
+	}
+	hash_table_iterate_deinit(&iter);
+	if (ret < 0)
+		return -1;
+
+	if (x->db_pending != NULL) {
+		array_foreach_elem(&x->pending_uids, uid)
+			*max_uid_r = I_MAX(*max_uid_r, uid);
+	}
+	return 0;
+}
+
 /* Returns: 0 not found, 1 deleted, -1 on error */
 int fts_flatcurve_xapian_expunge(struct flatcurve_fts_backend *backend,
 				 uint32_t uid, const char **error_r)
 {
 	struct flatcurve_xapian_db *xdb;
 
+	if (fts_flatcurve_xapian_clear_document(backend, error_r) < 0 ||
+	    fts_flatcurve_xapian_pipeline_flush(backend, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_flush_existing(backend, error_r) < 0)
+		return -1;
+
 	if (fts_flatcurve_xapian_write_db_by_uid(
 		backend, uid, &xdb, error_r) <= 0) {
 		e_debug(backend->event, "Expunge failed uid=%u; UID not found",
@@ -1646,11 +3127,48 @@ fts_flatcurve_xapian_init_msg(struct flatcurve_fts_backend_update_context *ctx,
 	if (fts_flatcurve_xapian_clear_document(ctx->backend, error_r) < 0)
 		return -1;
 
-	int ret = fts_flatcurve_xapian_write_db_current(
+	int ret;
+	if (fts_flatcurve_xapian_deferred_enabled(ctx->backend)) {
+		/* Checking whether the UID exists reopens the read DB, which
+		   is too expensive to do for each message. Look up the
+		   highest existing UID once per mailbox. The UIDs above it
+		   haven't been indexed yet. */
+		if (!ctx->max_uid_set) {
+			if (fts_flatcurve_xapian_get_max_uid(ctx->backend,
+					&ctx->max_uid, error_r) < 0)
+				return -1;
+			ctx->max_uid_set = TRUE;
+		}
+		ret = ctx->uid > ctx->max_uid ? 0 :
+			fts_flatcurve_xapian_uid_exists(ctx->backend, ctx->uid,
+							error_r);
+		if (ret != 0)
+			return ret < 0 ? -1 : 0;
+		x->doc = new Xapian::Document();
+		x->doc_created = TRUE;
+		x->doc_uid = ctx->uid;
+		return 1;
+	}
+
+	ret = fts_flatcurve_xapian_write_db_current(
 		ctx->backend, opts, &xdb, error_r);
 	if (ret <= 0)
 		/* error or x->dbw_current == NULL */
 		return ret;
+
+	if (x->pipeline == NULL && ctx->backend->fuser->set->index_threads > 0)
+		fts_flatcurve_xapian_pipeline_init(ctx->backend);
+	if (x->pipeline != NULL) {
+		/* The indexing threads check whether the document already
+		   exists, since dbw can't be accessed while they are
+		   writing to it. */
+		x->pipeline_msg = new flatcurve_xapian_pipeline_msg();
+		x->pipeline_msg->dbw = xdb->dbw;
+		x->pipeline_msg->uid = ctx->uid;
+		x->doc_uid = ctx->uid;
+		return 1;
+	}
+
 	try {
 		(void)xdb->dbw->get_document(ctx->uid);
 		/* document already existed */
@@ -1683,50 +3201,20 @@ fts_flatcurve_xapian_index_header(struct flatcurve_fts_backend_update_context *c
 	i_assert(uni_utf8_data_is_valid(data, size));
 
 	T_BEGIN {
-		char *hdr_name =
+		const char *hdr_name =
 			str_lcase(t_strdup_noconst(str_c(ctx->hdr_name)));
 
-		if (*hdr_name != '\0')
-			x->doc->add_boolean_term(t_strdup_printf(
-				FLATCURVE_XAPIAN_BOOLEAN_FIELD_PREFIX
-				"%s", hdr_name));
-
-		if (ctx->indexed_hdr)
-			hdr_name = str_ucase(hdr_name);
-
-		string_t *all_term = t_str_new(size);
-		string_t *hdr_term = t_str_new(size + strlen(hdr_name));
-		str_append(hdr_term, FLATCURVE_XAPIAN_HEADER_PREFIX);
-		str_append(hdr_term, hdr_name);
-		size_t hdr_term_start = str_len(hdr_term);
-
-		const unsigned char *end = data + size;
-		for(; end > data; data += uni_utf8_char_bytes((unsigned char) *data)) {
-			size_t len = end - data;
-			if (len < fuser->set->min_term_size)
-				break;
-
-			/* Capital ASCII letters at the beginning of a Xapian
-			   term are treated as a "term prefix". Force to non-
-			   -uppercase the first letter of the header value to
-			   ensure the term is not confused with a
-			   "term prefix". */
-
-			str_truncate(all_term, 0);
-			str_append(all_term, FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX);
-			str_append_c(all_term, i_tolower(*data));
-			str_append_data(all_term, data + 1, len - 1);
-			x->doc->add_term(str_c(all_term));
-
-			if (ctx->indexed_hdr) {
-				str_truncate(hdr_term, hdr_term_start);
-				str_append_c(hdr_term, i_tolower(*data));
-				str_append_data(hdr_term, data + 1, len - 1);
-				x->doc->add_term(str_c(hdr_term));
-			}
-
-			if (!fuser->set->substring_search)
-				break;
+		if (x->pipeline_msg != NULL) {
+			struct flatcurve_xapian_pipeline_field field;
+			field.hdr_name = hdr_name;
+			field.data.assign((const char *)data, size);
+			field.header = TRUE;
+			field.indexed_hdr = ctx->indexed_hdr;
+			x->pipeline_msg->fields.push_back(std_move(field));
+		} else {
+			fts_flatcurve_xapian_doc_add_header(
+				x->doc, fuser->set, hdr_name,
+				ctx->indexed_hdr, data, size);
 		}
 	} T_END;
 	return 1;
@@ -1746,29 +3234,16 @@ fts_flatcurve_xapian_index_body(struct flatcurve_fts_backend_update_context *ctx
 
 	i_assert(uni_utf8_data_is_valid(data_ro, size));
 
-	T_BEGIN {
-		string_t *term = t_str_new(size);
-		str_append_data(term, data_ro, size);
-
-		char *data = str_c_modifiable(term);
-		const char *end = data + str_len(term);
-		for(; end > data; data += uni_utf8_char_bytes((unsigned char) *data)) {
-			size_t len = end - data;
-			if (len < fuser->set->min_term_size)
-				break;
-
-			/* Capital ASCII letters at the beginning of a Xapian term are
-			treated as a "term prefix". Check for a leading ASCII
-			capital, and temporary lowercase it in place if necessary,
-			to ensure the term is not confused with a "term prefix". */
-			*data = i_tolower(*data);
-			x->doc->add_term(data);
-
-			if (!fuser->set->substring_search)
-				break;
-		}
-	} T_END;
-
+	if (x->pipeline_msg != NULL) {
+		struct flatcurve_xapian_pipeline_field field;
+		field.data.assign((const char *)data_ro, size);
+		field.header = FALSE;
+		field.indexed_hdr = FALSE;
+		x->pipeline_msg->fields.push_back(std_move(field));
+	} else {
+		fts_flatcurve_xapian_doc_add_body(x->doc, fuser->set,
+						  data_ro, size);
+	}
 	return 1;
 }
 
@@ -1777,6 +3252,8 @@ int fts_flatcurve_xapian_delete_index(struct flatcurve_fts_backend *backend,
 				      const char **error_r)
 {
 	const char *error;
+	/* No need to commit the pending documents */
+	fts_flatcurve_xapian_pending_close(backend->xapian);
 	int ret = fts_flatcurve_xapian_close(backend, error_r);
 	if (fts_flatcurve_xapian_delete(backend, NULL, &error) < 0) {
 		if (ret < 0)
@@ -1833,10 +3310,106 @@ fts_flatcurve_xapian_optimize_rebuild(struct flatcurve_fts_backend *backend,
 			backend, xdb, FLATCURVE_XAPIAN_DB_CLOSE_WDB, error_r);
 }
 
+/* Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_db_size(struct flatcurve_xapian_db_path *dbpath,
+			     uoff_t *size_r, const char **error_r)
+{
+	DIR *dirp = opendir(dbpath->path);
+	if (dirp == NULL) {
+		*error_r = t_strdup_printf("opendir(%s) failed: %m",
+					   dbpath->path);
+		return -1;
+	}
+
+	string_t *path = t_str_new(256);
+	str_printfa(path, "%s/", dbpath->path);
+	size_t dir_len = str_len(path);
+
+	struct dirent *d;
+	struct stat st;
+	*size_r = 0;
+	errno = 0;
+	while ((d = readdir(dirp)) != NULL) {
+		str_truncate(path, dir_len);
+		str_append(path, d->d_name);
+		if (stat(str_c(path), &st) == 0 && S_ISREG(st.st_mode))
+			*size_r += st.st_size;
+		errno = 0;
+	}
+
+	int ret = 0;
+	if (errno != 0) {
+		*error_r = t_strdup_printf("readdir(%s) failed: %m",
+					   dbpath->path);
+		ret = -1;
+	}
+	if (closedir(dirp) < 0 && ret == 0) {
+		*error_r = t_strdup_printf("closedir(%s) failed: %m",
+					   dbpath->path);
+		ret = -1;
+	}
+	return ret;
+}
+
+static int
+fts_flatcurve_xapian_optimize_shard_cmp(
+	const struct flatcurve_xapian_optimize_shard *s1,
+	const struct flatcurve_xapian_optimize_shard *s2)
+{
+	if (s1->size < s2->size)
+		return -1;
+	return s1->size > s2->size ? 1 : 0;
+}
+
+/* Select the shards to merge. Normally all shards are merged into a single
+ * one. If fts_flatcurve_optimize_merge_limit is set and there are more
+ * shards, only that many of the smallest non-current shards are merged. This
+ * way the large shards aren't rewritten each time the mailbox is optimized.
+ * Returns: 0 on success, -1 on error */
+static int
+fts_flatcurve_xapian_optimize_select(struct flatcurve_fts_backend *backend,
+				     ARRAY_TYPE(flatcurve_xapian_optimize_shard) *shards,
+				     bool *all_r, const char **error_r)
+{
+	struct flatcurve_xapian *x = backend->xapian;
+	unsigned int merge_limit = backend->fuser == NULL ? 0 :
+		backend->fuser->set->optimize_merge_limit;
+	struct flatcurve_xapian_optimize_shard *shard;
+	void *key, *val;
+
+	*all_r = merge_limit == 0 || x->shards <= merge_limit;
+
+	struct hash_iterate_context *hiter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(hiter, x->dbs, &key, &val)) {
+		struct flatcurve_xapian_db *xdb =
+			(struct flatcurve_xapian_db *)val;
+		if (xdb->db == NULL ||
+		    (!*all_r && xdb->type != FLATCURVE_XAPIAN_DB_TYPE_INDEX))
+			continue;
+		shard = array_append_space(shards);
+		shard->xdb = xdb;
+		if (fts_flatcurve_xapian_db_size(xdb->dbpath, &shard->size,
+						 error_r) < 0) {
+			hash_table_iterate_deinit(&hiter);
+			return -1;
+		}
+	}
+	hash_table_iterate_deinit(&hiter);
+
+	if (!*all_r) {
+		array_sort(shards, fts_flatcurve_xapian_optimize_shard_cmp);
+		if (array_count(shards) > merge_limit)
+			array_delete(shards, merge_limit,
+				     array_count(shards) - merge_limit);
+	}
+	return 0;
+}
+
 /* Returns: 0 on success, -1 on error */
 static int
 fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
-				     Xapian::Database *db, const char **error_r)
+				     const char **error_r)
 {
 	static const enum flatcurve_xapian_db_opts opts =
 		ENUM_EMPTY(flatcurve_xapian_db_opts);
@@ -1844,19 +3417,28 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 		ENUM_EMPTY(flatcurve_xapian_wdb);
 
 	struct flatcurve_xapian *x = backend->xapian;
+	ARRAY_TYPE(flatcurve_xapian_optimize_shard) shards;
+	const struct flatcurve_xapian_optimize_shard *shard;
+	bool all;
 
-	/* We need to lock all of the mailboxes so nothing changes while we
-	 * are optimizing. */
+	t_array_init(&shards, x->shards);
+	if (fts_flatcurve_xapian_optimize_select(backend, &shards, &all,
+						 error_r) < 0)
+		return -1;
+	if (!all && array_count(&shards) < 2)
+		return 0;
 
-	void *key, *val;
-	struct hash_iterate_context *hiter = hash_table_iterate_init(x->dbs);
-	while (hash_table_iterate(hiter, x->dbs, &key, &val)) {
-		struct flatcurve_xapian_db *db = (struct flatcurve_xapian_db *)val;
+	/* We need to lock all of the merged shards so nothing changes while
+	 * we are optimizing. */
+	Xapian::Database db;
+	uoff_t read_bytes = 0;
+	array_foreach(&shards, shard) {
 		if (fts_flatcurve_xapian_write_db_get(
-			backend, db, wopts, error_r) < 0)
+			backend, shard->xdb, wopts, error_r) < 0)
 			return -1;
+		db.add_database(*shard->xdb->db);
+		read_bytes += shard->size;
 	}
-	hash_table_iterate_deinit(&hiter);
 
 	/* Create the optimize target. */
 	struct flatcurve_xapian_db_path *dbpath =
@@ -1870,10 +3452,10 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 
 	bool failed = FALSE;
 	try {
-		(void)db->reopen();
-		db->compact(dbpath->path, Xapian::DBCOMPACT_NO_RENUMBER |
-					  Xapian::DBCOMPACT_MULTIPASS |
-					  Xapian::Compactor::FULLER);
+		(void)db.reopen();
+		db.compact(dbpath->path, Xapian::DBCOMPACT_NO_RENUMBER |
+					 Xapian::DBCOMPACT_MULTIPASS |
+					 Xapian::Compactor::FULLER);
 	} catch (Xapian::InvalidOperationError &e) {
 		/* This exception is not as specific as it could be...
 		 * but the likely reason it happens is due to
@@ -1889,7 +3471,7 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 		 *      documents.
 		 * Let's try to be awesome and do the latter. */
 		failed = fts_flatcurve_xapian_optimize_rebuild(
-				backend, db, dbpath, error_r) < 0;
+				backend, &db, dbpath, error_r) < 0;
 		if (!failed)
 			e_debug(backend->event, "Native optimize failed, "
 				"falling back to manual optimization; %s",
@@ -1903,29 +3485,43 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 		return 0;
 	}
 
-	/* Delete old indexes. */
-	struct flatcurve_xapian_db_iter *iter =
-		fts_flatcurve_xapian_db_iter_init(backend, opts);
+	uoff_t written_bytes;
+	if (fts_flatcurve_xapian_db_size(dbpath, &written_bytes, error_r) < 0)
+		return -1;
 
+	/* Delete old indexes. */
 	int ret = 0;
-	while (fts_flatcurve_xapian_db_iter_next(iter)) {
-		if (iter->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX ||
-		    iter->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) {
+	if (all) {
+		struct flatcurve_xapian_db_iter *iter =
+			fts_flatcurve_xapian_db_iter_init(backend, opts);
+
+		while (fts_flatcurve_xapian_db_iter_next(iter)) {
+			if (iter->type == FLATCURVE_XAPIAN_DB_TYPE_INDEX ||
+			    iter->type == FLATCURVE_XAPIAN_DB_TYPE_CURRENT) {
+				if (fts_flatcurve_xapian_delete(
+					backend, iter->path, error_r) < 0) {
+					ret = -1;
+					break;
+				}
+			}
+		}
+		const char *error;
+		if (fts_flatcurve_xapian_db_iter_deinit(&iter, &error) < 0) {
+			if (ret < 0)
+				e_error(backend->event, "%s", error);
+			else
+				*error_r = error;
+			ret = -1;
+		}
+	} else {
+		array_foreach(&shards, shard) {
 			if (fts_flatcurve_xapian_delete(
-				backend, iter->path, error_r) < 0) {
+				backend, shard->xdb->dbpath, error_r) < 0) {
 				ret = -1;
 				break;
 			}
 		}
 	}
-	const char *error;
-	if (fts_flatcurve_xapian_db_iter_deinit(&iter, &error) < 0) {
-		if (ret < 0)
-			e_error(backend->event, "%s", error);
-		else
-			*error_r = error;
-		ret = -1;
-	}
 	if (ret < 0)
 		return -1;
 
@@ -1937,8 +3533,17 @@ fts_flatcurve_xapian_optimize_box_do(struct flatcurve_fts_backend *backend,
 	struct timeval now;
 	i_gettimeofday(&now);
 	long long elapsed = timeval_diff_msecs(&now, &start);
-	e_debug(backend->event, "Optimized DB in %lld.%03lld secs",
-				elapsed / 1000, elapsed % 1000);
+	e_debug(event_create_passthrough(backend->event)->
+		set_name("fts_flatcurve_optimize_finished")->
+		add_str("mailbox", str_c(backend->boxname))->
+		add_int("shards", x->shards)->
+		add_int("merged_shards", array_count(&shards))->
+		add_int("read_bytes", read_bytes)->
+		add_int("written_bytes", written_bytes)->event(),
+		"Optimized DB in %lld.%03lld secs; merged %u/%u shards, "
+		"%" PRIuUOFF_T " bytes into %" PRIuUOFF_T " bytes",
+		elapsed / 1000, elapsed % 1000, array_count(&shards),
+		x->shards, read_bytes, written_bytes);
 
 	return 0;
 }
@@ -1952,13 +3557,22 @@ int fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend,
 			(FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT |
 			 FLATCURVE_XAPIAN_DB_IGNORE_EMPTY);
 
-	Xapian::Database *db;
+	/* Commit the pending log first. Only the on-disk shards are merged,
+	   never db_read, which also contains db_pending. Documents that are
+	   appended to the log after this stay in the log. */
 	int ret;
+	if (fts_flatcurve_xapian_clear_document(backend, error_r) < 0 ||
+	    fts_flatcurve_xapian_pipeline_flush(backend, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_flush_existing(backend, error_r) < 0)
+		return -1;
 	if ((ret = fts_flatcurve_xapian_read_db(
-		backend, opts, &db, error_r)) <= 0)
+		backend, opts, NULL, error_r)) <= 0)
 		return ret;
 
-	if (backend->xapian->deinit &&
+	/* At deinit and in the background optimization only the mailboxes
+	   that have reached fts_flatcurve_optimize_limit are optimized. */
+	if ((backend->xapian->deinit ||
+	     fts_flatcurve_xapian_optimize_is_background(backend)) &&
 	    !fts_flatcurve_xapian_need_optimize(backend)) {
 		return fts_flatcurve_xapian_close(backend, error_r);
 	}
@@ -1970,7 +3584,7 @@ int fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend,
 
 	ret = 0;
 	if (fts_flatcurve_xapian_lock(backend, error_r) < 0 ||
-	    fts_flatcurve_xapian_optimize_box_do(backend, db, error_r) < 0)
+	    fts_flatcurve_xapian_optimize_box_do(backend, error_r) < 0)
 		ret = -1;
 
 	const char *error;
@@ -1985,6 +3599,26 @@ int fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend,
 	return ret;
 }
 
+/* Returns a query matching all the terms starting with prefix. */
+static Xapian::Query
+fts_flatcurve_build_query_prefix(struct flatcurve_fts_query *query,
+				 const char *prefix)
+{
+	std::vector<std::string> terms;
+	const char *error;
+
+	if (query->xapian->expand_prefixes) {
+		if (fts_flatcurve_xapian_terms_expand(query->backend, prefix,
+						      terms, &error) == 0) {
+			return Xapian::Query(Xapian::Query::OP_SYNONYM,
+					     terms.begin(), terms.end());
+		}
+		e_error(query->backend->event,
+			"Prefix index lookup failed: %s", error);
+	}
+	return Xapian::Query(Xapian::Query::OP_WILDCARD, prefix);
+}
+
 static void
 fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
 				   struct mail_search_arg *arg,
@@ -2014,18 +3648,18 @@ fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
 	switch (arg->type) {
 	case SEARCH_TEXT:
 		q = Xapian::Query(Xapian::Query::OP_OR,
-			Xapian::Query(Xapian::Query::OP_WILDCARD,
+			fts_flatcurve_build_query_prefix(query,
 				t_strdup_printf("%s%s",
 					FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX,
 					term)),
-			Xapian::Query(Xapian::Query::OP_WILDCARD, term));
+			fts_flatcurve_build_query_prefix(query, term));
 		str_printfa(query->qtext, "(%s:%s* OR %s:%s*)",
 			    FLATCURVE_XAPIAN_ALL_HEADERS_QP, term,
 			    FLATCURVE_XAPIAN_BODY_QP, term);
 		break;
 
 	case SEARCH_BODY:
-		q = Xapian::Query(Xapian::Query::OP_WILDCARD, term);
+		q = fts_flatcurve_build_query_prefix(query, term);
 		str_printfa(query->qtext, "%s:%s*",
 			    FLATCURVE_XAPIAN_BODY_QP, term);
 		break;
@@ -2035,8 +3669,7 @@ fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
 	case SEARCH_HEADER_COMPRESS_LWSP:
 		if (*term != '\0') {
 			if (fts_header_want_indexed(arg->hdr_field_name)) {
-				q = Xapian::Query(
-					Xapian::Query::OP_WILDCARD,
+				q = fts_flatcurve_build_query_prefix(query,
 					t_strdup_printf("%s%s%s",
 						FLATCURVE_XAPIAN_HEADER_PREFIX,
 						t_str_ucase(arg->hdr_field_name),
@@ -2046,8 +3679,7 @@ fts_flatcurve_build_query_arg_term(struct flatcurve_fts_query *query,
 					    t_str_lcase(arg->hdr_field_name),
 					    term);
 			} else {
-				q = Xapian::Query(
-					Xapian::Query::OP_WILDCARD,
+				q = fts_flatcurve_build_query_prefix(query,
 					t_strdup_printf("%s%s",
 						FLATCURVE_XAPIAN_ALL_HEADERS_PREFIX,
 						term));
@@ -2160,17 +3792,37 @@ fts_flatcurve_xapian_build_query_match_all(struct flatcurve_fts_query *query)
 	query->xapian->query = new Xapian::Query(Xapian::Query::MatchAll);
 }
 
-/* Returns: 0 on success, -1 on error */
-void fts_flatcurve_xapian_build_query(struct flatcurve_fts_query *query)
+static void
+fts_flatcurve_xapian_build_query_do(struct flatcurve_fts_query *query,
+				    bool expand_prefixes)
 {
 	struct mail_search_arg *args;
 
 	query->xapian = p_new(query->pool, struct flatcurve_fts_query_xapian, 1);
 	query->xapian->and_search = ((query->flags & FTS_LOOKUP_FLAG_AND_ARGS) != 0);
+	query->xapian->expand_prefixes = expand_prefixes;
 	for (args = query->args; args != NULL ; args = args->next)
 		fts_flatcurve_build_query_arg(query, args);
 }
 
+void fts_flatcurve_xapian_build_query(struct flatcurve_fts_query *query)
+{
+	fts_flatcurve_xapian_build_query_do(query, FALSE);
+}
+
+void fts_flatcurve_xapian_build_query_mailbox(struct flatcurve_fts_query *query)
+{
+	struct flatcurve_fts_backend *backend = query->backend;
+
+	/* The prefixes are expanded using the current mailbox's terms */
+	if (backend->fuser == NULL || !backend->fuser->set->prefix_index)
+		return;
+
+	fts_flatcurve_xapian_destroy_query(query);
+	str_truncate(query->qtext, 0);
+	fts_flatcurve_xapian_build_query_do(query, TRUE);
+}
+
 struct fts_flatcurve_xapian_query_iter *
 fts_flatcurve_xapian_query_iter_init(struct flatcurve_fts_query *query)
 {
@@ -2300,30 +3952,285 @@ fts_flatcurve_xapian_query_iter_deinit(struct fts_flatcurve_xapian_query_iter **
 }
 
 /* Returns: 0 on success, -1 on error */
+static void
+fts_flatcurve_xapian_query_result_add(struct flatcurve_fts_query *query,
+				      struct flatcurve_fts_result *r,
+				      const struct fts_flatcurve_xapian_query_result *result)
+{
+	struct fts_score_map *score;
+
+	bool add_score = TRUE;
+	if (result->maybe || query->xapian->maybe) {
+		add_score = !seq_range_exists(&r->uids, result->uid) &&
+			    !seq_range_exists(&r->maybe_uids, result->uid);
+		seq_range_array_add(&r->maybe_uids, result->uid);
+	} else
+		seq_range_array_add(&r->uids, result->uid);
+	if (add_score) {
+		score = array_append_space(&r->scores);
+		score->score = (float)result->score;
+		score->uid = result->uid;
+	}
+}
+
 int fts_flatcurve_xapian_run_query(struct flatcurve_fts_query *query,
 				   struct flatcurve_fts_result *r,
 				   const char **error_r)
 {
 	struct fts_flatcurve_xapian_query_iter *iter;
 	struct fts_flatcurve_xapian_query_result *result;
-	struct fts_score_map *score;
 
 	iter = fts_flatcurve_xapian_query_iter_init(query);
-	while (fts_flatcurve_xapian_query_iter_next(iter, &result)) {
-		bool add_score = TRUE;
-		if (result->maybe || query->xapian->maybe) {
-			add_score = !seq_range_exists(&r->uids, result->uid) &&
-				    !seq_range_exists(&r->maybe_uids, result->uid);
-			seq_range_array_add(&r->maybe_uids, result->uid);
-		} else
-			seq_range_array_add(&r->uids, result->uid);
-		if (add_score) {
-			score = array_append_space(&r->scores);
-			score->score = (float)result->score;
-			score->uid = result->uid;
+	while (fts_flatcurve_xapian_query_iter_next(iter, &result))
+		fts_flatcurve_xapian_query_result_add(query, r, result);
+	return fts_flatcurve_xapian_query_iter_deinit(&iter, error_r);
+}
+
+/* Parallel queries: each shard of each mailbox is a separate job, which
+ * opens its own Xapian::Database and runs the mailbox's query on it. The jobs are
+ * executed by a few threads, and their results are merged into the
+ * mailboxes' results afterwards by the main thread. Xapian::Query handles
+ * aren't safe to share between threads, so each job unserializes its own
+ * copy of the query. The documents in the pending log are queried directly
+ * by the main thread. */
+
+struct flatcurve_xapian_query_job {
+	std::string path;
+	/* Serialized queries, empty if there is no such query */
+	std::string main_query, maybe_query;
+	/* Index to fts_flatcurve_xapian_query_jobs.results */
+	unsigned int result_idx;
+	std::vector<fts_flatcurve_xapian_query_result> main_results;
+	std::vector<fts_flatcurve_xapian_query_result> maybe_results;
+	std::string error;
+	bool done;
+};
+
+struct fts_flatcurve_xapian_query_jobs {
+	struct flatcurve_fts_query *query;
+	std::vector<flatcurve_xapian_query_job> jobs;
+	std::vector<struct flatcurve_fts_result *> results;
+	std::atomic<unsigned int> next_job;
+};
+
+struct fts_flatcurve_xapian_query_jobs *
+fts_flatcurve_xapian_query_jobs_init(struct flatcurve_fts_query *query)
+{
+	struct fts_flatcurve_xapian_query_jobs *jobs;
+
+	jobs = new fts_flatcurve_xapian_query_jobs();
+	jobs->query = query;
+	jobs->next_job = 0;
+	return jobs;
+}
+
+static void
+fts_flatcurve_xapian_query_jobs_serialise(struct flatcurve_fts_query *query,
+					  struct flatcurve_xapian_query_job &job)
+{
+	if (query->xapian->query != NULL)
+		job.main_query = query->xapian->query->serialise();
+	if (array_not_empty(&query->xapian->maybe_queries)) {
+		/* Same as in fts_flatcurve_xapian_query_iter_next() */
+		const struct flatcurve_fts_query_xapian_maybe *mquery;
+		Xapian::Query maybe = Xapian::Query();
+		array_foreach(&query->xapian->maybe_queries, mquery)
+			maybe = Xapian::Query(Xapian::Query::OP_OR, maybe,
+					      *mquery->query);
+		if (query->xapian->query != NULL)
+			maybe = Xapian::Query(Xapian::Query::OP_AND_MAYBE, maybe,
+					      *query->xapian->query);
+		job.maybe_query = maybe.serialise();
+	}
+}
+
+static void
+fts_flatcurve_xapian_query_job_run_query(Xapian::Enquire &enquire,
+					 const Xapian::Database &db,
+					 const std::string &query, bool maybe,
+					 std::vector<fts_flatcurve_xapian_query_result> &results)
+{
+	struct fts_flatcurve_xapian_query_result result;
+
+	if (query.empty())
+		return;
+
+	enquire.set_query(Xapian::Query::unserialise(query));
+	Xapian::MSet m = enquire.get_mset(0, db.get_doccount());
+	for (Xapian::MSetIterator i = m.begin(); i != m.end(); ++i) {
+		i_zero(&result);
+		result.maybe = maybe;
+		result.score = i.get_weight();
+		result.uid = i.get_document().get_docid();
+		results.push_back(result);
+	}
+}
+
+/* Called by the query threads, so no Dovecot library functions can be
+ * used here. */
+static void
+fts_flatcurve_xapian_query_job_run(struct flatcurve_xapian_query_job &job,
+				   const Xapian::Database &db)
+{
+	try {
+		Xapian::Enquire enquire(db);
+		enquire.set_docid_order(Xapian::Enquire::DONT_CARE);
+		fts_flatcurve_xapian_query_job_run_query(enquire, db,
+			job.main_query, FALSE, job.main_results);
+		fts_flatcurve_xapian_query_job_run_query(enquire, db,
+			job.maybe_query, TRUE, job.maybe_results);
+	} catch (Xapian::Error &e) {
+		job.error = e.get_description();
+	} catch (std::exception &e) {
+		job.error = std::string("Unexpected exception: ") + e.what();
+	} catch (...) {
+		job.error = "Unknown exception";
+	}
+	job.done = TRUE;
+}
+
+static void
+fts_flatcurve_xapian_query_jobs_thread(struct fts_flatcurve_xapian_query_jobs *jobs)
+{
+	unsigned int idx;
+
+	while ((idx = jobs->next_job++) < jobs->jobs.size()) {
+		struct flatcurve_xapian_query_job &job = jobs->jobs[idx];
+		if (job.done)
+			continue;
+		/* An exception must not escape the thread, or the process
+		   is terminated. */
+		try {
+			Xapian::Database db(job.path);
+			fts_flatcurve_xapian_query_job_run(job, db);
+		} catch (Xapian::Error &e) {
+			job.error = e.get_description();
+		} catch (std::exception &e) {
+			job.error = std::string("Unexpected exception: ") + e.what();
+		} catch (...) {
+			job.error = "Unknown exception";
 		}
 	}
-	return fts_flatcurve_xapian_query_iter_deinit(&iter, error_r);
+}
+
+/* Add jobs for the current mailbox. The results are added to r by
+ * fts_flatcurve_xapian_query_jobs_run().
+ * Returns: 0 on success, -1 on error */
+int fts_flatcurve_xapian_query_jobs_add(struct fts_flatcurve_xapian_query_jobs *jobs,
+					struct flatcurve_fts_result *r,
+					const char **error_r)
+{
+	static const enum flatcurve_xapian_db_opts opts =
+		FLATCURVE_XAPIAN_DB_NOCREATE_CURRENT;
+	struct flatcurve_fts_backend *backend = jobs->query->backend;
+	struct flatcurve_xapian *x = backend->xapian;
+	struct flatcurve_xapian_query_job query_job;
+	void *key, *val;
+
+	fts_flatcurve_xapian_query_jobs_serialise(jobs->query, query_job);
+	if (query_job.main_query.empty() && query_job.maybe_query.empty())
+		return 0;
+
+	if (fts_flatcurve_xapian_db_populate(backend, opts, error_r) < 0 ||
+	    fts_flatcurve_xapian_pending_load(backend, error_r) < 0)
+		return -1;
+
+	query_job.result_idx = jobs->results.size();
+	query_job.done = FALSE;
+	jobs->results.push_back(r);
+
+	struct hash_iterate_context *iter = hash_table_iterate_init(x->dbs);
+	while (hash_table_iterate(iter, x->dbs, &key, &val)) {
+		struct flatcurve_xapian_db *xdb =
+			(struct flatcurve_xapian_db *)val;
+		jobs->jobs.push_back(query_job);
+		jobs->jobs.back().path = xdb->dbpath->path;
+	}
+	hash_table_iterate_deinit(&iter);
+
+	if (x->db_pending != NULL && array_not_empty(&x->pending_uids)) {
+		/* db_pending is freed when the mailbox is closed */
+		jobs->jobs.push_back(query_job);
+		fts_flatcurve_xapian_query_job_run(jobs->jobs.back(),
+						   *x->db_pending);
+	}
+	return 0;
+}
+
+/* Run the jobs with at most threads_count threads and add the results to
+ * the mailboxes' results.
+ * Returns: 0 on success, -1 on error (e.g. the shards were just rotated or
+ * optimized, so the caller should retry without the jobs) */
+int fts_flatcurve_xapian_query_jobs_run(struct fts_flatcurve_xapian_query_jobs *jobs,
+					unsigned int threads_count,
+					const char **error_r)
+{
+	std::vector<std::thread> threads;
+	unsigned int jobs_left = 0;
+
+	for (const flatcurve_xapian_query_job &job : jobs->jobs) {
+		if (!job.done)
+			jobs_left++;
+	}
+	threads_count = I_MIN(threads_count, jobs_left);
+
+	if (threads_count > 1) {
+		/* Signals must be handled only by the main thread. */
+		sigset_t set_all, set_old;
+		sigfillset(&set_all);
+		(void)pthread_sigmask(SIG_SETMASK, &set_all, &set_old);
+		try {
+			/* the main thread runs jobs as well */
+			for (unsigned int i = 1; i < threads_count; i++) {
+				threads.emplace_back(
+					fts_flatcurve_xapian_query_jobs_thread,
+					jobs);
+			}
+		} catch (std::system_error &e) {
+			/* The main thread runs the rest of the jobs */
+			e_debug(jobs->query->backend->event,
+				"Failed to create query threads: %s",
+				e.what());
+		}
+		(void)pthread_sigmask(SIG_SETMASK, &set_old, NULL);
+	}
+	fts_flatcurve_xapian_query_jobs_thread(jobs);
+	for (std::thread &thread : threads)
+		thread.join();
+
+	for (const flatcurve_xapian_query_job &job : jobs->jobs) {
+		if (!job.error.empty()) {
+			*error_r = t_strdup_printf("Query failed (%s): %s",
+				job.path.c_str(), job.error.c_str());
+			return -1;
+		}
+	}
+
+	/* Add the definite matches first, the same as the
+	   fts_flatcurve_xapian_query_iter does */
+	for (const flatcurve_xapian_query_job &job : jobs->jobs) {
+		struct flatcurve_fts_result *r = jobs->results[job.result_idx];
+		for (const fts_flatcurve_xapian_query_result &result :
+		     job.main_results)
+			fts_flatcurve_xapian_query_result_add(jobs->query, r,
+							      &result);
+	}
+	for (const flatcurve_xapian_query_job &job : jobs->jobs) {
+		struct flatcurve_fts_result *r = jobs->results[job.result_idx];
+		for (const fts_flatcurve_xapian_query_result &result :
+		     job.maybe_results)
+			fts_flatcurve_xapian_query_result_add(jobs->query, r,
+							      &result);
+	}
+	return 0;
+}
+
+void fts_flatcurve_xapian_query_jobs_deinit(struct fts_flatcurve_xapian_query_jobs **_jobs)
+{
+	struct fts_flatcurve_xapian_query_jobs *jobs = *_jobs;
+
+	*_jobs = NULL;
+	delete(jobs);
 }
 
 void fts_flatcurve_xapian_destroy_query(struct flatcurve_fts_query *query)
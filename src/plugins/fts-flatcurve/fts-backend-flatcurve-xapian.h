@@ -20,11 +20,13 @@ struct fts_flatcurve_xapian_db_stats {
 	int messages;
 	unsigned int shards;
 	unsigned int version;
+	uoff_t prefix_index_size;
 };
 
 HASH_TABLE_DEFINE_TYPE(term_counter, char *, void *);
 
 struct fts_flatcurve_xapian_query_iter;
+struct fts_flatcurve_xapian_query_jobs;
 
 void fts_flatcurve_xapian_init(struct flatcurve_fts_backend *backend);
 int fts_flatcurve_xapian_refresh(struct flatcurve_fts_backend *backend,
@@ -56,6 +58,7 @@ int fts_flatcurve_xapian_optimize_box(struct flatcurve_fts_backend *backend,
 void
 fts_flatcurve_xapian_build_query_match_all(struct flatcurve_fts_query *query);
 void fts_flatcurve_xapian_build_query(struct flatcurve_fts_query *query);
+void fts_flatcurve_xapian_build_query_mailbox(struct flatcurve_fts_query *query);
 int fts_flatcurve_xapian_run_query(struct flatcurve_fts_query *query,
 				   struct flatcurve_fts_result *r,
 				   const char **error_r);
@@ -72,6 +75,16 @@ int
 fts_flatcurve_xapian_query_iter_deinit(struct fts_flatcurve_xapian_query_iter **_iter,
 				       const char **error_r);
 
+struct fts_flatcurve_xapian_query_jobs *
+fts_flatcurve_xapian_query_jobs_init(struct flatcurve_fts_query *query);
+int fts_flatcurve_xapian_query_jobs_add(struct fts_flatcurve_xapian_query_jobs *jobs,
+					struct flatcurve_fts_result *r,
+					const char **error_r);
+int fts_flatcurve_xapian_query_jobs_run(struct fts_flatcurve_xapian_query_jobs *jobs,
+					unsigned int threads_count,
+					const char **error_r);
+void fts_flatcurve_xapian_query_jobs_deinit(struct fts_flatcurve_xapian_query_jobs **_jobs);
+
 int
 fts_flatcurve_xapian_mailbox_check(struct flatcurve_fts_backend *backend,
 				   struct fts_flatcurve_xapian_db_check *check,
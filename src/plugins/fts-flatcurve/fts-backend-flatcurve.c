@@ -220,6 +220,7 @@ fts_backend_flatcurve_update_set_mailbox(struct fts_backend_update_context *_ctx
 	struct flatcurve_fts_backend_update_context *ctx =
 		(struct flatcurve_fts_backend_update_context *)_ctx;
 
+	ctx->max_uid_set = FALSE;
 	int ret = box == NULL ?
 		fts_backend_flatcurve_close_mailbox(ctx->backend, &error) :
 		fts_backend_flatcurve_set_mailbox(ctx->backend, box, &error);
@@ -569,6 +570,46 @@ static int fts_backend_flatcurve_rescan(struct fts_backend *backend)
 			FTS_BACKEND_FLATCURVE_ACTION_RESCAN);
 }
 
+/* Returns: 1 if the results were looked up, 0 if the lookup should be
+ * retried without the query threads, -1 on error */
+static int
+fts_backend_flatcurve_lookup_threads(struct flatcurve_fts_backend *backend,
+				     struct flatcurve_fts_query *query,
+				     struct mailbox *const boxes[],
+				     struct flatcurve_fts_result *const *fresults,
+				     const char **error_r)
+{
+	struct fts_flatcurve_xapian_query_jobs *jobs;
+	const char *error;
+	unsigned int i;
+	int ret = 1;
+
+	jobs = fts_flatcurve_xapian_query_jobs_init(query);
+	for (i = 0; boxes[i] != NULL; i++) {
+		if (fts_backend_flatcurve_set_mailbox(backend, boxes[i],
+						      error_r) < 0) {
+			ret = -1;
+			break;
+		}
+		fts_flatcurve_xapian_build_query_mailbox(query);
+		if (fts_flatcurve_xapian_query_jobs_add(jobs, fresults[i],
+							error_r) < 0) {
+			ret = -1;
+			break;
+		}
+	}
+	if (ret > 0 && fts_flatcurve_xapian_query_jobs_run(jobs,
+			backend->fuser->set->query_threads, &error) < 0) {
+		/* Most likely the shards were just rotated or optimized.
+		   No results were added yet. */
+		e_debug(backend->event, "%s - retrying without threads",
+			error);
+		ret = 0;
+	}
+	fts_flatcurve_xapian_query_jobs_deinit(&jobs);
+	return ret;
+}
+
 static int
 fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 				   struct mailbox *const boxes[],
@@ -580,6 +621,7 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 	struct flatcurve_fts_backend *backend =
 		(struct flatcurve_fts_backend *)_backend;
 	ARRAY(struct fts_result) box_results;
+	ARRAY(struct flatcurve_fts_result *) fresults;
 	struct flatcurve_fts_result *fresult;
 	unsigned int i;
 	struct flatcurve_fts_query *query;
@@ -593,6 +635,7 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 	fts_flatcurve_xapian_build_query(query);
 
 	p_array_init(&box_results, result->pool, 8);
+	p_array_init(&fresults, result->pool, 8);
 	for (i = 0; boxes[i] != NULL; i++) {
 		r = array_append_space(&box_results);
 		r->box = boxes[i];
@@ -601,16 +644,33 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 		p_array_init(&fresult->maybe_uids, result->pool, 32);
 		p_array_init(&fresult->scores, result->pool, 32);
 		p_array_init(&fresult->uids, result->pool, 32);
+		array_push_back(&fresults, &fresult);
+	}
 
-		if (fts_backend_flatcurve_set_mailbox(backend, r->box, &error) < 0) {
-			ret = -1;
-			break;
+	if (backend->fuser->set->query_threads > 0) {
+		ret = fts_backend_flatcurve_lookup_threads(backend, query,
+			boxes, array_front(&fresults), &error);
+	}
+	if (ret == 0) {
+		for (i = 0; boxes[i] != NULL; i++) {
+			fresult = array_idx_elem(&fresults, i);
+			if (fts_backend_flatcurve_set_mailbox(
+				backend, boxes[i], &error) < 0) {
+				ret = -1;
+				break;
+			}
+			fts_flatcurve_xapian_build_query_mailbox(query);
+			if (fts_flatcurve_xapian_run_query(
+				query, fresult, &error) < 0) {
+				ret = -1;
+				break;
+			}
 		}
+	}
 
-		if (fts_flatcurve_xapian_run_query(query, fresult, &error) < 0) {
-			ret = -1;
-			break;
-		}
+	for (i = 0; ret >= 0 && boxes[i] != NULL; i++) {
+		r = array_idx_modifiable(&box_results, i);
+		fresult = array_idx_elem(&fresults, i);
 
 		r->definite_uids = fresult->uids;
 		r->maybe_uids = fresult->maybe_uids;
@@ -644,7 +704,8 @@ fts_backend_flatcurve_lookup_multi(struct fts_backend *_backend,
 		} T_END;
 	}
 
-	if (ret == 0) {
+	if (ret >= 0) {
+		ret = 0;
 		array_append_zero(&box_results);
 		result->box_results = array_idx_modifiable(&box_results, 0);
 	} else {
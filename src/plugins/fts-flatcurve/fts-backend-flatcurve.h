@@ -32,9 +32,13 @@ struct flatcurve_fts_backend_update_context {
 	string_t *hdr_name;
 	uint32_t uid;
 	struct timeval start;
+	/* With deferred commits: the highest UID that may already be
+	   indexed in the current mailbox, valid if max_uid_set is TRUE */
+	uint32_t max_uid;
 
 	bool indexed_hdr:1;
 	bool skip_uid:1;
+	bool max_uid_set:1;
 };
 
 struct flatcurve_fts_query {
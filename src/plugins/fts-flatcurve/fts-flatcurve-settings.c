@@ -13,8 +13,15 @@ static const struct setting_define fts_flatcurve_setting_defines[] = {
 	   like it is possible in the other fts_backends. */
 	{ .type = SET_FILTER_NAME, .key = FTS_FLATCURVE_FILTER },
 	DEF(UINT, commit_limit),
+	DEF(SIZE, deferred_commit_size),
+	DEF(TIME, deferred_commit_time),
+	DEF(UINT, index_threads),
 	DEF(UINT, min_term_size),
+	DEF(BOOL, optimize_background),
 	DEF(UINT, optimize_limit),
+	DEF(UINT, optimize_merge_limit),
+	DEF(BOOL, prefix_index),
+	DEF(UINT, query_threads),
 	DEF(UINT, rotate_count),
 	DEF(TIME_MSECS, rotate_time),
 	DEF(BOOL, substring_search),
@@ -23,10 +30,17 @@ static const struct setting_define fts_flatcurve_setting_defines[] = {
 
 static const struct fts_flatcurve_settings fts_flatcurve_default_settings = {
 	.commit_limit     =   500,
+	.deferred_commit_size =   0,
+	.deferred_commit_time =  60,
+	.index_threads    =     0,
 	.min_term_size    =     2,
 	.optimize_limit   =    10,
+	.optimize_merge_limit = 0,
+	.query_threads    =     0,
 	.rotate_count     =  5000,
 	.rotate_time      =  5000,
+	.optimize_background = FALSE,
+	.prefix_index     = FALSE,
 	.substring_search = FALSE,
 };
 
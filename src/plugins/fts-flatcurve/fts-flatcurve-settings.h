@@ -8,10 +8,17 @@
 struct fts_flatcurve_settings {
 	pool_t pool;
 	unsigned int commit_limit;
+	uoff_t deferred_commit_size;
+	unsigned int deferred_commit_time;
+	unsigned int index_threads;
 	unsigned int min_term_size;
 	unsigned int optimize_limit;
+	unsigned int optimize_merge_limit;
+	unsigned int query_threads;
 	unsigned int rotate_count;
 	unsigned int rotate_time;
+	bool optimize_background;
+	bool prefix_index;
 	bool substring_search;
 };
 
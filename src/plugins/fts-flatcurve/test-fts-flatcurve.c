@@ -0,0 +1,289 @@
+/* Copyright (c) 2026 Dovecot authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "istream.h"
+#include "module-dir.h"
+#include "master-service.h"
+#include "mail-search-build.h"
+#include "test-common.h"
+#include "test-mail-storage-common.h"
+#include "fts-backend-flatcurve.h"
+
+#include <sys/stat.h>
+
+#define TEST_MESSAGES_COUNT 3
+
+static struct test_mail_storage_ctx *test_ctx;
+static struct module *test_modules;
+
+static void test_init(const char *username, const char *commit_size,
+		      const char *commit_time)
+{
+	const char *const extra_input[] = {
+		"mail_plugins=fts fts_flatcurve",
+		"fts+=flatcurve",
+		t_strdup_printf("fts_flatcurve_deferred_commit_size=%s",
+				commit_size),
+		t_strdup_printf("fts_flatcurve_deferred_commit_time=%s",
+				commit_time),
+		NULL
+	};
+	struct test_mail_storage_settings set = {
+		.username = username,
+		.driver = "sdbox",
+		.extra_input = extra_input,
+	};
+
+	test_ctx = test_mail_storage_init();
+	test_mail_storage_init_user(test_ctx, &set);
+}
+
+static void test_deinit(void)
+{
+	test_mail_storage_deinit_user(test_ctx);
+	test_mail_storage_deinit(&test_ctx);
+}
+
+static struct mailbox *test_mailbox_open(void)
+{
+	struct mailbox *box;
+
+	box = mailbox_alloc(test_ctx->user->namespaces->list, "INBOX", 0);
+	if (mailbox_open(box) < 0) {
+		i_fatal("Failed to open mailbox: %s",
+			mailbox_get_last_internal_error(box, NULL));
+	}
+	return box;
+}
+
+static void test_save(struct mailbox *box)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_save_context *save_ctx;
+	struct istream *input;
+	const char *mail_input;
+	int ret;
+
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_EXTERNAL, __func__);
+	for (unsigned int i = 0; i < TEST_MESSAGES_COUNT; i++) {
+		mail_input = t_strdup_printf(
+			"From: sender@example.com\n"
+			"Subject: message %u\n"
+			"\n"
+			"deferred flatcurve body%u\n", i, i);
+		input = i_stream_create_from_data(mail_input,
+						  strlen(mail_input));
+		save_ctx = mailbox_save_alloc(trans);
+		test_assert(mailbox_save_begin(&save_ctx, input) == 0);
+		while ((ret = i_stream_read(input)) > 0 || ret == -2)
+			test_assert(mailbox_save_continue(save_ctx) == 0);
+		test_assert(mailbox_save_finish(&save_ctx) == 0);
+		i_stream_unref(&input);
+	}
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	test_assert(mailbox_sync(box, 0) == 0);
+}
+
+/* Index the mails into fts the same way as indexer-worker does it. */
+static void test_index(struct mailbox *box)
+{
+	struct mailbox_metadata metadata;
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+
+	test_assert(mailbox_get_metadata(box, MAILBOX_METADATA_PRECACHE_FIELDS,
+					 &metadata) == 0);
+	trans = mailbox_transaction_begin(box,
+			MAILBOX_TRANSACTION_FLAG_NO_CACHE_DEC, "indexing");
+	search_args = mail_search_build_init();
+	mail_search_build_add_all(search_args);
+	ctx = mailbox_search_init(trans, search_args, NULL,
+				  metadata.precache_fields, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(ctx, &mail))
+		test_assert(mail_precache(mail) == 0);
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+}
+
+static unsigned int test_search_body(struct mailbox *box, const char *word)
+{
+	struct mailbox_transaction_context *trans;
+	struct mail_search_args *search_args;
+	struct mail_search_arg *arg;
+	struct mail_search_context *ctx;
+	struct mail *mail;
+	unsigned int count = 0;
+
+	trans = mailbox_transaction_begin(box, 0, __func__);
+	search_args = mail_search_build_init();
+	arg = mail_search_build_add(search_args, SEARCH_BODY);
+	arg->value.str = p_strdup(search_args->pool, word);
+	ctx = mailbox_search_init(trans, search_args, NULL, 0, NULL);
+	mail_search_args_unref(&search_args);
+	while (mailbox_search_next(ctx, &mail))
+		count++;
+	test_assert(mailbox_search_deinit(&ctx) == 0);
+	test_assert(mailbox_transaction_commit(&trans) == 0);
+	return count;
+}
+
+static const char *test_pending_log_path(struct mailbox *box)
+{
+	const char *path;
+
+	test_assert(mailbox_get_path_to(box, MAILBOX_LIST_PATH_TYPE_INDEX,
+					&path) > 0);
+	return t_strdup_printf("%s/%s/pending", path, FTS_FLATCURVE_LABEL);
+}
+
+static bool test_path_exists(const char *path)
+{
+	struct stat st;
+
+	if (stat(path, &st) == 0)
+		return TRUE;
+	if (errno != ENOENT)
+		i_fatal("stat(%s) failed: %m", path);
+	return FALSE;
+}
+
+static void test_fts_flatcurve_deferred_commit(void)
+{
+	struct mailbox *box;
+	struct timeout *to;
+
+	test_begin("fts flatcurve deferred commit");
+	test_init("testuser", "1M", "1s");
+	box = test_mailbox_open();
+	test_save(box);
+	test_index(box);
+
+	/* the documents are in the pending log, but they are found */
+	test_assert(test_search_body(box, "deferred") == TEST_MESSAGES_COUNT);
+	test_assert(test_search_body(box, "body1") == 1);
+	test_assert(test_path_exists(test_pending_log_path(box)));
+
+	/* the log is committed once fts_flatcurve_deferred_commit_time
+	   is reached, even when the mailbox isn't accessed */
+	to = timeout_add(2100, io_loop_stop, current_ioloop);
+	io_loop_run(current_ioloop);
+	timeout_remove(&to);
+	test_assert(!test_path_exists(test_pending_log_path(box)));
+
+	test_assert(test_search_body(box, "deferred") == TEST_MESSAGES_COUNT);
+	test_assert(test_search_body(box, "body2") == 1);
+	test_assert(!test_path_exists(test_pending_log_path(box)));
+
+	mailbox_free(&box);
+	test_deinit();
+	test_end();
+}
+
+static void test_fts_flatcurve_deferred_commit_size(void)
+{
+	struct mailbox *box;
+
+	test_begin("fts flatcurve deferred commit size");
+	/* the first document already exceeds the size, so the rest are
+	   written directly to the DB */
+	test_init("testuser2", "1", "1s");
+	box = test_mailbox_open();
+	test_save(box);
+	test_index(box);
+
+	test_assert(test_search_body(box, "deferred") == TEST_MESSAGES_COUNT);
+	test_assert(test_search_body(box, "body0") == 1);
+	test_assert(!test_path_exists(test_pending_log_path(box)));
+
+	mailbox_free(&box);
+	test_deinit();
+	test_end();
+}
+
+static void test_fts_flatcurve_deferred_commit_deinit(void)
+{
+	struct mailbox *box;
+	const char *path;
+
+	test_begin("fts flatcurve deferred commit at deinit");
+	test_init("testuser3", "1M", "1h");
+	box = test_mailbox_open();
+	test_save(box);
+	test_index(box);
+	path = test_pending_log_path(box);
+	test_assert(test_path_exists(path));
+	mailbox_free(&box);
+
+	/* the log isn't old enough yet, but it's committed anyway */
+	test_mail_storage_deinit_user(test_ctx);
+	test_assert(!test_path_exists(path));
+	test_mail_storage_deinit(&test_ctx);
+	test_end();
+}
+
+static void test_fts_flatcurve_deferred_commit_optimize(void)
+{
+	struct mailbox *box;
+
+	test_begin("fts flatcurve deferred commit optimize");
+	test_init("testuser4", "1M", "1h");
+	box = test_mailbox_open();
+	test_save(box);
+	test_index(box);
+	test_assert(test_path_exists(test_pending_log_path(box)));
+
+	/* optimizing commits the pending log first and compacts only the
+	   on-disk shards */
+	test_assert(mailbox_sync(box, MAILBOX_SYNC_FLAG_OPTIMIZE) == 0);
+	test_assert(!test_path_exists(test_pending_log_path(box)));
+	test_assert(test_search_body(box, "deferred") == TEST_MESSAGES_COUNT);
+
+	mailbox_free(&box);
+	test_deinit();
+	test_end();
+}
+
+int main(int argc, char *argv[])
+{
+	static void (*const test_functions[])(void) = {
+		test_fts_flatcurve_deferred_commit,
+		test_fts_flatcurve_deferred_commit_size,
+		test_fts_flatcurve_deferred_commit_deinit,
+		test_fts_flatcurve_deferred_commit_optimize,
+		NULL
+	};
+	const char *const fts_names[] = { "fts", NULL };
+	const char *const flatcurve_names[] = { "fts_flatcurve", NULL };
+	struct module_dir_load_settings mod_set = {
+		.abi_version = DOVECOT_ABI_VERSION,
+		.require_init_funcs = TRUE,
+	};
+	int ret;
+
+	master_service = master_service_init("test-fts-flatcurve",
+					     MASTER_SERVICE_FLAG_STANDALONE |
+					     MASTER_SERVICE_FLAG_DONT_SEND_STATS |
+					     MASTER_SERVICE_FLAG_CONFIG_BUILTIN |
+					     MASTER_SERVICE_FLAG_NO_SSL_INIT |
+					     MASTER_SERVICE_FLAG_NO_INIT_DATASTACK_FRAME,
+					     &argc, &argv, "");
+
+	/* the storage service doesn't load plugins in the test setup */
+	test_modules = module_dir_load(top_builddir "/src/plugins/fts/.libs",
+				       fts_names, &mod_set);
+	test_modules = module_dir_load_missing(test_modules,
+		top_builddir "/src/plugins/fts-flatcurve/.libs",
+		flatcurve_names, &mod_set);
+	module_dir_init(test_modules);
+
+	ret = test_run(test_functions);
+
+	module_dir_unload(&test_modules);
+	master_service_deinit(&master_service);
+	return ret;
+}
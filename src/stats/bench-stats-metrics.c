@@ -0,0 +1,132 @@
+/* Copyright (c) 2025 Dovecot authors, see the included COPYING file */
+
+#include "test-stats-common.h"
+#include "strnum.h"
+#include "time-util.h"
+
+#include <stdio.h>
+
+/**
+ * Measures how many events per second the stats process can ingest into
+ * its metrics. The same events are sent with plain metrics, with
+ * metric_duration_histogram enabled and with group_by, so the histogram's
+ * cost can be compared against the existing stats_dist based metrics.
+ */
+
+struct bench_config {
+	const char *name;
+	const char *const *settings;
+};
+
+static const char *const settings_plain[] = {
+	"metric=bench",
+	"metric/bench/metric_name=bench",
+	"metric/bench/filter=event=bench",
+	NULL
+};
+
+static const char *const settings_histogram[] = {
+	"metric=bench",
+	"metric/bench/metric_name=bench",
+	"metric/bench/filter=event=bench",
+	"metric/bench/metric_duration_histogram=yes",
+	NULL
+};
+
+static const char *const settings_group_by[] = {
+	"metric=bench",
+	"metric/bench/metric_name=bench",
+	"metric/bench/filter=event=bench",
+	"metric/bench/group_by=bench_name",
+	"metric/bench/group_by/bench_name/field=bench_name",
+	NULL
+};
+
+static const char *const settings_group_by_histogram[] = {
+	"metric=bench",
+	"metric/bench/metric_name=bench",
+	"metric/bench/filter=event=bench",
+	"metric/bench/metric_duration_histogram=yes",
+	"metric/bench/group_by=bench_name",
+	"metric/bench/group_by/bench_name/field=bench_name",
+	NULL
+};
+
+static const struct bench_config bench_configs[] = {
+	{ "plain", settings_plain },
+	{ "duration histogram", settings_histogram },
+	{ "group_by", settings_group_by },
+	{ "group_by + duration histogram", settings_group_by_histogram },
+};
+
+/* The events are fed directly to stats_metrics_event(), so that the
+   benchmark doesn't include the event_send() overhead. */
+bool test_stats_callback(struct event *event ATTR_UNUSED,
+			 enum event_callback_type type ATTR_UNUSED,
+			 struct failure_context *ctx ATTR_UNUSED,
+			 const char *fmt ATTR_UNUSED, va_list args ATTR_UNUSED)
+{
+	return TRUE;
+}
+
+static void
+bench_stats_metrics(const struct bench_config *config,
+		    unsigned int event_count)
+{
+	static const char *names[] = { "alpha", "beta", "gamma", "delta" };
+	struct failure_context ctx = {
+		.type = LOG_TYPE_DEBUG,
+	};
+	struct event *events[N_ELEMENTS(names)];
+	uint64_t ts_0, ts_1;
+	unsigned int i;
+
+	test_init(config->settings);
+	for (i = 0; i < N_ELEMENTS(events); i++) {
+		events[i] = event_create(NULL);
+		event_add_category(events[i], &test_category);
+		event_set_name(events[i], "bench");
+		event_add_str(events[i], "bench_name", names[i]);
+	}
+
+	ts_0 = i_nanoseconds();
+	for (i = 0; i < event_count; i++)
+		stats_metrics_event(stats_metrics, events[i % N_ELEMENTS(events)],
+				    &ctx);
+	ts_1 = i_nanoseconds();
+	printf("\t%-30s %0.02lf Mevents/s\n", config->name,
+	       (double)event_count * 1000.0 / (double)(ts_1 - ts_0 + 1));
+
+	for (i = 0; i < N_ELEMENTS(events); i++)
+		event_unref(&events[i]);
+	test_deinit();
+}
+
+static void print_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [<events>]\n", prog);
+	fprintf(stderr, "Runs with 1000000 events if nothing given\n");
+	lib_exit(1);
+}
+
+int main(int argc, const char *argv[])
+{
+	unsigned int i, event_count = 1000000;
+
+	lib_init();
+
+	if (argc > 2)
+		print_usage(argv[0]);
+	if (argc > 1 &&
+	    (str_to_uint(argv[1], &event_count) < 0 || event_count == 0)) {
+		fprintf(stderr, "Invalid parameters\n");
+		print_usage(argv[0]);
+	}
+
+	printf("%u events per metric configuration\n", event_count);
+	for (i = 0; i < N_ELEMENTS(bench_configs); i++)
+		bench_stats_metrics(&bench_configs[i], event_count);
+
+	lib_deinit();
+	return 0;
+}
@@ -4,6 +4,7 @@
 #include "array.h"
 #include "str.h"
 #include "stats-dist.h"
+#include "stats-histogram.h"
 #include "strescape.h"
 #include "connection.h"
 #include "ostream.h"
@@ -41,6 +42,7 @@ static void reader_client_destroy(struct connection *conn)
 }
 
 static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
+				     const struct stats_histogram *histogram,
 				     const char *const *fields)
 {
 	for (unsigned int i = 0; fields[i] != NULL; i++) {
@@ -57,13 +59,23 @@ static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
 			str_printfa(str, "%"PRIu64, stats_dist_get_max(stats));
 		else if (strcmp(field, "avg") == 0)
 			str_printfa(str, "%.02f", stats_dist_get_avg(stats));
-		else if (strcmp(field, "median") == 0)
+		else if (strcmp(field, "median") == 0 && histogram != NULL) {
+			str_printfa(str, "%"PRIu64,
+				    stats_histogram_get_percentile(histogram, 0.5));
+		} else if (strcmp(field, "median") == 0)
 			str_printfa(str, "%"PRIu64, stats_dist_get_median(stats));
 		else if (strcmp(field, "variance") == 0)
 			str_printfa(str, "%.02f", stats_dist_get_variance(stats));
-		else if (field[0] == '%') {
+		else if (field[0] == '%' && histogram != NULL) {
+			str_printfa(str, "%"PRIu64,
+				    stats_histogram_get_percentile(histogram, strtod(field+1, NULL)/100.0));
+		} else if (field[0] == '%') {
 			str_printfa(str, "%"PRIu64,
 				    stats_dist_get_percentile(stats, strtod(field+1, NULL)/100.0));
+		} else if (strcmp(field, "histogram") == 0) {
+			/* can be merged with other processes' histograms */
+			if (histogram != NULL)
+				stats_histogram_export(histogram, str);
 		} else {
 			/* return unknown fields as empty */
 		}
@@ -73,11 +85,13 @@ static void reader_client_dump_stats(string_t *str, struct stats_dist *stats,
 static void reader_client_dump_metric(string_t *str, const struct metric *metric,
 				      const char *const *fields)
 {
-	reader_client_dump_stats(str, metric->duration_stats, fields);
+	reader_client_dump_stats(str, metric->duration_stats,
+				 metric->duration_histogram, fields);
 	for (unsigned int i = 0; i < metric->fields_count; i++) {
 		str_append_c(str, '\t');
 		str_append_tabescaped(str, metric->fields[i].field_key);
-		reader_client_dump_stats(str, metric->fields[i].stats, fields);
+		reader_client_dump_stats(str, metric->fields[i].stats, NULL,
+					 fields);
 	}
 	str_append_c(str, '\n');
 }
@@ -5,6 +5,7 @@
 #include "str.h"
 #include "str-sanitize.h"
 #include "stats-dist.h"
+#include "stats-histogram.h"
 #include "time-util.h"
 #include "var-expand.h"
 #include "event-filter.h"
@@ -107,6 +108,8 @@ stats_metric_alloc(pool_t pool, const char *name,
 	metric->set = set;
 	pool_ref(set->pool);
 	metric->duration_stats = stats_dist_init();
+	if (set->duration_histogram)
+		metric->duration_histogram = stats_histogram_init();
 	metric->fields_count = str_array_length(fields);
 	if (metric->fields_count > 0) {
 		metric->fields = p_new(pool, struct metric_field,
@@ -486,6 +489,8 @@ static void stats_metric_free(struct metric *metric)
 {
 	struct metric *sub_metric;
 	stats_dist_deinit(&metric->duration_stats);
+	if (metric->duration_histogram != NULL)
+		stats_histogram_deinit(&metric->duration_histogram);
 	for (unsigned int i = 0; i < metric->fields_count; i++)
 		stats_dist_deinit(&metric->fields[i].stats);
 	settings_free(metric->set);
@@ -516,6 +521,8 @@ static void stats_metric_reset(struct metric *metric)
 {
 	struct metric *sub_metric;
 	stats_dist_reset(metric->duration_stats);
+	if (metric->duration_histogram != NULL)
+		stats_histogram_reset(metric->duration_histogram);
 	for (unsigned int i = 0; i < metric->fields_count; i++)
 		stats_dist_reset(metric->fields[i].stats);
 	if (!array_is_created(&metric->sub_metrics))
@@ -881,7 +888,8 @@ stats_metric_group_by(struct metric *metric, struct event *event, pool_t pool)
 
 static void
 stats_metric_event_field(struct event *event, const char *fieldname,
-			 struct stats_dist *stats)
+			 struct stats_dist *stats,
+			 struct stats_histogram *histogram)
 {
 	const struct event_field *field =
 		event_find_field_recursive(event, fieldname);
@@ -905,6 +913,8 @@ stats_metric_event_field(struct event *event, const char *fieldname,
 	}
 
 	stats_dist_add(stats, num);
+	if (histogram != NULL)
+		stats_histogram_add(histogram, num);
 }
 
 static void
@@ -912,12 +922,13 @@ stats_metric_event(struct metric *metric, struct event *event, pool_t pool)
 {
 	/* duration is special - we always add it */
 	stats_metric_event_field(event, STATS_EVENT_FIELD_NAME_DURATION,
-				 metric->duration_stats);
+				 metric->duration_stats,
+				 metric->duration_histogram);
 
 	for (unsigned int i = 0; i < metric->fields_count; i++)
 		stats_metric_event_field(event,
 					 metric->fields[i].field_key,
-					 metric->fields[i].stats);
+					 metric->fields[i].stats, NULL);
 
 	if (metric->group_by != NULL)
 		stats_metric_group_by(metric, event, pool);
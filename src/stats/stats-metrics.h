@@ -86,6 +86,9 @@ struct metric {
 
 	/* Timing for how long the event existed */
 	struct stats_dist *duration_stats;
+	/* Histogram of the durations, NULL unless
+	   metric_duration_histogram=yes */
+	struct stats_histogram *duration_histogram;
 
 	unsigned int fields_count;
 	struct metric_field *fields;
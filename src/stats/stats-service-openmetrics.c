@@ -4,10 +4,12 @@
 #include "dovecot-version.h"
 #include "str.h"
 #include "array.h"
+#include "bits.h"
 #include "json-generator.h"
 #include "ioloop.h"
 #include "ostream.h"
 #include "stats-dist.h"
+#include "stats-histogram.h"
 #include "http-server.h"
 #include "client-http.h"
 #include "stats-settings.h"
@@ -16,6 +18,10 @@
 
 #define OPENMETRICS_CONTENT_VERSION "0.0.1"
 
+/* The duration histograms are exported with a fixed set of buckets: one for
+   each power of 2 microseconds up to 2^30 usecs (~18 minutes), and +Inf. */
+#define OPENMETRICS_DURATION_HISTOGRAM_MAX_BITS 30
+
 #ifdef DOVECOT_REVISION
 #define OPENMETRICS_BUILD_INFO \
 	"version=\""DOVECOT_VERSION"\"," \
@@ -28,6 +34,7 @@
 enum openmetrics_metric_type {
 	OPENMETRICS_METRIC_TYPE_COUNT,
 	OPENMETRICS_METRIC_TYPE_DURATION,
+	OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM,
 	OPENMETRICS_METRIC_TYPE_FIELD,
 	OPENMETRICS_METRIC_TYPE_HISTOGRAM,
 };
@@ -144,6 +151,7 @@ openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 		else
 			str_printfa(out, "_%s_total", field->field_key);
 		break;
+	case OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM:
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
 		i_unreached();
 	}
@@ -169,11 +177,92 @@ openmetrics_export_metric_value(struct openmetrics_request *req, string_t *out,
 		str_printfa(out, " %"PRIu64"\n",
 			    stats_dist_get_sum(field->stats));
 		break;
+	case OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM:
 	case OPENMETRICS_METRIC_TYPE_HISTOGRAM:
 		i_unreached();
 	}
 }
 
+static void
+openmetrics_append_usecs_as_secs(string_t *out, uint64_t usecs)
+{
+	str_printfa(out, "%"PRIu64".%06"PRIu64,
+		    usecs / 1000000, usecs % 1000000);
+}
+
+static void
+openmetrics_export_duration_histogram_line(struct openmetrics_request *req,
+					   string_t *out, const char *suffix,
+					   const char *le)
+{
+	/* Metric name */
+	str_append(out, "dovecot_");
+	str_append(out, req->metric->name);
+	str_append(out, "_duration_histogram_seconds");
+	str_append(out, suffix);
+	/* Labels */
+	if (str_len(req->labels) > 0 || le != NULL) {
+		str_append_c(out, '{');
+		str_append_str(out, req->labels);
+		if (le != NULL) {
+			if (str_len(req->labels) > 0)
+				str_append_c(out, ',');
+			str_printfa(out, "le=\"%s\"", le);
+		}
+		str_append_c(out, '}');
+	}
+	str_append_c(out, ' ');
+}
+
+static void
+openmetrics_export_duration_histogram(struct openmetrics_request *req,
+				      string_t *out,
+				      const struct metric *metric)
+{
+	const struct stats_histogram *hist = metric->duration_histogram;
+	uint64_t counts[OPENMETRICS_DURATION_HISTOGRAM_MAX_BITS + 2];
+	string_t *le = t_str_new(32);
+	uint64_t max_usecs, count, total_count = 0;
+	unsigned int bits, idx = 0;
+
+	/* Every power of 2 is a bucket boundary in the stats_histogram, so
+	   each of its buckets is entirely within 0..2^n-1 where n is the
+	   number of bits required by the bucket's maximum. The last counts[]
+	   entry is for +Inf. */
+	memset(counts, 0, sizeof(counts));
+	while (stats_histogram_iterate(hist, &idx, &max_usecs, &count)) {
+		bits = bits_required64(max_usecs);
+		if (bits > OPENMETRICS_DURATION_HISTOGRAM_MAX_BITS)
+			bits = OPENMETRICS_DURATION_HISTOGRAM_MAX_BITS + 1;
+		counts[bits] += count;
+	}
+
+	/* All the buckets are exported on every scrape, so the series stay
+	   the same. Durations are in whole microseconds, so the inclusive
+	   upper bound le=2^n-1 usecs counts the events that took less than
+	   2^n usecs. */
+	for (bits = 0; bits <= OPENMETRICS_DURATION_HISTOGRAM_MAX_BITS; bits++) {
+		total_count += counts[bits];
+		str_truncate(le, 0);
+		openmetrics_append_usecs_as_secs(le, (1ULL << bits) - 1);
+		openmetrics_export_duration_histogram_line(req, out, "_bucket",
+							   str_c(le));
+		str_printfa(out, "%"PRIu64"\n", total_count);
+	}
+	total_count += counts[bits];
+	i_assert(total_count == stats_histogram_get_count(hist));
+	openmetrics_export_duration_histogram_line(req, out, "_bucket", "+Inf");
+	str_printfa(out, "%"PRIu64"\n", total_count);
+
+	/* Sum */
+	openmetrics_export_duration_histogram_line(req, out, "_sum", NULL);
+	openmetrics_append_usecs_as_secs(out, stats_histogram_get_sum(hist));
+	str_append_c(out, '\n');
+	/* Count */
+	openmetrics_export_duration_histogram_line(req, out, "_count", NULL);
+	str_printfa(out, "%"PRIu64"\n", total_count);
+}
+
 static const struct metric *
 openmetrics_find_histogram_bucket(const struct metric *metric,
 				 unsigned int index)
@@ -296,6 +385,9 @@ openmetrics_export_metric_header(struct openmetrics_request *req, string_t *out)
 	case OPENMETRICS_METRIC_TYPE_DURATION:
 		str_append(out, "_duration_seconds Total duration of all events of this kind");
 		break;
+	case OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM:
+		str_append(out, "_duration_histogram_seconds Histogram of the durations of all events of this kind");
+		break;
 	case OPENMETRICS_METRIC_TYPE_FIELD:
 		field = &metric->fields[req->field_pos];
 		str_printfa(out, "_%s Total of field value for events of this kind",
@@ -320,6 +412,9 @@ openmetrics_export_metric_header(struct openmetrics_request *req, string_t *out)
 	case OPENMETRICS_METRIC_TYPE_DURATION:
 		str_append(out, "_duration_seconds counter\n");
 		break;
+	case OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM:
+		str_append(out, "_duration_histogram_seconds histogram\n");
+		break;
 	case OPENMETRICS_METRIC_TYPE_FIELD:
 		field = &metric->fields[req->field_pos];
 		str_printfa(out, "_%s counter\n", field->field_key);
@@ -350,6 +445,10 @@ openmetrics_export_submetric(struct openmetrics_request *req, string_t *out,
 		openmetrics_export_histogram(req, out, metric);
 		return;
 	}
+	if (req->metric_type == OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM) {
+		openmetrics_export_duration_histogram(req, out, metric);
+		return;
+	}
 
 	openmetrics_export_metric_value(req, out, metric);
 
@@ -560,6 +659,16 @@ static void openmetrics_export_next(struct openmetrics_request *req)
 		req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
 		break;
 	case OPENMETRICS_METRIC_TYPE_DURATION:
+		if (req->metric->duration_histogram != NULL) {
+			/* Continue with duration histogram output for this
+			   metric. */
+			req->metric_type =
+				OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM;
+			req->state = OPENMETRICS_REQUEST_STATE_METRIC_HEADER;
+			break;
+		}
+		/* fall through */
+	case OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM:
 		if (openmetrics_export_has_histogram(req)) {
 			/* Continue with histogram output for this metric. */
 			req->metric_type = OPENMETRICS_METRIC_TYPE_HISTOGRAM;
@@ -659,7 +768,11 @@ openmetrics_export_continue(struct openmetrics_request *req, string_t *out)
 		str_truncate(req->labels, req->labels_pos);
 		if (req->metric_type == OPENMETRICS_METRIC_TYPE_HISTOGRAM)
 			openmetrics_export_histogram(req, out, req->metric);
-		else
+		else if (req->metric_type ==
+			 OPENMETRICS_METRIC_TYPE_DURATION_HISTOGRAM) {
+			openmetrics_export_duration_histogram(req, out,
+							      req->metric);
+		} else
 			openmetrics_export_metric_body(req, out);
 		openmetrics_export_next(req);
 		break;
@@ -180,6 +180,7 @@ static const struct setting_define stats_metric_setting_defines[] = {
 	DEF(STR, name),
 	DEF(BOOLLIST, fields),
 	DEF(STR, filter),
+	DEF(BOOL, duration_histogram),
 	DEF(STR, exporter),
 	DEF(BOOLLIST, exporter_include),
 	DEF(STR, description),
@@ -195,6 +196,7 @@ const struct stats_metric_settings stats_metric_default_settings = {
 	.name = "",
 	.fields = ARRAY_INIT,
 	.filter = "",
+	.duration_histogram = FALSE,
 	.exporter = "",
 	.group_by = ARRAY_INIT,
 	.description = "",
@@ -132,6 +132,8 @@ struct stats_metric_settings {
 	ARRAY_TYPE(const_string) fields;
 	ARRAY_TYPE(const_string) group_by;
 	const char *filter;
+	/* Track the duration distribution in a histogram */
+	bool duration_histogram;
 
 	struct event_filter *parsed_filter;
 
@@ -2,6 +2,7 @@
 
 #include "test-stats-common.h"
 #include "array.h"
+#include "stats-histogram.h"
 
 bool test_stats_callback(struct event *event,
 			 enum event_callback_type type ATTR_UNUSED,
@@ -92,6 +93,64 @@ static void test_stats_metrics_filter(void)
 	test_end();
 }
 
+static const char *const settings_blob_duration_histogram[] = {
+	"metric=test test2",
+	"metric/test/metric_name=test",
+	"metric/test/filter=event=test",
+	"metric/test/metric_duration_histogram=yes",
+	"metric/test2/metric_name=test2",
+	"metric/test2/filter=event=test2",
+	NULL
+};
+
+static const struct metric *test_stats_metrics_find(const char *name)
+{
+	struct stats_metrics_iter *iter =
+		stats_metrics_iterate_init(stats_metrics);
+	const struct metric *metric;
+
+	while ((metric = stats_metrics_iterate(iter)) != NULL) {
+		if (strcmp(metric->name, name) == 0)
+			break;
+	}
+	stats_metrics_iterate_deinit(&iter);
+	i_assert(metric != NULL);
+	return metric;
+}
+
+static void test_stats_metrics_duration_histogram(void)
+{
+	const struct metric *metric;
+	unsigned int i;
+
+	test_begin("stats metrics (duration histogram)");
+	test_init(settings_blob_duration_histogram);
+
+	for (i = 0; i < 10; i++) {
+		struct event *event = event_create(NULL);
+		event_add_category(event, &test_category);
+		event_set_name(event, i % 2 == 0 ? "test" : "test2");
+		test_event_send(event);
+		event_unref(&event);
+	}
+
+	/* histogram is allocated only when enabled */
+	metric = test_stats_metrics_find("test");
+	test_assert(metric->duration_histogram != NULL);
+	test_assert(stats_histogram_get_count(metric->duration_histogram) == 5);
+	test_assert(stats_histogram_get_sum(metric->duration_histogram) ==
+		    stats_dist_get_sum(metric->duration_stats));
+	test_assert(stats_histogram_get_max(metric->duration_histogram) ==
+		    stats_dist_get_max(metric->duration_stats));
+
+	metric = test_stats_metrics_find("test2");
+	test_assert(metric->duration_histogram == NULL);
+	test_assert(stats_dist_get_count(metric->duration_stats) == 5);
+
+	test_deinit();
+	test_end();
+}
+
 static void test_stats_metrics_group_by_check_one(const struct metric *metric,
 						  const char *sub_name,
 						  unsigned int total_count,
@@ -502,6 +561,7 @@ int main(void) {
 	void (*const test_functions[])(void) = {
 		test_stats_metrics,
 		test_stats_metrics_filter,
+		test_stats_metrics_duration_histogram,
 		test_stats_metrics_group_by_discrete,
 		test_stats_metrics_group_by_quantized,
 		NULL